@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "dispositivo.h"
+#include "assincrono.h"
+
+// Fila circular de pedidos: quem pede espera vaga quando ela enche, o que
+// limita a memória e o número de pedidos no dispositivo
+#define CAPACIDADE_FILA 256
+
+typedef struct {
+    GrupoPedidos *grupo;
+    uint64_t endereco;
+    void *buffer;
+    uint64_t tamanho;
+    int escrita;
+} Pedido;
+
+static Pedido fila[CAPACIDADE_FILA];
+static uint32_t inicio_fila = 0;
+static uint32_t total_fila = 0;
+
+static pthread_mutex_t trava = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tem_pedido = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tem_vaga = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t concluido = PTHREAD_COND_INITIALIZER;
+
+static uint32_t threads_configuradas = ASSINCRONO_THREADS_PADRAO;
+static pthread_t *threads = NULL;
+static uint32_t threads_rodando = 0;
+static int encerrando = 0;
+
+static int executar(const Pedido *pedido) {
+    return pedido->escrita ? dispositivo_escrever(pedido->endereco, pedido->buffer, pedido->tamanho)
+                           : dispositivo_ler(pedido->endereco, pedido->buffer, pedido->tamanho);
+}
+
+// Com a trava
+static void concluir(GrupoPedidos *grupo, int res) {
+    if (res != 0 && grupo->resultado == 0) grupo->resultado = res;
+    if (--grupo->pendentes == 0) pthread_cond_broadcast(&concluido);
+}
+
+// Só sai com a fila vazia: nenhum pedido fica para trás num encerramento
+static void *trabalhar(void *parametro) {
+    (void)parametro;
+    pthread_mutex_lock(&trava);
+    while (1) {
+        while (total_fila == 0 && !encerrando) pthread_cond_wait(&tem_pedido, &trava);
+        if (total_fila == 0) break;
+
+        Pedido pedido = fila[inicio_fila];
+        inicio_fila = (inicio_fila + 1) % CAPACIDADE_FILA;
+        total_fila--;
+        pthread_cond_signal(&tem_vaga);
+        pthread_mutex_unlock(&trava);
+
+        int res = executar(&pedido);
+
+        pthread_mutex_lock(&trava);
+        concluir(pedido.grupo, res);
+    }
+    pthread_mutex_unlock(&trava);
+    return NULL;
+}
+
+// Com a trava. Se nenhuma thread nascer, os pedidos seguem rodando na hora.
+static void iniciar_threads() {
+    threads = malloc(threads_configuradas * sizeof(pthread_t));
+    if (!threads) return;
+    while (threads_rodando < threads_configuradas &&
+           pthread_create(&threads[threads_rodando], NULL, trabalhar, NULL) == 0) threads_rodando++;
+}
+
+int assincrono_configurar(uint32_t threads_novas) {
+    pthread_mutex_lock(&trava);
+    encerrando = 1;
+    pthread_cond_broadcast(&tem_pedido);
+    pthread_cond_broadcast(&tem_vaga);
+    uint32_t rodando = threads_rodando;
+    pthread_t *antigas = threads;
+    pthread_mutex_unlock(&trava);
+
+    for (uint32_t i = 0; i < rodando; i++) pthread_join(antigas[i], NULL);
+    free(antigas);
+
+    pthread_mutex_lock(&trava);
+    threads = NULL;
+    threads_rodando = 0;
+    __atomic_store_n(&threads_configuradas, threads_novas, __ATOMIC_RELAXED);
+    encerrando = 0;
+    pthread_mutex_unlock(&trava);
+    return 0;
+}
+
+int assincrono_ativo() {
+    return __atomic_load_n(&threads_configuradas, __ATOMIC_RELAXED) > 0 &&
+           dispositivo_modo() == DISPOSITIVO_POSICIONAL;
+}
+
+static void pedir(GrupoPedidos *grupo, uint64_t endereco, void *buffer, uint64_t tamanho, int escrita) {
+    Pedido pedido = {grupo, endereco, buffer, tamanho, escrita};
+    pthread_mutex_lock(&trava);
+    if (!threads && threads_configuradas > 0 && !encerrando && dispositivo_modo() == DISPOSITIVO_POSICIONAL)
+        iniciar_threads();
+    while (total_fila == CAPACIDADE_FILA && !encerrando) pthread_cond_wait(&tem_vaga, &trava);
+
+    if (threads_rodando == 0 || encerrando || dispositivo_modo() != DISPOSITIVO_POSICIONAL) {
+        pthread_mutex_unlock(&trava);
+        int res = executar(&pedido);
+        pthread_mutex_lock(&trava);
+        if (res != 0 && grupo->resultado == 0) grupo->resultado = res;
+        pthread_mutex_unlock(&trava);
+        return;
+    }
+
+    fila[(inicio_fila + total_fila) % CAPACIDADE_FILA] = pedido;
+    total_fila++;
+    grupo->pendentes++;
+    pthread_cond_signal(&tem_pedido);
+    pthread_mutex_unlock(&trava);
+}
+
+void assincrono_ler(GrupoPedidos *grupo, uint64_t endereco, void *buffer, uint64_t tamanho) {
+    pedir(grupo, endereco, buffer, tamanho, 0);
+}
+
+void assincrono_escrever(GrupoPedidos *grupo, uint64_t endereco, const void *buffer, uint64_t tamanho) {
+    pedir(grupo, endereco, (void *)buffer, tamanho, 1);
+}
+
+int assincrono_aguardar(GrupoPedidos *grupo) {
+    pthread_mutex_lock(&trava);
+    while (grupo->pendentes > 0) pthread_cond_wait(&concluido, &trava);
+    int res = grupo->resultado;
+    grupo->resultado = 0;
+    pthread_mutex_unlock(&trava);
+    return res;
+}
@@ -0,0 +1,39 @@
+#ifndef ASSINCRONO_H
+#define ASSINCRONO_H
+
+#include <stdint.h>
+
+// --- E/S Assíncrona ---
+// Um conjunto de threads que executa leituras e escritas do dispositivo
+// enquanto quem pediu segue adiante: com várias threads há vários pedidos no
+// dispositivo ao mesmo tempo, em vez de um por vez. Os pedidos se juntam em
+// grupos, e assincrono_aguardar() espera todos os de um grupo terminarem.
+//
+// As threads nascem no primeiro pedido. Sem threads, ou no modo mapeado (em
+// que um pedido é só uma cópia de memória), o pedido roda na hora, na própria
+// thread que pediu. As chamadas ao dispositivo feitas pelas threads do motor
+// contam nos contadores delas, não nos de quem pediu.
+//
+// Os buffers de um pedido são de quem pediu e não podem ser liberados nem
+// reaproveitados antes de assincrono_aguardar().
+
+#define ASSINCRONO_THREADS_PADRAO 8
+
+typedef struct {
+    uint32_t pendentes;
+    int resultado;                  // Primeiro erro entre os pedidos já concluídos
+} GrupoPedidos;                     // Começa zerado
+
+// 0 = sem threads: todo pedido roda na hora. Espera os pedidos na fila.
+int assincrono_configurar(uint32_t threads);
+// 1 se os pedidos de fato correm em paralelo com quem pediu
+int assincrono_ativo();
+
+void assincrono_ler(GrupoPedidos *grupo, uint64_t endereco, void *buffer, uint64_t tamanho);
+void assincrono_escrever(GrupoPedidos *grupo, uint64_t endereco, const void *buffer, uint64_t tamanho);
+
+// Espera os pedidos do grupo e devolve 0 ou o primeiro erro; o grupo volta a
+// ficar zerado, pronto para outros pedidos
+int assincrono_aguardar(GrupoPedidos *grupo);
+
+#endif
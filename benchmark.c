@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs.h"
+#include "dispositivo.h"
+
+// --- Benchmark ---
+// Formata uma imagem e mede as operações principais de fs.c, fase a fase:
+// vazão, latência por operação (percentis) e chamadas ao sistema feitas pelo
+// dispositivo. Com a mesma semente e os mesmos parâmetros a sequência de
+// operações é sempre a mesma.
+//
+// Cada fase termina com sincronizar_disco(), que entra no tempo total da fase
+// (ops/s e MB/s) mas não na latência das operações.
+
+#define GRUPOS 3                // c, a, i: ficam no disco ao mesmo tempo
+#define ARQUIVOS_POR_PASTA ((ENTRADAS_POR_DIRETORIO - 1) / GRUPOS)
+
+typedef struct {
+    uint64_t setores;
+    uint32_t arquivos;
+    uint32_t tamanho;
+    uint32_t pedaco;
+    uint32_t fragmentacao;      // % dos blocos de dados ocupados antes de começar
+    uint32_t mudancas_diretorio;
+    uint32_t semente;
+    int mapeado;
+    int csv;
+} Parametros;
+
+typedef struct {
+    const char *nome;
+    uint64_t *latencias;        // ns
+    uint64_t total;
+    uint64_t capacidade;
+    uint64_t bytes;
+    uint64_t erros;
+    uint64_t inicio;
+} Fase;
+
+static Parametros parametros = {
+    .setores = 400000,
+    .arquivos = 200,
+    .tamanho = 256 * 1024,
+    .pedaco = TAMANHO_BLOCO,
+    .fragmentacao = 0,
+    .mudancas_diretorio = 10000,
+    .semente = 1,
+};
+
+static uint8_t *dados = NULL;
+
+static uint64_t agora_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void iniciar_fase(Fase *fase, const char *nome) {
+    memset(fase, 0, sizeof(Fase));
+    fase->nome = nome;
+    dispositivo_zerar_contadores();
+    fase->inicio = agora_ns();
+}
+
+static void registrar(Fase *fase, uint64_t inicio, int resultado, uint64_t bytes) {
+    uint64_t latencia = agora_ns() - inicio;
+    if (resultado < 0) {
+        fase->erros++;
+        return;
+    }
+
+    if (fase->total == fase->capacidade) {
+        fase->capacidade = fase->capacidade ? fase->capacidade * 2 : 1024;
+        fase->latencias = realloc(fase->latencias, fase->capacidade * sizeof(uint64_t));
+        if (!fase->latencias) { perror("realloc"); exit(1); }
+    }
+    fase->latencias[fase->total++] = latencia;
+    fase->bytes += bytes;
+}
+
+static int comparar_latencias(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentil_us(Fase *fase, double fracao) {
+    if (fase->total == 0) return 0;
+    return fase->latencias[(uint64_t)(fracao * (fase->total - 1))] / 1000.0;
+}
+
+static void imprimir_cabecalho() {
+    if (parametros.csv) {
+        printf("fase,ops,erros,ops_s,mb_s,p50_us,p90_us,p99_us,max_us,leituras,escritas,vetorizadas,sincronizacoes\n");
+        return;
+    }
+    printf("%-20s %8s %10s %9s %9s %9s %9s %10s %9s %9s %6s %6s\n",
+           "fase", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us",
+           "leituras", "escritas", "vetor", "sync");
+}
+
+static void concluir_fase(Fase *fase) {
+    sincronizar_disco();
+    double segundos = (agora_ns() - fase->inicio) / 1e9;
+
+    ContadoresDispositivo c;
+    dispositivo_contadores(&c);
+    qsort(fase->latencias, fase->total, sizeof(uint64_t), comparar_latencias);
+
+    double ops_s = fase->total / segundos;
+    double mb_s = fase->bytes / segundos / (1024.0 * 1024.0);
+    double maximo = fase->total ? fase->latencias[fase->total - 1] / 1000.0 : 0;
+
+    if (parametros.csv) {
+        printf("%s,%llu,%llu,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%llu,%llu,%llu,%llu\n",
+               fase->nome, (unsigned long long)fase->total, (unsigned long long)fase->erros, ops_s, mb_s,
+               percentil_us(fase, 0.50), percentil_us(fase, 0.90), percentil_us(fase, 0.99), maximo,
+               (unsigned long long)c.leituras, (unsigned long long)c.escritas,
+               (unsigned long long)c.escritas_vetorizadas, (unsigned long long)c.sincronizacoes);
+    } else {
+        char mb[16] = "-";
+        if (fase->bytes) snprintf(mb, sizeof(mb), "%.1f", mb_s);
+        printf("%-20s %8llu %10.0f %9s %9.1f %9.1f %9.1f %10.1f %9llu %9llu %6llu %6llu\n",
+               fase->nome, (unsigned long long)fase->total, ops_s, mb,
+               percentil_us(fase, 0.50), percentil_us(fase, 0.90), percentil_us(fase, 0.99), maximo,
+               (unsigned long long)c.leituras, (unsigned long long)c.escritas,
+               (unsigned long long)c.escritas_vetorizadas, (unsigned long long)c.sincronizacoes);
+        if (fase->erros) printf("  (%llu operacoes falharam)\n", (unsigned long long)fase->erros);
+    }
+    free(fase->latencias);
+}
+
+// --- Arquivos e Pastas ---
+// Os arquivos são distribuídos em pastas p0, p1, ... na raiz, cada uma com o
+// que cabe num bloco de diretório (ENTRADAS_POR_DIRETORIO entradas); o
+// arquivo i de todos os grupos fica na mesma pasta
+
+static void nome_arquivo(char *nome, char grupo, uint32_t i) {
+    snprintf(nome, TAMANHO_NOME_ARQUIVO, "%c%u", grupo, i);
+}
+
+static int64_t pasta_atual = -1;
+
+static void entrar_na_pasta_do_arquivo(uint32_t i) {
+    int64_t pasta = i / ARQUIVOS_POR_PASTA;
+    if (pasta == pasta_atual) return;
+
+    char nome[TAMANHO_NOME_ARQUIVO];
+    snprintf(nome, sizeof(nome), "p%lld", (long long)pasta);
+    mudar_diretorio("/");
+    if (mudar_diretorio(nome) != 0) {
+        criar_arquivo(nome, 0, TIPO_DIRETORIO);
+        mudar_diretorio(nome);
+    }
+    pasta_atual = pasta;
+}
+
+// Marca como ocupados blocos avulsos sorteados até a porcentagem pedida dos
+// blocos de dados; nenhuma extensão maior que o vão entre eles cabe inteira
+static void fragmentar() {
+    if (parametros.fragmentacao == 0) return;
+
+    uint64_t blocos_dados = total_blocos_disco - bloco_inicio_dados;
+    uint64_t alvo = blocos_dados * parametros.fragmentacao / 100;
+    for (uint64_t ocupados = 0; ocupados < alvo;) {
+        uint64_t bloco = bloco_inicio_dados + (((uint64_t)rand() << 31) ^ rand()) % blocos_dados;
+        if (!verificar_se_bloco_esta_livre(bloco)) continue;
+        definir_status_blocos_bitmap(bloco, 1, STATUS_USADO);
+        ocupados++;
+    }
+    sincronizar_disco();
+}
+
+// --- Fases ---
+
+static void fase_criar(char grupo, uint32_t tamanho) {
+    Fase fase;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    char titulo[32];
+    snprintf(titulo, sizeof(titulo), "criar (%c)", grupo);
+
+    iniciar_fase(&fase, titulo);
+    for (uint32_t i = 0; i < parametros.arquivos; i++) {
+        entrar_na_pasta_do_arquivo(i);
+        nome_arquivo(nome, grupo, i);
+        uint64_t inicio = agora_ns();
+        registrar(&fase, inicio, criar_arquivo(nome, tamanho, TIPO_ARQUIVO), 0);
+    }
+    concluir_fase(&fase);
+}
+
+// Percorre todos os arquivos do grupo em pedaços, arquivo por arquivo
+static void fase_sequencial(const char *titulo, char grupo, int escrita) {
+    Fase fase;
+    char nome[TAMANHO_NOME_ARQUIVO];
+
+    iniciar_fase(&fase, titulo);
+    for (uint32_t i = 0; i < parametros.arquivos; i++) {
+        entrar_na_pasta_do_arquivo(i);
+        nome_arquivo(nome, grupo, i);
+        for (uint32_t deslocamento = 0; deslocamento < parametros.tamanho; deslocamento += parametros.pedaco) {
+            uint32_t tamanho = parametros.tamanho - deslocamento;
+            if (tamanho > parametros.pedaco) tamanho = parametros.pedaco;
+
+            uint64_t inicio = agora_ns();
+            int res = escrita ? escrever_arquivo(nome, deslocamento, dados + deslocamento, tamanho)
+                              : ler_arquivo(nome, deslocamento, tamanho, dados + deslocamento);
+            registrar(&fase, inicio, res, tamanho);
+        }
+    }
+    concluir_fase(&fase);
+}
+
+// Um pedaço por arquivo a cada volta: o bloco seguinte ao fim de cada arquivo
+// já foi tomado pelo vizinho, então cada crescimento abre uma extensão nova
+static void fase_intercalada(const char *titulo, char grupo) {
+    Fase fase;
+    char nome[TAMANHO_NOME_ARQUIVO];
+
+    iniciar_fase(&fase, titulo);
+    for (uint32_t deslocamento = 0; deslocamento < parametros.tamanho; deslocamento += parametros.pedaco) {
+        uint32_t tamanho = parametros.tamanho - deslocamento;
+        if (tamanho > parametros.pedaco) tamanho = parametros.pedaco;
+
+        for (uint32_t i = 0; i < parametros.arquivos; i++) {
+            entrar_na_pasta_do_arquivo(i);
+            nome_arquivo(nome, grupo, i);
+            uint64_t inicio = agora_ns();
+            registrar(&fase, inicio, escrever_arquivo(nome, deslocamento, dados + deslocamento, tamanho), tamanho);
+        }
+    }
+    concluir_fase(&fase);
+}
+
+static void fase_mudar_diretorio() {
+    Fase fase;
+    entrar_na_pasta_do_arquivo(0);
+    mudar_diretorio("/");
+
+    iniciar_fase(&fase, "mudar_diretorio");
+    for (uint32_t i = 0; i < parametros.mudancas_diretorio; i++) {
+        uint64_t inicio = agora_ns();
+        registrar(&fase, inicio, mudar_diretorio((i % 2) ? "/" : "p0"), 0);
+    }
+    pasta_atual = -1;
+    concluir_fase(&fase);
+}
+
+static void fase_remover(const char *grupos) {
+    Fase fase;
+    char nome[TAMANHO_NOME_ARQUIVO];
+
+    iniciar_fase(&fase, "remover");
+    for (const char *grupo = grupos; *grupo; grupo++) {
+        for (uint32_t i = 0; i < parametros.arquivos; i++) {
+            entrar_na_pasta_do_arquivo(i);
+            nome_arquivo(nome, *grupo, i);
+            uint64_t inicio = agora_ns();
+            registrar(&fase, inicio, remover_arquivo(nome), 0);
+        }
+    }
+    concluir_fase(&fase);
+}
+
+static void uso(const char *programa) {
+    printf("Uso: %s [opcoes] <imagem>\n", programa);
+    printf("  --setores N        tamanho da imagem em setores de 512 bytes (padrao %llu)\n",
+           (unsigned long long)parametros.setores);
+    printf("  --arquivos N       arquivos por grupo (padrao %u)\n", parametros.arquivos);
+    printf("  --tamanho BYTES    tamanho de cada arquivo (padrao %u)\n", parametros.tamanho);
+    printf("  --pedaco BYTES     tamanho de cada leitura/escrita (padrao %u)\n", parametros.pedaco);
+    printf("  --fragmentacao P   %% dos blocos de dados ocupados por blocos avulsos (padrao 0)\n");
+    printf("  --cd N             chamadas a mudar_diretorio (padrao %u)\n", parametros.mudancas_diretorio);
+    printf("  --semente N        semente dos sorteios (padrao %u)\n", parametros.semente);
+    printf("  --mmap             usa o dispositivo mapeado em memoria\n");
+    printf("  --csv              saida em CSV\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *caminho_imagem = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        int tem_valor = (i + 1 < argc);
+        if (strcmp(argv[i], "--setores") == 0 && tem_valor) parametros.setores = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--arquivos") == 0 && tem_valor) parametros.arquivos = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--tamanho") == 0 && tem_valor) parametros.tamanho = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--pedaco") == 0 && tem_valor) parametros.pedaco = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--fragmentacao") == 0 && tem_valor) parametros.fragmentacao = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cd") == 0 && tem_valor) parametros.mudancas_diretorio = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--semente") == 0 && tem_valor) parametros.semente = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--mmap") == 0) parametros.mapeado = 1;
+        else if (strcmp(argv[i], "--csv") == 0) parametros.csv = 1;
+        else if (argv[i][0] == '-') { uso(argv[0]); return 1; }
+        else caminho_imagem = argv[i];
+    }
+
+    uint64_t pastas = (parametros.arquivos + ARQUIVOS_POR_PASTA - 1) / ARQUIVOS_POR_PASTA;
+    if (!caminho_imagem || parametros.arquivos == 0 || parametros.pedaco == 0 || parametros.tamanho == 0 ||
+        parametros.fragmentacao > 90) {
+        uso(argv[0]);
+        return 1;
+    }
+
+    arquivo_disco = fopen(caminho_imagem, "w+b");
+    if (!arquivo_disco) { perror("Erro ao criar imagem"); return 1; }
+
+    srand(parametros.semente);
+    formatar_disco(parametros.setores);
+    if (parametros.mapeado && montar_disco_com_modo(DISPOSITIVO_MAPEADO) == 0) {
+        printf("Erro: modo mapeado indisponivel.\n");
+        return 1;
+    }
+    fragmentar();
+
+    uint64_t blocos_por_arquivo = (parametros.tamanho + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
+    uint64_t blocos_necessarios = GRUPOS * parametros.arquivos * (blocos_por_arquivo + 1) + pastas + pastas / ENTRADAS_POR_DIRETORIO;
+    if (blocos_necessarios > contar_blocos_livres()) {
+        printf("Erro: imagem pequena demais (%llu blocos livres, %llu necessarios).\n",
+               (unsigned long long)contar_blocos_livres(), (unsigned long long)blocos_necessarios);
+        return 1;
+    }
+
+    dados = malloc(parametros.tamanho);
+    if (!dados) { perror("malloc"); return 1; }
+    for (uint32_t i = 0; i < parametros.tamanho; i++) dados[i] = rand();
+
+    if (!parametros.csv) {
+        printf("Imagem: %s, %llu blocos, %u%% fragmentada%s\n", caminho_imagem,
+               (unsigned long long)total_blocos_disco, parametros.fragmentacao,
+               dispositivo_modo() == DISPOSITIVO_MAPEADO ? ", mmap" : "");
+        printf("%u arquivos de %u bytes por grupo, pedacos de %u bytes\n\n",
+               parametros.arquivos, parametros.tamanho, parametros.pedaco);
+    }
+    imprimir_cabecalho();
+
+    // c: criados já com o tamanho final e sobrescritos no lugar
+    fase_criar('c', parametros.tamanho);
+    fase_sequencial("escrever no lugar", 'c', 1);
+    fase_sequencial("ler", 'c', 0);
+
+    // a: crescem um arquivo por vez, sempre para o bloco ao lado
+    fase_criar('a', 0);
+    fase_sequencial("crescer adjacente", 'a', 1);
+
+    // i: crescem intercalados, cada pedaço numa extensão nova
+    fase_criar('i', 0);
+    fase_intercalada("crescer intercalado", 'i');
+    fase_sequencial("ler fragmentado", 'i', 0);
+
+    fase_mudar_diretorio();
+    fase_remover("cai");
+
+    free(dados);
+    desmontar_disco();
+    fclose(arquivo_disco);
+    return 0;
+}
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fs.h"
+#include "cache.h"
+#include "dispositivo.h"
+
+#define SEM_QUADRO -1
+
+typedef struct {
+    uint64_t bloco;
+    int32_t  proximo_no_balde;
+    uint8_t  valido;
+    uint8_t  sujo;
+    uint8_t  referenciado;
+} QuadroCache;
+
+static QuadroCache *quadros = NULL;
+static uint8_t *dados_quadros = NULL;
+static int32_t *baldes = NULL;
+static uint32_t capacidade = 0;
+static uint32_t mascara_baldes = 0;
+static uint32_t ponteiro_relogio = 0;
+static uint32_t total_sujos = 0;
+static int escritas_adiadas = 0;
+
+// Uma trava para o cache inteiro: cada chamada só copia no máximo um bloco
+// com ela adquirida. É recursiva porque as funções públicas chamam umas às outras.
+static pthread_mutex_t trava_cache;
+static pthread_once_t trava_cache_iniciada = PTHREAD_ONCE_INIT;
+
+static void iniciar_trava_cache() {
+    pthread_mutexattr_t atributos;
+    pthread_mutexattr_init(&atributos);
+    pthread_mutexattr_settype(&atributos, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&trava_cache, &atributos);
+    pthread_mutexattr_destroy(&atributos);
+}
+
+static void travar_cache() {
+    pthread_once(&trava_cache_iniciada, iniciar_trava_cache);
+    pthread_mutex_lock(&trava_cache);
+}
+
+static void destravar_cache() {
+    pthread_mutex_unlock(&trava_cache);
+}
+
+static int sincronizar_sem_trava();
+
+static uint32_t balde_do_bloco(uint64_t bloco) {
+    return (uint32_t)((bloco * 0x9E3779B97F4A7C15ULL) >> 32) & mascara_baldes;
+}
+
+static uint8_t *dados_do_quadro(int32_t indice) {
+    return dados_quadros + (uint64_t)indice * TAMANHO_BLOCO;
+}
+
+static int configurar_sem_trava(uint32_t capacidade_blocos) {
+    if (capacidade_blocos == 0) return -EINVAL;
+    if (quadros) {
+        // Com escrita adiada os sujos só saem pelo diário: confirme antes
+        if (escritas_adiadas && total_sujos > 0) return -EBUSY;
+        sincronizar_sem_trava();
+    }
+
+    uint32_t total_baldes = 1;
+    while (total_baldes < capacidade_blocos * 2) total_baldes <<= 1;
+
+    QuadroCache *novos_quadros = calloc(capacidade_blocos, sizeof(QuadroCache));
+    uint8_t *novos_dados = malloc((uint64_t)capacidade_blocos * TAMANHO_BLOCO);
+    int32_t *novos_baldes = malloc(total_baldes * sizeof(int32_t));
+    if (!novos_quadros || !novos_dados || !novos_baldes) {
+        free(novos_quadros); free(novos_dados); free(novos_baldes);
+        return -ENOMEM;
+    }
+
+    free(quadros); free(dados_quadros); free(baldes);
+    quadros = novos_quadros;
+    dados_quadros = novos_dados;
+    baldes = novos_baldes;
+    capacidade = capacidade_blocos;
+    mascara_baldes = total_baldes - 1;
+    ponteiro_relogio = 0;
+    total_sujos = 0;
+    for (uint32_t i = 0; i <= mascara_baldes; i++) baldes[i] = SEM_QUADRO;
+    return 0;
+}
+
+int cache_configurar(uint32_t capacidade_blocos) {
+    travar_cache();
+    int res = configurar_sem_trava(capacidade_blocos);
+    destravar_cache();
+    return res;
+}
+
+void cache_descartar() {
+    travar_cache();
+    if (quadros) {
+        memset(quadros, 0, capacidade * sizeof(QuadroCache));
+        for (uint32_t i = 0; i <= mascara_baldes; i++) baldes[i] = SEM_QUADRO;
+        ponteiro_relogio = 0;
+        total_sujos = 0;
+    }
+    destravar_cache();
+}
+
+void cache_adiar_escritas(int ativo) {
+    travar_cache();
+    escritas_adiadas = ativo;
+    destravar_cache();
+}
+
+uint32_t cache_capacidade() {
+    travar_cache();
+    if (!quadros) configurar_sem_trava(CACHE_CAPACIDADE_PADRAO);
+    uint32_t resultado = capacidade;
+    destravar_cache();
+    return resultado;
+}
+
+uint32_t cache_total_sujos() {
+    travar_cache();
+    uint32_t resultado = total_sujos;
+    destravar_cache();
+    return resultado;
+}
+
+static int comparar_pendentes(const void *a, const void *b) {
+    uint64_t bloco_a = ((const BlocoPendente *)a)->bloco;
+    uint64_t bloco_b = ((const BlocoPendente *)b)->bloco;
+    return (bloco_a > bloco_b) - (bloco_a < bloco_b);
+}
+
+// Preenche 'pendentes' (com espaço para cache_capacidade() itens) com os
+// quadros sujos, em ordem de bloco; os buffers apontam para dentro do cache
+uint32_t cache_coletar_sujos(BlocoPendente *pendentes) {
+    travar_cache();
+    uint32_t coletados = 0;
+    for (uint32_t i = 0; quadros && i < capacidade; i++) {
+        if (quadros[i].valido && quadros[i].sujo) {
+            pendentes[coletados].bloco = quadros[i].bloco;
+            pendentes[coletados].dados = dados_quadros + (uint64_t)i * TAMANHO_BLOCO;
+            coletados++;
+        }
+    }
+    qsort(pendentes, coletados, sizeof(BlocoPendente), comparar_pendentes);
+    destravar_cache();
+    return coletados;
+}
+
+void cache_marcar_limpos() {
+    travar_cache();
+    for (uint32_t i = 0; quadros && i < capacidade; i++) quadros[i].sujo = 0;
+    total_sujos = 0;
+    destravar_cache();
+}
+
+static int32_t procurar_quadro(uint64_t bloco) {
+    for (int32_t q = baldes[balde_do_bloco(bloco)]; q != SEM_QUADRO; q = quadros[q].proximo_no_balde) {
+        if (quadros[q].bloco == bloco) return q;
+    }
+    return SEM_QUADRO;
+}
+
+static void remover_do_balde(int32_t indice) {
+    int32_t *elo = &baldes[balde_do_bloco(quadros[indice].bloco)];
+    while (*elo != indice) elo = &quadros[*elo].proximo_no_balde;
+    *elo = quadros[indice].proximo_no_balde;
+}
+
+static void invalidar_quadro(int32_t indice) {
+    remover_do_balde(indice);
+    if (quadros[indice].sujo) total_sujos--;
+    quadros[indice].valido = 0;
+    quadros[indice].sujo = 0;
+}
+
+static int gravar_quadro(int32_t indice) {
+    int res = dispositivo_escrever(quadros[indice].bloco * TAMANHO_BLOCO, dados_do_quadro(indice), TAMANHO_BLOCO);
+    if (res != 0) return res;
+    quadros[indice].sujo = 0;
+    total_sujos--;
+    return 0;
+}
+
+// Dobra o número de quadros mantendo os atuais (e seus índices)
+static int crescer_cache() {
+    uint32_t nova_capacidade = capacidade * 2;
+    uint32_t total_baldes = (mascara_baldes + 1) * 2;
+
+    QuadroCache *novos_quadros = realloc(quadros, nova_capacidade * sizeof(QuadroCache));
+    if (!novos_quadros) return -ENOMEM;
+    quadros = novos_quadros;
+    uint8_t *novos_dados = realloc(dados_quadros, (uint64_t)nova_capacidade * TAMANHO_BLOCO);
+    if (!novos_dados) return -ENOMEM;
+    dados_quadros = novos_dados;
+    int32_t *novos_baldes = realloc(baldes, total_baldes * sizeof(int32_t));
+    if (!novos_baldes) return -ENOMEM;
+    baldes = novos_baldes;
+
+    memset(quadros + capacidade, 0, (nova_capacidade - capacidade) * sizeof(QuadroCache));
+    mascara_baldes = total_baldes - 1;
+    for (uint32_t i = 0; i <= mascara_baldes; i++) baldes[i] = SEM_QUADRO;
+    for (uint32_t i = 0; i < capacidade; i++) {
+        if (!quadros[i].valido) continue;
+        uint32_t balde = balde_do_bloco(quadros[i].bloco);
+        quadros[i].proximo_no_balde = baldes[balde];
+        baldes[balde] = i;
+    }
+    ponteiro_relogio = capacidade;
+    capacidade = nova_capacidade;
+    return 0;
+}
+
+// CLOCK: dá uma segunda chance a quadros referenciados desde a última volta
+static int32_t escolher_vitima() {
+    // Cache cheio de blocos que ainda não podem ir ao disco: a confirmação só
+    // acontece entre operações, então o cache cresce até lá
+    if (escritas_adiadas && total_sujos == capacidade && crescer_cache() != 0) return SEM_QUADRO;
+
+    for (uint32_t tentativas = 0; tentativas < 3 * capacidade; tentativas++) {
+        int32_t indice = ponteiro_relogio;
+        ponteiro_relogio = (ponteiro_relogio + 1) % capacidade;
+
+        if (!quadros[indice].valido) return indice;
+        if (quadros[indice].referenciado) {
+            quadros[indice].referenciado = 0;
+            continue;
+        }
+        if (quadros[indice].sujo && (escritas_adiadas || gravar_quadro(indice) != 0)) continue;
+
+        remover_do_balde(indice);
+        quadros[indice].valido = 0;
+        return indice;
+    }
+    return SEM_QUADRO;
+}
+
+static int32_t obter_quadro(uint64_t bloco, int carregar) {
+    if (!quadros && configurar_sem_trava(CACHE_CAPACIDADE_PADRAO) != 0) return SEM_QUADRO;
+
+    int32_t indice = procurar_quadro(bloco);
+    if (indice != SEM_QUADRO) {
+        quadros[indice].referenciado = 1;
+        return indice;
+    }
+
+    indice = escolher_vitima();
+    if (indice == SEM_QUADRO) return SEM_QUADRO;
+    if (carregar) {
+        if (dispositivo_ler(bloco * TAMANHO_BLOCO, dados_do_quadro(indice), TAMANHO_BLOCO) != 0)
+            memset(dados_do_quadro(indice), 0, TAMANHO_BLOCO);
+    }
+
+    uint32_t balde = balde_do_bloco(bloco);
+    quadros[indice].bloco = bloco;
+    quadros[indice].valido = 1;
+    quadros[indice].sujo = 0;
+    quadros[indice].referenciado = 1;
+    quadros[indice].proximo_no_balde = baldes[balde];
+    baldes[balde] = indice;
+    return indice;
+}
+
+int cache_ler(uint64_t bloco, uint32_t deslocamento, void *buffer, uint32_t tamanho) {
+    if (deslocamento + tamanho > TAMANHO_BLOCO) return -EINVAL;
+    travar_cache();
+
+    // Com o disco mapeado o próprio mapeamento faz o papel do cache; só blocos
+    // com escrita adiada ficam em quadros
+    int res = 0;
+    uint8_t *no_mapeamento = dispositivo_ponteiro(bloco * TAMANHO_BLOCO + deslocamento, tamanho);
+    if (no_mapeamento && (total_sujos == 0 || procurar_quadro(bloco) == SEM_QUADRO)) {
+        memcpy(buffer, no_mapeamento, tamanho);
+    } else {
+        int32_t indice = obter_quadro(bloco, 1);
+        if (indice == SEM_QUADRO) res = -ENOMEM;
+        else memcpy(buffer, dados_do_quadro(indice) + deslocamento, tamanho);
+    }
+
+    destravar_cache();
+    return res;
+}
+
+int cache_escrever(uint64_t bloco, uint32_t deslocamento, const void *buffer, uint32_t tamanho) {
+    if (deslocamento + tamanho > TAMANHO_BLOCO) return -EINVAL;
+    travar_cache();
+
+    int res = 0;
+    uint8_t *no_mapeamento = dispositivo_ponteiro(bloco * TAMANHO_BLOCO + deslocamento, tamanho);
+    if (no_mapeamento && !escritas_adiadas) {
+        memcpy(no_mapeamento, buffer, tamanho);
+    } else {
+        // Bloco sobrescrito por inteiro não precisa ser lido antes
+        int bloco_inteiro = (deslocamento == 0 && tamanho == TAMANHO_BLOCO);
+        int32_t indice = obter_quadro(bloco, !bloco_inteiro);
+        if (indice == SEM_QUADRO) {
+            res = -ENOMEM;
+        } else {
+            memcpy(dados_do_quadro(indice) + deslocamento, buffer, tamanho);
+            if (!quadros[indice].sujo) total_sujos++;
+            quadros[indice].sujo = 1;
+        }
+    }
+
+    destravar_cache();
+    return res;
+}
+
+int cache_ler_bytes(uint64_t endereco, void *buffer, uint64_t tamanho) {
+    uint8_t *destino = buffer;
+    while (tamanho > 0) {
+        uint32_t deslocamento = endereco % TAMANHO_BLOCO;
+        uint32_t parcial = TAMANHO_BLOCO - deslocamento;
+        if (parcial > tamanho) parcial = tamanho;
+
+        int res = cache_ler(endereco / TAMANHO_BLOCO, deslocamento, destino, parcial);
+        if (res != 0) return res;
+
+        destino += parcial;
+        endereco += parcial;
+        tamanho -= parcial;
+    }
+    return 0;
+}
+
+int cache_escrever_bytes(uint64_t endereco, const void *buffer, uint64_t tamanho) {
+    const uint8_t *origem = buffer;
+    while (tamanho > 0) {
+        uint32_t deslocamento = endereco % TAMANHO_BLOCO;
+        uint32_t parcial = TAMANHO_BLOCO - deslocamento;
+        if (parcial > tamanho) parcial = tamanho;
+
+        int res = cache_escrever(endereco / TAMANHO_BLOCO, deslocamento, origem, parcial);
+        if (res != 0) return res;
+
+        origem += parcial;
+        endereco += parcial;
+        tamanho -= parcial;
+    }
+    return 0;
+}
+
+static int comparar_quadros_por_bloco(const void *a, const void *b) {
+    uint64_t bloco_a = quadros[*(const int32_t *)a].bloco;
+    uint64_t bloco_b = quadros[*(const int32_t *)b].bloco;
+    return (bloco_a > bloco_b) - (bloco_a < bloco_b);
+}
+
+void cache_descartar_faixa(uint64_t bloco_inicial, uint64_t quantidade) {
+    travar_cache();
+    if (quadros && quantidade > capacidade) {
+        for (uint32_t i = 0; i < capacidade; i++) {
+            if (quadros[i].valido && quadros[i].bloco >= bloco_inicial && quadros[i].bloco - bloco_inicial < quantidade)
+                invalidar_quadro(i);
+        }
+    } else if (quadros) {
+        for (uint64_t bloco = bloco_inicial; bloco < bloco_inicial + quantidade; bloco++) {
+            int32_t indice = procurar_quadro(bloco);
+            if (indice != SEM_QUADRO) invalidar_quadro(indice);
+        }
+    }
+    destravar_cache();
+}
+
+// Grava os quadros sujos em ordem de bloco; cada sequência de blocos vizinhos
+// sai numa única escrita vetorizada
+static int sincronizar_sem_trava() {
+    // Com escrita adiada quem grava os sujos é o dono do diário
+    if (!quadros || escritas_adiadas) return 0;
+
+    int32_t *sujos = malloc(capacidade * sizeof(int32_t));
+    uint8_t **buffers = malloc(capacidade * sizeof(uint8_t *));
+    if (!sujos || !buffers) {
+        free(sujos); free(buffers);
+        return -ENOMEM;
+    }
+
+    uint32_t quantidade_sujos = 0;
+    for (uint32_t i = 0; i < capacidade; i++) {
+        if (quadros[i].valido && quadros[i].sujo) sujos[quantidade_sujos++] = i;
+    }
+    qsort(sujos, quantidade_sujos, sizeof(int32_t), comparar_quadros_por_bloco);
+
+    int res = 0;
+    uint32_t inicio_sequencia = 0;
+    for (uint32_t i = 0; i < quantidade_sujos; i++) {
+        buffers[i] = dados_do_quadro(sujos[i]);
+
+        int fim_sequencia = (i + 1 == quantidade_sujos) ||
+                            quadros[sujos[i + 1]].bloco != quadros[sujos[i]].bloco + 1;
+        if (!fim_sequencia) continue;
+
+        int res_sequencia = dispositivo_escrever_blocos(quadros[sujos[inicio_sequencia]].bloco,
+                                                        buffers + inicio_sequencia, i + 1 - inicio_sequencia);
+        if (res_sequencia == 0) {
+            for (uint32_t k = inicio_sequencia; k <= i; k++) quadros[sujos[k]].sujo = 0;
+            total_sujos -= i + 1 - inicio_sequencia;
+        } else {
+            res = res_sequencia;
+        }
+        inicio_sequencia = i + 1;
+    }
+
+    free(sujos);
+    free(buffers);
+    return res;
+}
+
+int cache_sincronizar() {
+    travar_cache();
+    int res = sincronizar_sem_trava();
+    destravar_cache();
+    return res;
+}
@@ -0,0 +1,41 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "diario.h"
+
+// --- Cache de Blocos ---
+// Fica entre o sistema de arquivos e o dispositivo para os blocos de metadados
+// (superbloco, bitmap, diretórios e listas de extensões); os dados dos arquivos
+// vão direto ao dispositivo. Guarda blocos inteiros indexados pelo número do
+// bloco, com substituição CLOCK e escrita adiada: blocos modificados só vão
+// para o disco na expulsão ou em cache_sincronizar().
+//
+// Com escritas adiadas (imagens com diário) nenhum bloco sujo vai direto para o
+// seu lugar: quem grava é o dono do diário, via cache_coletar_sujos() e
+// cache_marcar_limpos(). Se a expulsão só encontrar quadros sujos, o cache
+// cresce: a confirmação acontece entre operações, nunca no meio de uma.
+//
+// Todas as funções podem ser chamadas de várias threads.
+
+#define CACHE_CAPACIDADE_PADRAO 256     // Em blocos (1MB)
+
+int  cache_configurar(uint32_t capacidade_blocos);
+void cache_descartar();
+void cache_descartar_faixa(uint64_t bloco_inicial, uint64_t quantidade);
+int  cache_sincronizar();
+
+void     cache_adiar_escritas(int ativo);
+uint32_t cache_capacidade();
+uint32_t cache_total_sujos();
+uint32_t cache_coletar_sujos(BlocoPendente *pendentes);
+void     cache_marcar_limpos();
+
+int cache_ler(uint64_t bloco, uint32_t deslocamento, void *buffer, uint32_t tamanho);
+int cache_escrever(uint64_t bloco, uint32_t deslocamento, const void *buffer, uint32_t tamanho);
+
+// Versões por endereço absoluto em bytes, podendo atravessar vários blocos
+int cache_ler_bytes(uint64_t endereco, void *buffer, uint64_t tamanho);
+int cache_escrever_bytes(uint64_t endereco, const void *buffer, uint64_t tamanho);
+
+#endif
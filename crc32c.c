@@ -0,0 +1,198 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <nmmintrin.h>
+    #define CRC32C_X86
+#endif
+
+#define POLINOMIO 0x82F63B78U       // Castagnoli, bits invertidos
+
+// Os três fluxos processam faixas deste tamanho (potências de 2); a faixa
+// curta cobre o que sobra de um bloco de 4KB
+#define FAIXA_LONGA 1024
+#define FAIXA_CURTA 256
+
+static uint32_t tabelas[8][256];
+static int acelerado = 0;
+static pthread_once_t tabelas_prontas = PTHREAD_ONCE_INIT;
+
+#ifdef CRC32C_X86
+
+// --- Operadores de Zeros ---
+// Avançar um CRC por n bytes zero é linear: uma matriz 32x32 sobre GF(2),
+// guardada como 4 tabelas de 256 entradas (uma por byte do CRC)
+
+static uint32_t gf2_vezes(const uint32_t *matriz, uint32_t vetor) {
+    uint32_t soma = 0;
+    while (vetor) {
+        if (vetor & 1) soma ^= *matriz;
+        vetor >>= 1;
+        matriz++;
+    }
+    return soma;
+}
+
+static void gf2_quadrado(uint32_t *quadrado, const uint32_t *matriz) {
+    for (int n = 0; n < 32; n++) quadrado[n] = gf2_vezes(matriz, matriz[n]);
+}
+
+// Matriz que avança o CRC por 'tamanho' bytes zero ('tamanho' potência de 2)
+static void operador_zeros(uint32_t *par, uint64_t tamanho) {
+    uint32_t impar[32];
+    impar[0] = POLINOMIO;       // um bit zero
+    uint32_t linha = 1;
+    for (int n = 1; n < 32; n++) {
+        impar[n] = linha;
+        linha <<= 1;
+    }
+    gf2_quadrado(par, impar);   // dois bits
+    gf2_quadrado(impar, par);   // quatro bits
+
+    // Cada quadrado dobra: o primeiro deixa um byte em 'par'
+    do {
+        gf2_quadrado(par, impar);
+        tamanho >>= 1;
+        if (tamanho == 0) return;
+        gf2_quadrado(impar, par);
+        tamanho >>= 1;
+    } while (tamanho);
+    memcpy(par, impar, sizeof(impar));
+}
+
+static void montar_zeros(uint32_t zeros[4][256], uint64_t tamanho) {
+    uint32_t operador[32];
+    operador_zeros(operador, tamanho);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_vezes(operador, n);
+        zeros[1][n] = gf2_vezes(operador, n << 8);
+        zeros[2][n] = gf2_vezes(operador, n << 16);
+        zeros[3][n] = gf2_vezes(operador, n << 24);
+    }
+}
+
+static uint32_t deslocar(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t zeros_longa[4][256];
+static uint32_t zeros_curta[4][256];
+
+#endif
+
+static void montar_tabelas() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ POLINOMIO : crc >> 1;
+        tabelas[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) tabelas[k][n] = (tabelas[k - 1][n] >> 8) ^ tabelas[0][tabelas[k - 1][n] & 0xFF];
+    }
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    acelerado = __builtin_cpu_supports("sse4.2") != 0;
+    if (acelerado) {
+        montar_zeros(zeros_longa, FAIXA_LONGA);
+        montar_zeros(zeros_curta, FAIXA_CURTA);
+    }
+#endif
+}
+
+// --- Tabelas (sem a instrução) ---
+
+static uint32_t crc32c_tabelas(uint32_t crc, const uint8_t *p, uint64_t tamanho) {
+    while (tamanho > 0 && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ tabelas[0][(crc ^ *p++) & 0xFF];
+        tamanho--;
+    }
+    while (tamanho >= 8) {
+        uint64_t palavra;
+        memcpy(&palavra, p, 8);
+        palavra ^= crc;
+        crc = tabelas[7][palavra & 0xFF] ^ tabelas[6][(palavra >> 8) & 0xFF] ^
+              tabelas[5][(palavra >> 16) & 0xFF] ^ tabelas[4][(palavra >> 24) & 0xFF] ^
+              tabelas[3][(palavra >> 32) & 0xFF] ^ tabelas[2][(palavra >> 40) & 0xFF] ^
+              tabelas[1][(palavra >> 48) & 0xFF] ^ tabelas[0][palavra >> 56];
+        p += 8;
+        tamanho -= 8;
+    }
+    while (tamanho > 0) {
+        crc = (crc >> 8) ^ tabelas[0][(crc ^ *p++) & 0xFF];
+        tamanho--;
+    }
+    return crc;
+}
+
+// --- SSE4.2 ---
+// A instrução tem latência de 3 ciclos e vazão de 1 por ciclo: com três
+// faixas vizinhas em paralelo o processador fica ocupado. O CRC de A seguido
+// de B é o de A avançado por |B| bytes zero, combinado (xor) com o de B.
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+static uint64_t tres_fluxos(uint64_t crc0, const uint8_t **p, uint64_t *tamanho,
+                            uint64_t faixa, uint32_t zeros[4][256]) {
+    while (*tamanho >= 3 * faixa) {
+        const uint8_t *a = *p, *b = a + faixa, *c = b + faixa, *fim = b;
+        uint64_t crc1 = 0, crc2 = 0;
+        do {
+            uint64_t pa, pb, pc;
+            memcpy(&pa, a, 8); memcpy(&pb, b, 8); memcpy(&pc, c, 8);
+            crc0 = _mm_crc32_u64(crc0, pa);
+            crc1 = _mm_crc32_u64(crc1, pb);
+            crc2 = _mm_crc32_u64(crc2, pc);
+            a += 8; b += 8; c += 8;
+        } while (a < fim);
+        crc0 = deslocar(zeros, (uint32_t)crc0) ^ crc1;
+        crc0 = deslocar(zeros, (uint32_t)crc0) ^ crc2;
+        *p += 3 * faixa;
+        *tamanho -= 3 * faixa;
+    }
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, uint64_t tamanho) {
+    uint64_t crc0 = crc;
+    while (tamanho > 0 && ((uintptr_t)p & 7)) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+        tamanho--;
+    }
+
+    crc0 = tres_fluxos(crc0, &p, &tamanho, FAIXA_LONGA, zeros_longa);
+    crc0 = tres_fluxos(crc0, &p, &tamanho, FAIXA_CURTA, zeros_curta);
+
+    while (tamanho >= 8) {
+        uint64_t palavra;
+        memcpy(&palavra, p, 8);
+        crc0 = _mm_crc32_u64(crc0, palavra);
+        p += 8;
+        tamanho -= 8;
+    }
+    while (tamanho > 0) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+        tamanho--;
+    }
+    return (uint32_t)crc0;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *dados, uint64_t tamanho) {
+    pthread_once(&tabelas_prontas, montar_tabelas);
+    crc = ~crc;
+#ifdef CRC32C_X86
+    if (acelerado) return ~crc32c_sse42(crc, dados, tamanho);
+#endif
+    return ~crc32c_tabelas(crc, dados, tamanho);
+}
+
+int crc32c_acelerado() {
+    pthread_once(&tabelas_prontas, montar_tabelas);
+    return acelerado;
+}
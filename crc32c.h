@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// --- CRC32C (Castagnoli) ---
+// Usado nas somas de verificação dos blocos. Em processadores x86 com SSE4.2
+// usa a instrução crc32 em três fluxos independentes, cujos resultados são
+// combinados no fim; nos outros, tabelas de 8 bytes por iteração.
+//
+// 'crc' é o valor devolvido pela chamada anterior (0 para começar), então uma
+// faixa pode ser processada em partes.
+
+uint32_t crc32c(uint32_t crc, const void *dados, uint64_t tamanho);
+int      crc32c_acelerado();    // 1 se a instrução do processador está em uso
+
+#endif
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fs.h"
+#include "diario.h"
+#include "dispositivo.h"
+
+static uint64_t inicio_diario = 0;
+static uint64_t blocos_diario = 0;
+static uint64_t proxima_sequencia = 1;
+
+static uint64_t blocos_descritores(uint64_t quantidade) {
+    return (quantidade + DESTINOS_POR_BLOCO - 1) / DESTINOS_POR_BLOCO;
+}
+
+// FNV-1a de 64 bits, palavra a palavra
+static uint64_t acumular_soma(uint64_t soma, const void *dados, uint64_t tamanho) {
+    const uint64_t *palavras = dados;
+    for (uint64_t i = 0; i < tamanho / sizeof(uint64_t); i++) {
+        soma ^= palavras[i];
+        soma *= 0x100000001B3ULL;
+    }
+    return soma;
+}
+
+int diario_configurar(uint64_t bloco_inicial, uint64_t total_blocos) {
+    inicio_diario = bloco_inicial;
+    blocos_diario = total_blocos;
+    proxima_sequencia = 1;
+    return 0;
+}
+
+int diario_ativo() {
+    return blocos_diario > 0;
+}
+
+// Cabeçalho, descritores e cópias de 'disponiveis' blocos
+static uint64_t capacidade_em(uint64_t disponiveis) {
+    if (disponiveis < 2) return 0;
+    disponiveis--;
+    return disponiveis - blocos_descritores(disponiveis);
+}
+
+// Maior número de blocos que cabe numa transação: o último bloco é do
+// registro de intenções
+uint64_t diario_capacidade() {
+    return blocos_diario < 4 ? 0 : capacidade_em(blocos_diario - 1);
+}
+
+int diario_limpar() {
+    if (!diario_ativo()) return 0;
+
+    CabecalhoDiario cabecalho;
+    memset(&cabecalho, 0, sizeof(CabecalhoDiario));
+    int res = dispositivo_escrever(inicio_diario * TAMANHO_BLOCO, &cabecalho, sizeof(CabecalhoDiario));
+    if (res == 0) res = dispositivo_sincronizar();
+    return res;
+}
+
+int diario_gravar(BlocoPendente *pendentes, uint32_t quantidade) {
+    if (quantidade > diario_capacidade()) return -ENOSPC;
+
+    uint64_t total_descritores = blocos_descritores(quantidade);
+    uint64_t total_gravados = 1 + total_descritores + quantidade;
+
+    CabecalhoDiario *cabecalho = calloc(1, sizeof(CabecalhoDiario));
+    uint64_t *descritores = calloc(total_descritores, TAMANHO_BLOCO);
+    uint8_t **buffers = malloc(total_gravados * sizeof(uint8_t *));
+    if (!cabecalho || !descritores || !buffers) {
+        free(cabecalho); free(descritores); free(buffers);
+        return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < quantidade; i++) descritores[i] = pendentes[i].bloco;
+
+    uint64_t soma = acumular_soma(0xCBF29CE484222325ULL, descritores, total_descritores * TAMANHO_BLOCO);
+    for (uint32_t i = 0; i < quantidade; i++) soma = acumular_soma(soma, pendentes[i].dados, TAMANHO_BLOCO);
+
+    cabecalho->assinatura = ASSINATURA_DIARIO;
+    cabecalho->sequencia = proxima_sequencia++;
+    cabecalho->total_blocos = quantidade;
+    cabecalho->soma_verificacao = soma;
+
+    buffers[0] = (uint8_t *)cabecalho;
+    for (uint64_t i = 0; i < total_descritores; i++) buffers[1 + i] = (uint8_t *)descritores + i * TAMANHO_BLOCO;
+    for (uint32_t i = 0; i < quantidade; i++) buffers[1 + total_descritores + i] = pendentes[i].dados;
+
+    int res = dispositivo_escrever_blocos(inicio_diario, buffers, total_gravados);
+    if (res == 0) res = dispositivo_sincronizar();
+
+    free(cabecalho);
+    free(descritores);
+    free(buffers);
+    return res;
+}
+
+// Reaplica a última transação, se ela estiver inteira no diário
+int diario_recuperar() {
+    if (!diario_ativo()) return 0;
+
+    CabecalhoDiario cabecalho;
+    if (dispositivo_ler(inicio_diario * TAMANHO_BLOCO, &cabecalho, sizeof(CabecalhoDiario)) != 0) return -EIO;
+    if (cabecalho.assinatura != ASSINATURA_DIARIO) return 0;
+    proxima_sequencia = cabecalho.sequencia + 1;
+
+    // Imagens gravadas antes do registro de intenções usavam a região inteira
+    uint64_t quantidade = cabecalho.total_blocos;
+    if (quantidade == 0 || quantidade > capacidade_em(blocos_diario)) return 0;
+
+    uint64_t total_descritores = blocos_descritores(quantidade);
+    uint64_t *descritores = malloc(total_descritores * TAMANHO_BLOCO);
+    uint8_t *copias = malloc(quantidade * TAMANHO_BLOCO);
+    if (!descritores || !copias) {
+        free(descritores); free(copias);
+        return -ENOMEM;
+    }
+
+    int res = dispositivo_ler((inicio_diario + 1) * TAMANHO_BLOCO, descritores, total_descritores * TAMANHO_BLOCO);
+    if (res == 0)
+        res = dispositivo_ler((inicio_diario + 1 + total_descritores) * TAMANHO_BLOCO, copias, quantidade * TAMANHO_BLOCO);
+
+    int aplicada = 0;
+    if (res == 0) {
+        uint64_t soma = acumular_soma(0xCBF29CE484222325ULL, descritores, total_descritores * TAMANHO_BLOCO);
+        soma = acumular_soma(soma, copias, quantidade * TAMANHO_BLOCO);
+
+        if (soma == cabecalho.soma_verificacao) {
+            for (uint64_t i = 0; i < quantidade && res == 0; i++)
+                res = dispositivo_escrever(descritores[i] * TAMANHO_BLOCO, copias + i * TAMANHO_BLOCO, TAMANHO_BLOCO);
+            if (res == 0) res = dispositivo_sincronizar();
+            aplicada = (res == 0);
+        }
+    }
+
+    free(descritores);
+    free(copias);
+    if (res != 0) return res;
+    if (aplicada) res = diario_limpar();
+    return res == 0 ? aplicada : res;
+}
+
+// --- Registro de Intenções ---
+
+static uint64_t endereco_intencoes() {
+    return (inicio_diario + blocos_diario - 1) * TAMANHO_BLOCO;
+}
+
+int diario_gravar_intencoes(const FaixaIntencao *faixas, uint32_t quantidade) {
+    if (diario_capacidade() == 0) return 0;
+    if (quantidade > MAXIMO_INTENCOES) return -ENOSPC;
+
+    RegistroIntencoes registro;
+    memset(&registro, 0, sizeof(RegistroIntencoes));
+    if (quantidade > 0) {
+        memcpy(registro.faixas, faixas, quantidade * sizeof(FaixaIntencao));
+        registro.assinatura = ASSINATURA_INTENCOES;
+        registro.total_faixas = quantidade;
+        registro.soma_verificacao = acumular_soma(0xCBF29CE484222325ULL, registro.faixas, sizeof(registro.faixas));
+    }
+    int res = dispositivo_escrever(endereco_intencoes(), &registro, sizeof(RegistroIntencoes));
+    if (res == 0) res = dispositivo_sincronizar();
+    return res;
+}
+
+int diario_ler_intencoes(FaixaIntencao *faixas, uint32_t maximo) {
+    if (diario_capacidade() == 0) return 0;
+
+    RegistroIntencoes registro;
+    if (dispositivo_ler(endereco_intencoes(), &registro, sizeof(RegistroIntencoes)) != 0) return -EIO;
+    if (registro.assinatura != ASSINATURA_INTENCOES || registro.total_faixas > MAXIMO_INTENCOES) return 0;
+    if (acumular_soma(0xCBF29CE484222325ULL, registro.faixas, sizeof(registro.faixas)) != registro.soma_verificacao) return 0;
+
+    uint32_t quantidade = registro.total_faixas < maximo ? (uint32_t)registro.total_faixas : maximo;
+    memcpy(faixas, registro.faixas, quantidade * sizeof(FaixaIntencao));
+    return (int)quantidade;
+}
@@ -0,0 +1,64 @@
+#ifndef DIARIO_H
+#define DIARIO_H
+
+#include <stdint.h>
+
+// --- Diário de Metadados ---
+// Região reservada no formatar_disco, logo depois do diretório raiz. Cada
+// confirmação grava, numa única escrita sequencial seguida de um único fsync:
+//
+//   [cabeçalho][descritores: números dos blocos de destino][cópias dos blocos]
+//
+// A soma de verificação do cabeçalho cobre descritores e cópias, então uma
+// transação interrompida no meio simplesmente não é reaplicada.
+//
+// O último bloco da região fica fora das transações: guarda o registro de
+// intenções, as faixas de blocos de dados que podem ter sido escritas no lugar
+// depois da última confirmação (ver "Somas de Verificação" em fs.c).
+
+#define ASSINATURA_DIARIO  0x4F49524149444653ULL   // "SFDIARIO"
+#define DESTINOS_POR_BLOCO (TAMANHO_BLOCO / sizeof(uint64_t))
+
+typedef struct {
+    uint64_t assinatura;
+    uint64_t sequencia;
+    uint64_t total_blocos;      // Cópias de blocos nesta transação
+    uint64_t soma_verificacao;
+    uint8_t  padding[4064];
+} CabecalhoDiario;
+
+#define ASSINATURA_INTENCOES 0x434E45544E494653ULL   // "SFINTENC"
+#define MAXIMO_INTENCOES   254
+
+typedef struct {
+    uint64_t inicio;
+    uint64_t quantidade;
+} FaixaIntencao;
+
+typedef struct {
+    uint64_t assinatura;
+    uint64_t total_faixas;
+    uint64_t soma_verificacao;  // Das faixas
+    FaixaIntencao faixas[MAXIMO_INTENCOES];
+    uint8_t  padding[8];
+} RegistroIntencoes;
+
+// Um bloco de metadados pendente e o buffer com o seu novo conteúdo
+typedef struct {
+    uint64_t bloco;
+    uint8_t *dados;
+} BlocoPendente;
+
+int      diario_configurar(uint64_t bloco_inicial, uint64_t total_blocos);
+int      diario_ativo();
+uint64_t diario_capacidade();
+int      diario_limpar();
+int      diario_gravar(BlocoPendente *pendentes, uint32_t quantidade);
+int      diario_recuperar();
+
+// Grava o registro (0 faixas o esvazia) e só volta com ele no disco
+int      diario_gravar_intencoes(const FaixaIntencao *faixas, uint32_t quantidade);
+// Quantas faixas o registro tem (0 se ausente ou inválido), até 'maximo'
+int      diario_ler_intencoes(FaixaIntencao *faixas, uint32_t maximo);
+
+#endif
@@ -0,0 +1,339 @@
+#ifdef __linux__
+    #define _GNU_SOURCE     // fallocate
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fs.h"
+#include "dispositivo.h"
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <sys/uio.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #ifdef __linux__
+        #include <sys/ioctl.h>
+        #include <linux/fs.h>   // BLKDISCARD
+    #endif
+#else
+    #include <pthread.h>
+#endif
+
+#define MAXIMO_VETOR 512    // Abaixo do IOV_MAX de qualquer sistema POSIX
+#define PEDACO_ZEROS (1024 * 1024)
+
+// Zera uma faixa gravando zeros em pedaços grandes
+static int gravar_zeros(uint64_t endereco, uint64_t tamanho) {
+    uint64_t pedaco = tamanho < PEDACO_ZEROS ? tamanho : PEDACO_ZEROS;
+    void *zeros = calloc(1, pedaco ? pedaco : 1);
+    if (!zeros) return -ENOMEM;
+
+    int res = 0;
+    while (res == 0 && tamanho > 0) {
+        uint64_t neste = tamanho < pedaco ? tamanho : pedaco;
+        res = dispositivo_escrever(endereco, zeros, neste);
+        endereco += neste;
+        tamanho -= neste;
+    }
+    free(zeros);
+    return res;
+}
+
+static ContadoresDispositivo contadores;
+static _Thread_local ContadoresDispositivo contadores_thread;
+
+// Conta no total e no campo correspondente da thread que fez a chamada
+static void contar(uint64_t *contador, uint64_t valor) {
+    __atomic_fetch_add(contador, valor, __ATOMIC_RELAXED);
+    size_t campo = (size_t)(contador - (uint64_t *)&contadores);
+    ((uint64_t *)&contadores_thread)[campo] += valor;
+}
+
+void dispositivo_contadores_thread(ContadoresDispositivo *copia) {
+    *copia = contadores_thread;
+}
+
+void dispositivo_contadores(ContadoresDispositivo *copia) {
+    copia->leituras = __atomic_load_n(&contadores.leituras, __ATOMIC_RELAXED);
+    copia->escritas = __atomic_load_n(&contadores.escritas, __ATOMIC_RELAXED);
+    copia->escritas_vetorizadas = __atomic_load_n(&contadores.escritas_vetorizadas, __ATOMIC_RELAXED);
+    copia->sincronizacoes = __atomic_load_n(&contadores.sincronizacoes, __ATOMIC_RELAXED);
+    copia->bytes_lidos = __atomic_load_n(&contadores.bytes_lidos, __ATOMIC_RELAXED);
+    copia->bytes_escritos = __atomic_load_n(&contadores.bytes_escritos, __ATOMIC_RELAXED);
+}
+
+void dispositivo_zerar_contadores() {
+    __atomic_store_n(&contadores.leituras, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&contadores.escritas, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&contadores.escritas_vetorizadas, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&contadores.sincronizacoes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&contadores.bytes_lidos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&contadores.bytes_escritos, 0, __ATOMIC_RELAXED);
+}
+
+#ifdef _WIN32
+
+// Sem mmap: o modo mapeado não está disponível e tudo segue pelo stdio
+int dispositivo_usar_modo(int modo) {
+    return modo == DISPOSITIVO_POSICIONAL ? 0 : -ENOSYS;
+}
+
+int dispositivo_modo() {
+    return DISPOSITIVO_POSICIONAL;
+}
+
+void *dispositivo_ponteiro(uint64_t endereco, uint64_t tamanho) {
+    (void)endereco; (void)tamanho;
+    return NULL;
+}
+
+int dispositivo_sincronizar() {
+    return 0;
+}
+
+// Sem pread/pwrite: volta ao stdio, esvaziando o buffer a cada operação. A
+// posição do FILE é compartilhada, então cada busca+transferência é atômica.
+static pthread_mutex_t trava_stdio = PTHREAD_MUTEX_INITIALIZER;
+
+int dispositivo_ler(uint64_t endereco, void *buffer, uint64_t tamanho) {
+    pthread_mutex_lock(&trava_stdio);
+    fseek_64(arquivo_disco, endereco, SEEK_SET);
+    int res = fread(buffer, 1, tamanho, arquivo_disco) == tamanho ? 0 : -EIO;
+    pthread_mutex_unlock(&trava_stdio);
+    contar(&contadores.leituras, 1);
+    contar(&contadores.bytes_lidos, tamanho);
+    return res;
+}
+
+int dispositivo_escrever(uint64_t endereco, const void *buffer, uint64_t tamanho) {
+    pthread_mutex_lock(&trava_stdio);
+    fseek_64(arquivo_disco, endereco, SEEK_SET);
+    int res = fwrite(buffer, 1, tamanho, arquivo_disco) == tamanho ? 0 : -EIO;
+    if (res == 0 && fflush(arquivo_disco) != 0) res = -EIO;
+    pthread_mutex_unlock(&trava_stdio);
+    contar(&contadores.escritas, 1);
+    contar(&contadores.bytes_escritos, tamanho);
+    return res;
+}
+
+int dispositivo_escrever_blocos(uint64_t bloco, uint8_t *const *buffers, uint32_t quantidade) {
+    for (uint32_t i = 0; i < quantidade; i++) {
+        int res = dispositivo_escrever((bloco + i) * TAMANHO_BLOCO, buffers[i], TAMANHO_BLOCO);
+        if (res != 0) return res;
+    }
+    return 0;
+}
+
+int dispositivo_estender(uint64_t tamanho, uint64_t *tamanho_anterior) {
+    pthread_mutex_lock(&trava_stdio);
+    fseek_64(arquivo_disco, 0, SEEK_END);
+    uint64_t atual = _ftelli64(arquivo_disco);
+    pthread_mutex_unlock(&trava_stdio);
+
+    *tamanho_anterior = atual;
+    if (atual >= tamanho) return 0;
+    uint8_t ultimo_byte = 0;
+    return dispositivo_escrever(tamanho - 1, &ultimo_byte, 1);
+}
+
+int dispositivo_zerar(uint64_t endereco, uint64_t tamanho) {
+    return gravar_zeros(endereco, tamanho);
+}
+
+int dispositivo_descartar(uint64_t endereco, uint64_t tamanho) {
+    (void)endereco;
+    (void)tamanho;
+    return -EOPNOTSUPP;
+}
+
+#else
+
+static int modo_atual = DISPOSITIVO_POSICIONAL;
+static uint8_t *mapeamento = NULL;
+static uint64_t tamanho_mapeamento = 0;
+
+// (Re)aplica o modo; no mapeado, mapeia o tamanho atual da imagem. Uma imagem
+// vazia fica sem mapeamento até ser formatada, usando pread/pwrite no meio tempo.
+int dispositivo_usar_modo(int modo) {
+    if (mapeamento) {
+        munmap(mapeamento, tamanho_mapeamento);
+        mapeamento = NULL;
+        tamanho_mapeamento = 0;
+    }
+
+    modo_atual = modo;
+    if (modo != DISPOSITIVO_MAPEADO) return 0;
+
+    int fd = fileno(arquivo_disco);
+    off_t tamanho = lseek(fd, 0, SEEK_END);
+    if (tamanho <= 0) return -EINVAL;
+
+    void *endereco = mmap(NULL, tamanho, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (endereco == MAP_FAILED) return -errno;
+
+    mapeamento = endereco;
+    tamanho_mapeamento = tamanho;
+    return 0;
+}
+
+int dispositivo_modo() {
+    return modo_atual;
+}
+
+void *dispositivo_ponteiro(uint64_t endereco, uint64_t tamanho) {
+    if (!mapeamento || endereco + tamanho > tamanho_mapeamento) return NULL;
+    return mapeamento + endereco;
+}
+
+int dispositivo_sincronizar() {
+    contar(&contadores.sincronizacoes, mapeamento ? 2 : 1);
+    if (mapeamento && msync(mapeamento, tamanho_mapeamento, MS_SYNC) != 0) return -errno;
+    if (fdatasync(fileno(arquivo_disco)) != 0 && errno != EINVAL) return -errno;
+    return 0;
+}
+
+int dispositivo_ler(uint64_t endereco, void *buffer, uint64_t tamanho) {
+    uint8_t *origem_mapeada = dispositivo_ponteiro(endereco, tamanho);
+    if (origem_mapeada) {
+        memcpy(buffer, origem_mapeada, tamanho);
+        return 0;
+    }
+
+    int fd = fileno(arquivo_disco);
+    uint8_t *destino = buffer;
+
+    while (tamanho > 0) {
+        ssize_t lidos = pread(fd, destino, tamanho, endereco);
+        contar(&contadores.leituras, 1);
+        if (lidos < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (lidos == 0) return -EIO;
+        contar(&contadores.bytes_lidos, lidos);
+
+        destino += lidos;
+        endereco += lidos;
+        tamanho -= lidos;
+    }
+    return 0;
+}
+
+int dispositivo_escrever(uint64_t endereco, const void *buffer, uint64_t tamanho) {
+    uint8_t *destino_mapeado = dispositivo_ponteiro(endereco, tamanho);
+    if (destino_mapeado) {
+        memcpy(destino_mapeado, buffer, tamanho);
+        return 0;
+    }
+
+    int fd = fileno(arquivo_disco);
+    const uint8_t *origem = buffer;
+
+    while (tamanho > 0) {
+        ssize_t escritos = pwrite(fd, origem, tamanho, endereco);
+        contar(&contadores.escritas, 1);
+        if (escritos < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        contar(&contadores.bytes_escritos, escritos);
+
+        origem += escritos;
+        endereco += escritos;
+        tamanho -= escritos;
+    }
+    return 0;
+}
+
+int dispositivo_escrever_blocos(uint64_t bloco, uint8_t *const *buffers, uint32_t quantidade) {
+    if (dispositivo_ponteiro(bloco * TAMANHO_BLOCO, (uint64_t)quantidade * TAMANHO_BLOCO)) {
+        for (uint32_t i = 0; i < quantidade; i++)
+            memcpy(mapeamento + (bloco + i) * TAMANHO_BLOCO, buffers[i], TAMANHO_BLOCO);
+        return 0;
+    }
+
+    int fd = fileno(arquivo_disco);
+    struct iovec vetor[MAXIMO_VETOR];
+
+    while (quantidade > 0) {
+        uint32_t neste_lote = quantidade < MAXIMO_VETOR ? quantidade : MAXIMO_VETOR;
+        for (uint32_t i = 0; i < neste_lote; i++) {
+            vetor[i].iov_base = buffers[i];
+            vetor[i].iov_len = TAMANHO_BLOCO;
+        }
+
+        ssize_t escritos = pwritev(fd, vetor, neste_lote, bloco * TAMANHO_BLOCO);
+        contar(&contadores.escritas_vetorizadas, 1);
+        if (escritos < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        contar(&contadores.bytes_escritos, escritos);
+
+        // Escrita parcial: conclui o bloco interrompido e segue do próximo
+        uint32_t completos = escritos / TAMANHO_BLOCO;
+        uint32_t resto = escritos % TAMANHO_BLOCO;
+        if (resto) {
+            int res = dispositivo_escrever((bloco + completos) * TAMANHO_BLOCO + resto,
+                                           buffers[completos] + resto, TAMANHO_BLOCO - resto);
+            if (res != 0) return res;
+            completos++;
+        }
+
+        bloco += completos;
+        buffers += completos;
+        quantidade -= completos;
+    }
+    return 0;
+}
+
+// Arquivos comuns crescem com ftruncate, sem gravar nada (a parte nova fica
+// esparsa e já lê zeros). Dispositivos de bloco não mudam de tamanho e o
+// conteúdo anterior é desconhecido.
+int dispositivo_estender(uint64_t tamanho, uint64_t *tamanho_anterior) {
+    int fd = fileno(arquivo_disco);
+    struct stat info;
+    if (fstat(fd, &info) != 0) return -errno;
+
+    if (!S_ISREG(info.st_mode)) {
+        *tamanho_anterior = UINT64_MAX;
+        return 0;
+    }
+    *tamanho_anterior = info.st_size;
+    if ((uint64_t)info.st_size >= tamanho) return 0;
+    return ftruncate(fd, tamanho) == 0 ? 0 : -errno;
+}
+
+// Com fallocate a faixa é desalocada (arquivos) ou descartada com garantia de
+// zeros (dispositivos) numa chamada só; sem suporte, grava os zeros
+int dispositivo_zerar(uint64_t endereco, uint64_t tamanho) {
+    if (tamanho == 0) return 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    contar(&contadores.escritas, 1);
+    if (fallocate(fileno(arquivo_disco), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, endereco, tamanho) == 0)
+        return 0;
+#endif
+    return gravar_zeros(endereco, tamanho);
+}
+
+int dispositivo_descartar(uint64_t endereco, uint64_t tamanho) {
+    if (tamanho == 0) return 0;
+    int fd = fileno(arquivo_disco);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    contar(&contadores.escritas, 1);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, endereco, tamanho) == 0) return 0;
+#endif
+#ifdef BLKDISCARD
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISBLK(info.st_mode)) {
+        uint64_t faixa[2] = {endereco, tamanho};
+        if (ioctl(fd, BLKDISCARD, faixa) == 0) return 0;
+    }
+#endif
+    return -EOPNOTSUPP;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef DISPOSITIVO_H
+#define DISPOSITIVO_H
+
+#include <stdint.h>
+
+// --- Acesso ao Dispositivo ---
+// Leituras e escritas posicionais sobre o arquivo_disco, sem passar pelo
+// buffer do stdio. Cada chamada transfere a faixa inteira de uma vez.
+//
+// No modo mapeado a imagem inteira fica num mmap compartilhado: as mesmas
+// funções viram cópias de memória e dispositivo_ponteiro() dá acesso direto
+// aos bytes, sem cópia. A durabilidade vem de dispositivo_sincronizar()
+// (msync no modo mapeado, fdatasync no posicional).
+
+#define DISPOSITIVO_POSICIONAL 0    // pread/pwrite
+#define DISPOSITIVO_MAPEADO    1    // mmap
+
+int   dispositivo_usar_modo(int modo);
+int   dispositivo_modo();
+void *dispositivo_ponteiro(uint64_t endereco, uint64_t tamanho);
+int   dispositivo_sincronizar();
+
+int dispositivo_ler(uint64_t endereco, void *buffer, uint64_t tamanho);
+int dispositivo_escrever(uint64_t endereco, const void *buffer, uint64_t tamanho);
+
+// Grava 'quantidade' blocos consecutivos a partir de 'bloco', cada um vindo
+// de um buffer diferente (uma única chamada vetorizada quando disponível)
+int dispositivo_escrever_blocos(uint64_t bloco, uint8_t *const *buffers, uint32_t quantidade);
+
+// Garante que a imagem tenha pelo menos 'tamanho' bytes e informa quantos ela
+// tinha antes (UINT64_MAX quando não dá para saber): dali em diante já é zero
+int dispositivo_estender(uint64_t tamanho, uint64_t *tamanho_anterior);
+int dispositivo_zerar(uint64_t endereco, uint64_t tamanho);
+// Devolve a faixa ao sistema (buraco no arquivo de imagem, descarte no
+// dispositivo) sem garantia do conteúdo que fica; sem suporte, -EOPNOTSUPP
+int dispositivo_descartar(uint64_t endereco, uint64_t tamanho);
+
+// Chamadas ao sistema desde o último dispositivo_zerar_contadores(); cópias
+// pelo mapeamento não contam
+typedef struct {
+    uint64_t leituras;              // pread (fread no Windows)
+    uint64_t escritas;              // pwrite (fwrite no Windows)
+    uint64_t escritas_vetorizadas;  // pwritev
+    uint64_t sincronizacoes;        // fdatasync e msync
+    uint64_t bytes_lidos;
+    uint64_t bytes_escritos;
+} ContadoresDispositivo;
+
+void dispositivo_contadores(ContadoresDispositivo *copia);
+void dispositivo_zerar_contadores();
+
+// Só as chamadas feitas pela thread atual, desde que ela começou (não são
+// zerados por dispositivo_zerar_contadores())
+void dispositivo_contadores_thread(ContadoresDispositivo *copia);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "estatisticas.h"
+
+typedef struct EstatisticasThread {
+    Estatisticas dados;
+    struct EstatisticasThread *proxima;
+} EstatisticasThread;
+
+static const char *nomes_operacoes[TOTAL_OPERACOES] = {
+    "formatar_disco", "montar_disco", "desmontar_disco", "sincronizar_disco",
+    "criar_arquivo", "criar_arquivos_em_lote", "remover_arquivo", "ler_arquivo",
+    "escrever_arquivo", "mudar_diretorio", "listar_diretorio", "buscar_entrada_diretorio",
+    "ler_entrada_diretorio", "salvar_entrada_diretorio", "abrir_arquivo", "fechar_arquivo",
+    "ler_descritor", "escrever_descritor", "posicionar_descritor", "sincronizar_descritor",
+    "definir_status_blocos_bitmap", "verificar_se_bloco_esta_livre", "verificar_faixa_livre",
+    "buscar_blocos_livres", "contar_blocos_livres", "medir_fragmentacao", "desfragmentar_disco",
+    "varrer_disco", "verificar_consistencia", "comprimir_arquivo", "clonar_arquivo", "criar_instantaneo",
+    "remover_instantaneo"
+};
+
+static const char *nomes_eventos[TOTAL_EVENTOS] = {
+    "confirmacoes", "blocos_confirmados", "extensoes_novas", "diretorios_crescidos", "arquivos_movidos",
+    "somas_invalidas", "blocos_devolvidos", "bytes_para_comprimir", "bytes_comprimidos", "ns_compressao",
+    "bytes_descomprimidos", "ns_descompressao", "fluxos_compactados", "blocos_clonados",
+    "blocos_copiados_na_escrita", "blocos_antecipados", "bytes_antecipados_usados", "antecipacoes_descartadas"
+};
+
+// Lista das threads vivas, mais a soma das que já terminaram e a base
+// descontada depois de estatisticas_zerar(); tudo com trava_estatisticas
+static EstatisticasThread *threads = NULL;
+static Estatisticas encerradas;
+static Estatisticas base;
+static pthread_mutex_t trava_estatisticas = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t chave_thread;
+static pthread_once_t chave_criada = PTHREAD_ONCE_INIT;
+static _Thread_local EstatisticasThread *desta_thread = NULL;
+
+#define CONTADORES_POR_ESTATISTICA (sizeof(Estatisticas) / sizeof(uint64_t))
+
+// Só a thread dona escreve; a leitura atômica do lado de quem soma basta
+static void somar(uint64_t *contador, uint64_t valor) {
+    __atomic_store_n(contador, __atomic_load_n(contador, __ATOMIC_RELAXED) + valor, __ATOMIC_RELAXED);
+}
+
+static void acumular(Estatisticas *destino, const Estatisticas *origem, int subtrair) {
+    uint64_t *d = (uint64_t *)destino;
+    const uint64_t *o = (const uint64_t *)origem;
+    for (size_t i = 0; i < CONTADORES_POR_ESTATISTICA; i++) {
+        uint64_t valor = __atomic_load_n(&o[i], __ATOMIC_RELAXED);
+        d[i] = subtrair ? d[i] - valor : d[i] + valor;
+    }
+}
+
+static void encerrar_thread(void *valor) {
+    EstatisticasThread *estatisticas = valor;
+    pthread_mutex_lock(&trava_estatisticas);
+    acumular(&encerradas, &estatisticas->dados, 0);
+    EstatisticasThread **elo = &threads;
+    while (*elo != estatisticas) elo = &(*elo)->proxima;
+    *elo = estatisticas->proxima;
+    pthread_mutex_unlock(&trava_estatisticas);
+    free(estatisticas);
+    desta_thread = NULL;
+}
+
+static void criar_chave() {
+    pthread_key_create(&chave_thread, encerrar_thread);
+}
+
+static EstatisticasThread *estatisticas_da_thread() {
+    if (desta_thread) return desta_thread;
+
+    pthread_once(&chave_criada, criar_chave);
+    EstatisticasThread *nova = calloc(1, sizeof(EstatisticasThread));
+    if (!nova) return NULL;
+
+    pthread_mutex_lock(&trava_estatisticas);
+    nova->proxima = threads;
+    threads = nova;
+    pthread_mutex_unlock(&trava_estatisticas);
+    pthread_setspecific(chave_thread, nova);
+    desta_thread = nova;
+    return nova;
+}
+
+static uint64_t agora_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void estatisticas_iniciar(Medicao *medicao) {
+    dispositivo_contadores_thread(&medicao->dispositivo);
+    medicao->inicio = agora_ns();
+}
+
+int64_t estatisticas_registrar(int operacao, const Medicao *medicao, int64_t resultado, uint64_t bytes) {
+    uint64_t gasto = agora_ns() - medicao->inicio;
+    EstatisticasThread *estatisticas = estatisticas_da_thread();
+    if (!estatisticas) return resultado;
+
+    ContadoresDispositivo depois;
+    dispositivo_contadores_thread(&depois);
+
+    int balde = gasto ? 63 - __builtin_clzll(gasto) : 0;
+    if (balde >= BALDES_LATENCIA) balde = BALDES_LATENCIA - 1;
+
+    EstatisticaOperacao *op = &estatisticas->dados.operacoes[operacao];
+    somar(&op->chamadas, 1);
+    if (resultado < 0) somar(&op->erros, 1);
+    somar(&op->bytes, bytes);
+    somar(&op->leituras, depois.leituras - medicao->dispositivo.leituras);
+    somar(&op->escritas, (depois.escritas - medicao->dispositivo.escritas) +
+                         (depois.escritas_vetorizadas - medicao->dispositivo.escritas_vetorizadas));
+    somar(&op->sincronizacoes, depois.sincronizacoes - medicao->dispositivo.sincronizacoes);
+    somar(&op->nanossegundos, gasto);
+    somar(&op->histograma[balde], 1);
+    return resultado;
+}
+
+void estatisticas_evento(int evento, uint64_t quantidade) {
+    EstatisticasThread *estatisticas = estatisticas_da_thread();
+    if (estatisticas) somar(&estatisticas->dados.eventos[evento], quantidade);
+}
+
+void estatisticas_ler(Estatisticas *copia) {
+    pthread_mutex_lock(&trava_estatisticas);
+    *copia = encerradas;
+    for (EstatisticasThread *estatisticas = threads; estatisticas; estatisticas = estatisticas->proxima)
+        acumular(copia, &estatisticas->dados, 0);
+    acumular(copia, &base, 1);
+    pthread_mutex_unlock(&trava_estatisticas);
+}
+
+// Os contadores das threads não são tocados: a soma atual vira a base
+void estatisticas_zerar() {
+    Estatisticas atual;
+    estatisticas_ler(&atual);
+    pthread_mutex_lock(&trava_estatisticas);
+    acumular(&base, &atual, 0);
+    pthread_mutex_unlock(&trava_estatisticas);
+}
+
+const char *estatisticas_nome_operacao(int operacao) {
+    return (operacao >= 0 && operacao < TOTAL_OPERACOES) ? nomes_operacoes[operacao] : "?";
+}
+
+const char *estatisticas_nome_evento(int evento) {
+    return (evento >= 0 && evento < TOTAL_EVENTOS) ? nomes_eventos[evento] : "?";
+}
+
+uint64_t estatisticas_percentil(const EstatisticaOperacao *operacao, double fracao) {
+    if (operacao->chamadas == 0) return 0;
+
+    uint64_t alvo = (uint64_t)(operacao->chamadas * fracao);
+    if (alvo >= operacao->chamadas) alvo = operacao->chamadas - 1;
+    uint64_t acumulado = 0;
+    for (int balde = 0; balde < BALDES_LATENCIA; balde++) {
+        acumulado += operacao->histograma[balde];
+        if (acumulado > alvo) return 2ULL << balde;
+    }
+    return 2ULL << (BALDES_LATENCIA - 1);
+}
@@ -0,0 +1,113 @@
+#ifndef ESTATISTICAS_H
+#define ESTATISTICAS_H
+
+#include <stdint.h>
+#include "dispositivo.h"
+
+// --- Estatísticas das Operações ---
+// Cada função pública de fs.h conta chamadas, erros, bytes transferidos, as
+// chamadas ao dispositivo feitas enquanto ela rodava e um histograma de
+// latência em baldes de potências de 2 (em nanossegundos). Eventos internos
+// (confirmações, extensões novas etc.) têm contadores próprios.
+//
+// Os contadores são por thread: só a dona escreve neles, sem instruções
+// atômicas com trava, e estatisticas_ler() soma todos. Os de threads que já
+// terminaram ficam acumulados à parte.
+
+enum {
+    OP_FORMATAR,
+    OP_MONTAR,
+    OP_DESMONTAR,
+    OP_SINCRONIZAR,
+    OP_CRIAR,
+    OP_CRIAR_LOTE,
+    OP_REMOVER,
+    OP_LER,
+    OP_ESCREVER,
+    OP_MUDAR_DIRETORIO,
+    OP_LISTAR,
+    OP_BUSCAR_ENTRADA,
+    OP_LER_ENTRADA,
+    OP_SALVAR_ENTRADA,
+    OP_ABRIR,
+    OP_FECHAR,
+    OP_LER_DESCRITOR,
+    OP_ESCREVER_DESCRITOR,
+    OP_POSICIONAR,
+    OP_SINCRONIZAR_DESCRITOR,
+    OP_DEFINIR_BITMAP,
+    OP_VERIFICAR_BLOCO,
+    OP_VERIFICAR_FAIXA,
+    OP_BUSCAR_LIVRES,
+    OP_CONTAR_LIVRES,
+    OP_MEDIR_FRAGMENTACAO,
+    OP_DESFRAGMENTAR,
+    OP_VARRER,
+    OP_VERIFICAR_CONSISTENCIA,
+    OP_COMPRIMIR,
+    OP_CLONAR,
+    OP_CRIAR_INSTANTANEO,
+    OP_REMOVER_INSTANTANEO,
+    TOTAL_OPERACOES
+};
+
+enum {
+    EVENTO_CONFIRMACAO,             // Transações gravadas (diário ou direto)
+    EVENTO_BLOCOS_CONFIRMADOS,      // Blocos de metadados nessas transações
+    EVENTO_EXTENSAO_NOVA,           // Arquivo cresceu longe da sua última extensão
+    EVENTO_DIRETORIO_CRESCEU,
+    EVENTO_ARQUIVO_MOVIDO,          // Pela desfragmentação
+    EVENTO_SOMA_INVALIDA,           // Blocos que não conferiram (leitura ou varredura)
+    EVENTO_BLOCOS_DEVOLVIDOS,       // Liberados e descartados no arquivo de imagem
+    EVENTO_BYTES_PARA_COMPRIMIR,    // Pedaços de arquivos comprimidos gravados (sem os só de zeros)
+    EVENTO_BYTES_COMPRIMIDOS,       // O que eles ocuparam depois do compressor
+    EVENTO_NS_COMPRESSAO,
+    EVENTO_BYTES_DESCOMPRIMIDOS,
+    EVENTO_NS_DESCOMPRESSAO,
+    EVENTO_FLUXO_COMPACTADO,        // Versões mortas de pedaços descartadas
+    EVENTO_BLOCOS_CLONADOS,         // Referências a mais criadas por clones e instantâneos
+    EVENTO_BLOCOS_COPIADOS,         // Blocos divididos trocados por uma cópia na primeira escrita
+    EVENTO_BLOCOS_ANTECIPADOS,      // Pedidos pela leitura antecipada dos descritores
+    EVENTO_BYTES_ANTECIPADOS_USADOS, // Lidos de trechos já antecipados
+    EVENTO_ANTECIPACAO_DESCARTADA,  // Trechos jogados fora (arquivo escrito, leitura fora de sequência)
+    TOTAL_EVENTOS
+};
+
+#define BALDES_LATENCIA 40          // Balde i: [2^i, 2^(i+1)) ns; o último acumula o resto
+
+typedef struct {
+    uint64_t chamadas;
+    uint64_t erros;                 // Retornos negativos
+    uint64_t bytes;
+    uint64_t leituras;              // Chamadas ao dispositivo durante a operação
+    uint64_t escritas;              // (as vetorizadas também)
+    uint64_t sincronizacoes;
+    uint64_t nanossegundos;
+    uint64_t histograma[BALDES_LATENCIA];
+} EstatisticaOperacao;
+
+typedef struct {
+    EstatisticaOperacao operacoes[TOTAL_OPERACOES];
+    uint64_t eventos[TOTAL_EVENTOS];
+} Estatisticas;
+
+// Estado de uma chamada em andamento
+typedef struct {
+    uint64_t inicio;
+    ContadoresDispositivo dispositivo;
+} Medicao;
+
+void    estatisticas_iniciar(Medicao *medicao);
+// Devolve 'resultado', para fechar a medição no próprio return
+int64_t estatisticas_registrar(int operacao, const Medicao *medicao, int64_t resultado, uint64_t bytes);
+void    estatisticas_evento(int evento, uint64_t quantidade);
+
+void estatisticas_ler(Estatisticas *copia);
+void estatisticas_zerar();
+const char *estatisticas_nome_operacao(int operacao);
+const char *estatisticas_nome_evento(int evento);
+
+// Latência (limite superior do balde, em ns) abaixo da qual fica 'fracao' das chamadas
+uint64_t estatisticas_percentil(const EstatisticaOperacao *operacao, double fracao);
+
+#endif
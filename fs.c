@@ -2,13 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "fs.h"
+#include "cache.h"
+#include "dispositivo.h"
+#include "diario.h"
+#include "estatisticas.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include "assincrono.h"
 
-// Macro para compatibilidade Windows/Linux
-#ifdef _WIN32
-    #define fseek_64 _fseeki64
-#else
-    #define fseek_64 fseeko
+#ifdef __SSE2__
+    #include <emmintrin.h>
 #endif
 
 // Definição das variáveis globais
@@ -17,387 +27,5427 @@ uint64_t total_blocos_disco = 0;
 uint64_t bloco_inicio_bitmap = 0;
 uint64_t bloco_inicio_raiz = 0;
 uint64_t bloco_inicio_dados = 0;
-uint64_t bloco_diretorio_atual = 0;
+uint64_t bloco_inicio_somas = 0;
+uint64_t bloco_inicio_referencias = 0;
+uint32_t versao_formato_disco = VERSAO_FORMATO;
+int entradas_por_diretorio = TAMANHO_BLOCO / sizeof(EntradaDiretorio);
+_Thread_local uint64_t bloco_diretorio_atual = 0;
+
+// Montar/formatar invalida o diretório atual de todas as threads
+static uint64_t geracao_montagem = 0;
+static _Thread_local uint64_t geracao_diretorio_atual = 0;
+
+// --- Diretórios Atuais ---
+// Quantas threads estão em cada pasta (a raiz não conta: não pode ser
+// removida). Remover uma pasta que é o diretório atual de alguém devolve
+// -EBUSY, senão o bloco dela voltaria a ser usado por outro arquivo. A thread
+// desconta a sua ao trocar de diretório e ao terminar; montar/formatar zera
+// a tabela junto com a geração.
+
+typedef struct {
+    uint64_t bloco;
+    uint32_t threads;
+} DiretorioAtual;
+
+static DiretorioAtual *diretorios_atuais = NULL;
+static uint32_t total_diretorios_atuais = 0;
+static uint32_t capacidade_diretorios_atuais = 0;
+static pthread_mutex_t trava_diretorios_atuais = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t chave_diretorio_atual;     // só para descontar na saída da thread
+static pthread_once_t chave_diretorio_criada = PTHREAD_ONCE_INIT;
+static _Thread_local uint64_t diretorio_contado = 0;    // 0 = nada na tabela
+static _Thread_local uint64_t geracao_contada = 0;
+
+// Com trava_diretorios_atuais
+static void contar_diretorio_atual(uint64_t bloco, int delta) {
+    for (uint32_t i = 0; i < total_diretorios_atuais; i++) {
+        if (diretorios_atuais[i].bloco != bloco) continue;
+        diretorios_atuais[i].threads += delta;
+        if (diretorios_atuais[i].threads == 0) diretorios_atuais[i] = diretorios_atuais[--total_diretorios_atuais];
+        return;
+    }
+    if (delta < 0) return;
+    if (total_diretorios_atuais == capacidade_diretorios_atuais) {
+        uint32_t capacidade = capacidade_diretorios_atuais ? capacidade_diretorios_atuais * 2 : 16;
+        DiretorioAtual *novos = realloc(diretorios_atuais, capacidade * sizeof(DiretorioAtual));
+        if (!novos) return;     // sem memória a pasta só fica sem a proteção
+        diretorios_atuais = novos;
+        capacidade_diretorios_atuais = capacidade;
+    }
+    diretorios_atuais[total_diretorios_atuais++] = (DiretorioAtual){bloco, 1};
+}
+
+// Com trava_diretorios_atuais. Uma contagem de antes da última montagem já sumiu.
+static void descontar_diretorio_atual() {
+    if (diretorio_contado != 0 && geracao_contada == geracao_montagem) contar_diretorio_atual(diretorio_contado, -1);
+    diretorio_contado = 0;
+}
+
+static void sair_da_thread(void *valor) {
+    (void)valor;
+    pthread_mutex_lock(&trava_diretorios_atuais);
+    descontar_diretorio_atual();
+    pthread_mutex_unlock(&trava_diretorios_atuais);
+}
+
+static void criar_chave_diretorio() {
+    pthread_key_create(&chave_diretorio_atual, sair_da_thread);
+}
+
+static void trocar_diretorio_atual(uint64_t bloco) {
+    pthread_mutex_lock(&trava_diretorios_atuais);
+    descontar_diretorio_atual();
+    if (bloco != bloco_inicio_raiz) {
+        pthread_once(&chave_diretorio_criada, criar_chave_diretorio);
+        pthread_setspecific(chave_diretorio_atual, &diretorio_contado);
+        contar_diretorio_atual(bloco, 1);
+        diretorio_contado = bloco;
+        geracao_contada = geracao_montagem;
+    }
+    pthread_mutex_unlock(&trava_diretorios_atuais);
+    bloco_diretorio_atual = bloco;
+}
+
+static int diretorio_em_uso(uint64_t bloco) {
+    pthread_mutex_lock(&trava_diretorios_atuais);
+    int em_uso = 0;
+    for (uint32_t i = 0; i < total_diretorios_atuais && !em_uso; i++) em_uso = diretorios_atuais[i].bloco == bloco;
+    pthread_mutex_unlock(&trava_diretorios_atuais);
+    return em_uso;
+}
+
+// Com trava_operacoes exclusiva
+static void nova_montagem() {
+    pthread_mutex_lock(&trava_diretorios_atuais);
+    total_diretorios_atuais = 0;
+    geracao_montagem++;
+    pthread_mutex_unlock(&trava_diretorios_atuais);
+}
 
 // --- Funções Auxiliares ---
 
 void inicializar_diretorio_atual() {
-    bloco_diretorio_atual = bloco_inicio_raiz;
+    geracao_diretorio_atual = geracao_montagem;
+    trocar_diretorio_atual(bloco_inicio_raiz);
+}
+
+// As entradas da versão 1 guardam o tamanho em 32 bits; as posições dos
+// descritores são int64_t
+static uint64_t tamanho_maximo_arquivo() {
+    return versao_formato_disco < 2 ? UINT32_MAX : INT64_MAX;
 }
 
-void definir_status_blocos_bitmap(uint64_t bloco_inicial, int quantidade, int status) {
-    for(int i = 0; i < quantidade; i++) {
-        uint64_t bloco_atual = bloco_inicial + i;
-        uint64_t deslocamento_byte = bloco_atual / 8;
-        int deslocamento_bit = bloco_atual % 8;
-        uint64_t endereco_fisico = (bloco_inicio_bitmap * TAMANHO_BLOCO) + deslocamento_byte;
+static void usar_versao_formato(uint32_t versao) {
+    versao_formato_disco = versao;
+    entradas_por_diretorio = TAMANHO_BLOCO / (versao < 2 ? sizeof(EntradaDiretorioV1) : sizeof(EntradaDiretorio));
+}
 
-        fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-        uint8_t byte_lido;
-        fread(&byte_lido, 1, 1, arquivo_disco);
+// --- Concorrência ---
+// As operações podem ser chamadas de várias threads ao mesmo tempo; cada
+// thread tem o seu diretório atual. As travas são sempre adquiridas nesta ordem:
+//   trava_operacoes  compartilhada por toda operação; exclusiva para confirmar
+//                    no diário, formatar e montar (nunca com operação pela metade)
+//   diretório        leitura para consultar, escrita para criar/remover entradas
+//   arquivo          leitura para ler, escrita para escrever (tamanho/extensões)
+//   descritor        a posição e a leitura antecipada de cada um (ver Descritor)
+//   trava_indices -> trava_mapa -> trava do cache (cache.c)
+//   trava_diretorios_atuais  só a tabela de Diretórios Atuais, sem nada dentro
+//   trava_intencoes  só o registro de intenções (Somas de Verificação)
+// Diretórios e arquivos compartilham conjuntos fixos de travas, por hash.
 
-        if(status == STATUS_USADO) 
-            byte_lido |= (1 << deslocamento_bit);
-        else                       
-            byte_lido &= ~(1 << deslocamento_bit);
+#define FAIXAS_DIRETORIO 64
+#define FAIXAS_ARQUIVO 256
 
-        fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-        fwrite(&byte_lido, 1, 1, arquivo_disco);
-    }
-    fflush(arquivo_disco);
+static pthread_rwlock_t trava_operacoes = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t travas_diretorio[FAIXAS_DIRETORIO];
+static pthread_rwlock_t travas_arquivo[FAIXAS_ARQUIVO];
+static pthread_mutex_t trava_indices = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trava_mapa;      // recursiva: as funções do bitmap se chamam
+static pthread_once_t travas_iniciadas = PTHREAD_ONCE_INIT;
+
+static void iniciar_travas() {
+    for (int i = 0; i < FAIXAS_DIRETORIO; i++) pthread_rwlock_init(&travas_diretorio[i], NULL);
+    for (int i = 0; i < FAIXAS_ARQUIVO; i++) pthread_rwlock_init(&travas_arquivo[i], NULL);
+
+    pthread_mutexattr_t atributos;
+    pthread_mutexattr_init(&atributos);
+    pthread_mutexattr_settype(&atributos, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&trava_mapa, &atributos);
+    pthread_mutexattr_destroy(&atributos);
 }
 
-int verificar_se_bloco_esta_livre(uint64_t indice_bloco) {
-    uint64_t deslocamento_byte = indice_bloco / 8;
-    int deslocamento_bit = indice_bloco % 8;
-    uint64_t endereco_fisico = (bloco_inicio_bitmap * TAMANHO_BLOCO) + deslocamento_byte;
-    
-    fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-    uint8_t byte_lido;
-    fread(&byte_lido, 1, 1, arquivo_disco);
-    
-    return !(byte_lido & (1 << deslocamento_bit));
+static void entrar_operacao(int exclusiva) {
+    pthread_once(&travas_iniciadas, iniciar_travas);
+    if (exclusiva) pthread_rwlock_wrlock(&trava_operacoes);
+    else pthread_rwlock_rdlock(&trava_operacoes);
+    if (geracao_diretorio_atual != geracao_montagem) inicializar_diretorio_atual();
 }
 
-EntradaDiretorio ler_entrada_diretorio(int indice) {
-    EntradaDiretorio entrada = {0};
-    uint64_t endereco_fisico = (bloco_diretorio_atual * TAMANHO_BLOCO) + (indice * sizeof(EntradaDiretorio));
-    
-    fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-    fread(&entrada, sizeof(EntradaDiretorio), 1, arquivo_disco);
-    return entrada;
+static void sair_operacao() {
+    pthread_rwlock_unlock(&trava_operacoes);
 }
 
-void salvar_entrada_diretorio(int indice, EntradaDiretorio *entrada) {
-    uint64_t endereco_fisico = (bloco_diretorio_atual * TAMANHO_BLOCO) + (indice * sizeof(EntradaDiretorio));
-    fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-    fwrite(entrada, sizeof(EntradaDiretorio), 1, arquivo_disco);
-    fflush(arquivo_disco);
+static pthread_rwlock_t *trava_do_diretorio(uint64_t bloco) {
+    return &travas_diretorio[(bloco * 0x9E3779B97F4A7C15ULL) >> 58];
 }
 
-// --- Funções Principais ---
+// Um arquivo é identificado pela posição da sua entrada
+static pthread_rwlock_t *trava_do_arquivo(uint64_t bloco_diretorio, int slot) {
+    uint64_t chave = (bloco_diretorio << 32) ^ (uint32_t)slot;
+    return &travas_arquivo[(chave * 0x9E3779B97F4A7C15ULL) >> 56];
+}
 
-void formatar_disco(int quantidade_setores) {
-    uint64_t total_bytes = (uint64_t)quantidade_setores * 512;
-    uint64_t total_blocos = total_bytes / TAMANHO_BLOCO;
-    
-    uint64_t bytes_mapa = (total_blocos + 7) / 8;
-    uint64_t blocos_mapa = (bytes_mapa + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
+static void travar_mapa() {
+    pthread_once(&travas_iniciadas, iniciar_travas);
+    pthread_mutex_lock(&trava_mapa);
+}
 
-    uint64_t inicio_bitmap = 2;
-    uint64_t inicio_raiz = inicio_bitmap + blocos_mapa;
-    uint64_t inicio_dados = inicio_raiz + 1;
+static void destravar_mapa() {
+    pthread_mutex_unlock(&trava_mapa);
+}
 
-    SuperBloco sb = {0};
-    sb.tamanho_bloco = TAMANHO_BLOCO;
-    sb.total_blocos = total_blocos;
-    sb.inicio_bitmap = inicio_bitmap;
-    sb.inicio_raiz = inicio_raiz;
-    sb.inicio_dados = inicio_dados;
+// --- Bitmap em Memória ---
+// O bitmap inteiro fica em memória desde montar/formatar. As buscas andam
+// palavra a palavra (64 blocos por vez) e só os blocos do bitmap alterados
+// voltam para o disco, juntos, em sincronizar_disco().
 
-    fseek_64(arquivo_disco, total_bytes - 1, SEEK_SET);
-    fputc(0, arquivo_disco); 
-    
-    char *zeros = calloc(TAMANHO_BLOCO, 1);
-    for(uint64_t i=0; i < inicio_dados; i++) {
-        fseek_64(arquivo_disco, i * TAMANHO_BLOCO, SEEK_SET);
-        fwrite(zeros, TAMANHO_BLOCO, 1, arquivo_disco);
-    }
-    free(zeros);
+static uint64_t *mapa_bits = NULL;
+static int mapa_bits_no_mapeamento = 0;     // aponta direto para o disco mapeado
+static uint64_t palavras_mapa = 0;
+static uint64_t total_blocos_mapa = 0;
+static uint8_t *blocos_mapa_sujos = NULL;
+static uint64_t total_blocos_mapa_sujos = 0;
+static uint64_t dica_palavra_livre = 0;   // nenhuma palavra antes desta tem bit livre
+static uint64_t total_blocos_livres = 0;
 
-    fseek_64(arquivo_disco, 1 * TAMANHO_BLOCO, SEEK_SET);
-    fwrite(&sb, sizeof(SuperBloco), 1, arquivo_disco);
-    fflush(arquivo_disco);
+// Faixas liberadas desde a última confirmação: depois dela passam para as
+// faixas a devolver, e as que continuarem livres são devolvidas ao sistema
+// fora da confirmação (ver devolver_liberadas())
+static Extensao *faixas_liberadas = NULL;
+static uint32_t total_faixas_liberadas = 0;
+static uint32_t capacidade_faixas_liberadas = 0;
 
-    total_blocos_disco = total_blocos;
-    bloco_inicio_bitmap = inicio_bitmap;
-    bloco_inicio_raiz = inicio_raiz;
-    bloco_inicio_dados = inicio_dados;
-    
-    inicializar_diretorio_atual();
-    definir_status_blocos_bitmap(0, inicio_dados, STATUS_USADO);
+// Já confirmadas, esperando a devolução; protegidas pela trava do mapa
+static Extensao *faixas_a_devolver = NULL;
+static uint32_t total_faixas_a_devolver = 0;
+static uint32_t capacidade_faixas_a_devolver = 0;
+
+// Faixas que os metadados já confirmados ainda usam: só voltam ao bitmap
+// depois da próxima confirmação (ver adiar_liberacao())
+static Extensao *faixas_adiadas = NULL;
+static uint32_t total_faixas_adiadas = 0;
+static uint32_t capacidade_faixas_adiadas = 0;
+
+#define PALAVRA_CHEIA UINT64_MAX
+
+// Máscara com os bits [inicio, inicio + quantidade) de uma palavra
+static uint64_t mascara_bits(int inicio, int quantidade) {
+    uint64_t mascara = (quantidade == 64) ? PALAVRA_CHEIA : ((1ULL << quantidade) - 1);
+    return mascara << inicio;
 }
 
-int montar_disco() {
-    if (!arquivo_disco) return 0;
+static int carregar_bitmap(int ler_do_disco) {
+    uint64_t blocos_mapa = bloco_inicio_raiz - bloco_inicio_bitmap;
+    uint64_t bytes_mapa = blocos_mapa * TAMANHO_BLOCO;
 
-    SuperBloco sb;
-    fseek_64(arquivo_disco, 1 * TAMANHO_BLOCO, SEEK_SET);
-    if (fread(&sb, sizeof(SuperBloco), 1, arquivo_disco) != 1) return 0;
+    if (!mapa_bits_no_mapeamento) free(mapa_bits);
+    free(blocos_mapa_sujos);
+    blocos_mapa_sujos = calloc(blocos_mapa, 1);
+    if (!blocos_mapa_sujos) return 0;
+    total_blocos_mapa = blocos_mapa;
+    total_blocos_mapa_sujos = 0;
 
-    total_blocos_disco = sb.total_blocos;
-    bloco_inicio_bitmap = sb.inicio_bitmap;
-    bloco_inicio_raiz = sb.inicio_raiz;
-    bloco_inicio_dados = sb.inicio_dados;
-    
-    inicializar_diretorio_atual();
+    // Com o disco mapeado o bitmap é usado no lugar, sem cópia em memória. Com
+    // diário não: as alterações só podem chegar ao disco depois de confirmadas.
+    uint64_t *mapa_no_disco = NULL;
+    if (!diario_ativo()) mapa_no_disco = dispositivo_ponteiro(bloco_inicio_bitmap * TAMANHO_BLOCO, bytes_mapa);
+    mapa_bits_no_mapeamento = (mapa_no_disco != NULL);
+    if (mapa_no_disco) {
+        mapa_bits = mapa_no_disco;
+        if (!ler_do_disco) memset(mapa_bits, 0, bytes_mapa);
+    } else {
+        mapa_bits = calloc(1, bytes_mapa);
+        if (!mapa_bits) return 0;
+        if (ler_do_disco && dispositivo_ler(bloco_inicio_bitmap * TAMANHO_BLOCO, mapa_bits, bytes_mapa) != 0) return 0;
+    }
+    palavras_mapa = bytes_mapa / sizeof(uint64_t);
+    dica_palavra_livre = 0;
+    total_faixas_liberadas = 0;
+    total_faixas_a_devolver = 0;
+    total_faixas_adiadas = 0;
+
+    total_blocos_livres = total_blocos_disco;
+    uint64_t palavras_validas = total_blocos_disco / 64;
+    for (uint64_t i = 0; i < palavras_validas; i++)
+        total_blocos_livres -= __builtin_popcountll(mapa_bits[i]);
+    if (total_blocos_disco % 64)
+        total_blocos_livres -= __builtin_popcountll(mapa_bits[palavras_validas] & mascara_bits(0, total_blocos_disco % 64));
     return 1;
 }
 
-int criar_arquivo(const char *nome, uint32_t tamanho_solicitado, uint8_t tipo) {
-    if (tipo == TIPO_DIRETORIO && bloco_diretorio_atual != bloco_inicio_raiz) {
-        return -EPERM;
-    }
+#define PALAVRAS_POR_BLOCO (TAMANHO_BLOCO / sizeof(uint64_t))
 
-    if (tipo == TIPO_DIRETORIO) {
-        tamanho_solicitado = TAMANHO_BLOCO;
+static void marcar_palavras_sujas(uint64_t primeira, uint64_t ultima) {
+    if (mapa_bits_no_mapeamento) return;
+
+    for (uint64_t bloco = primeira / PALAVRAS_POR_BLOCO; bloco <= ultima / PALAVRAS_POR_BLOCO; bloco++) {
+        if (!blocos_mapa_sujos[bloco]) {
+            blocos_mapa_sujos[bloco] = 1;
+            total_blocos_mapa_sujos++;
+        }
     }
+}
 
-    int blocos_necessarios = (tamanho_solicitado + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
-    if (blocos_necessarios == 0 && tamanho_solicitado > 0) blocos_necessarios = 1; 
-    
-    int indice_primeiro_bloco_livre = -1;
-    uint64_t contador_blocos_livres_consecutivos = 0;
-    
-    for (uint64_t i = 0; i < total_blocos_disco - bloco_inicio_dados; i++) { 
-        uint64_t indice_absoluto = bloco_inicio_dados + i;
-        if (indice_absoluto >= total_blocos_disco) break;
-
-        if(verificar_se_bloco_esta_livre(indice_absoluto)) {
-            contador_blocos_livres_consecutivos++;
-            if (contador_blocos_livres_consecutivos == blocos_necessarios) {
-                indice_primeiro_bloco_livre = indice_absoluto - blocos_necessarios + 1;
-                break;
-            }
-        } else {
-            contador_blocos_livres_consecutivos = 0;
+// Acrescenta os blocos sujos do bitmap à lista de pendentes (em ordem de bloco)
+static uint32_t coletar_bitmap_sujo(BlocoPendente *pendentes) {
+    uint32_t coletados = 0;
+    for (uint64_t i = 0; i < total_blocos_mapa && coletados < total_blocos_mapa_sujos; i++) {
+        if (blocos_mapa_sujos[i]) {
+            pendentes[coletados].bloco = bloco_inicio_bitmap + i;
+            pendentes[coletados].dados = (uint8_t *)mapa_bits + i * TAMANHO_BLOCO;
+            coletados++;
         }
     }
+    return coletados;
+}
+
+static void marcar_bitmap_limpo() {
+    if (total_blocos_mapa_sujos == 0) return;
+    memset(blocos_mapa_sujos, 0, total_blocos_mapa);
+    total_blocos_mapa_sujos = 0;
+}
 
-    if (indice_primeiro_bloco_livre < 0) return -ENOSPC;
+// Avança sobre palavras totalmente ocupadas; com SSE2 testa 8 palavras por iteração
+static uint64_t pular_palavras_cheias(uint64_t palavra, uint64_t fim) {
+#ifdef __SSE2__
+    const __m128i cheia = _mm_set1_epi32(-1);
+    while (palavra + 8 <= fim) {
+        const __m128i *p = (const __m128i *)(mapa_bits + palavra);
+        __m128i a = _mm_and_si128(_mm_loadu_si128(p),     _mm_loadu_si128(p + 1));
+        __m128i b = _mm_and_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(a, b), cheia)) != 0xFFFF) break;
+        palavra += 8;
+    }
+#endif
+    while (palavra < fim && mapa_bits[palavra] == PALAVRA_CHEIA) palavra++;
+    return palavra;
+}
 
-    int indice_diretorio_livre = -1;
-    for (int i = 0; i < 64; i++) {
-        EntradaDiretorio entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_LIVRE || entrada.status == STATUS_APAGADO) {
-            indice_diretorio_livre = i;
-            break;
+// Acrescenta a faixa à lista, juntando com a última se for vizinha
+static void anotar_faixa(Extensao **faixas, uint32_t *total, uint32_t *capacidade, uint64_t inicio, uint64_t quantidade) {
+    if (*total > 0) {
+        Extensao *ultima = &(*faixas)[*total - 1];
+        if (ultima->inicio + ultima->quantidade == inicio) {
+            ultima->quantidade += quantidade;
+            return;
         }
-        if (entrada.status == STATUS_USADO && strcmp(entrada.nome_arquivo, nome) == 0) return -EEXIST;
     }
+    if (*total == *capacidade) {
+        uint32_t nova_capacidade = *capacidade ? *capacidade * 2 : 64;
+        Extensao *novas = realloc(*faixas, nova_capacidade * sizeof(Extensao));
+        if (!novas) return;
+        *faixas = novas;
+        *capacidade = nova_capacidade;
+    }
+    (*faixas)[*total].inicio = inicio;
+    (*faixas)[*total].quantidade = quantidade;
+    (*total)++;
+}
 
-    if (indice_diretorio_livre < 0) return -ENOSPC;
+static int comparar_faixas(const void *a, const void *b) {
+    uint64_t inicio_a = ((const Extensao *)a)->inicio;
+    uint64_t inicio_b = ((const Extensao *)b)->inicio;
+    return (inicio_a > inicio_b) - (inicio_a < inicio_b);
+}
 
-    if (tamanho_solicitado > 0) {
-        definir_status_blocos_bitmap(indice_primeiro_bloco_livre, blocos_necessarios, STATUS_USADO);
-    } else {
-        indice_primeiro_bloco_livre = 0;
-    }
+// Ordena as faixas e junta as vizinhas ou sobrepostas; devolve quantas sobram
+static uint32_t juntar_faixas(Extensao *faixas, uint32_t total) {
+    if (total < 2) return total;
+    qsort(faixas, total, sizeof(Extensao), comparar_faixas);
 
-    if (tipo == TIPO_DIRETORIO) {
-        void *buffer_zeros = calloc(1, TAMANHO_BLOCO);
-        if (buffer_zeros) {
-            uint64_t endereco_fisico = (uint64_t)indice_primeiro_bloco_livre * TAMANHO_BLOCO;
-            fseek_64(arquivo_disco, endereco_fisico, SEEK_SET);
-            fwrite(buffer_zeros, TAMANHO_BLOCO, 1, arquivo_disco);
-            free(buffer_zeros);
+    uint32_t juntas = 0;
+    for (uint32_t i = 1; i < total; i++) {
+        Extensao *ultima = &faixas[juntas];
+        if (faixas[i].inicio <= ultima->inicio + ultima->quantidade) {
+            uint64_t fim = faixas[i].inicio + faixas[i].quantidade;
+            if (fim > ultima->inicio + ultima->quantidade) ultima->quantidade = fim - ultima->inicio;
+        } else {
+            faixas[++juntas] = faixas[i];
         }
     }
+    return juntas + 1;
+}
 
-    EntradaDiretorio nova_entrada = {0};
-    strncpy(nova_entrada.nome_arquivo, nome, 49);
-    nova_entrada.tamanho_bytes = tamanho_solicitado;
-    nova_entrada.bloco_inicial = indice_primeiro_bloco_livre;
-    nova_entrada.status        = STATUS_USADO;
-    nova_entrada.tipo          = tipo;
-    
-    salvar_entrada_diretorio(indice_diretorio_livre, &nova_entrada);
-    return 0;
+// Sem memória a faixa só deixa de ser devolvida; no bitmap ela já está livre
+static void anotar_liberada(uint64_t inicio, uint64_t quantidade) {
+    anotar_faixa(&faixas_liberadas, &total_faixas_liberadas, &capacidade_faixas_liberadas, inicio, quantidade);
 }
 
-int remover_arquivo(const char *nome) {
-    EntradaDiretorio entrada;
-    int indice_encontrado = -1;
+// Para blocos que deixam de ser usados por uma alteração ainda não confirmada:
+// liberados na hora, poderiam ser reescritos por outro arquivo antes dela e
+// uma queda deixaria os metadados antigos apontando para eles. Sem memória a
+// faixa fica marcada até uma verificação de consistência a recuperar.
+static void adiar_liberacao(uint64_t inicio, uint64_t quantidade) {
+    travar_mapa();
+    anotar_faixa(&faixas_adiadas, &total_faixas_adiadas, &capacidade_faixas_adiadas, inicio, quantidade);
+    destravar_mapa();
+}
 
-    for (int i = 0; i < 64; i++) {
-        entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_USADO && strcmp(entrada.nome_arquivo, nome) == 0) {
-            indice_encontrado = i;
-            break;
+static void marcar_blocos(uint64_t bloco_inicial, uint64_t quantidade, int status) {
+    if (quantidade == 0) return;
+    travar_mapa();
+
+    uint64_t bloco_atual = bloco_inicial;
+    uint64_t restantes = quantidade;
+
+    marcar_palavras_sujas(bloco_inicial / 64, (bloco_inicial + quantidade - 1) / 64);
+
+    while (restantes > 0) {
+        uint64_t palavra = bloco_atual / 64;
+        int bit = bloco_atual % 64;
+        int bits_nesta_palavra = 64 - bit;
+        if ((uint64_t)bits_nesta_palavra > restantes) bits_nesta_palavra = restantes;
+
+        uint64_t mascara = mascara_bits(bit, bits_nesta_palavra);
+        if (status == STATUS_USADO) {
+            total_blocos_livres -= __builtin_popcountll(mascara & ~mapa_bits[palavra]);
+            mapa_bits[palavra] |= mascara;
+        } else {
+            total_blocos_livres += __builtin_popcountll(mascara & mapa_bits[palavra]);
+            mapa_bits[palavra] &= ~mascara;
         }
+
+        bloco_atual += bits_nesta_palavra;
+        restantes -= bits_nesta_palavra;
     }
 
-    if (indice_encontrado < 0) return -ENOENT;
-    
-    if (entrada.tamanho_bytes > 0) {
-        int blocos_ocupados = (entrada.tamanho_bytes + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
-        definir_status_blocos_bitmap(entrada.bloco_inicial, blocos_ocupados, STATUS_LIVRE);
+    if (status != STATUS_USADO) {
+        if (bloco_inicial / 64 < dica_palavra_livre) dica_palavra_livre = bloco_inicial / 64;
+        // Cópias em cache de blocos liberados não podem voltar ao disco por cima
+        // de dados que outro arquivo venha a gravar diretamente ali
+        cache_descartar_faixa(bloco_inicial, quantidade);
+        anotar_liberada(bloco_inicial, quantidade);
     }
+    destravar_mapa();
+}
 
-    entrada.status = STATUS_APAGADO;
-    salvar_entrada_diretorio(indice_encontrado, &entrada);
+// Para quem está fora de fs.c; as chamadas internas usam marcar_blocos() e
+// não entram nas estatísticas
+void definir_status_blocos_bitmap(uint64_t bloco_inicial, uint64_t quantidade, int status) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    marcar_blocos(bloco_inicial, quantidade, status);
+    estatisticas_registrar(OP_DEFINIR_BITMAP, &medicao, 0, 0);
+}
 
-    return 0;
+int verificar_se_bloco_esta_livre(uint64_t indice_bloco) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    travar_mapa();
+    int livre = !(mapa_bits[indice_bloco / 64] & (1ULL << (indice_bloco % 64)));
+    destravar_mapa();
+    return estatisticas_registrar(OP_VERIFICAR_BLOCO, &medicao, livre, 0);
 }
 
-int mudar_diretorio(const char *nome) {
-    if (strcmp(nome, "..") == 0 || strcmp(nome, "/") == 0) {
-        inicializar_diretorio_atual();
-        return 0;
+static int verificar_faixa_sem_trava(uint64_t bloco_inicial, uint64_t quantidade) {
+    if (bloco_inicial + quantidade > total_blocos_disco) return 0;
+
+    uint64_t bloco_atual = bloco_inicial;
+    while (quantidade > 0) {
+        int bit = bloco_atual % 64;
+        int bits_nesta_palavra = 64 - bit;
+        if ((uint64_t)bits_nesta_palavra > quantidade) bits_nesta_palavra = quantidade;
+
+        if (mapa_bits[bloco_atual / 64] & mascara_bits(bit, bits_nesta_palavra)) return 0;
+
+        bloco_atual += bits_nesta_palavra;
+        quantidade -= bits_nesta_palavra;
     }
+    return 1;
+}
 
-    EntradaDiretorio entrada;
-    int encontrado = 0;
-
-    for (int i = 0; i < 64; i++) {
-        entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_USADO && 
-            strcmp(entrada.nome_arquivo, nome) == 0 && 
-            entrada.tipo == TIPO_DIRETORIO) {
-            encontrado = 1;
-            break;
+int verificar_faixa_livre(uint64_t bloco_inicial, uint64_t quantidade) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    travar_mapa();
+    int livre = verificar_faixa_sem_trava(bloco_inicial, quantidade);
+    destravar_mapa();
+    return estatisticas_registrar(OP_VERIFICAR_FAIXA, &medicao, livre, 0);
+}
+
+static int64_t buscar_sem_trava(uint64_t quantidade) {
+    if (quantidade == 0) return -1;
+
+    uint64_t fim_palavras = (total_blocos_disco + 63) / 64;
+    uint64_t primeira_palavra = bloco_inicio_dados / 64;
+    if (dica_palavra_livre > primeira_palavra) primeira_palavra = dica_palavra_livre;
+
+    uint64_t inicio_sequencia = 0;
+    uint64_t contagem = 0;
+    int dica_atualizada = 0;
+
+    for (uint64_t palavra = primeira_palavra; palavra < fim_palavras; palavra++) {
+        if (mapa_bits[palavra] == PALAVRA_CHEIA) {
+            contagem = 0;
+            palavra = pular_palavras_cheias(palavra, fim_palavras);
+            if (palavra >= fim_palavras) break;
+        }
+
+        if (!dica_atualizada) {
+            dica_palavra_livre = palavra;
+            dica_atualizada = 1;
+        }
+
+        uint64_t livres = ~mapa_bits[palavra];
+        if (palavra == bloco_inicio_dados / 64)
+            livres &= ~mascara_bits(0, bloco_inicio_dados % 64);
+        if (palavra == fim_palavras - 1 && total_blocos_disco % 64)
+            livres &= mascara_bits(0, total_blocos_disco % 64);
+
+        if (livres == PALAVRA_CHEIA) {
+            if (contagem == 0) inicio_sequencia = palavra * 64;
+            contagem += 64;
+            if (contagem >= quantidade) return inicio_sequencia;
+            continue;
+        }
+
+        int bit = 0;
+        while (bit < 64) {
+            uint64_t resto = livres >> bit;
+            if (resto == 0) { contagem = 0; break; }
+
+            int ocupados = __builtin_ctzll(resto);
+            if (ocupados > 0) {
+                contagem = 0;
+                bit += ocupados;
+                resto >>= ocupados;
+            }
+
+            int sequencia = __builtin_ctzll(~resto);
+            if (contagem == 0) inicio_sequencia = palavra * 64 + bit;
+            contagem += sequencia;
+            if (contagem >= quantidade) return inicio_sequencia;
+            bit += sequencia;
         }
     }
 
-    if (!encontrado) return -ENOENT;
+    if (!dica_atualizada) dica_palavra_livre = fim_palavras;
+    return -1;
+}
 
-    bloco_diretorio_atual = entrada.bloco_inicial;
-    return 0;
+int64_t buscar_blocos_livres(uint64_t quantidade) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    travar_mapa();
+    int64_t inicio = buscar_sem_trava(quantidade);
+    destravar_mapa();
+    return estatisticas_registrar(OP_BUSCAR_LIVRES, &medicao, inicio, 0);
 }
 
-int ler_arquivo(const char *nome, uint32_t deslocamento_inicial, uint32_t tamanho_leitura, void *buffer_saida) { 
-    EntradaDiretorio entrada;
-    int arquivo_encontrado = 0;
-    
-    for (int i = 0; i < 64; i++) {
-        entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_USADO && strcmp(entrada.nome_arquivo, nome) == 0) {
-            arquivo_encontrado = 1; break;
-        }
+// Busca e marca como usado numa só seção crítica
+static int64_t alocar_blocos(uint64_t quantidade) {
+    travar_mapa();
+    int64_t inicio = buscar_sem_trava(quantidade);
+    if (inicio >= 0) marcar_blocos(inicio, quantidade, STATUS_USADO);
+    destravar_mapa();
+    return inicio;
+}
+
+// Último bloco livre da área de dados. As páginas das cadeias de extensões
+// vêm de lá: logo depois de uma extensão elas impediriam o arquivo de
+// continuar crescendo nela.
+static int64_t alocar_do_fim() {
+    uint64_t ultima_palavra = (total_blocos_disco - 1) / 64;
+    for (uint64_t palavra = ultima_palavra + 1; palavra-- > bloco_inicio_dados / 64;) {
+        uint64_t livres = ~mapa_bits[palavra];
+        if (palavra == ultima_palavra) livres &= mascara_bits(0, total_blocos_disco - palavra * 64);
+        if (palavra == bloco_inicio_dados / 64) livres &= ~mascara_bits(0, bloco_inicio_dados % 64);
+        if (livres == 0) continue;
+
+        uint64_t bloco = palavra * 64 + 63 - __builtin_clzll(livres);
+        marcar_blocos(bloco, 1, STATUS_USADO);
+        return bloco;
     }
-    if (!arquivo_encontrado) return -ENOENT;
-    if (deslocamento_inicial + tamanho_leitura > entrada.tamanho_bytes) return -EINVAL;
+    return -ENOSPC;
+}
+
+uint64_t contar_blocos_livres() {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    travar_mapa();
+    uint64_t livres = total_blocos_livres;
+    destravar_mapa();
+    estatisticas_registrar(OP_CONTAR_LIVRES, &medicao, 0, 0);
+    return livres;
+}
+
+// --- Somas de Verificação ---
+// Nas imagens da versão 3 uma região logo antes da área de dados guarda um
+// CRC32C (uint32_t) por bloco do disco, lida e escrita pelo cache como os
+// demais metadados. Soma 0 = bloco ainda sem soma, que não é conferido.
+//
+// Os blocos de metadados são somados em confirmar_pendentes(), e as somas vão
+// ao diário na mesma transação que eles; os de dados, a cada escrita. Diário
+// e região de somas não têm soma: o diário tem a sua própria.
+//
+// Um bloco de dados é escrito no lugar na hora, mas a soma nova só chega ao
+// disco na confirmação seguinte. Antes da primeira escrita numa janela de
+// JANELA_INTENCOES blocos desde a última confirmação, a janela vai ao registro
+// de intenções do diário (um bloco e um fsync); a montagem depois de uma
+// queda refaz as somas dos blocos em uso dessas janelas e apaga as dos livres.
 
-    uint8_t *ponteiro_buffer = (uint8_t*)buffer_saida;
-    uint32_t bytes_restantes = tamanho_leitura;
-    uint32_t posicao_atual = deslocamento_inicial;
+#define SEM_SOMA 0
+#define SOMAS_POR_BLOCO (TAMANHO_BLOCO / sizeof(uint32_t))
+#define BLOCOS_POR_TRECHO_SOMAS 256     // Blocos de dados por passo (1MB)
 
-    while (bytes_restantes > 0) {
-        uint32_t indice_bloco_relativo = posicao_atual / TAMANHO_BLOCO;
-        uint32_t bloco_alvo = entrada.bloco_inicial + indice_bloco_relativo;
-        uint32_t deslocamento_dentro_bloco = posicao_atual % TAMANHO_BLOCO;
-        uint64_t endereco_absoluto = (uint64_t)bloco_alvo * TAMANHO_BLOCO + deslocamento_dentro_bloco;
+// Layout: [superbloco][bitmap][raiz][diário][somas][dados]
+static int bloco_com_soma(uint64_t bloco) {
+    return bloco <= bloco_inicio_raiz || bloco >= bloco_inicio_dados;
+}
+
+static uint64_t endereco_soma(uint64_t bloco) {
+    return bloco_inicio_somas * TAMANHO_BLOCO + bloco * sizeof(uint32_t);
+}
 
-        uint32_t bytes_neste_bloco = TAMANHO_BLOCO - deslocamento_dentro_bloco;
-        if (bytes_neste_bloco > bytes_restantes) bytes_neste_bloco = bytes_restantes;
+static int ler_somas(uint64_t bloco, uint64_t quantidade, uint32_t *somas) {
+    return cache_ler_bytes(endereco_soma(bloco), somas, quantidade * sizeof(uint32_t));
+}
 
-        fseek_64(arquivo_disco, endereco_absoluto, SEEK_SET);
-        fread(ponteiro_buffer, bytes_neste_bloco, 1, arquivo_disco);
+static int gravar_somas(uint64_t bloco, uint64_t quantidade, const uint32_t *somas) {
+    return cache_escrever_bytes(endereco_soma(bloco), somas, quantidade * sizeof(uint32_t));
+}
 
-        ponteiro_buffer += bytes_neste_bloco;
-        posicao_atual += bytes_neste_bloco;
-        bytes_restantes -= bytes_neste_bloco;
+// O conteúdo de um bloco devolvido deixa de ser garantido, então a soma sai
+// na mesma transação que o libera
+static int esquecer_somas(uint64_t inicio, uint64_t quantidade) {
+    static const uint32_t sem_somas[SOMAS_POR_BLOCO];
+    for (uint64_t feito = 0; feito < quantidade; feito += SOMAS_POR_BLOCO) {
+        uint64_t neste = quantidade - feito < SOMAS_POR_BLOCO ? quantidade - feito : SOMAS_POR_BLOCO;
+        int res = gravar_somas(inicio + feito, neste, sem_somas);
+        if (res != 0) return res;
     }
     return 0;
 }
 
-int escrever_arquivo(const char *nome, uint32_t deslocamento_inicial, const void *buffer_entrada, uint32_t tamanho_escrita) { 
-    EntradaDiretorio entrada;
-    int indice_diretorio = -1;
+#define JANELA_INTENCOES 4096   // Blocos (16MB): uma escrita em sequência grava o registro uma vez por janela
 
-    for (int i = 0; i < 64; i++) {
-        entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_USADO && strcmp(entrada.nome_arquivo, nome) == 0) {
-            indice_diretorio = i;
-            break;
+static FaixaIntencao intencoes[MAXIMO_INTENCOES];   // Desde a última confirmação, sem sobreposições
+static uint32_t total_intencoes = 0;
+static int intencoes_no_disco = 0;                  // O registro pode não estar vazio
+static pthread_mutex_t trava_intencoes = PTHREAD_MUTEX_INITIALIZER;
+
+// Com trava_intencoes. Junta [inicio, fim) às faixas que encostam nela; com o
+// registro cheio, à mais próxima (cobrir blocos a mais só custa na montagem).
+static void anotar_intencao(uint64_t inicio, uint64_t fim) {
+    uint32_t mantidas = 0;
+    for (uint32_t i = 0; i < total_intencoes; i++) {
+        uint64_t a = intencoes[i].inicio, b = a + intencoes[i].quantidade;
+        if (b < inicio || a > fim) {
+            intencoes[mantidas++] = intencoes[i];
+            continue;
         }
+        if (a < inicio) inicio = a;
+        if (b > fim) fim = b;
     }
-    if (indice_diretorio < 0) return -ENOENT;
+    total_intencoes = mantidas;
 
-    uint32_t novo_tamanho_total = deslocamento_inicial + tamanho_escrita;
-    if (novo_tamanho_total < entrada.tamanho_bytes) novo_tamanho_total = entrada.tamanho_bytes;
+    if (total_intencoes == MAXIMO_INTENCOES) {
+        uint32_t proxima = 0;
+        uint64_t menor_distancia = UINT64_MAX;
+        for (uint32_t i = 0; i < total_intencoes; i++) {
+            uint64_t a = intencoes[i].inicio, b = a + intencoes[i].quantidade;
+            uint64_t distancia = b < inicio ? inicio - b : a - fim;
+            if (distancia < menor_distancia) {
+                menor_distancia = distancia;
+                proxima = i;
+            }
+        }
+        uint64_t a = intencoes[proxima].inicio, b = a + intencoes[proxima].quantidade;
+        intencoes[proxima] = intencoes[--total_intencoes];
+        anotar_intencao(a < inicio ? a : inicio, b > fim ? b : fim);
+        return;
+    }
+    intencoes[total_intencoes++] = (FaixaIntencao){inicio, fim - inicio};
+}
 
-    int quantidade_blocos_atuais = (entrada.tamanho_bytes + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO; 
-    if (entrada.tamanho_bytes == 0) quantidade_blocos_atuais = 0;
-    
-    int quantidade_blocos_necessarios = (novo_tamanho_total + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
-    if (quantidade_blocos_necessarios == 0 && novo_tamanho_total > 0) quantidade_blocos_necessarios = 1;
-
-    if (quantidade_blocos_necessarios > quantidade_blocos_atuais) {
-        int blocos_extras = quantidade_blocos_necessarios - quantidade_blocos_atuais;
-        int existe_espaco_adjacente = 1;
-
-        if (quantidade_blocos_atuais > 0) {
-            for (int i = 0; i < blocos_extras; i++) {
-                uint64_t proximo_bloco = entrada.bloco_inicial + quantidade_blocos_atuais + i;
-                if (proximo_bloco >= total_blocos_disco || !verificar_se_bloco_esta_livre(proximo_bloco)) {
-                    existe_espaco_adjacente = 0;
-                    break;
-                }
+// Antes de escrever [bloco, bloco + quantidade) no lugar: volta com as
+// janelas dos blocos no registro de intenções do disco
+static int anunciar_escrita(uint64_t bloco, uint64_t quantidade) {
+    uint64_t inicio = bloco / JANELA_INTENCOES * JANELA_INTENCOES;
+    uint64_t fim = (bloco + quantidade + JANELA_INTENCOES - 1) / JANELA_INTENCOES * JANELA_INTENCOES;
+
+    pthread_mutex_lock(&trava_intencoes);
+    int coberta = 0;
+    for (uint32_t i = 0; i < total_intencoes && !coberta; i++)
+        coberta = intencoes[i].inicio <= inicio && fim <= intencoes[i].inicio + intencoes[i].quantidade;
+    int res = 0;
+    if (!coberta) {
+        anotar_intencao(inicio, fim);
+        intencoes_no_disco = 1;
+        res = diario_gravar_intencoes(intencoes, total_intencoes);
+    }
+    pthread_mutex_unlock(&trava_intencoes);
+    return res;
+}
+
+// Depois de uma confirmação as somas de tudo o que foi anunciado estão no
+// disco; o registro antigo fica lá até a próxima escrita anunciada
+static void intencoes_confirmadas() {
+    pthread_mutex_lock(&trava_intencoes);
+    total_intencoes = 0;
+    pthread_mutex_unlock(&trava_intencoes);
+}
+
+static int intencoes_quase_cheias() {
+    pthread_mutex_lock(&trava_intencoes);
+    int cheias = total_intencoes >= MAXIMO_INTENCOES / 2;
+    pthread_mutex_unlock(&trava_intencoes);
+    return cheias;
+}
+
+static int soma_confere(const uint8_t *dados, uint32_t soma) {
+    if (soma == SEM_SOMA || crc32c(0, dados, TAMANHO_BLOCO) == soma) return 1;
+    estatisticas_evento(EVENTO_SOMA_INVALIDA, 1);
+    return 0;
+}
+
+// Lê os blocos [bloco, bloco + quantidade), cada um para o seu buffer,
+// juntando numa chamada só os que estão seguidos também na memória
+static int ler_blocos(uint64_t bloco, uint8_t **blocos, uint64_t quantidade) {
+    uint64_t inicio = 0;
+    for (uint64_t i = 0; i < quantidade; i++) {
+        if (i + 1 < quantidade && blocos[i + 1] == blocos[i] + TAMANHO_BLOCO) continue;
+        int res = dispositivo_ler((bloco + inicio) * TAMANHO_BLOCO, blocos[inicio], (i + 1 - inicio) * TAMANHO_BLOCO);
+        if (res != 0) return res;
+        inicio = i + 1;
+    }
+    return 0;
+}
+
+// Transfere [deslocamento_no_bloco, + tamanho) a partir de 'bloco', uma faixa
+// contígua no disco, sempre em blocos inteiros: as pontas parciais passam por
+// 'bordas'. A leitura confere a soma de cada bloco tocado; a escrita lê as
+// pontas, grava tudo numa chamada vetorizada e recalcula as somas.
+static int transferir_com_somas(uint64_t bloco, uint64_t deslocamento_no_bloco, uint8_t *buffer, uint64_t tamanho, int escrita) {
+    uint8_t bordas[2][TAMANHO_BLOCO];
+    uint8_t *blocos[BLOCOS_POR_TRECHO_SOMAS];
+    uint32_t somas[BLOCOS_POR_TRECHO_SOMAS];
+
+    while (tamanho > 0) {
+        uint64_t bytes = BLOCOS_POR_TRECHO_SOMAS * TAMANHO_BLOCO - deslocamento_no_bloco;
+        if (bytes > tamanho) bytes = tamanho;
+        uint64_t quantidade = (deslocamento_no_bloco + bytes + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
+        uint64_t fim_no_ultimo = (deslocamento_no_bloco + bytes) % TAMANHO_BLOCO;
+        int parcial_inicio = deslocamento_no_bloco != 0 || (quantidade == 1 && fim_no_ultimo != 0);
+        int parcial_fim = quantidade > 1 && fim_no_ultimo != 0;
+
+        blocos[0] = parcial_inicio ? bordas[0] : buffer;
+        for (uint64_t i = 1; i < quantidade; i++) blocos[i] = buffer + i * TAMANHO_BLOCO - deslocamento_no_bloco;
+        if (parcial_fim) blocos[quantidade - 1] = bordas[1];
+        uint64_t na_primeira = TAMANHO_BLOCO - deslocamento_no_bloco;
+        if (na_primeira > bytes) na_primeira = bytes;
+
+        int res = 0;
+        if (!escrita) {
+            res = ler_blocos(bloco, blocos, quantidade);
+            if (res == 0) res = ler_somas(bloco, quantidade, somas);
+            for (uint64_t i = 0; res == 0 && i < quantidade; i++) {
+                if (!soma_confere(blocos[i], somas[i])) res = -EIO;
             }
+            if (res == 0 && parcial_inicio) memcpy(buffer, bordas[0] + deslocamento_no_bloco, na_primeira);
+            if (res == 0 && parcial_fim) memcpy(buffer + bytes - fim_no_ultimo, bordas[1], fim_no_ultimo);
         } else {
-            existe_espaco_adjacente = 0;
-        }
-
-        if (existe_espaco_adjacente) {
-            definir_status_blocos_bitmap(entrada.bloco_inicial + quantidade_blocos_atuais, blocos_extras, STATUS_USADO);
-            entrada.tamanho_bytes = novo_tamanho_total;
-            salvar_entrada_diretorio(indice_diretorio, &entrada);
-        } 
-        else {
-            int novo_bloco_inicio = -1;
-            uint64_t contagem_livres = 0;
-
-            for (uint64_t i = 0; i < total_blocos_disco - bloco_inicio_dados; i++) {
-                uint64_t bloco_candidato = bloco_inicio_dados + i;
-                if (verificar_se_bloco_esta_livre(bloco_candidato)) {
-                    contagem_livres++;
-                    if (contagem_livres == quantidade_blocos_necessarios) {
-                        novo_bloco_inicio = bloco_candidato - quantidade_blocos_necessarios + 1;
-                        break;
-                    }
-                } else {
-                    contagem_livres = 0;
-                }
+            if (parcial_inicio) {
+                res = dispositivo_ler(bloco * TAMANHO_BLOCO, bordas[0], TAMANHO_BLOCO);
+                memcpy(bordas[0] + deslocamento_no_bloco, buffer, na_primeira);
+            }
+            if (res == 0 && parcial_fim) {
+                res = dispositivo_ler((bloco + quantidade - 1) * TAMANHO_BLOCO, bordas[1], TAMANHO_BLOCO);
+                memcpy(bordas[1], buffer + bytes - fim_no_ultimo, fim_no_ultimo);
+            }
+            if (res == 0) res = anunciar_escrita(bloco, quantidade);
+            if (res == 0) res = dispositivo_escrever_blocos(bloco, blocos, quantidade);
+            if (res == 0) {
+                for (uint64_t i = 0; i < quantidade; i++) somas[i] = crc32c(0, blocos[i], TAMANHO_BLOCO);
+                res = gravar_somas(bloco, quantidade, somas);
             }
+        }
+        if (res != 0) return res;
+
+        bloco += quantidade;
+        buffer += bytes;
+        tamanho -= bytes;
+        deslocamento_no_bloco = 0;
+    }
+    return 0;
+}
 
-            if (novo_bloco_inicio < 0) return -ENOSPC;
+// Soma os blocos pendentes de confirmação; as somas sujam blocos da região,
+// que entram na mesma transação
+static int somar_pendentes() {
+    uint32_t maximo = cache_capacidade() + total_blocos_mapa_sujos;
+    BlocoPendente *pendentes = malloc((maximo ? maximo : 1) * sizeof(BlocoPendente));
+    uint32_t *somas = malloc((maximo ? maximo : 1) * sizeof(uint32_t));
+    if (!pendentes || !somas) {
+        free(pendentes); free(somas);
+        return -ENOMEM;
+    }
 
-            if (entrada.tamanho_bytes > 0) {
-                void *buffer_temporario = malloc(TAMANHO_BLOCO);
-                for(int k = 0; k < quantidade_blocos_atuais; k++) {
-                    fseek_64(arquivo_disco, (uint64_t)(entrada.bloco_inicial + k) * TAMANHO_BLOCO, SEEK_SET);
-                    fread(buffer_temporario, TAMANHO_BLOCO, 1, arquivo_disco);
-                    fseek_64(arquivo_disco, (uint64_t)(novo_bloco_inicio + k) * TAMANHO_BLOCO, SEEK_SET);
-                    fwrite(buffer_temporario, TAMANHO_BLOCO, 1, arquivo_disco);
-                }
-                free(buffer_temporario);
-                definir_status_blocos_bitmap(entrada.bloco_inicial, quantidade_blocos_atuais, STATUS_LIVRE);
-            }
+    uint32_t quantidade = coletar_bitmap_sujo(pendentes);
+    quantidade += cache_coletar_sujos(pendentes + quantidade);
+    for (uint32_t i = 0; i < quantidade; i++) somas[i] = crc32c(0, pendentes[i].dados, TAMANHO_BLOCO);
+
+    // Gravar as somas pode fazer o cache crescer e mudar os buffers de lugar:
+    // daqui em diante só os números dos blocos valem
+    int res = 0;
+    for (uint32_t i = 0; i < quantidade && res == 0; i++) {
+        if (bloco_com_soma(pendentes[i].bloco)) res = gravar_somas(pendentes[i].bloco, 1, &somas[i]);
+    }
+    free(pendentes);
+    free(somas);
+    return res;
+}
+
+// --- Referências ---
+// Clones e instantâneos dividem blocos de dados entre arquivos. Uma tabela com
+// um contador (uint16_t) por bloco do disco diz quantos donos cada bloco tem
+// além do primeiro: 0 é o caso comum, e o de todo bloco livre e de metadados
+// (páginas de extensões e de mapas nunca se dividem). Ela só nasce no
+// primeiro clone, numa faixa da área de dados registrada no superbloco, e é
+// lida e escrita pelo cache como os demais metadados, sob trava_mapa.
+//
+// Soltar um bloco dividido só desconta uma referência; o bitmap o libera
+// quando o último dono soltar. Quem escreve num bloco dividido recebe antes um
+// bloco novo com a cópia (ver separar_compartilhados()).
+
+#define REFERENCIAS_POR_BLOCO (TAMANHO_BLOCO / sizeof(uint16_t))
+#define MAXIMO_REFERENCIAS (UINT16_MAX - 1)     // Donos além do primeiro
+
+static uint64_t blocos_referencias = 0;
+
+static uint64_t endereco_referencia(uint64_t bloco) {
+    return bloco_inicio_referencias * TAMANHO_BLOCO + bloco * sizeof(uint16_t);
+}
+
+static int ler_referencias(uint64_t bloco, uint64_t quantidade, uint16_t *contadores) {
+    return cache_ler_bytes(endereco_referencia(bloco), contadores, quantidade * sizeof(uint16_t));
+}
+
+static int gravar_referencias(uint64_t bloco, uint64_t quantidade, const uint16_t *contadores) {
+    return cache_escrever_bytes(endereco_referencia(bloco), contadores, quantidade * sizeof(uint16_t));
+}
+
+// A tabela nasce zerada, já que até ali nenhum bloco tinha dois donos; ela é
+// zerada direto no disco e só os blocos alterados depois passam pelo cache.
+// A imagem passa para a versão 4, que as versões anteriores não montam.
+static int criar_referencias() {
+    if (bloco_inicio_referencias) return 0;
+    if (versao_formato_disco < 2) return -ENOTSUP;
+
+    uint64_t blocos = (total_blocos_disco + REFERENCIAS_POR_BLOCO - 1) / REFERENCIAS_POR_BLOCO;
+    int64_t inicio = alocar_blocos(blocos);
+    if (inicio < 0) return -ENOSPC;
+    cache_descartar_faixa(inicio, blocos);
+    int res = dispositivo_zerar(inicio * TAMANHO_BLOCO, blocos * TAMANHO_BLOCO);
+    if (res == 0 && bloco_inicio_somas) res = esquecer_somas(inicio, blocos);
+    if (res != 0) {
+        marcar_blocos(inicio, blocos, STATUS_LIVRE);
+        return res;
+    }
+
+    uint64_t campos[2] = {(uint64_t)inicio, blocos};
+    uint32_t versao = VERSAO_REFERENCIAS;
+    cache_escrever(1, offsetof(SuperBloco, inicio_referencias), campos, sizeof(campos));
+    cache_escrever(1, offsetof(SuperBloco, versao), &versao, sizeof(uint32_t));
+    usar_versao_formato(versao);
+    bloco_inicio_referencias = inicio;
+    blocos_referencias = blocos;
+    return 0;
+}
+
+// 1 se algum bloco de [inicio, inicio + quantidade) tem mais de um dono
+static int faixa_compartilhada(uint64_t inicio, uint64_t quantidade) {
+    if (!bloco_inicio_referencias) return 0;
+
+    uint16_t contadores[REFERENCIAS_POR_BLOCO];
+    int compartilhada = 0;
+    travar_mapa();
+    while (quantidade > 0 && !compartilhada) {
+        uint64_t neste = quantidade < REFERENCIAS_POR_BLOCO ? quantidade : REFERENCIAS_POR_BLOCO;
+        if (ler_referencias(inicio, neste, contadores) != 0) break;
+        for (uint64_t i = 0; i < neste && !compartilhada; i++) compartilhada = contadores[i] != 0;
+        inicio += neste;
+        quantidade -= neste;
+    }
+    destravar_mapa();
+    return compartilhada;
+}
 
-            definir_status_blocos_bitmap(novo_bloco_inicio, quantidade_blocos_necessarios, STATUS_USADO);
-            entrada.bloco_inicial = novo_bloco_inicio;
-            entrada.tamanho_bytes = novo_tamanho_total;
-            salvar_entrada_diretorio(indice_diretorio, &entrada);
+// Com trava_mapa. Mais um dono para cada bloco da faixa; com 'so_conferir'
+// não altera nada, só devolve -EMLINK se algum já tem o máximo de donos.
+static int compartilhar_faixa(uint64_t inicio, uint64_t quantidade, int so_conferir) {
+    uint16_t contadores[REFERENCIAS_POR_BLOCO];
+    while (quantidade > 0) {
+        uint64_t neste = quantidade < REFERENCIAS_POR_BLOCO ? quantidade : REFERENCIAS_POR_BLOCO;
+        int res = ler_referencias(inicio, neste, contadores);
+        for (uint64_t i = 0; res == 0 && i < neste; i++) {
+            if (contadores[i] >= MAXIMO_REFERENCIAS) res = -EMLINK;
+            contadores[i]++;
         }
-    } 
-    else {
-        if (novo_tamanho_total > entrada.tamanho_bytes) {
-            entrada.tamanho_bytes = novo_tamanho_total;
-            salvar_entrada_diretorio(indice_diretorio, &entrada);
+        if (res == 0 && !so_conferir) res = gravar_referencias(inicio, neste, contadores);
+        if (res != 0) return res;
+        inicio += neste;
+        quantidade -= neste;
+    }
+    return 0;
+}
+
+// Tira um dono de cada bloco da faixa: os divididos perdem uma referência,
+// os que só tinham este dono voltam ao bitmap. Sem conseguir ler a tabela a
+// faixa fica marcada, para uma verificação de consistência recuperar.
+static void soltar_faixa(uint64_t inicio, uint64_t quantidade) {
+    if (!bloco_inicio_referencias) {
+        marcar_blocos(inicio, quantidade, STATUS_LIVRE);
+        return;
+    }
+
+    uint16_t contadores[REFERENCIAS_POR_BLOCO];
+    travar_mapa();
+    while (quantidade > 0) {
+        uint64_t neste = quantidade < REFERENCIAS_POR_BLOCO ? quantidade : REFERENCIAS_POR_BLOCO;
+        if (ler_referencias(inicio, neste, contadores) != 0) break;
+
+        int divididos = 0;
+        uint64_t livres_desde = 0;
+        for (uint64_t i = 0; i <= neste; i++) {
+            if (i < neste && contadores[i] == 0) continue;
+            if (i > livres_desde) marcar_blocos(inicio + livres_desde, i - livres_desde, STATUS_LIVRE);
+            livres_desde = i + 1;
+            if (i < neste) {
+                contadores[i]--;
+                divididos = 1;
+            }
         }
+        if (divididos) gravar_referencias(inicio, neste, contadores);
+        inicio += neste;
+        quantidade -= neste;
     }
+    destravar_mapa();
+}
+
+// --- Extensões ---
+// Um arquivo é uma lista de extensões (faixas contíguas de blocos). Com uma só
+// extensão ele continua no formato antigo, só com bloco_inicial; com mais de
+// uma, a lista completa fica numa cadeia de BlocoExtensoes apontada por
+// bloco_extensoes.
+//
+// Extensões em BURACO não têm blocos: leem zeros e a escrita que as atinge
+// aloca só os blocos que toca, partindo o buraco se preciso.
+
+typedef struct {
+    Extensao *itens;
+    uint32_t total;
+    uint32_t capacidade;
+} ListaExtensoes;
+
+// Posição da última consulta, para percorrer a lista em ordem sem recomeçar
+typedef struct {
+    uint32_t indice;
+    uint64_t base_logica;
+} CursorExtensoes;
+
+static uint64_t blocos_do_tamanho(uint64_t tamanho_bytes) {
+    return (tamanho_bytes + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
+}
 
-    uint8_t *ponteiro_entrada = (uint8_t*)buffer_entrada;
-    uint32_t bytes_a_escrever = tamanho_escrita;
-    uint32_t posicao_escrita = deslocamento_inicial;
+// Arquivos pequenos ficam com o conteúdo na entrada; crescer além de
+// TAMANHO_EMBUTIDO os passa para blocos e eles não voltam mais
+static int entrada_embutida(const EntradaDiretorio *entrada) {
+    return (entrada->atributos & ATRIBUTO_EMBUTIDO) != 0;
+}
+
+static int pode_embutir(uint8_t tipo, uint64_t tamanho_bytes) {
+    return tipo == TIPO_ARQUIVO && versao_formato_disco >= 2 && tamanho_bytes <= TAMANHO_EMBUTIDO;
+}
+
+// Um arquivo embutido com ATRIBUTO_COMPRIMIDO só ganha o fluxo ao sair da entrada
+static int entrada_comprimida(const EntradaDiretorio *entrada) {
+    return (entrada->atributos & (ATRIBUTO_COMPRIMIDO | ATRIBUTO_EMBUTIDO)) == ATRIBUTO_COMPRIMIDO;
+}
 
-    while (bytes_a_escrever > 0) {
-        uint32_t indice_relativo = posicao_escrita / TAMANHO_BLOCO;
-        uint32_t bloco_fisico_alvo = entrada.bloco_inicial + indice_relativo;
-        uint32_t deslocamento_no_bloco = posicao_escrita % TAMANHO_BLOCO;
-        uint64_t endereco_disco = (uint64_t)bloco_fisico_alvo * TAMANHO_BLOCO + deslocamento_no_bloco;
+static CabecalhoCompressao *cabecalho_compressao(EntradaDiretorio *entrada) {
+    return (CabecalhoCompressao *)entrada->embutido;
+}
 
-        uint32_t bytes_parcial = TAMANHO_BLOCO - deslocamento_no_bloco;
-        if (bytes_parcial > bytes_a_escrever) bytes_parcial = bytes_a_escrever;
+// Nos comprimidos as extensões cobrem o fluxo, não o tamanho
+static uint64_t blocos_do_arquivo(const EntradaDiretorio *entrada) {
+    if (entrada_embutida(entrada)) return 0;
+    if (entrada_comprimida(entrada)) return ((const CabecalhoCompressao *)entrada->embutido)->blocos_fluxo;
+    return blocos_do_tamanho(entrada->tamanho_bytes);
+}
 
-        fseek_64(arquivo_disco, endereco_disco, SEEK_SET);
-        fwrite(ponteiro_entrada, bytes_parcial, 1, arquivo_disco);
+static int adicionar_extensao(ListaExtensoes *lista, uint64_t inicio, uint64_t quantidade) {
+    if (lista->total > 0) {
+        Extensao *ultima = &lista->itens[lista->total - 1];
+        int juntar = ultima->inicio == BURACO ? inicio == BURACO
+                                              : ultima->inicio + ultima->quantidade == inicio;
+        if (juntar) {
+            ultima->quantidade += quantidade;
+            return 0;
+        }
+    }
 
-        ponteiro_entrada += bytes_parcial;
-        posicao_escrita += bytes_parcial;
-        bytes_a_escrever -= bytes_parcial;
+    if (lista->total == lista->capacidade) {
+        uint32_t nova_capacidade = lista->capacidade ? lista->capacidade * 2 : 4;
+        Extensao *novos_itens = realloc(lista->itens, nova_capacidade * sizeof(Extensao));
+        if (!novos_itens) return -ENOMEM;
+        lista->itens = novos_itens;
+        lista->capacidade = nova_capacidade;
     }
 
+    lista->itens[lista->total].inicio = inicio;
+    lista->itens[lista->total].quantidade = quantidade;
+    lista->total++;
     return 0;
-}
\ No newline at end of file
+}
+
+static int carregar_extensoes(const EntradaDiretorio *entrada, ListaExtensoes *lista) {
+    lista->total = 0;
+
+    if (entrada->bloco_extensoes == 0) {
+        uint64_t blocos = blocos_do_arquivo(entrada);
+        return blocos ? adicionar_extensao(lista, entrada->bloco_inicial, blocos) : 0;
+    }
+
+    BlocoExtensoes pagina;
+    for (uint64_t bloco = entrada->bloco_extensoes; bloco != 0; bloco = pagina.proximo_bloco) {
+        if (cache_ler(bloco, 0, &pagina, sizeof(BlocoExtensoes)) != 0) return -EIO;
+        if (pagina.total_extensoes > EXTENSOES_POR_BLOCO) return -EIO;
+
+        for (uint32_t i = 0; i < pagina.total_extensoes; i++) {
+            int res = adicionar_extensao(lista, pagina.extensoes[i].inicio, pagina.extensoes[i].quantidade);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
+}
+
+static uint64_t contar_cadeia_extensoes(uint64_t bloco) {
+    uint64_t total = 0;
+    while (bloco != 0) {
+        total++;
+        if (cache_ler(bloco, offsetof(BlocoExtensoes, proximo_bloco), &bloco, sizeof(uint64_t)) != 0) break;
+    }
+    return total;
+}
+
+// Serve também para a cadeia do mapa de pedaços dos arquivos comprimidos, que
+// tem proximo_bloco na mesma posição
+
+static void liberar_cadeia_extensoes(uint64_t bloco) {
+    while (bloco != 0) {
+        uint64_t proximo = 0;
+        cache_ler(bloco, offsetof(BlocoExtensoes, proximo_bloco), &proximo, sizeof(uint64_t));
+        marcar_blocos(bloco, 1, STATUS_LIVRE);
+        bloco = proximo;
+    }
+}
+
+// Grava a lista na entrada; reaproveita a cadeia existente e só aloca ou
+// libera as páginas que faltam ou sobram. Sem espaço a entrada fica intacta.
+static int salvar_extensoes_sem_trava(EntradaDiretorio *entrada, ListaExtensoes *lista) {
+    if (lista->total <= 1) {
+        entrada->bloco_inicial = lista->total ? lista->itens[0].inicio : 0;
+        liberar_cadeia_extensoes(entrada->bloco_extensoes);
+        entrada->bloco_extensoes = 0;
+        return 0;
+    }
+
+    uint64_t paginas_necessarias = (lista->total + EXTENSOES_POR_BLOCO - 1) / EXTENSOES_POR_BLOCO;
+    uint64_t paginas_existentes = contar_cadeia_extensoes(entrada->bloco_extensoes);
+    if (paginas_necessarias > paginas_existentes &&
+        paginas_necessarias - paginas_existentes > total_blocos_livres) return -ENOSPC;
+    entrada->bloco_inicial = lista->itens[0].inicio;
+
+    // Páginas recém-alocadas não têm continuação válida para reaproveitar
+    int pagina_nova = 0;
+    if (entrada->bloco_extensoes == 0) {
+        entrada->bloco_extensoes = alocar_do_fim();
+        pagina_nova = 1;
+    }
+
+    BlocoExtensoes pagina;
+    uint64_t bloco = entrada->bloco_extensoes;
+    uint32_t gravadas = 0;
+    while (1) {
+        uint64_t proximo_existente = 0;
+        if (!pagina_nova)
+            cache_ler(bloco, offsetof(BlocoExtensoes, proximo_bloco), &proximo_existente, sizeof(uint64_t));
+
+        memset(&pagina, 0, sizeof(BlocoExtensoes));
+        pagina.total_extensoes = lista->total - gravadas;
+        if (pagina.total_extensoes > EXTENSOES_POR_BLOCO) pagina.total_extensoes = EXTENSOES_POR_BLOCO;
+        memcpy(pagina.extensoes, lista->itens + gravadas, pagina.total_extensoes * sizeof(Extensao));
+        gravadas += pagina.total_extensoes;
+
+        if (gravadas == lista->total) {
+            cache_escrever(bloco, 0, &pagina, sizeof(BlocoExtensoes));
+            liberar_cadeia_extensoes(proximo_existente);
+            return 0;
+        }
+
+        pagina_nova = (proximo_existente == 0);
+        if (pagina_nova) proximo_existente = alocar_do_fim();
+        pagina.proximo_bloco = proximo_existente;
+        cache_escrever(bloco, 0, &pagina, sizeof(BlocoExtensoes));
+        bloco = proximo_existente;
+    }
+}
+
+// A conferência de espaço e as alocações de páginas ficam numa seção crítica
+static int salvar_extensoes(EntradaDiretorio *entrada, ListaExtensoes *lista) {
+    travar_mapa();
+    int res = salvar_extensoes_sem_trava(entrada, lista);
+    destravar_mapa();
+    return res;
+}
+
+// Quantos blocos livres seguidos existem a partir de 'bloco' (no máximo 'limite')
+static uint64_t comprimento_livre(uint64_t bloco, uint64_t limite) {
+    uint64_t quantidade = 0;
+    while (quantidade < limite && bloco < total_blocos_disco) {
+        int bit = bloco % 64;
+        uint64_t ocupados = mapa_bits[bloco / 64] >> bit;
+        int livres_seguidos = ocupados ? __builtin_ctzll(ocupados) : 64 - bit;
+
+        quantidade += livres_seguidos;
+        bloco += livres_seguidos;
+        if (livres_seguidos < 64 - bit) break;
+    }
+
+    if (bloco > total_blocos_disco) quantidade -= bloco - total_blocos_disco;
+    return quantidade < limite ? quantidade : limite;
+}
+
+// Primeira sequência livre a partir de 'desde'; devolve o tamanho (0 se não houver)
+static uint64_t proxima_sequencia_livre(uint64_t desde, uint64_t limite, uint64_t *inicio) {
+    uint64_t fim_palavras = (total_blocos_disco + 63) / 64;
+    uint64_t palavra = desde / 64;
+    uint64_t livres = ~mapa_bits[palavra] & ~mascara_bits(0, desde % 64);
+
+    while (livres == 0) {
+        palavra = pular_palavras_cheias(palavra + 1, fim_palavras);
+        if (palavra >= fim_palavras) return 0;
+        livres = ~mapa_bits[palavra];
+    }
+
+    *inicio = palavra * 64 + __builtin_ctzll(livres);
+    if (*inicio >= total_blocos_disco) return 0;
+    return comprimento_livre(*inicio, limite);
+}
+
+// Acrescenta 'quantidade' blocos ao fim da lista e os marca como usados
+// Ocupa as próximas sequências livres a partir de *posicao, na ordem do
+// disco, e deixa *posicao logo depois do último bloco ocupado
+static int alocar_a_partir(ListaExtensoes *lista, uint64_t quantidade, uint64_t *posicao) {
+    while (quantidade > 0) {
+        uint64_t inicio;
+        uint64_t encontrados = proxima_sequencia_livre(*posicao, quantidade, &inicio);
+        if (encontrados == 0) return -ENOSPC;
+
+        marcar_blocos(inicio, encontrados, STATUS_USADO);
+        int res = adicionar_extensao(lista, inicio, encontrados);
+        if (res != 0) return res;
+
+        quantidade -= encontrados;
+        *posicao = inicio + encontrados;
+    }
+    return 0;
+}
+
+static int estender_sem_trava(ListaExtensoes *lista, uint64_t quantidade) {
+    if (quantidade > total_blocos_livres) return -ENOSPC;
+
+    if (lista->total > 0 && lista->itens[lista->total - 1].inicio != BURACO) {
+        Extensao *ultima = &lista->itens[lista->total - 1];
+        uint64_t fim = ultima->inicio + ultima->quantidade;
+        uint64_t adjacentes = comprimento_livre(fim, quantidade);
+        if (adjacentes > 0) {
+            marcar_blocos(fim, adjacentes, STATUS_USADO);
+            ultima->quantidade += adjacentes;
+            quantidade -= adjacentes;
+        }
+    }
+    if (quantidade == 0) return 0;
+    if (lista->total > 0) estatisticas_evento(EVENTO_EXTENSAO_NOVA, 1);
+
+    int64_t inicio_contiguo = buscar_sem_trava(quantidade);
+    if (inicio_contiguo >= 0) {
+        marcar_blocos(inicio_contiguo, quantidade, STATUS_USADO);
+        return adicionar_extensao(lista, inicio_contiguo, quantidade);
+    }
+
+    uint64_t posicao = bloco_inicio_dados;
+    return alocar_a_partir(lista, quantidade, &posicao);
+}
+
+static int estender_extensoes(ListaExtensoes *lista, uint64_t quantidade) {
+    travar_mapa();
+    int res = estender_sem_trava(lista, quantidade);
+    destravar_mapa();
+    return res;
+}
+
+// Libera os blocos das extensões a partir de 'primeira' (os divididos com
+// outros arquivos só perdem uma referência)
+static void liberar_extensoes(ListaExtensoes *lista, uint32_t primeira) {
+    for (uint32_t i = primeira; i < lista->total; i++) {
+        if (lista->itens[i].inicio != BURACO) soltar_faixa(lista->itens[i].inicio, lista->itens[i].quantidade);
+    }
+}
+
+// Mais um dono para todos os blocos da lista, ou para nenhum (-EMLINK)
+static int compartilhar_extensoes(const ListaExtensoes *lista) {
+    int res = 0;
+    uint64_t blocos = 0;
+    travar_mapa();
+    for (int so_conferir = 1; so_conferir >= 0 && res == 0; so_conferir--) {
+        for (uint32_t i = 0; i < lista->total && res == 0; i++) {
+            if (lista->itens[i].inicio == BURACO) continue;
+            res = compartilhar_faixa(lista->itens[i].inicio, lista->itens[i].quantidade, so_conferir);
+            if (!so_conferir) blocos += lista->itens[i].quantidade;
+        }
+    }
+    destravar_mapa();
+    if (res == 0) estatisticas_evento(EVENTO_BLOCOS_CLONADOS, blocos);
+    return res;
+}
+
+static int extensoes_compartilhadas(const ListaExtensoes *lista) {
+    for (uint32_t i = 0; i < lista->total; i++) {
+        if (lista->itens[i].inicio != BURACO && faixa_compartilhada(lista->itens[i].inicio, lista->itens[i].quantidade))
+            return 1;
+    }
+    return 0;
+}
+
+// Devolve ao bitmap o que estender_extensoes alocou depois do estado anterior
+static void desfazer_extensao(ListaExtensoes *lista, uint32_t total_anterior, uint64_t quantidade_ultima_anterior) {
+    if (total_anterior > 0) {
+        Extensao *ultima = &lista->itens[total_anterior - 1];
+        if (ultima->quantidade > quantidade_ultima_anterior) {
+            marcar_blocos(ultima->inicio + quantidade_ultima_anterior,
+                                         ultima->quantidade - quantidade_ultima_anterior, STATUS_LIVRE);
+            ultima->quantidade = quantidade_ultima_anterior;
+        }
+    }
+    liberar_extensoes(lista, total_anterior);
+    lista->total = total_anterior;
+}
+
+// Bloco físico de 'bloco_logico' e quantos blocos seguem contíguos a partir dele
+static uint64_t mapear_bloco(ListaExtensoes *lista, CursorExtensoes *cursor, uint64_t bloco_logico, uint64_t *contiguos) {
+    if (bloco_logico < cursor->base_logica) {
+        cursor->indice = 0;
+        cursor->base_logica = 0;
+    }
+    while (bloco_logico >= cursor->base_logica + lista->itens[cursor->indice].quantidade) {
+        cursor->base_logica += lista->itens[cursor->indice].quantidade;
+        cursor->indice++;
+    }
+
+    uint64_t deslocamento = bloco_logico - cursor->base_logica;
+    *contiguos = lista->itens[cursor->indice].quantidade - deslocamento;
+    return lista->itens[cursor->indice].inicio + deslocamento;
+}
+
+#define PEDACO_ASSINCRONO (128 * 1024)     // Maior pedido de uma transferência ao motor assíncrono
+
+// Move a faixa [deslocamento, deslocamento + tamanho) do arquivo com uma única
+// leitura/escrita posicional por extensão atravessada. As grandes vão ao motor
+// assíncrono em pedaços de PEDACO_ASSINCRONO, todos no dispositivo ao mesmo
+// tempo, e só voltam quando o último terminar.
+static int transferir_dados(ListaExtensoes *lista, uint64_t deslocamento, uint8_t *buffer, uint64_t tamanho, int escrita) {
+    CursorExtensoes cursor = {0};
+    GrupoPedidos grupo = {0};
+    int paralela = !bloco_inicio_somas && tamanho >= 2 * PEDACO_ASSINCRONO && assincrono_ativo();
+    int res = 0;
+
+    while (res == 0 && tamanho > 0) {
+        uint64_t blocos_contiguos;
+        uint64_t bloco_fisico = mapear_bloco(lista, &cursor, deslocamento / TAMANHO_BLOCO, &blocos_contiguos);
+        uint64_t deslocamento_no_bloco = deslocamento % TAMANHO_BLOCO;
+        uint64_t endereco = bloco_fisico * TAMANHO_BLOCO + deslocamento_no_bloco;
+
+        uint64_t bytes_na_faixa = blocos_contiguos * TAMANHO_BLOCO - deslocamento_no_bloco;
+        if (bytes_na_faixa > tamanho) bytes_na_faixa = tamanho;
+
+        if (lista->itens[cursor.indice].inicio == BURACO) {
+            // Quem escreve preenche os buracos antes (preencher_buracos())
+            if (escrita) res = -EIO;
+            else memset(buffer, 0, bytes_na_faixa);
+        } else if (bloco_inicio_somas) {
+            res = transferir_com_somas(bloco_fisico, deslocamento_no_bloco, buffer, bytes_na_faixa, escrita);
+        } else if (paralela) {
+            for (uint64_t feito = 0; feito < bytes_na_faixa; feito += PEDACO_ASSINCRONO) {
+                uint64_t neste = bytes_na_faixa - feito < PEDACO_ASSINCRONO ? bytes_na_faixa - feito : PEDACO_ASSINCRONO;
+                if (escrita) assincrono_escrever(&grupo, endereco + feito, buffer + feito, neste);
+                else assincrono_ler(&grupo, endereco + feito, buffer + feito, neste);
+            }
+        } else {
+            res = escrita ? dispositivo_escrever(endereco, buffer, bytes_na_faixa)
+                          : dispositivo_ler(endereco, buffer, bytes_na_faixa);
+        }
+
+        buffer += bytes_na_faixa;
+        deslocamento += bytes_na_faixa;
+        tamanho -= bytes_na_faixa;
+    }
+
+    // Os buffers são de quem chamou: nada pode continuar em voo depois daqui
+    int pedidos = paralela ? assincrono_aguardar(&grupo) : 0;
+    return res != 0 ? res : pedidos;
+}
+
+static int bloco_em_buraco(const ListaExtensoes *lista, uint64_t bloco) {
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < lista->total; base += lista->itens[i++].quantidade) {
+        if (bloco < base + lista->itens[i].quantidade) return lista->itens[i].inicio == BURACO;
+    }
+    return 1;   // Depois do fim da lista também não há blocos
+}
+
+// 1 se todos os blocos de [primeiro, fim) já têm lugar no disco
+static int faixa_alocada(const ListaExtensoes *lista, uint64_t primeiro, uint64_t fim) {
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < lista->total && base < fim; base += lista->itens[i++].quantidade) {
+        if (lista->itens[i].inicio == BURACO && base + lista->itens[i].quantidade > primeiro) return 0;
+    }
+    return base >= fim;
+}
+
+// Dá blocos aos buracos de [primeiro, fim) e leva a lista até 'total' blocos
+// (o que passar do fim antigo sem ser tocado fica buraco). Os blocos novos
+// saem de uma alocação só, logo depois da extensão anterior ao primeiro
+// buraco quando houver espaço, e a lista nova é montada à parte: um erro
+// deixa o arquivo como estava.
+static int preencher_buracos(EntradaDiretorio *entrada, ListaExtensoes *lista, uint64_t primeiro, uint64_t fim, uint64_t total) {
+    uint64_t faltam = 0;
+    uint64_t base = 0;
+    Extensao anterior = {BURACO, 0};
+    for (uint32_t i = 0; i < lista->total || base < total; i++) {
+        Extensao extensao = i < lista->total ? lista->itens[i] : (Extensao){BURACO, total - base};
+        uint64_t de = base > primeiro ? base : primeiro;
+        uint64_t ate = base + extensao.quantidade < fim ? base + extensao.quantidade : fim;
+        if (extensao.inicio == BURACO && de < ate) faltam += ate - de;
+        else if (extensao.inicio != BURACO && faltam == 0 && base < fim) anterior = extensao;
+        base += extensao.quantidade;
+    }
+
+    // 'novos' começa com a extensão anterior para estender_sem_trava() tentar
+    // continuar nela; depois fica só com o que foi alocado
+    ListaExtensoes novos = {0};
+    ListaExtensoes nova = {0};
+    int res = anterior.inicio != BURACO ? adicionar_extensao(&novos, anterior.inicio, anterior.quantidade) : 0;
+    if (res != 0) return res;
+
+    travar_mapa();
+    uint32_t semente = novos.total;
+    res = estender_sem_trava(&novos, faltam);
+    if (res != 0) {
+        desfazer_extensao(&novos, semente, anterior.quantidade);
+        destravar_mapa();
+        free(novos.itens);
+        return res;
+    }
+    if (semente) {
+        novos.itens[0].inicio += anterior.quantidade;
+        novos.itens[0].quantidade -= anterior.quantidade;
+    }
+
+    uint32_t proximo = 0;
+    uint64_t usados = 0;    // Do novos.itens[proximo]
+    base = 0;
+    for (uint32_t i = 0; res == 0 && (i < lista->total || base < total); i++) {
+        Extensao extensao = i < lista->total ? lista->itens[i] : (Extensao){BURACO, total - base};
+        uint64_t de = base > primeiro ? base : primeiro;
+        uint64_t ate = base + extensao.quantidade < fim ? base + extensao.quantidade : fim;
+        base += extensao.quantidade;
+        if (extensao.inicio != BURACO || de >= ate) {
+            res = adicionar_extensao(&nova, extensao.inicio, extensao.quantidade);
+            continue;
+        }
+
+        if (de > base - extensao.quantidade) res = adicionar_extensao(&nova, BURACO, de - (base - extensao.quantidade));
+        for (uint64_t restantes = ate - de; res == 0 && restantes > 0;) {
+            while (novos.itens[proximo].quantidade == usados) {
+                proximo++;
+                usados = 0;
+            }
+            uint64_t pedaco = novos.itens[proximo].quantidade - usados;
+            if (pedaco > restantes) pedaco = restantes;
+            res = adicionar_extensao(&nova, novos.itens[proximo].inicio + usados, pedaco);
+            usados += pedaco;
+            restantes -= pedaco;
+        }
+        if (res == 0 && ate < base) res = adicionar_extensao(&nova, BURACO, base - ate);
+    }
+
+    if (res == 0) res = salvar_extensoes_sem_trava(entrada, &nova);
+    if (res != 0) liberar_extensoes(&novos, 0);
+    destravar_mapa();
+
+    free(novos.itens);
+    if (res != 0) {
+        free(nova.itens);
+        return res;
+    }
+    free(lista->itens);
+    *lista = nova;
+    return 0;
+}
+
+// --- Índice de Diretórios ---
+// Cada diretório ganha, no primeiro acesso, uma tabela hash nome -> slot em
+// memória e um mapa dos slots livres/apagados. Depois disso buscar um nome ou
+// um slot livre não lê mais o diretório do disco.
+//
+// O índice também faz o papel de cache de dentries na resolução de caminhos:
+// guarda o tipo e o bloco de cada subdiretório, então descer por um caminho
+// só consulta tabelas em memória. Como cada índice tem o diretório inteiro,
+// um nome ausente da tabela é uma resposta negativa definitiva.
+//
+// Diretórios crescem de bloco em bloco. O slot é global no diretório (bloco
+// slot / ENTRADAS_POR_DIRETORIO da lista, posição slot % ENTRADAS_POR_DIRETORIO)
+// e uma entrada nunca muda de slot. A entrada ".." (slot 0) descreve também o
+// próprio diretório: tamanho_bytes e bloco_extensoes são o tamanho e a cadeia
+// de extensões dele, cujo primeiro bloco é o bloco do diretório. Diretórios sem
+// ".." (imagens antigas) e os das imagens da versão 1 ficam com um bloco só.
+//
+// A lista de índices é protegida por trava_indices; o conteúdo de cada índice,
+// pela trava do seu diretório. Índices descartados só são liberados quando
+// nenhuma operação está em andamento (na confirmação ou ao montar).
+
+#define SLOT_VAZIO -1
+#define BALDES_INDICES 64
+
+typedef struct IndiceDiretorio {
+    uint64_t bloco;
+    uint32_t capacidade;            // Slots dos blocos já alocados
+    uint32_t mascara_tabela;        // A tabela tem pelo menos o dobro da capacidade
+    int32_t  *tabela;
+    uint32_t *hashes;
+    char     (*nomes)[TAMANHO_NOME_ARQUIVO];
+    uint64_t *blocos_filhos;        // Só vale para subdiretórios
+    uint8_t  *tipos;
+    uint64_t *slots_livres;         // bit i ligado = slot i livre ou apagado
+    uint32_t dica_livre;            // Nenhuma palavra antes desta tem slot livre
+    int      pode_crescer;
+    EntradaDiretorio proprio;       // Tamanho e extensões do diretório (vindos do "..")
+    ListaExtensoes extensoes;
+    uint64_t *blocos;               // Blocos do diretório, na ordem dos slots
+    struct IndiceDiretorio *proximo;
+} IndiceDiretorio;
+
+static IndiceDiretorio *indices_diretorio[BALDES_INDICES];
+static IndiceDiretorio *indices_aposentados = NULL;
+
+static uint32_t hash_nome(const char *nome) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < TAMANHO_NOME_ARQUIVO && nome[i]; i++) {
+        hash ^= (uint8_t)nome[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void inserir_na_tabela(IndiceDiretorio *indice, int slot) {
+    uint32_t posicao = indice->hashes[slot] & indice->mascara_tabela;
+    while (indice->tabela[posicao] != SLOT_VAZIO) posicao = (posicao + 1) & indice->mascara_tabela;
+    indice->tabela[posicao] = slot;
+}
+
+static int32_t procurar_na_tabela(IndiceDiretorio *indice, const char *nome) {
+    uint32_t hash = hash_nome(nome);
+    uint32_t posicao = hash & indice->mascara_tabela;
+
+    while (indice->tabela[posicao] != SLOT_VAZIO) {
+        int slot = indice->tabela[posicao];
+        if (indice->hashes[slot] == hash && strncmp(indice->nomes[slot], nome, TAMANHO_NOME_ARQUIVO) == 0)
+            return posicao;
+        posicao = (posicao + 1) & indice->mascara_tabela;
+    }
+    return SLOT_VAZIO;
+}
+
+// Remoção com deslocamento para trás: a sondagem linear continua sem lápides
+static void remover_da_tabela(IndiceDiretorio *indice, int slot) {
+    uint32_t mascara = indice->mascara_tabela;
+    uint32_t vazio = indice->hashes[slot] & mascara;
+    while (indice->tabela[vazio] != slot) vazio = (vazio + 1) & mascara;
+    indice->tabela[vazio] = SLOT_VAZIO;
+
+    for (uint32_t atual = (vazio + 1) & mascara; indice->tabela[atual] != SLOT_VAZIO; atual = (atual + 1) & mascara) {
+        int slot_atual = indice->tabela[atual];
+        uint32_t ideal = indice->hashes[slot_atual] & mascara;
+        if (((atual - ideal) & mascara) >= ((atual - vazio) & mascara)) {
+            indice->tabela[vazio] = slot_atual;
+            indice->tabela[atual] = SLOT_VAZIO;
+            vazio = atual;
+        }
+    }
+}
+
+static int slot_livre(IndiceDiretorio *indice, int slot) {
+    return (indice->slots_livres[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void indexar_slot(IndiceDiretorio *indice, int slot, EntradaDiretorio *entrada) {
+    if (entrada->status == STATUS_USADO) {
+        strncpy(indice->nomes[slot], entrada->nome_arquivo, TAMANHO_NOME_ARQUIVO);
+        indice->hashes[slot] = hash_nome(indice->nomes[slot]);
+        indice->blocos_filhos[slot] = entrada->bloco_inicial;
+        indice->tipos[slot] = entrada->tipo;
+        indice->slots_livres[slot / 64] &= ~(1ULL << (slot % 64));
+        inserir_na_tabela(indice, slot);
+    } else {
+        indice->slots_livres[slot / 64] |= (1ULL << (slot % 64));
+        if ((uint32_t)slot / 64 < indice->dica_livre) indice->dica_livre = slot / 64;
+    }
+}
+
+static int entrada_pai(const EntradaDiretorio *entrada) {
+    return entrada->status == STATUS_USADO && entrada->tipo == TIPO_DIRETORIO &&
+           strncmp(entrada->nome_arquivo, NOME_PAI, TAMANHO_NOME_ARQUIVO) == 0;
+}
+
+// Leitura e gravação de uma entrada dado o bloco físico, convertendo o
+// formato da versão 1. Nela os valores já chegam dentro de 32 bits
+// (tamanho_maximo_arquivo() e o tamanho dessas imagens garantem isso).
+static uint32_t tamanho_entrada() {
+    return versao_formato_disco < 2 ? sizeof(EntradaDiretorioV1) : sizeof(EntradaDiretorio);
+}
+
+// 'dados' aponta para uma entrada no formato do disco
+static EntradaDiretorio decodificar_entrada(const uint8_t *dados) {
+    EntradaDiretorio entrada = {0};
+    if (versao_formato_disco < 2) {
+        EntradaDiretorioV1 antiga;
+        memcpy(&antiga, dados, sizeof(antiga));
+        entrada.status = antiga.status;
+        entrada.tipo = antiga.tipo;
+        entrada.bloco_inicial = antiga.bloco_inicial;
+        entrada.tamanho_bytes = antiga.tamanho_bytes;
+        entrada.bloco_extensoes = antiga.bloco_extensoes;
+        memcpy(entrada.nome_arquivo, antiga.nome_arquivo, TAMANHO_NOME_ARQUIVO);
+        return entrada;
+    }
+
+    memcpy(&entrada, dados, sizeof(EntradaDiretorio));
+    return entrada;
+}
+
+static EntradaDiretorio ler_entrada_fisica(uint64_t bloco, int posicao) {
+    uint8_t dados[sizeof(EntradaDiretorio)] = {0};
+    cache_ler_bytes(bloco * TAMANHO_BLOCO + posicao * tamanho_entrada(), dados, tamanho_entrada());
+    return decodificar_entrada(dados);
+}
+
+static void salvar_entrada_fisica(uint64_t bloco, int posicao, EntradaDiretorio *entrada) {
+    if (versao_formato_disco < 2) {
+        EntradaDiretorioV1 antiga = {0};
+        antiga.status = entrada->status;
+        antiga.tipo = entrada->tipo;
+        antiga.bloco_inicial = (uint32_t)entrada->bloco_inicial;
+        antiga.tamanho_bytes = (uint32_t)entrada->tamanho_bytes;
+        antiga.bloco_extensoes = (uint32_t)entrada->bloco_extensoes;
+        memcpy(antiga.nome_arquivo, entrada->nome_arquivo, TAMANHO_NOME_ARQUIVO);
+        cache_escrever_bytes(bloco * TAMANHO_BLOCO + posicao * sizeof(EntradaDiretorioV1), &antiga, sizeof(antiga));
+    } else {
+        uint64_t endereco_fisico = (bloco * TAMANHO_BLOCO) + (posicao * sizeof(EntradaDiretorio));
+        cache_escrever_bytes(endereco_fisico, entrada, sizeof(EntradaDiretorio));
+    }
+}
+
+// Monta em 'proprio' a descrição do armazenamento do diretório; devolve se
+// ele tem ".." (e pode crescer)
+static int descrever_diretorio(uint64_t bloco_diretorio, EntradaDiretorio *proprio) {
+    EntradaDiretorio pai = ler_entrada_fisica(bloco_diretorio, 0);
+    int tem_pai = entrada_pai(&pai);
+
+    memset(proprio, 0, sizeof(EntradaDiretorio));
+    proprio->status = STATUS_USADO;
+    proprio->tipo = TIPO_DIRETORIO;
+    proprio->bloco_inicial = bloco_diretorio;
+    proprio->tamanho_bytes = (tem_pai && pai.tamanho_bytes > TAMANHO_BLOCO) ? pai.tamanho_bytes : TAMANHO_BLOCO;
+    proprio->bloco_extensoes = tem_pai ? pai.bloco_extensoes : 0;
+    return tem_pai;
+}
+
+// Acrescenta 'blocos' blocos vazios ao índice (arrays, tabela e slots livres)
+static int ampliar_indice(IndiceDiretorio *indice, uint32_t blocos_novos) {
+    uint32_t capacidade = indice->capacidade + blocos_novos * ENTRADAS_POR_DIRETORIO;
+    uint32_t palavras = (capacidade + 63) / 64;
+
+    uint32_t *hashes = realloc(indice->hashes, capacidade * sizeof(uint32_t));
+    if (hashes) indice->hashes = hashes;
+    char (*nomes)[TAMANHO_NOME_ARQUIVO] = realloc(indice->nomes, capacidade * sizeof(*nomes));
+    if (nomes) indice->nomes = nomes;
+    uint64_t *blocos_filhos = realloc(indice->blocos_filhos, capacidade * sizeof(uint64_t));
+    if (blocos_filhos) indice->blocos_filhos = blocos_filhos;
+    uint8_t *tipos = realloc(indice->tipos, capacidade);
+    if (tipos) indice->tipos = tipos;
+    uint64_t *slots_livres = realloc(indice->slots_livres, palavras * sizeof(uint64_t));
+    if (slots_livres) indice->slots_livres = slots_livres;
+    if (!hashes || !nomes || !blocos_filhos || !tipos || !slots_livres) return -ENOMEM;
+
+    // Slots novos começam livres; os bits além da capacidade ficam desligados
+    uint32_t palavras_antigas = (indice->capacidade + 63) / 64;
+    memset(indice->slots_livres + palavras_antigas, 0, (palavras - palavras_antigas) * sizeof(uint64_t));
+    for (uint32_t slot = indice->capacidade; slot < capacidade; slot++)
+        indice->slots_livres[slot / 64] |= 1ULL << (slot % 64);
+    if (indice->capacidade / 64 < indice->dica_livre) indice->dica_livre = indice->capacidade / 64;
+
+    uint32_t tamanho_tabela = indice->mascara_tabela + 1;
+    if (indice->tabela == NULL || tamanho_tabela < capacidade * 2) {
+        tamanho_tabela = 16;
+        while (tamanho_tabela < capacidade * 2) tamanho_tabela *= 2;
+        int32_t *tabela = malloc(tamanho_tabela * sizeof(int32_t));
+        if (!tabela) return -ENOMEM;
+        free(indice->tabela);
+        indice->tabela = tabela;
+        indice->mascara_tabela = tamanho_tabela - 1;
+        for (uint32_t i = 0; i < tamanho_tabela; i++) tabela[i] = SLOT_VAZIO;
+        for (uint32_t slot = 0; slot < indice->capacidade; slot++)
+            if (!slot_livre(indice, slot)) inserir_na_tabela(indice, slot);
+    }
+    indice->capacidade = capacidade;
+    return 0;
+}
+
+static void liberar_indice(IndiceDiretorio *indice) {
+    free(indice->tabela);
+    free(indice->hashes);
+    free(indice->nomes);
+    free(indice->blocos_filhos);
+    free(indice->tipos);
+    free(indice->slots_livres);
+    free(indice->extensoes.itens);
+    free(indice->blocos);
+    free(indice);
+}
+
+static int carregar_indice(IndiceDiretorio *indice, uint64_t bloco_diretorio) {
+    indice->bloco = bloco_diretorio;
+    indice->pode_crescer = descrever_diretorio(bloco_diretorio, &indice->proprio) && versao_formato_disco >= 2;
+
+    int res = carregar_extensoes(&indice->proprio, &indice->extensoes);
+    uint64_t total_blocos = blocos_do_tamanho(indice->proprio.tamanho_bytes);
+    indice->blocos = malloc(total_blocos * sizeof(uint64_t));
+    if (res == 0 && !indice->blocos) res = -ENOMEM;
+    if (res == 0) res = ampliar_indice(indice, total_blocos);
+    if (res != 0) return res;
+
+    uint64_t i = 0;
+    for (uint32_t e = 0; e < indice->extensoes.total; e++)
+        for (uint64_t b = 0; b < indice->extensoes.itens[e].quantidade && i < total_blocos; b++)
+            indice->blocos[i++] = indice->extensoes.itens[e].inicio + b;
+
+    for (uint32_t slot = 0; slot < indice->capacidade; slot++) {
+        EntradaDiretorio entrada = ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO],
+                                                      slot % ENTRADAS_POR_DIRETORIO);
+        indexar_slot(indice, slot, &entrada);
+    }
+    return 0;
+}
+
+static IndiceDiretorio *obter_indice_diretorio(uint64_t bloco_diretorio) {
+    pthread_mutex_lock(&trava_indices);
+    uint32_t balde = bloco_diretorio % BALDES_INDICES;
+    for (IndiceDiretorio *indice = indices_diretorio[balde]; indice; indice = indice->proximo) {
+        if (indice->bloco == bloco_diretorio) {
+            pthread_mutex_unlock(&trava_indices);
+            return indice;
+        }
+    }
+
+    IndiceDiretorio *indice = calloc(1, sizeof(IndiceDiretorio));
+    if (indice && carregar_indice(indice, bloco_diretorio) != 0) {
+        liberar_indice(indice);
+        indice = NULL;
+    }
+    if (indice) {
+        indice->proximo = indices_diretorio[balde];
+        indices_diretorio[balde] = indice;
+    }
+    pthread_mutex_unlock(&trava_indices);
+    return indice;
+}
+
+// Uma thread ainda dentro do diretório removido pode estar usando o índice
+static void descartar_indice_diretorio(uint64_t bloco) {
+    pthread_mutex_lock(&trava_indices);
+    IndiceDiretorio **elo = &indices_diretorio[bloco % BALDES_INDICES];
+    while (*elo) {
+        if ((*elo)->bloco == bloco) {
+            IndiceDiretorio *removido = *elo;
+            *elo = removido->proximo;
+            removido->proximo = indices_aposentados;
+            indices_aposentados = removido;
+            break;
+        }
+        elo = &(*elo)->proximo;
+    }
+    pthread_mutex_unlock(&trava_indices);
+}
+
+// Só com trava_operacoes exclusiva
+static void liberar_indices_aposentados() {
+    while (indices_aposentados) {
+        IndiceDiretorio *removido = indices_aposentados;
+        indices_aposentados = removido->proximo;
+        liberar_indice(removido);
+    }
+}
+
+static void descartar_indices_diretorio() {
+    for (int i = 0; i < BALDES_INDICES; i++) {
+        while (indices_diretorio[i]) {
+            IndiceDiretorio *removido = indices_diretorio[i];
+            indices_diretorio[i] = removido->proximo;
+            liberar_indice(removido);
+        }
+    }
+    liberar_indices_aposentados();
+}
+
+static EntradaDiretorio ler_entrada_em(uint64_t bloco_diretorio, int slot) {
+    if (slot < ENTRADAS_POR_DIRETORIO) return ler_entrada_fisica(bloco_diretorio, slot);
+
+    EntradaDiretorio vazia = {0};
+    IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+    if (!indice || (uint32_t)slot >= indice->capacidade) return vazia;
+    return ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO], slot % ENTRADAS_POR_DIRETORIO);
+}
+
+EntradaDiretorio ler_entrada_diretorio(int indice) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    EntradaDiretorio entrada = ler_entrada_em(bloco_diretorio_atual, indice);
+    estatisticas_registrar(OP_LER_ENTRADA, &medicao, 0, sizeof(EntradaDiretorio));
+    return entrada;
+}
+
+static void salvar_entrada_em(uint64_t bloco_diretorio, int slot, EntradaDiretorio *entrada) {
+    IndiceDiretorio *indice_dir = obter_indice_diretorio(bloco_diretorio);
+    if (slot < ENTRADAS_POR_DIRETORIO) {
+        salvar_entrada_fisica(bloco_diretorio, slot, entrada);
+    } else {
+        if (!indice_dir || (uint32_t)slot >= indice_dir->capacidade) return;
+        salvar_entrada_fisica(indice_dir->blocos[slot / ENTRADAS_POR_DIRETORIO], slot % ENTRADAS_POR_DIRETORIO, entrada);
+    }
+
+    // Só criar/remover (com o diretório travado para escrita) mudam o índice;
+    // atualizar tamanho ou extensões de um arquivo não toca nele
+    if (indice_dir) {
+        int estava_usado = !slot_livre(indice_dir, slot);
+        int fica_usado = (entrada->status == STATUS_USADO);
+        if (estava_usado && fica_usado &&
+            strncmp(indice_dir->nomes[slot], entrada->nome_arquivo, TAMANHO_NOME_ARQUIVO) == 0) return;
+        if (!estava_usado && !fica_usado) return;
+
+        if (estava_usado) remover_da_tabela(indice_dir, slot);
+        indexar_slot(indice_dir, slot, entrada);
+    }
+}
+
+void salvar_entrada_diretorio(int indice, EntradaDiretorio *entrada) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    salvar_entrada_em(bloco_diretorio_atual, indice, entrada);
+    estatisticas_registrar(OP_SALVAR_ENTRADA, &medicao, 0, sizeof(EntradaDiretorio));
+}
+
+static int procurar_entrada(uint64_t bloco_diretorio, const char *nome, EntradaDiretorio *entrada) {
+    IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+    if (!indice) return -ENOMEM;
+
+    int32_t posicao = procurar_na_tabela(indice, nome);
+    if (posicao == SLOT_VAZIO) return -ENOENT;
+
+    int slot = indice->tabela[posicao];
+    if (entrada) *entrada = ler_entrada_em(bloco_diretorio, slot);
+    return slot;
+}
+
+// Mais um bloco no fim do diretório: zerado, na lista de extensões e no ".."
+static int crescer_diretorio(IndiceDiretorio *indice) {
+    if (!indice->pode_crescer) return -ENOSPC;
+    if ((uint64_t)indice->capacidade + ENTRADAS_POR_DIRETORIO > INT32_MAX) return -ENOSPC;
+
+    uint32_t total_anterior = indice->extensoes.total;
+    uint64_t quantidade_ultima_anterior = indice->extensoes.itens[total_anterior - 1].quantidade;
+    uint64_t total_blocos = blocos_do_tamanho(indice->proprio.tamanho_bytes);
+    uint64_t *blocos = realloc(indice->blocos, (total_blocos + 1) * sizeof(uint64_t));
+    if (!blocos) return -ENOMEM;
+    indice->blocos = blocos;
+
+    int res = estender_extensoes(&indice->extensoes, 1);
+    if (res == 0) {
+        indice->proprio.tamanho_bytes += TAMANHO_BLOCO;
+        res = salvar_extensoes(&indice->proprio, &indice->extensoes);
+        if (res != 0) indice->proprio.tamanho_bytes -= TAMANHO_BLOCO;
+    }
+    if (res == 0) res = ampliar_indice(indice, 1);
+    if (res != 0) {
+        desfazer_extensao(&indice->extensoes, total_anterior, quantidade_ultima_anterior);
+        return res;
+    }
+
+    Extensao *ultima = &indice->extensoes.itens[indice->extensoes.total - 1];
+    uint64_t bloco_novo = ultima->inicio + ultima->quantidade - 1;
+    indice->blocos[total_blocos] = bloco_novo;
+
+    void *buffer_zeros = calloc(1, TAMANHO_BLOCO);
+    if (!buffer_zeros) return -ENOMEM;
+    cache_escrever(bloco_novo, 0, buffer_zeros, TAMANHO_BLOCO);
+    free(buffer_zeros);
+
+    EntradaDiretorio pai = ler_entrada_fisica(indice->bloco, 0);
+    pai.tamanho_bytes = indice->proprio.tamanho_bytes;
+    pai.bloco_extensoes = indice->proprio.bloco_extensoes;
+    salvar_entrada_fisica(indice->bloco, 0, &pai);
+    estatisticas_evento(EVENTO_DIRETORIO_CRESCEU, 1);
+    return 0;
+}
+
+// Primeiro slot livre; sem nenhum, o diretório ganha mais um bloco
+static int buscar_slot_livre_diretorio(uint64_t bloco_diretorio) {
+    IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+    if (!indice) return -ENOMEM;
+
+    uint32_t palavras = (indice->capacidade + 63) / 64;
+    for (uint32_t palavra = indice->dica_livre; palavra < palavras; palavra++) {
+        if (indice->slots_livres[palavra]) {
+            indice->dica_livre = palavra;
+            return palavra * 64 + __builtin_ctzll(indice->slots_livres[palavra]);
+        }
+    }
+    indice->dica_livre = palavras;
+
+    uint32_t primeiro_novo = indice->capacidade;
+    int res = crescer_diretorio(indice);
+    return res == 0 ? (int)primeiro_novo : res;
+}
+
+// Vazio = nada além da entrada ".."
+static int diretorio_vazio(uint64_t bloco_diretorio) {
+    IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+    if (!indice) return -ENOMEM;
+
+    uint64_t livres = 0;
+    for (uint32_t palavra = 0; palavra < (indice->capacidade + 63) / 64; palavra++)
+        livres += __builtin_popcountll(indice->slots_livres[palavra]);
+    uint64_t usados = indice->capacidade - livres;
+    if (procurar_na_tabela(indice, NOME_PAI) != SLOT_VAZIO) usados--;
+    return usados == 0;
+}
+
+// --- Caminhos ---
+// Um caminho começa na raiz ("/a/b/c.txt") ou no diretório atual ("b/c.txt").
+// "." e ".." valem em qualquer ponto. Todo diretório ganha na criação uma
+// entrada ".." apontando para o pai (a raiz aponta para si mesma); onde ela
+// não existe, nas imagens antigas, ".." leva à raiz.
+//
+// Cada diretório é travado para leitura só enquanto o seu índice é consultado.
+// Remover um diretório exige a trava de operações exclusiva, então nenhum
+// diretório some no meio de uma resolução.
+
+// Desce de *bloco para o subdiretório 'nome'
+static int descer(uint64_t *bloco, const char *nome) {
+    if (strcmp(nome, ".") == 0) return 0;
+
+    pthread_rwlock_t *trava = trava_do_diretorio(*bloco);
+    pthread_rwlock_rdlock(trava);
+    int res = -ENOMEM;
+    IndiceDiretorio *indice = obter_indice_diretorio(*bloco);
+    if (indice) {
+        int32_t posicao = procurar_na_tabela(indice, nome);
+        if (posicao == SLOT_VAZIO) {
+            res = -ENOENT;
+            if (strcmp(nome, NOME_PAI) == 0) {
+                *bloco = bloco_inicio_raiz;
+                res = 0;
+            }
+        } else {
+            int slot = indice->tabela[posicao];
+            res = (indice->tipos[slot] == TIPO_DIRETORIO) ? 0 : -ENOTDIR;
+            if (res == 0) *bloco = indice->blocos_filhos[slot];
+        }
+    }
+    pthread_rwlock_unlock(trava);
+    return res;
+}
+
+// Percorre o caminho até o diretório que contém o último componente: devolve
+// esse diretório em *bloco e o componente em nome_final (vazio quando o
+// caminho é só "/"). Chamada sem travas de diretório.
+static int resolver_caminho(const char *caminho, uint64_t *bloco, char *nome_final) {
+    *bloco = (caminho[0] == '/') ? bloco_inicio_raiz : bloco_diretorio_atual;
+    nome_final[0] = '\0';
+
+    const char *atual = caminho;
+    while (1) {
+        while (*atual == '/') atual++;
+        if (*atual == '\0') return 0;
+
+        size_t tamanho = strcspn(atual, "/");
+        if (tamanho >= TAMANHO_NOME_ARQUIVO) return -ENAMETOOLONG;
+        if (nome_final[0] != '\0') {
+            int res = descer(bloco, nome_final);
+            if (res != 0) return res;
+        }
+        memcpy(nome_final, atual, tamanho);
+        nome_final[tamanho] = '\0';
+        atual += tamanho;
+    }
+}
+
+static int resolver_diretorio(const char *caminho, uint64_t *bloco) {
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, bloco, nome);
+    if (res == 0 && nome[0] != '\0') res = descer(bloco, nome);
+    return res;
+}
+
+static int nome_reservado(const char *nome) {
+    return strcmp(nome, ".") == 0 || strcmp(nome, NOME_PAI) == 0;
+}
+
+// "/", "." ou "a/." nomeiam o próprio diretório, que não tem entrada com nome
+static int caminho_de_diretorio(const char *caminho, const char *nome) {
+    return caminho[0] != '\0' && (nome[0] == '\0' || strcmp(nome, ".") == 0);
+}
+
+// --- Arquivos Abertos ---
+// abrir_arquivo() resolve o nome uma vez e guarda a entrada e a lista de
+// extensões em memória: ler/escrever pelo descritor não consultam mais o
+// diretório nem recarregam as extensões. Todos os descritores de um arquivo (e
+// as chamadas por nome enquanto ele estiver aberto) compartilham esse estado,
+// protegido pela trava do arquivo. Tamanho e extensões novos voltam para a
+// entrada no fechamento, em sincronizar_descritor() e antes de cada confirmação.
+// Nos arquivos comprimidos o mapa de pedaços também fica em memória, e o
+// pedaço sendo escrito só é comprimido e gravado nesses mesmos momentos ou
+// quando a escrita passa para outro pedaço.
+
+#define MAXIMO_DESCRITORES 256
+
+typedef struct {
+    Pedaco *itens;
+    uint64_t total;
+    uint64_t capacidade;
+    uint64_t *paginas;          // Blocos das páginas, em ordem
+    uint64_t total_paginas;
+    uint64_t capacidade_paginas;
+} MapaPedacos;
+
+typedef struct {
+    uint64_t bloco_diretorio;
+    int slot;
+    uint32_t referencias;
+    int entrada_suja;
+    EntradaDiretorio entrada;
+    ListaExtensoes extensoes;
+    MapaPedacos mapa;
+    uint8_t *pedaco;            // TAMANHO_PEDACO bytes descomprimidos
+    uint64_t indice_pedaco;
+    int pedaco_valido;
+    int pedaco_sujo;
+    uint64_t geracao;           // Muda a cada escrita ou mudança de lugar dos dados
+} ArquivoAberto;
+
+typedef struct Antecipacao Antecipacao;
+
+// Duas threads podem ler pelo mesmo descritor com a trava do arquivo só para
+// leitura: a posição e a leitura antecipada ficam sob a trava do descritor.
+// Quem escreve ou fecha tem a do arquivo para escrita e não precisa dela.
+typedef struct {
+    ArquivoAberto *arquivo;     // NULL = descritor livre
+    pthread_mutex_t trava;
+    uint64_t posicao;
+    uint64_t fim_ultima_leitura;
+    uint32_t leituras_sequenciais;
+    Antecipacao *antecipacao;   // Só depois de LEITURAS_PARA_ANTECIPAR leituras em sequência
+} Descritor;
+
+static Descritor descritores[MAXIMO_DESCRITORES] = {
+    [0 ... MAXIMO_DESCRITORES - 1] = {.trava = PTHREAD_MUTEX_INITIALIZER}
+};
+static pthread_mutex_t trava_descritores = PTHREAD_MUTEX_INITIALIZER;
+
+// Com trava_descritores
+static ArquivoAberto *procurar_aberto(uint64_t bloco_diretorio, int slot) {
+    for (int i = 0; i < MAXIMO_DESCRITORES; i++) {
+        ArquivoAberto *arquivo = descritores[i].arquivo;
+        if (arquivo && arquivo->bloco_diretorio == bloco_diretorio && arquivo->slot == slot) return arquivo;
+    }
+    return NULL;
+}
+
+static ArquivoAberto *arquivo_aberto_em(uint64_t bloco_diretorio, int slot) {
+    pthread_mutex_lock(&trava_descritores);
+    ArquivoAberto *arquivo = procurar_aberto(bloco_diretorio, slot);
+    pthread_mutex_unlock(&trava_descritores);
+    return arquivo;
+}
+
+// Com a trava do diretório. Um arquivo aberto pode ter a entrada mais nova em
+// memória (tamanho, conteúdo embutido) do que no diretório: é ela que vale.
+// A trava do arquivo impede que ele seja fechado durante a cópia.
+static void entrada_atualizada(uint64_t bloco_diretorio, int slot, EntradaDiretorio *entrada) {
+    if (entrada->tipo != TIPO_ARQUIVO) return;
+    pthread_rwlock_t *trava = trava_do_arquivo(bloco_diretorio, slot);
+    pthread_rwlock_rdlock(trava);
+    ArquivoAberto *aberto = arquivo_aberto_em(bloco_diretorio, slot);
+    if (aberto) *entrada = aberto->entrada;
+    pthread_rwlock_unlock(trava);
+}
+
+static int carregar_mapa(ArquivoAberto *arquivo);
+static int gravar_pedaco(ArquivoAberto *arquivo);
+static int ler_comprimido(ArquivoAberto *arquivo, uint64_t deslocamento, uint8_t *buffer, uint32_t tamanho);
+static int escrever_comprimido(ArquivoAberto *arquivo, uint64_t deslocamento, const uint8_t *buffer, uint32_t tamanho);
+
+static int carregar_aberto(ArquivoAberto *arquivo, uint64_t bloco_diretorio, int slot) {
+    memset(arquivo, 0, sizeof(ArquivoAberto));
+    arquivo->bloco_diretorio = bloco_diretorio;
+    arquivo->slot = slot;
+    arquivo->entrada = ler_entrada_em(bloco_diretorio, slot);
+    int res = carregar_extensoes(&arquivo->entrada, &arquivo->extensoes);
+    if (res == 0 && entrada_comprimida(&arquivo->entrada)) res = carregar_mapa(arquivo);
+    return res;
+}
+
+static void liberar_aberto(ArquivoAberto *arquivo) {
+    free(arquivo->extensoes.itens);
+    free(arquivo->mapa.itens);
+    free(arquivo->mapa.paginas);
+    free(arquivo->pedaco);
+}
+
+// Um pedaço que não pôde ser gravado continua pendente em memória
+static int gravar_aberto(ArquivoAberto *arquivo) {
+    int res = gravar_pedaco(arquivo);
+    if (arquivo->entrada_suja) {
+        salvar_entrada_em(arquivo->bloco_diretorio, arquivo->slot, &arquivo->entrada);
+        arquivo->entrada_suja = 0;
+    }
+    return res;
+}
+
+static void liberar_antecipacao(Descritor *descritor);
+
+static void soltar_descritor(int descritor) {
+    ArquivoAberto *arquivo = descritores[descritor].arquivo;
+    liberar_antecipacao(&descritores[descritor]);
+    descritores[descritor].arquivo = NULL;
+    if (--arquivo->referencias == 0) {
+        liberar_aberto(arquivo);
+        free(arquivo);
+    }
+}
+
+// Só com trava_operacoes exclusiva (nenhuma trava de arquivo em uso)
+static void gravar_arquivos_abertos() {
+    for (int i = 0; i < MAXIMO_DESCRITORES; i++) {
+        if (descritores[i].arquivo) gravar_aberto(descritores[i].arquivo);
+    }
+}
+
+static uint64_t geracao_pedacos = 1;
+
+// Os pedaços descomprimidos guardados pelas threads são achados pelo slot da
+// entrada: além de cada pedaço gravado, um slot que passa a outro arquivo
+// (remoção, clone) ou muda de formato os invalida
+static void esquecer_pedacos() {
+    __atomic_fetch_add(&geracao_pedacos, 1, __ATOMIC_RELEASE);
+}
+
+// Ao montar/formatar os descritores antigos deixam de valer, e os pedaços
+// descomprimidos guardados pelas threads também
+static void descartar_descritores() {
+    for (int i = 0; i < MAXIMO_DESCRITORES; i++) {
+        if (descritores[i].arquivo) soltar_descritor(i);
+    }
+    esquecer_pedacos();
+}
+
+// O conteúdo embutido vai para um primeiro bloco (inteiro, o resto com zeros),
+// ou para o primeiro pedaço se o arquivo já estava marcado para compressão
+static int sair_do_embutido(ArquivoAberto *arquivo) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    if (entrada->atributos & ATRIBUTO_COMPRIMIDO) {
+        uint8_t conteudo[TAMANHO_EMBUTIDO];
+        uint32_t tamanho = (uint32_t)entrada->tamanho_bytes;
+        memcpy(conteudo, entrada->embutido, tamanho);
+        entrada->atributos &= ~ATRIBUTO_EMBUTIDO;
+        memset(entrada->embutido, 0, TAMANHO_EMBUTIDO);
+        arquivo->entrada_suja = 1;
+        return tamanho ? escrever_comprimido(arquivo, 0, conteudo, tamanho) : 0;
+    }
+
+    if (entrada->tamanho_bytes > 0) {
+        uint8_t *bloco = calloc(1, TAMANHO_BLOCO);
+        if (!bloco) return -ENOMEM;
+        memcpy(bloco, entrada->embutido, entrada->tamanho_bytes);
+
+        int res = estender_extensoes(&arquivo->extensoes, 1);
+        if (res == 0) res = transferir_dados(&arquivo->extensoes, 0, bloco, TAMANHO_BLOCO, 1);
+        if (res == 0) res = salvar_extensoes(entrada, &arquivo->extensoes);
+        free(bloco);
+        if (res != 0) {
+            liberar_extensoes(&arquivo->extensoes, 0);
+            arquivo->extensoes.total = 0;
+            return res;
+        }
+    }
+
+    entrada->atributos &= ~ATRIBUTO_EMBUTIDO;
+    memset(entrada->embutido, 0, TAMANHO_EMBUTIDO);
+    arquivo->entrada_suja = 1;
+    return 0;
+}
+
+// Blocos divididos com outros arquivos não são escritos no lugar: os de
+// [primeiro, fim) viram buracos e preencher_buracos() dá blocos novos a eles
+// (e aos buracos que já havia na faixa), levando a lista até 'total'. Os
+// blocos das pontas que a escrita só cobre em parte ('copiar_primeiro',
+// 'copiar_ultimo') recebem antes a cópia do conteúdo antigo. As referências
+// antigas só são soltas depois da confirmação, como as faixas liberadas.
+static int separar_compartilhados(ArquivoAberto *arquivo, uint64_t primeiro, uint64_t fim, uint64_t total,
+                                  int copiar_primeiro, int copiar_ultimo) {
+    ListaExtensoes *lista = &arquivo->extensoes;
+    ListaExtensoes nova = {0}, separados = {0};
+    uint16_t contadores[REFERENCIAS_POR_BLOCO];
+    int res = 0;
+    uint64_t base = 0;
+
+    travar_mapa();
+    for (uint32_t i = 0; i < lista->total && res == 0; base += lista->itens[i++].quantidade) {
+        Extensao extensao = lista->itens[i];
+        uint64_t de = base > primeiro ? base : primeiro;
+        uint64_t ate = base + extensao.quantidade < fim ? base + extensao.quantidade : fim;
+        if (extensao.inicio == BURACO || de >= ate) {
+            res = adicionar_extensao(&nova, extensao.inicio, extensao.quantidade);
+            continue;
+        }
+
+        if (de > base) res = adicionar_extensao(&nova, extensao.inicio, de - base);
+        for (uint64_t bloco = de; res == 0 && bloco < ate;) {
+            uint64_t neste = ate - bloco < REFERENCIAS_POR_BLOCO ? ate - bloco : REFERENCIAS_POR_BLOCO;
+            uint64_t fisico = extensao.inicio + (bloco - base);
+            res = ler_referencias(fisico, neste, contadores);
+            for (uint64_t j = 0; res == 0 && j < neste; j++) {
+                if (contadores[j] == 0) {
+                    res = adicionar_extensao(&nova, fisico + j, 1);
+                } else {
+                    res = adicionar_extensao(&nova, BURACO, 1);
+                    if (res == 0) res = adicionar_extensao(&separados, fisico + j, 1);
+                }
+            }
+            bloco += neste;
+        }
+        if (res == 0 && ate < base + extensao.quantidade)
+            res = adicionar_extensao(&nova, extensao.inicio + (ate - base), base + extensao.quantidade - ate);
+    }
+    destravar_mapa();
+
+    uint8_t antigos[2][TAMANHO_BLOCO];
+    copiar_primeiro = copiar_primeiro && !bloco_em_buraco(lista, primeiro) && bloco_em_buraco(&nova, primeiro);
+    copiar_ultimo = copiar_ultimo && fim - 1 != primeiro && !bloco_em_buraco(lista, fim - 1) &&
+                    bloco_em_buraco(&nova, fim - 1);
+    if (res == 0 && separados.total > 0) {
+        if (copiar_primeiro) res = transferir_dados(lista, primeiro * TAMANHO_BLOCO, antigos[0], TAMANHO_BLOCO, 0);
+        if (res == 0 && copiar_ultimo)
+            res = transferir_dados(lista, (fim - 1) * TAMANHO_BLOCO, antigos[1], TAMANHO_BLOCO, 0);
+        if (res == 0) res = preencher_buracos(&arquivo->entrada, &nova, primeiro, fim, total);
+    }
+    if (res != 0 || separados.total == 0) {
+        free(nova.itens);
+        free(separados.itens);
+        return res;
+    }
+
+    // Daqui em diante o arquivo já está nos blocos novos
+    free(lista->itens);
+    *lista = nova;
+    arquivo->entrada_suja = 1;
+    uint64_t copiados = 0;
+    for (uint32_t i = 0; i < separados.total; i++) {
+        adiar_liberacao(separados.itens[i].inicio, separados.itens[i].quantidade);
+        copiados += separados.itens[i].quantidade;
+    }
+    free(separados.itens);
+    estatisticas_evento(EVENTO_BLOCOS_COPIADOS, copiados);
+
+    if (copiar_primeiro) res = transferir_dados(lista, primeiro * TAMANHO_BLOCO, antigos[0], TAMANHO_BLOCO, 1);
+    if (res == 0 && copiar_ultimo) res = transferir_dados(lista, (fim - 1) * TAMANHO_BLOCO, antigos[1], TAMANHO_BLOCO, 1);
+    return res;
+}
+
+static int escrever_bloco_novo(ListaExtensoes *lista, uint64_t deslocamento, const uint8_t *dados, uint64_t tamanho) {
+    uint8_t bloco[TAMANHO_BLOCO] = {0};
+    memcpy(bloco + deslocamento % TAMANHO_BLOCO, dados, tamanho);
+    return transferir_dados(lista, deslocamento - deslocamento % TAMANHO_BLOCO, bloco, TAMANHO_BLOCO, 1);
+}
+
+// Lê ou escreve a faixa [deslocamento, deslocamento + tamanho). A escrita aloca
+// os blocos que faltam e atualiza tamanho e extensões só em memória.
+static int transferir_aberto(ArquivoAberto *arquivo, uint64_t deslocamento, uint8_t *buffer, uint32_t tamanho, int escrita) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    ListaExtensoes *lista = &arquivo->extensoes;
+    uint64_t fim = (uint64_t)deslocamento + tamanho;
+    if (escrita && (entrada->atributos & ATRIBUTO_INSTANTANEO)) return -EROFS;
+    if (escrita) arquivo->geracao++;
+
+    if (entrada_embutida(entrada)) {
+        if (!escrita) {
+            if (fim > entrada->tamanho_bytes) return -EINVAL;
+            memcpy(buffer, entrada->embutido + deslocamento, tamanho);
+            return 0;
+        }
+        if (fim <= TAMANHO_EMBUTIDO) {
+            memcpy(entrada->embutido + deslocamento, buffer, tamanho);
+            if (fim > entrada->tamanho_bytes) entrada->tamanho_bytes = fim;
+            arquivo->entrada_suja = 1;
+            return 0;
+        }
+        int res = sair_do_embutido(arquivo);
+        if (res != 0) return res;
+    }
+
+    if (!escrita) {
+        if (fim > entrada->tamanho_bytes) return -EINVAL;
+        if (entrada_comprimida(entrada)) return ler_comprimido(arquivo, deslocamento, buffer, tamanho);
+        return transferir_dados(lista, deslocamento, buffer, tamanho, 0);
+    }
+    if (fim > tamanho_maximo_arquivo()) return -EFBIG;
+    // Fluxos comprimidos só crescem no fim: nunca reescrevem um bloco dividido
+    if (entrada_comprimida(entrada)) return escrever_comprimido(arquivo, deslocamento, buffer, tamanho);
+
+    // Só os blocos que a escrita toca ganham lugar no disco: o que ficar entre
+    // o fim antigo e o começo dela vira buraco
+    uint64_t blocos_atuais = blocos_do_arquivo(entrada);
+    uint64_t total_blocos = blocos_do_tamanho(fim) > blocos_atuais ? blocos_do_tamanho(fim) : blocos_atuais;
+    uint64_t primeiro = deslocamento / TAMANHO_BLOCO;
+    uint64_t fim_blocos = tamanho ? blocos_do_tamanho(fim) : primeiro;
+    int primeiro_novo = tamanho && bloco_em_buraco(lista, primeiro);
+    int ultimo_novo = tamanho && bloco_em_buraco(lista, fim_blocos - 1);
+
+    if (tamanho && bloco_inicio_referencias) {
+        int res = separar_compartilhados(arquivo, primeiro, fim_blocos, total_blocos,
+                                         deslocamento % TAMANHO_BLOCO != 0 || (fim_blocos == primeiro + 1 && fim % TAMANHO_BLOCO),
+                                         fim % TAMANHO_BLOCO != 0);
+        if (res != 0) return res;
+    }
+
+    if (total_blocos > blocos_atuais || !faixa_alocada(lista, primeiro, fim_blocos)) {
+        int res = preencher_buracos(entrada, lista, primeiro, fim_blocos, total_blocos);
+        if (res != 0) return res;
+        arquivo->entrada_suja = 1;
+    }
+
+    if (fim > entrada->tamanho_bytes) {
+        entrada->tamanho_bytes = fim;
+        arquivo->entrada_suja = 1;
+    }
+
+    // Blocos que acabaram de sair de um buraco são gravados inteiros, com zeros
+    // em volta dos dados, sem ler o que havia neles
+    uint64_t no_primeiro = TAMANHO_BLOCO - deslocamento % TAMANHO_BLOCO;
+    if (no_primeiro > tamanho) no_primeiro = tamanho;
+    if (primeiro_novo && no_primeiro < TAMANHO_BLOCO) {
+        int res = escrever_bloco_novo(lista, deslocamento, buffer, no_primeiro);
+        if (res != 0) return res;
+        deslocamento += no_primeiro;
+        buffer += no_primeiro;
+        tamanho -= no_primeiro;
+    }
+
+    uint64_t no_ultimo = fim % TAMANHO_BLOCO;
+    if (tamanho > 0 && ultimo_novo && no_ultimo != 0) {
+        uint64_t antes = tamanho - no_ultimo;
+        int res = antes ? transferir_dados(lista, deslocamento, buffer, antes, 1) : 0;
+        if (res != 0) return res;
+        return escrever_bloco_novo(lista, deslocamento + antes, buffer + antes, no_ultimo);
+    }
+    return tamanho ? transferir_dados(lista, deslocamento, buffer, tamanho, 1) : 0;
+}
+
+// --- Leitura Antecipada ---
+// Um descritor que lê em sequência (cada leitura começando onde a anterior
+// terminou) passa a pedir ao motor assíncrono os blocos seguintes antes de
+// eles serem lidos: uma janela de janela_antecipacao blocos, dividida em
+// TRECHOS_ANTECIPACAO trechos, e cada trecho consumido volta a ser pedido
+// mais à frente. Assim o dispositivo trabalha enquanto quem lê faz alguma
+// coisa com os dados (gravá-los no PC, por exemplo).
+//
+// Os trechos guardam conteúdo do arquivo: uma escrita nele, ou a
+// desfragmentação, muda a geração do arquivo aberto e os trechos pedidos antes
+// disso são jogados fora. As somas de verificação são conferidas quando o
+// trecho é usado. Arquivos embutidos e comprimidos (que já guardam o último
+// pedaço) ficam de fora, e também o modo mapeado, em que o próprio sistema
+// antecipa as páginas.
+
+#define TRECHOS_ANTECIPACAO 4
+#define JANELA_ANTECIPACAO_PADRAO 256       // Blocos (1MB)
+#define MAXIMO_JANELA_ANTECIPACAO 65536     // 256MB por descritor
+#define LEITURAS_PARA_ANTECIPAR 2
+
+static uint32_t janela_antecipacao = JANELA_ANTECIPACAO_PADRAO;
+
+typedef struct {
+    uint8_t *dados;
+    uint64_t *fisicos;          // Bloco de cada bloco do trecho no disco (BURACO = zeros)
+    uint64_t inicio;            // No arquivo, múltiplo do bloco
+    uint64_t tamanho;           // 0 = trecho livre
+    uint64_t geracao;           // A do arquivo quando o trecho foi pedido
+    int pronto;                 // Já esperado e conferido
+    GrupoPedidos grupo;
+} TrechoAntecipado;
+
+struct Antecipacao {
+    uint32_t janela;
+    uint64_t proximo;           // Onde começa o próximo trecho a pedir
+    TrechoAntecipado trechos[TRECHOS_ANTECIPACAO];
+};
+
+static uint64_t blocos_por_trecho(const Antecipacao *antecipacao) {
+    return (antecipacao->janela + TRECHOS_ANTECIPACAO - 1) / TRECHOS_ANTECIPACAO;
+}
+
+// Os pedidos em voo escrevem em 'dados': o trecho só fica livre depois deles
+static void soltar_trecho(TrechoAntecipado *trecho) {
+    if (trecho->tamanho && !trecho->pronto) assincrono_aguardar(&trecho->grupo);
+    trecho->tamanho = 0;
+    trecho->pronto = 0;
+}
+
+static void esvaziar_antecipacao(Antecipacao *antecipacao) {
+    for (int i = 0; i < TRECHOS_ANTECIPACAO; i++) {
+        if (antecipacao->trechos[i].tamanho) estatisticas_evento(EVENTO_ANTECIPACAO_DESCARTADA, 1);
+        soltar_trecho(&antecipacao->trechos[i]);
+    }
+    antecipacao->proximo = 0;
+}
+
+static void destruir_antecipacao(Antecipacao *antecipacao) {
+    if (!antecipacao) return;
+    esvaziar_antecipacao(antecipacao);
+    for (int i = 0; i < TRECHOS_ANTECIPACAO; i++) {
+        free(antecipacao->trechos[i].dados);
+        free(antecipacao->trechos[i].fisicos);
+    }
+    free(antecipacao);
+}
+
+static void liberar_antecipacao(Descritor *descritor) {
+    destruir_antecipacao(descritor->antecipacao);
+    descritor->antecipacao = NULL;
+}
+
+static Antecipacao *criar_antecipacao(uint32_t janela) {
+    Antecipacao *antecipacao = calloc(1, sizeof(Antecipacao));
+    if (!antecipacao) return NULL;
+    antecipacao->janela = janela;
+
+    uint64_t blocos = blocos_por_trecho(antecipacao);
+    for (int i = 0; i < TRECHOS_ANTECIPACAO; i++) {
+        antecipacao->trechos[i].dados = malloc(blocos * TAMANHO_BLOCO);
+        antecipacao->trechos[i].fisicos = malloc(blocos * sizeof(uint64_t));
+        if (!antecipacao->trechos[i].dados || !antecipacao->trechos[i].fisicos) {
+            destruir_antecipacao(antecipacao);
+            return NULL;
+        }
+    }
+    return antecipacao;
+}
+
+// Pede os trechos livres, em ordem, a partir do bloco onde a leitura parou
+static void pedir_trechos(Antecipacao *antecipacao, ArquivoAberto *arquivo, uint64_t fim_leitura) {
+    ListaExtensoes *lista = &arquivo->extensoes;
+    uint64_t tamanho_arquivo = arquivo->entrada.tamanho_bytes;
+    uint64_t bytes_trecho = blocos_por_trecho(antecipacao) * TAMANHO_BLOCO;
+    if (antecipacao->proximo < fim_leitura / TAMANHO_BLOCO * TAMANHO_BLOCO)
+        antecipacao->proximo = fim_leitura / TAMANHO_BLOCO * TAMANHO_BLOCO;
+
+    CursorExtensoes cursor = {0};
+    for (int i = 0; i < TRECHOS_ANTECIPACAO && antecipacao->proximo < tamanho_arquivo; i++) {
+        TrechoAntecipado *trecho = &antecipacao->trechos[i];
+        if (trecho->tamanho) continue;
+
+        trecho->inicio = antecipacao->proximo;
+        trecho->tamanho = tamanho_arquivo - trecho->inicio < bytes_trecho ? tamanho_arquivo - trecho->inicio : bytes_trecho;
+        trecho->geracao = arquivo->geracao;
+        trecho->pronto = 0;
+
+        uint64_t blocos = blocos_do_tamanho(trecho->tamanho);
+        uint64_t primeiro = trecho->inicio / TAMANHO_BLOCO;
+        for (uint64_t feito = 0; feito < blocos;) {
+            uint64_t contiguos;
+            uint64_t fisico = mapear_bloco(lista, &cursor, primeiro + feito, &contiguos);
+            if (contiguos > blocos - feito) contiguos = blocos - feito;
+            int buraco = lista->itens[cursor.indice].inicio == BURACO;
+
+            for (uint64_t j = 0; j < contiguos; j++) trecho->fisicos[feito + j] = buraco ? BURACO : fisico + j;
+            if (buraco) memset(trecho->dados + feito * TAMANHO_BLOCO, 0, contiguos * TAMANHO_BLOCO);
+            else assincrono_ler(&trecho->grupo, fisico * TAMANHO_BLOCO, trecho->dados + feito * TAMANHO_BLOCO,
+                                contiguos * TAMANHO_BLOCO);
+            feito += contiguos;
+        }
+        antecipacao->proximo += trecho->tamanho;
+        estatisticas_evento(EVENTO_BLOCOS_ANTECIPADOS, blocos);
+    }
+}
+
+static int conferir_trecho(const TrechoAntecipado *trecho) {
+    uint32_t somas[BLOCOS_POR_TRECHO_SOMAS];
+    uint64_t blocos = blocos_do_tamanho(trecho->tamanho);
+    for (uint64_t i = 0; i < blocos;) {
+        if (trecho->fisicos[i] == BURACO) {
+            i++;
+            continue;
+        }
+        uint64_t seguidos = 1;
+        while (i + seguidos < blocos && seguidos < BLOCOS_POR_TRECHO_SOMAS &&
+               trecho->fisicos[i + seguidos] == trecho->fisicos[i] + seguidos) seguidos++;
+
+        int res = ler_somas(trecho->fisicos[i], seguidos, somas);
+        for (uint64_t j = 0; res == 0 && j < seguidos; j++) {
+            if (!soma_confere(trecho->dados + (i + j) * TAMANHO_BLOCO, somas[j])) res = -EIO;
+        }
+        if (res != 0) return res;
+        i += seguidos;
+    }
+    return 0;
+}
+
+// 0 se o trecho pode ser usado: pedidos concluídos, somas conferidas e
+// nenhuma escrita no arquivo desde que ele foi pedido
+static int usar_trecho(TrechoAntecipado *trecho, uint64_t geracao) {
+    if (trecho->geracao != geracao) return -EAGAIN;
+    if (trecho->pronto) return 0;
+
+    int res = assincrono_aguardar(&trecho->grupo);
+    trecho->pronto = 1;
+    if (res == 0 && bloco_inicio_somas) res = conferir_trecho(trecho);
+    return res;
+}
+
+// Leitura pelo descritor, com as travas do arquivo e do descritor: o que
+// estiver nos trechos sai deles, o resto vai direto ao dispositivo. Um erro
+// num trecho só o descarta; a leitura direta do mesmo lugar dá o erro de verdade.
+static int ler_antecipando(Descritor *descritor, ArquivoAberto *arquivo, uint64_t posicao, uint8_t *buffer, uint32_t tamanho) {
+    uint64_t fim = posicao + tamanho;
+    uint32_t janela = __atomic_load_n(&janela_antecipacao, __ATOMIC_RELAXED);
+    int sequencial = posicao == descritor->fim_ultima_leitura;
+    descritor->fim_ultima_leitura = fim;
+    if (!sequencial) descritor->leituras_sequenciais = 0;
+    else if (descritor->leituras_sequenciais < LEITURAS_PARA_ANTECIPAR) descritor->leituras_sequenciais++;
+
+    int antecipar = janela && sequencial && descritor->leituras_sequenciais >= LEITURAS_PARA_ANTECIPAR &&
+                    assincrono_ativo() && !entrada_embutida(&arquivo->entrada) && !entrada_comprimida(&arquivo->entrada);
+    if (descritor->antecipacao && descritor->antecipacao->janela != janela) liberar_antecipacao(descritor);
+    if (descritor->antecipacao && !antecipar) esvaziar_antecipacao(descritor->antecipacao);
+    if (antecipar && !descritor->antecipacao) descritor->antecipacao = criar_antecipacao(janela);
+    Antecipacao *antecipacao = descritor->antecipacao;
+    if (!antecipar || !antecipacao) return transferir_aberto(arquivo, posicao, buffer, tamanho, 0);
+
+    while (posicao < fim) {
+        TrechoAntecipado *trecho = NULL;
+        for (int i = 0; i < TRECHOS_ANTECIPACAO && !trecho; i++) {
+            TrechoAntecipado *candidato = &antecipacao->trechos[i];
+            if (candidato->tamanho && posicao >= candidato->inicio && posicao < candidato->inicio + candidato->tamanho)
+                trecho = candidato;
+        }
+        if (!trecho) break;
+        if (usar_trecho(trecho, arquivo->geracao) != 0) {
+            esvaziar_antecipacao(antecipacao);
+            break;
+        }
+
+        uint64_t fim_trecho = trecho->inicio + trecho->tamanho;
+        uint64_t neste = (fim < fim_trecho ? fim : fim_trecho) - posicao;
+        memcpy(buffer, trecho->dados + (posicao - trecho->inicio), neste);
+        estatisticas_evento(EVENTO_BYTES_ANTECIPADOS_USADOS, neste);
+        buffer += neste;
+        posicao += neste;
+    }
+    int res = posicao < fim ? transferir_aberto(arquivo, posicao, buffer, fim - posicao, 0) : 0;
+
+    // Os trechos que ficaram para trás abrem vaga para os seguintes
+    for (int i = 0; i < TRECHOS_ANTECIPACAO; i++) {
+        TrechoAntecipado *trecho = &antecipacao->trechos[i];
+        if (trecho->tamanho && trecho->inicio + trecho->tamanho <= fim) soltar_trecho(trecho);
+    }
+    if (res == 0) pedir_trechos(antecipacao, arquivo, fim);
+    return res;
+}
+
+int configurar_leitura_antecipada(uint32_t blocos) {
+    if (blocos > MAXIMO_JANELA_ANTECIPACAO) return -EINVAL;
+    __atomic_store_n(&janela_antecipacao, blocos, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// --- Compressão ---
+// Um arquivo comprimido é lido e escrito em pedaços de TAMANHO_PEDACO bytes.
+// Cada pedaço gravado vai para o fim do fluxo (as extensões do arquivo),
+// comprimido com LZ4 ou, se isso não economizar nem um bloco, como veio; a
+// versão anterior fica morta no meio do fluxo. Quando os mortos passam da
+// metade, o fluxo é copiado sem eles para blocos novos, e os antigos só
+// voltam ao bitmap depois da confirmação que grava o fluxo novo: uma queda
+// nunca deixa o mapa confirmado apontando para blocos reaproveitados.
+//
+// Leituras descomprimem o pedaço inteiro. Quem lê menos que um pedaço por vez
+// usa o último pedaço descomprimido pela própria thread, que vale enquanto
+// nenhum pedaço for gravado nem um slot mudar de arquivo (esquecer_pedacos()).
+
+#define MINIMO_MORTOS_COMPACTACAO (4 * TAMANHO_PEDACO / TAMANHO_BLOCO)
+
+static _Thread_local struct {
+    uint64_t geracao;           // 0 = vazio
+    uint64_t bloco_diretorio;
+    int slot;
+    uint64_t indice;
+    uint8_t dados[TAMANHO_PEDACO];
+} ultimo_pedaco;
+
+static uint64_t agora_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint32_t bytes_do_pedaco(Pedaco pedaco) {
+    return pedaco.bytes & ~PEDACO_SEM_COMPRESSAO;
+}
+
+static Pedaco pedaco_em(const ArquivoAberto *arquivo, uint64_t indice) {
+    return indice < arquivo->mapa.total ? arquivo->mapa.itens[indice] : (Pedaco){0, 0};
+}
+
+static int so_zeros(const uint8_t *dados, uint64_t tamanho) {
+    return tamanho == 0 || (dados[0] == 0 && memcmp(dados, dados + 1, tamanho - 1) == 0);
+}
+
+static int carregar_mapa(ArquivoAberto *arquivo) {
+    MapaPedacos *mapa = &arquivo->mapa;
+    uint64_t pedacos = (arquivo->entrada.tamanho_bytes + TAMANHO_PEDACO - 1) / TAMANHO_PEDACO;
+    uint64_t maximo_paginas = (pedacos + PEDACOS_POR_BLOCO - 1) / PEDACOS_POR_BLOCO;
+
+    BlocoPedacos pagina;
+    for (uint64_t bloco = cabecalho_compressao(&arquivo->entrada)->bloco_mapa; bloco != 0; bloco = pagina.proximo_bloco) {
+        if (mapa->total_paginas == maximo_paginas) return -EIO;
+        if (cache_ler(bloco, 0, &pagina, sizeof(BlocoPedacos)) != 0) return -EIO;
+        if (pagina.total_pedacos > PEDACOS_POR_BLOCO) return -EIO;
+
+        if (mapa->total_paginas == mapa->capacidade_paginas) {
+            uint64_t capacidade = mapa->capacidade_paginas ? mapa->capacidade_paginas * 2 : 4;
+            uint64_t *paginas = realloc(mapa->paginas, capacidade * sizeof(uint64_t));
+            if (!paginas) return -ENOMEM;
+            mapa->paginas = paginas;
+            mapa->capacidade_paginas = capacidade;
+        }
+        mapa->paginas[mapa->total_paginas++] = bloco;
+
+        if (mapa->total + pagina.total_pedacos > mapa->capacidade) {
+            uint64_t capacidade = mapa->capacidade ? mapa->capacidade * 2 : PEDACOS_POR_BLOCO;
+            Pedaco *itens = realloc(mapa->itens, capacidade * sizeof(Pedaco));
+            if (!itens) return -ENOMEM;
+            mapa->itens = itens;
+            mapa->capacidade = capacidade;
+        }
+        memcpy(mapa->itens + mapa->total, pagina.pedacos, pagina.total_pedacos * sizeof(Pedaco));
+        mapa->total += pagina.total_pedacos;
+    }
+    return 0;
+}
+
+// Leva o mapa (em memória e no disco) até o pedaço 'indice', com os novos só de zeros
+static int garantir_pedaco(ArquivoAberto *arquivo, uint64_t indice) {
+    MapaPedacos *mapa = &arquivo->mapa;
+    if (indice < mapa->total) return 0;
+
+    if (indice >= mapa->capacidade) {
+        uint64_t capacidade = mapa->capacidade ? mapa->capacidade * 2 : PEDACOS_POR_BLOCO;
+        if (capacidade <= indice) capacidade = indice + 1;
+        Pedaco *itens = realloc(mapa->itens, capacidade * sizeof(Pedaco));
+        if (!itens) return -ENOMEM;
+        mapa->itens = itens;
+        mapa->capacidade = capacidade;
+    }
+
+    uint64_t paginas = indice / PEDACOS_POR_BLOCO + 1;
+    if (paginas > mapa->capacidade_paginas) {
+        uint64_t *maior = realloc(mapa->paginas, paginas * sizeof(uint64_t));
+        if (!maior) return -ENOMEM;
+        mapa->paginas = maior;
+        mapa->capacidade_paginas = paginas;
+    }
+
+    // Páginas novas vêm do fim do disco, como as das cadeias de extensões
+    while (mapa->total_paginas < paginas) {
+        travar_mapa();
+        int64_t bloco = alocar_do_fim();
+        destravar_mapa();
+        if (bloco < 0) return (int)bloco;
+
+        BlocoPedacos vazia = {0};
+        cache_escrever(bloco, 0, &vazia, sizeof(BlocoPedacos));
+        if (mapa->total_paginas == 0) {
+            cabecalho_compressao(&arquivo->entrada)->bloco_mapa = bloco;
+            arquivo->entrada_suja = 1;
+        } else {
+            uint64_t proximo = bloco;
+            cache_escrever(mapa->paginas[mapa->total_paginas - 1], offsetof(BlocoPedacos, proximo_bloco),
+                           &proximo, sizeof(uint64_t));
+        }
+        mapa->paginas[mapa->total_paginas++] = bloco;
+    }
+
+    // As entradas novas já são zeros no disco: basta contar cada página
+    memset(mapa->itens + mapa->total, 0, (indice + 1 - mapa->total) * sizeof(Pedaco));
+    for (uint64_t pagina = mapa->total / PEDACOS_POR_BLOCO; pagina < paginas; pagina++) {
+        uint32_t nesta = pagina + 1 < paginas ? PEDACOS_POR_BLOCO : indice % PEDACOS_POR_BLOCO + 1;
+        cache_escrever(mapa->paginas[pagina], offsetof(BlocoPedacos, total_pedacos), &nesta, sizeof(uint32_t));
+    }
+    mapa->total = indice + 1;
+    return 0;
+}
+
+static int definir_pedaco(ArquivoAberto *arquivo, uint64_t indice, Pedaco pedaco) {
+    int res = garantir_pedaco(arquivo, indice);
+    if (res != 0) return res;
+    arquivo->mapa.itens[indice] = pedaco;
+    cache_escrever(arquivo->mapa.paginas[indice / PEDACOS_POR_BLOCO],
+                   offsetof(BlocoPedacos, pedacos) + (indice % PEDACOS_POR_BLOCO) * sizeof(Pedaco),
+                   &pedaco, sizeof(Pedaco));
+    return 0;
+}
+
+// Preenche 'destino' (TAMANHO_PEDACO bytes) com o pedaço; depois do fim, zeros
+static int descomprimir_pedaco(ArquivoAberto *arquivo, uint64_t indice, uint8_t *destino) {
+    Pedaco pedaco = pedaco_em(arquivo, indice);
+    uint32_t bytes = bytes_do_pedaco(pedaco);
+    if (pedaco.bytes == 0) {
+        memset(destino, 0, TAMANHO_PEDACO);
+        return 0;
+    }
+    if (bytes == 0 || bytes > TAMANHO_PEDACO ||
+        pedaco.bloco + blocos_do_tamanho(bytes) > cabecalho_compressao(&arquivo->entrada)->blocos_fluxo) return -EIO;
+
+    uint64_t deslocamento = (uint64_t)pedaco.bloco * TAMANHO_BLOCO;
+    if (pedaco.bytes & PEDACO_SEM_COMPRESSAO) {
+        memset(destino + bytes, 0, TAMANHO_PEDACO - bytes);
+        return transferir_dados(&arquivo->extensoes, deslocamento, destino, bytes, 0);
+    }
+
+    uint8_t comprimido[TAMANHO_PEDACO];
+    int res = transferir_dados(&arquivo->extensoes, deslocamento, comprimido, bytes, 0);
+    if (res != 0) return res;
+
+    uint64_t inicio = agora_ns();
+    int64_t descomprimidos = lz4_descomprimir(comprimido, bytes, destino, TAMANHO_PEDACO);
+    estatisticas_evento(EVENTO_NS_DESCOMPRESSAO, agora_ns() - inicio);
+    if (descomprimidos < 0) return -EIO;
+    estatisticas_evento(EVENTO_BYTES_DESCOMPRIMIDOS, descomprimidos);
+    memset(destino + descomprimidos, 0, TAMANHO_PEDACO - descomprimidos);
+    return 0;
+}
+
+// Com a trava do arquivo para leitura: só lê o estado compartilhado
+static int ler_comprimido(ArquivoAberto *arquivo, uint64_t deslocamento, uint8_t *buffer, uint32_t tamanho) {
+    while (tamanho > 0) {
+        uint64_t indice = deslocamento / TAMANHO_PEDACO;
+        uint32_t no_pedaco = deslocamento % TAMANHO_PEDACO;
+        uint32_t neste = TAMANHO_PEDACO - no_pedaco;
+        if (neste > tamanho) neste = tamanho;
+
+        int res = 0;
+        if (arquivo->pedaco_valido && arquivo->indice_pedaco == indice) {
+            memcpy(buffer, arquivo->pedaco + no_pedaco, neste);
+        } else if (neste == TAMANHO_PEDACO) {
+            res = descomprimir_pedaco(arquivo, indice, buffer);
+        } else {
+            uint64_t geracao = __atomic_load_n(&geracao_pedacos, __ATOMIC_ACQUIRE);
+            if (ultimo_pedaco.geracao != geracao || ultimo_pedaco.bloco_diretorio != arquivo->bloco_diretorio ||
+                ultimo_pedaco.slot != arquivo->slot || ultimo_pedaco.indice != indice) {
+                ultimo_pedaco.geracao = 0;
+                res = descomprimir_pedaco(arquivo, indice, ultimo_pedaco.dados);
+                if (res == 0) {
+                    ultimo_pedaco.geracao = geracao;
+                    ultimo_pedaco.bloco_diretorio = arquivo->bloco_diretorio;
+                    ultimo_pedaco.slot = arquivo->slot;
+                    ultimo_pedaco.indice = indice;
+                }
+            }
+            if (res == 0) memcpy(buffer, ultimo_pedaco.dados + no_pedaco, neste);
+        }
+        if (res != 0) return res;
+
+        buffer += neste;
+        deslocamento += neste;
+        tamanho -= neste;
+    }
+    return 0;
+}
+
+static void devolver_faixa_arquivo(uint64_t inicio, uint64_t quantidade, int adiar) {
+    if (adiar) adiar_liberacao(inicio, quantidade);
+    else soltar_faixa(inicio, quantidade);
+}
+
+static void devolver_cadeia(uint64_t bloco, int adiar) {
+    while (bloco != 0) {
+        uint64_t proximo = 0;
+        cache_ler(bloco, offsetof(BlocoExtensoes, proximo_bloco), &proximo, sizeof(uint64_t));
+        devolver_faixa_arquivo(bloco, 1, adiar);
+        bloco = proximo;
+    }
+}
+
+// Todos os blocos do arquivo: extensões, cadeia de extensões e mapa de pedaços
+static void devolver_blocos_arquivo(ArquivoAberto *arquivo, int adiar) {
+    for (uint32_t i = 0; i < arquivo->extensoes.total; i++) {
+        if (arquivo->extensoes.itens[i].inicio != BURACO)
+            devolver_faixa_arquivo(arquivo->extensoes.itens[i].inicio, arquivo->extensoes.itens[i].quantidade, adiar);
+    }
+    devolver_cadeia(arquivo->entrada.bloco_extensoes, adiar);
+    if (entrada_comprimida(&arquivo->entrada)) devolver_cadeia(cabecalho_compressao(&arquivo->entrada)->bloco_mapa, adiar);
+}
+
+// Páginas novas para o mapa de pedaços, com o mesmo conteúdo: clones e
+// reparos nunca dividem páginas de metadados
+static int copiar_mapa(EntradaDiretorio *entrada) {
+    CabecalhoCompressao *cabecalho = cabecalho_compressao(entrada);
+    BlocoPedacos pagina;
+    uint64_t primeira = 0, anterior = 0;
+    int res = 0;
+    for (uint64_t bloco = cabecalho->bloco_mapa; bloco != 0; bloco = pagina.proximo_bloco) {
+        res = cache_ler(bloco, 0, &pagina, sizeof(BlocoPedacos));
+        if (res != 0) break;
+        travar_mapa();
+        int64_t nova = alocar_do_fim();
+        destravar_mapa();
+        if (nova < 0) {
+            res = (int)nova;
+            break;
+        }
+
+        uint64_t proximo = pagina.proximo_bloco;
+        pagina.proximo_bloco = 0;
+        cache_escrever(nova, 0, &pagina, sizeof(BlocoPedacos));
+        pagina.proximo_bloco = proximo;
+        if (anterior) cache_escrever(anterior, offsetof(BlocoPedacos, proximo_bloco), &nova, sizeof(uint64_t));
+        else primeira = nova;
+        anterior = nova;
+    }
+
+    if (res != 0) liberar_cadeia_extensoes(primeira);
+    else cabecalho->bloco_mapa = primeira;
+    return res;
+}
+
+// Acrescenta 'blocos' blocos de 'dados' ao fim do fluxo; *posicao recebe onde
+static int acrescentar_ao_fluxo(ArquivoAberto *arquivo, const uint8_t *dados, uint64_t blocos, uint32_t *posicao) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    CabecalhoCompressao *cabecalho = cabecalho_compressao(entrada);
+    ListaExtensoes *lista = &arquivo->extensoes;
+    if (cabecalho->blocos_fluxo + blocos > UINT32_MAX) return -EFBIG;
+
+    uint32_t total_anterior = lista->total;
+    uint64_t quantidade_ultima_anterior = lista->total ? lista->itens[lista->total - 1].quantidade : 0;
+    travar_mapa();
+    int res = estender_sem_trava(lista, blocos);
+    if (res == 0) res = salvar_extensoes_sem_trava(entrada, lista);
+    if (res != 0) desfazer_extensao(lista, total_anterior, quantidade_ultima_anterior);
+    destravar_mapa();
+    if (res != 0) return res;
+
+    *posicao = (uint32_t)cabecalho->blocos_fluxo;
+    cabecalho->blocos_fluxo += blocos;
+    arquivo->entrada_suja = 1;
+    res = transferir_dados(lista, (uint64_t)*posicao * TAMANHO_BLOCO, (uint8_t *)dados, blocos * TAMANHO_BLOCO, 1);
+    if (res != 0) cabecalho->blocos_mortos += blocos;
+    return res;
+}
+
+// Copia os pedaços vivos para um fluxo novo. Sem espaço para ele o arquivo só
+// continua com os mortos.
+static int compactar_fluxo(ArquivoAberto *arquivo) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    CabecalhoCompressao *cabecalho = cabecalho_compressao(entrada);
+    MapaPedacos *mapa = &arquivo->mapa;
+    if (cabecalho->blocos_mortos < MINIMO_MORTOS_COMPACTACAO || cabecalho->blocos_mortos * 2 < cabecalho->blocos_fluxo)
+        return 0;
+
+    uint64_t vivos = cabecalho->blocos_fluxo - cabecalho->blocos_mortos;
+    ListaExtensoes nova = {0};
+    travar_mapa();
+    int res = vivos ? estender_sem_trava(&nova, vivos) : 0;
+    if (res != 0) desfazer_extensao(&nova, 0, 0);
+    destravar_mapa();
+    if (res != 0) {
+        free(nova.itens);
+        return res == -ENOSPC ? 0 : res;
+    }
+
+    Pedaco *novos = malloc((mapa->total ? mapa->total : 1) * sizeof(Pedaco));
+    uint8_t *buffer = malloc(TAMANHO_PEDACO);
+    res = (novos && buffer) ? 0 : -ENOMEM;
+    uint64_t posicao = 0;
+    for (uint64_t i = 0; res == 0 && i < mapa->total; i++) {
+        novos[i] = mapa->itens[i];
+        if (novos[i].bytes == 0) continue;
+        uint64_t blocos = blocos_do_tamanho(bytes_do_pedaco(novos[i]));
+        if (posicao + blocos > vivos) {
+            res = -EIO;
+            break;
+        }
+        res = transferir_dados(&arquivo->extensoes, (uint64_t)novos[i].bloco * TAMANHO_BLOCO, buffer,
+                               blocos * TAMANHO_BLOCO, 0);
+        if (res == 0) res = transferir_dados(&nova, posicao * TAMANHO_BLOCO, buffer, blocos * TAMANHO_BLOCO, 1);
+        novos[i].bloco = (uint32_t)posicao;
+        posicao += blocos;
+    }
+    free(buffer);
+
+    uint64_t bloco_inicial = entrada->bloco_inicial;
+    if (res == 0) res = salvar_extensoes(entrada, &nova);
+    if (res != 0) {
+        entrada->bloco_inicial = bloco_inicial;
+        liberar_extensoes(&nova, 0);
+        free(nova.itens);
+        free(novos);
+        return res == -ENOSPC ? 0 : res;
+    }
+
+    // Daqui em diante a entrada aponta para o fluxo novo
+    for (uint32_t i = 0; i < arquivo->extensoes.total; i++)
+        adiar_liberacao(arquivo->extensoes.itens[i].inicio, arquivo->extensoes.itens[i].quantidade);
+    free(arquivo->extensoes.itens);
+    arquivo->extensoes = nova;
+
+    memcpy(mapa->itens, novos, mapa->total * sizeof(Pedaco));
+    free(novos);
+    for (uint64_t pagina = 0; pagina < mapa->total_paginas; pagina++) {
+        uint64_t primeiro = pagina * PEDACOS_POR_BLOCO;
+        uint64_t nesta = mapa->total - primeiro < PEDACOS_POR_BLOCO ? mapa->total - primeiro : PEDACOS_POR_BLOCO;
+        cache_escrever(mapa->paginas[pagina], offsetof(BlocoPedacos, pedacos), mapa->itens + primeiro,
+                       nesta * sizeof(Pedaco));
+    }
+
+    cabecalho->blocos_fluxo = vivos;
+    cabecalho->blocos_mortos = 0;
+    arquivo->entrada_suja = 1;
+    esquecer_pedacos();
+    estatisticas_evento(EVENTO_FLUXO_COMPACTADO, 1);
+    return 0;
+}
+
+// Comprime e grava o pedaço do buffer do arquivo, se ele foi alterado
+static int gravar_pedaco(ArquivoAberto *arquivo) {
+    if (!arquivo->pedaco_valido || !arquivo->pedaco_sujo) return 0;
+
+    CabecalhoCompressao *cabecalho = cabecalho_compressao(&arquivo->entrada);
+    uint64_t indice = arquivo->indice_pedaco;
+    uint64_t base = indice * TAMANHO_PEDACO;
+    uint32_t validos = arquivo->entrada.tamanho_bytes - base < TAMANHO_PEDACO
+                     ? (uint32_t)(arquivo->entrada.tamanho_bytes - base) : TAMANHO_PEDACO;
+
+    Pedaco antigo = pedaco_em(arquivo, indice);
+    Pedaco novo = {0, 0};
+    uint64_t blocos = 0;
+    if (!so_zeros(arquivo->pedaco, validos)) {
+        // Só vale guardar comprimido o que economiza pelo menos um bloco; o
+        // resto do último bloco vai com zeros (o buffer já os tem depois do fim)
+        uint8_t comprimido[TAMANHO_PEDACO];
+        uint32_t limite = (uint32_t)(blocos_do_tamanho(validos) - 1) * TAMANHO_BLOCO;
+        uint64_t inicio = agora_ns();
+        uint32_t bytes = limite ? lz4_comprimir(arquivo->pedaco, validos, comprimido, limite) : 0;
+        estatisticas_evento(EVENTO_NS_COMPRESSAO, agora_ns() - inicio);
+        estatisticas_evento(EVENTO_BYTES_PARA_COMPRIMIR, validos);
+        estatisticas_evento(EVENTO_BYTES_COMPRIMIDOS, bytes ? bytes : validos);
+
+        const uint8_t *dados = arquivo->pedaco;
+        novo.bytes = validos | PEDACO_SEM_COMPRESSAO;
+        if (bytes) {
+            memset(comprimido + bytes, 0, blocos_do_tamanho(bytes) * TAMANHO_BLOCO - bytes);
+            dados = comprimido;
+            novo.bytes = bytes;
+        }
+        blocos = blocos_do_tamanho(bytes_do_pedaco(novo));
+        int res = acrescentar_ao_fluxo(arquivo, dados, blocos, &novo.bloco);
+        if (res != 0) return res;
+    }
+
+    int res = definir_pedaco(arquivo, indice, novo);
+    if (res != 0) {
+        cabecalho->blocos_mortos += blocos;
+        return res;
+    }
+    if (antigo.bytes) cabecalho->blocos_mortos += blocos_do_tamanho(bytes_do_pedaco(antigo));
+    arquivo->pedaco_sujo = 0;
+    arquivo->entrada_suja = 1;
+    esquecer_pedacos();
+    return compactar_fluxo(arquivo);
+}
+
+// Põe o pedaço 'indice' no buffer do arquivo, gravando antes o que estava lá;
+// com 'inteiro' a escrita vai cobrir o pedaço todo e ele nem é lido
+static int abrir_pedaco(ArquivoAberto *arquivo, uint64_t indice, int inteiro) {
+    if (arquivo->pedaco_valido && arquivo->indice_pedaco == indice) return 0;
+    int res = gravar_pedaco(arquivo);
+    if (res != 0) return res;
+
+    if (!arquivo->pedaco && !(arquivo->pedaco = malloc(TAMANHO_PEDACO))) return -ENOMEM;
+    arquivo->pedaco_valido = 0;
+    if (!inteiro) {
+        res = descomprimir_pedaco(arquivo, indice, arquivo->pedaco);
+        if (res != 0) return res;
+    }
+    arquivo->indice_pedaco = indice;
+    arquivo->pedaco_valido = 1;
+    return 0;
+}
+
+static int escrever_comprimido(ArquivoAberto *arquivo, uint64_t deslocamento, const uint8_t *buffer, uint32_t tamanho) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    while (tamanho > 0) {
+        uint64_t indice = deslocamento / TAMANHO_PEDACO;
+        uint32_t no_pedaco = deslocamento % TAMANHO_PEDACO;
+        uint32_t neste = TAMANHO_PEDACO - no_pedaco;
+        if (neste > tamanho) neste = tamanho;
+
+        int res = abrir_pedaco(arquivo, indice, neste == TAMANHO_PEDACO);
+        if (res != 0) return res;
+        memcpy(arquivo->pedaco + no_pedaco, buffer, neste);
+        arquivo->pedaco_sujo = 1;
+
+        // O tamanho acompanha cada pedaço: gravar_pedaco() comprime até ele
+        if (deslocamento + neste > entrada->tamanho_bytes) {
+            entrada->tamanho_bytes = deslocamento + neste;
+            arquivo->entrada_suja = 1;
+        }
+        buffer += neste;
+        deslocamento += neste;
+        tamanho -= neste;
+    }
+    return 0;
+}
+
+// Copia o conteúdo de 'origem' para 'destino' (já do mesmo tamanho, sem
+// nada gravado) pedaço a pedaço; os só de zeros ficam sem blocos
+static int copiar_conteudo(ArquivoAberto *origem, ArquivoAberto *destino) {
+    uint8_t *buffer = malloc(TAMANHO_PEDACO);
+    if (!buffer) return -ENOMEM;
+
+    int res = 0;
+    uint64_t tamanho = origem->entrada.tamanho_bytes;
+    for (uint64_t base = 0; res == 0 && base < tamanho; base += TAMANHO_PEDACO) {
+        uint32_t neste = tamanho - base < TAMANHO_PEDACO ? (uint32_t)(tamanho - base) : TAMANHO_PEDACO;
+        res = transferir_aberto(origem, base, buffer, neste, 0);
+        if (res == 0 && !so_zeros(buffer, neste)) res = transferir_aberto(destino, base, buffer, neste, 1);
+    }
+    if (res == 0) res = gravar_pedaco(destino);
+    free(buffer);
+    return res;
+}
+
+// --- Sincronização ---
+
+// Grava cada sequência de blocos vizinhos numa única escrita vetorizada
+static int gravar_pendentes(BlocoPendente *pendentes, uint32_t quantidade) {
+    uint8_t **buffers = malloc(quantidade * sizeof(uint8_t *));
+    if (!buffers) return -ENOMEM;
+
+    int res = 0;
+    uint32_t inicio_sequencia = 0;
+    for (uint32_t i = 0; i < quantidade && res == 0; i++) {
+        buffers[i] = pendentes[i].dados;
+        if (i + 1 < quantidade && pendentes[i + 1].bloco == pendentes[i].bloco + 1) continue;
+
+        res = dispositivo_escrever_blocos(pendentes[inicio_sequencia].bloco, buffers + inicio_sequencia,
+                                          i + 1 - inicio_sequencia);
+        inicio_sequencia = i + 1;
+    }
+    free(buffers);
+    return res;
+}
+
+// Cada transação vai ao diário e depois ao lugar definitivo. Um conjunto maior
+// que o diário (um bitmap enorme, um instantâneo de um diretório grande) vai
+// em várias, em ordem, cada uma sincronizada no lugar antes de a seguinte
+// sobrescrever o diário: uma queda no meio deixa as primeiras aplicadas e a
+// última reaplicável, nunca uma transação mais velha por cima das novas. O
+// conjunto não é atômico; a verificação da montagem seguinte acerta o resto.
+static int gravar_pelo_diario(BlocoPendente *pendentes, uint32_t quantidade) {
+    uint64_t capacidade = diario_capacidade();
+    if (capacidade == 0) {
+        // Sem diário (ou pequeno demais): nada antigo pode ficar para reaplicar
+        int res = diario_limpar();
+        return res == 0 ? gravar_pendentes(pendentes, quantidade) : res;
+    }
+
+    int res = 0;
+    for (uint32_t feitos = 0; feitos < quantidade && res == 0;) {
+        uint32_t parte = quantidade - feitos < capacidade ? quantidade - feitos : (uint32_t)capacidade;
+        res = diario_gravar(pendentes + feitos, parte);
+        if (res == 0) res = gravar_pendentes(pendentes + feitos, parte);
+        feitos += parte;
+        if (res == 0 && feitos < quantidade) res = dispositivo_sincronizar();
+    }
+    return res;
+}
+
+static int comparar_pendentes(const void *a, const void *b) {
+    uint64_t bloco_a = ((const BlocoPendente *)a)->bloco;
+    uint64_t bloco_b = ((const BlocoPendente *)b)->bloco;
+    return (bloco_a > bloco_b) - (bloco_a < bloco_b);
+}
+
+// Chama fazer() para cada sequência das faixas que continua livre; para no
+// primeiro erro
+static int percorrer_livres(const Extensao *faixas, uint32_t total, int (*fazer)(uint64_t inicio, uint64_t quantidade)) {
+    for (uint32_t i = 0; i < total; i++) {
+        uint64_t bloco = faixas[i].inicio;
+        uint64_t fim = bloco + faixas[i].quantidade;
+        while (bloco < fim) {
+            uint64_t livres = comprimento_livre(bloco, fim - bloco);
+            if (livres == 0) {
+                bloco++;
+                continue;
+            }
+            int res = fazer(bloco, livres);
+            if (res != 0) return res;
+            bloco += livres;
+        }
+    }
+    return 0;
+}
+
+// Só depois da confirmação: antes dela (ou numa queda) os metadados antigos
+// ainda podem apontar para a faixa
+static int devolver_faixa(uint64_t inicio, uint64_t quantidade) {
+    int res = dispositivo_descartar(inicio * TAMANHO_BLOCO, quantidade * TAMANHO_BLOCO);
+    if (res == 0) estatisticas_evento(EVENTO_BLOCOS_DEVOLVIDOS, quantidade);
+    return res;
+}
+
+// Devolve ao sistema o que as confirmações liberaram, com trava_operacoes
+// (compartilhada basta, para a imagem não mudar no meio) e fora delas: cada
+// furo no arquivo de imagem custa uma chamada ao sistema. A trava do mapa
+// fica presa por faixa, para nenhum bloco ser alocado e escrito entre a
+// conferência do bitmap e o descarte.
+static void devolver_liberadas() {
+    travar_mapa();
+    Extensao *faixas = faixas_a_devolver;
+    uint32_t total = total_faixas_a_devolver;
+    faixas_a_devolver = NULL;
+    total_faixas_a_devolver = 0;
+    capacidade_faixas_a_devolver = 0;
+    destravar_mapa();
+
+    // Sem suporte a descarte as faixas só ficam onde estão
+    total = juntar_faixas(faixas, total);
+    int res = 0;
+    for (uint32_t i = 0; i < total && res != -EOPNOTSUPP; i++) {
+        travar_mapa();
+        res = percorrer_livres(&faixas[i], 1, devolver_faixa);
+        destravar_mapa();
+    }
+    free(faixas);
+}
+
+// Confirmação em grupo: tudo que as operações desde a última chamada sujaram
+// (bitmap e blocos do cache) vira uma transação só no diário, com um fsync,
+// e depois é gravado no lugar definitivo. Só com trava_operacoes exclusiva.
+static int confirmar_pendentes() {
+    gravar_arquivos_abertos();
+    liberar_indices_aposentados();
+    total_faixas_liberadas = juntar_faixas(faixas_liberadas, total_faixas_liberadas);
+    if (bloco_inicio_somas) {
+        int res = percorrer_livres(faixas_liberadas, total_faixas_liberadas, esquecer_somas);
+        if (res == 0) res = somar_pendentes();
+        if (res != 0) return res;
+    }
+
+    uint32_t maximo = cache_capacidade() + total_blocos_mapa_sujos;
+    BlocoPendente *pendentes = malloc((maximo ? maximo : 1) * sizeof(BlocoPendente));
+    if (!pendentes) return -ENOMEM;
+
+    uint32_t quantidade = coletar_bitmap_sujo(pendentes);
+    quantidade += cache_coletar_sujos(pendentes + quantidade);
+    qsort(pendentes, quantidade, sizeof(BlocoPendente), comparar_pendentes);
+
+    int res = 0;
+    if (quantidade > 0) {
+        res = gravar_pelo_diario(pendentes, quantidade);
+        if (res == 0) {
+            marcar_bitmap_limpo();
+            cache_marcar_limpos();
+            estatisticas_evento(EVENTO_CONFIRMACAO, 1);
+            estatisticas_evento(EVENTO_BLOCOS_CONFIRMADOS, quantidade);
+        }
+    }
+    free(pendentes);
+
+    if (res == 0) res = dispositivo_sincronizar();
+    if (res == 0) {
+        intencoes_confirmadas();
+        travar_mapa();
+        for (uint32_t i = 0; i < total_faixas_liberadas; i++)
+            anotar_faixa(&faixas_a_devolver, &total_faixas_a_devolver, &capacidade_faixas_a_devolver,
+                         faixas_liberadas[i].inicio, faixas_liberadas[i].quantidade);
+        destravar_mapa();
+        total_faixas_liberadas = 0;
+
+        // Blocos que a transação deixou de usar: só agora podem ser reaproveitados
+        // (ou, se divididos, perder a referência)
+        for (uint32_t i = 0; i < total_faixas_adiadas; i++)
+            soltar_faixa(faixas_adiadas[i].inicio, faixas_adiadas[i].quantidade);
+        total_faixas_adiadas = 0;
+    }
+    return res;
+}
+
+int sincronizar_disco() {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = confirmar_pendentes();
+    sair_operacao();
+
+    entrar_operacao(0);
+    devolver_liberadas();
+    sair_operacao();
+    return estatisticas_registrar(OP_SINCRONIZAR, &medicao, res, 0);
+}
+
+static int confirmacoes_adiadas = 0;
+
+// Com confirmações adiadas o cache cresce e só o limite do diário conta
+void adiar_confirmacoes(int ativo) {
+    entrar_operacao(1);
+    confirmacoes_adiadas = ativo;
+    sair_operacao();
+}
+
+static int confirmacao_necessaria() {
+    travar_mapa();
+    uint64_t pendentes = cache_total_sujos() + total_blocos_mapa_sujos;
+    destravar_mapa();
+
+    uint64_t limite = diario_capacidade() / 2;
+    if (!confirmacoes_adiadas && cache_capacidade() / 2 < limite) limite = cache_capacidade() / 2;
+    return pendentes >= limite || intencoes_quase_cheias();
+}
+
+// Fim de uma operação que altera metadados (já sem travas): se há blocos
+// pendentes demais para caber com folga no cache ou no diário, confirma agora,
+// entre operações. Várias threads podem chegar juntas; só a primeira confirma.
+static void concluir_operacao() {
+    entrar_operacao(0);
+    int necessaria = diario_ativo() && confirmacao_necessaria();
+    sair_operacao();
+    if (!necessaria) return;
+
+    entrar_operacao(1);
+    if (confirmacao_necessaria()) confirmar_pendentes();
+    sair_operacao();
+
+    entrar_operacao(0);
+    devolver_liberadas();
+    sair_operacao();
+}
+
+// O superbloco diz se a imagem está em uso; uma montagem que o encontra
+// marcado sabe que a anterior não terminou com desmontar_disco()
+static void marcar_montado(uint32_t montado) {
+    cache_escrever(1, offsetof(SuperBloco, montado), &montado, sizeof(uint32_t));
+}
+
+int desmontar_disco() {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    marcar_montado(0);
+    int res = confirmar_pendentes();
+    // Os blocos adiados que a confirmação soltou sujaram o bitmap de novo, e
+    // os divididos com clones, os contadores da tabela de referências no cache
+    while (res == 0 && (total_blocos_mapa_sujos > 0 || cache_total_sujos() > 0)) res = confirmar_pendentes();
+    if (res == 0) res = diario_limpar();
+    if (res == 0 && intencoes_no_disco) res = diario_gravar_intencoes(NULL, 0);
+    if (res == 0) intencoes_no_disco = 0;
+    devolver_liberadas();
+    sair_operacao();
+    return estatisticas_registrar(OP_DESMONTAR, &medicao, res, 0);
+}
+
+// --- Funções Principais ---
+
+void formatar_disco(uint64_t quantidade_setores) {
+    formatar_disco_com_somas(quantidade_setores, 0);
+}
+
+void formatar_disco_com_somas(uint64_t quantidade_setores, int somas) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    uint64_t total_bytes = quantidade_setores * 512;
+    uint64_t total_blocos = total_bytes / TAMANHO_BLOCO;
+    
+    uint64_t bytes_mapa = (total_blocos + 7) / 8;
+    uint64_t blocos_mapa = (bytes_mapa + TAMANHO_BLOCO - 1) / TAMANHO_BLOCO;
+
+    // O diário comporta o bitmap inteiro mais um cache cheio de blocos sujos e
+    // o registro de intenções, limitado a 1/8 do disco; discos muito pequenos
+    // ficam sem diário
+    uint64_t capacidade_diario = blocos_mapa + CACHE_CAPACIDADE_PADRAO;
+    uint64_t blocos_diario = 1 + (capacidade_diario + DESTINOS_POR_BLOCO - 1) / DESTINOS_POR_BLOCO + capacidade_diario + 1;
+    if (blocos_diario > total_blocos / 8) blocos_diario = total_blocos / 8;
+    if (blocos_diario < 8) blocos_diario = 0;
+
+    // As somas de verificação dependem do diário para chegar ao disco junto
+    // com os blocos que descrevem
+    uint64_t blocos_somas = 0;
+    if (somas && blocos_diario) blocos_somas = (total_blocos + SOMAS_POR_BLOCO - 1) / SOMAS_POR_BLOCO;
+
+    uint64_t inicio_bitmap = 2;
+    uint64_t inicio_raiz = inicio_bitmap + blocos_mapa;
+    uint64_t inicio_diario = inicio_raiz + 1;
+    uint64_t inicio_somas = inicio_diario + blocos_diario;
+    uint64_t inicio_dados = inicio_somas + blocos_somas;
+
+    SuperBloco sb = {0};
+    sb.tamanho_bloco = TAMANHO_BLOCO;
+    sb.total_blocos = total_blocos;
+    sb.inicio_bitmap = inicio_bitmap;
+    sb.inicio_raiz = inicio_raiz;
+    sb.inicio_dados = inicio_dados;
+    sb.inicio_diario = blocos_diario ? inicio_diario : 0;
+    sb.blocos_diario = blocos_diario;
+    sb.versao = blocos_somas ? VERSAO_SOMAS : VERSAO_FORMATO;
+    sb.montado = 1;
+    sb.inicio_somas = blocos_somas ? inicio_somas : 0;
+    sb.blocos_somas = blocos_somas;
+
+    uint64_t tamanho_anterior;
+    dispositivo_estender(total_bytes, &tamanho_anterior);
+    dispositivo_usar_modo(dispositivo_modo());    // remapeia no novo tamanho
+
+    // Só o que a montagem lê precisa estar zerado: superbloco, bitmap, raiz,
+    // o cabeçalho do diário (o resto do diário só vale com um cabeçalho
+    // válido) e o registro de intenções. O trecho que a imagem acabou de
+    // ganhar já lê zeros.
+    uint64_t fim_metadados = (inicio_raiz + 1 + (blocos_diario ? 1 : 0)) * TAMANHO_BLOCO;
+    if (fim_metadados > tamanho_anterior) fim_metadados = tamanho_anterior;
+    dispositivo_zerar(0, fim_metadados);
+    uint64_t registro_intencoes = (inicio_diario + blocos_diario - 1) * TAMANHO_BLOCO;
+    if (blocos_diario && registro_intencoes < tamanho_anterior) dispositivo_zerar(registro_intencoes, TAMANHO_BLOCO);
+    if (blocos_somas && inicio_somas * TAMANHO_BLOCO < tamanho_anterior) {
+        uint64_t fim_somas = inicio_dados * TAMANHO_BLOCO;
+        if (fim_somas > tamanho_anterior) fim_somas = tamanho_anterior;
+        dispositivo_zerar(inicio_somas * TAMANHO_BLOCO, fim_somas - inicio_somas * TAMANHO_BLOCO);
+    }
+
+    dispositivo_escrever(1 * TAMANHO_BLOCO, &sb, sizeof(SuperBloco));
+    descartar_descritores();
+    cache_descartar();
+    descartar_indices_diretorio();
+
+    total_blocos_disco = total_blocos;
+    usar_versao_formato(sb.versao);
+    bloco_inicio_bitmap = inicio_bitmap;
+    bloco_inicio_raiz = inicio_raiz;
+    bloco_inicio_dados = inicio_dados;
+    bloco_inicio_somas = sb.inicio_somas;
+    bloco_inicio_referencias = 0;
+    blocos_referencias = 0;
+
+    diario_configurar(sb.inicio_diario, sb.blocos_diario);
+    cache_adiar_escritas(diario_ativo());
+    
+    nova_montagem();
+    inicializar_diretorio_atual();
+    total_intencoes = 0;
+    intencoes_no_disco = 0;
+    carregar_bitmap(0);
+    marcar_blocos(0, inicio_dados, STATUS_USADO);
+
+    // A raiz é pai de si mesma; o ".." dela guarda o tamanho e as extensões
+    // quando ela crescer além do primeiro bloco
+    EntradaDiretorio pai = {0};
+    strcpy(pai.nome_arquivo, NOME_PAI);
+    pai.tamanho_bytes = TAMANHO_BLOCO;
+    pai.status        = STATUS_USADO;
+    pai.tipo          = TIPO_DIRETORIO;
+    pai.bloco_inicial = inicio_raiz;
+    salvar_entrada_fisica(inicio_raiz, 0, &pai);
+
+    // Blocos gravados fora do cache: o superbloco e os do bitmap que a
+    // confirmação não vai levar (os zerados)
+    if (blocos_somas) {
+        uint32_t soma = crc32c(0, &sb, TAMANHO_BLOCO);
+        gravar_somas(1, 1, &soma);
+        for (uint64_t i = 0; i < blocos_mapa; i++) {
+            soma = crc32c(0, (uint8_t *)mapa_bits + i * TAMANHO_BLOCO, TAMANHO_BLOCO);
+            gravar_somas(inicio_bitmap + i, 1, &soma);
+        }
+    }
+    confirmar_pendentes();
+    sair_operacao();
+    estatisticas_registrar(OP_FORMATAR, &medicao, 0, 0);
+}
+
+int montar_disco() {
+    return montar_disco_com_modo(dispositivo_modo());
+}
+
+static Consistencia consistencia_montagem;
+static int verificada_na_montagem = 0;
+
+static int verificar_sem_trava(int reparar, uint32_t threads, Consistencia *consistencia);
+
+// Montagem depois de uma queda, com o bitmap carregado: as janelas do registro
+// de intenções podem ter dados mais novos que as somas confirmadas. Os blocos
+// em uso ganham a soma do que está no disco; os livres ficam sem soma. As
+// somas vão na confirmação da montagem; até lá o registro continua valendo.
+static int reconciliar_somas() {
+    FaixaIntencao faixas[MAXIMO_INTENCOES];
+    int total = diario_ler_intencoes(faixas, MAXIMO_INTENCOES);
+    if (total <= 0) return total;
+    intencoes_no_disco = 1;
+
+    uint8_t *blocos = malloc(BLOCOS_POR_TRECHO_SOMAS * TAMANHO_BLOCO);
+    uint32_t somas[BLOCOS_POR_TRECHO_SOMAS];
+    if (!blocos) return -ENOMEM;
+
+    int res = 0;
+    for (int f = 0; f < total && res == 0; f++) {
+        uint64_t bloco = faixas[f].inicio > bloco_inicio_dados ? faixas[f].inicio : bloco_inicio_dados;
+        uint64_t fim = faixas[f].inicio + faixas[f].quantidade;
+        if (fim > total_blocos_disco || fim < faixas[f].inicio) fim = total_blocos_disco;
+
+        while (res == 0 && bloco < fim) {
+            uint64_t quantidade = fim - bloco < BLOCOS_POR_TRECHO_SOMAS ? fim - bloco : BLOCOS_POR_TRECHO_SOMAS;
+            res = dispositivo_ler(bloco * TAMANHO_BLOCO, blocos, quantidade * TAMANHO_BLOCO);
+            for (uint64_t i = 0; res == 0 && i < quantidade; i++) {
+                uint64_t b = bloco + i;
+                int usado = (mapa_bits[b / 64] >> (b % 64)) & 1;
+                somas[i] = usado ? crc32c(0, blocos + i * TAMANHO_BLOCO, TAMANHO_BLOCO) : SEM_SOMA;
+            }
+            if (res == 0) res = gravar_somas(bloco, quantidade, somas);
+            bloco += quantidade;
+        }
+    }
+    free(blocos);
+    return res;
+}
+
+static int montar_sem_trava(int modo_dispositivo) {
+    if (!arquivo_disco) return 0;
+    dispositivo_usar_modo(modo_dispositivo);
+
+    SuperBloco sb;
+    descartar_descritores();
+    cache_descartar();
+    descartar_indices_diretorio();
+    if (dispositivo_ler(1 * TAMANHO_BLOCO, &sb, sizeof(SuperBloco)) != 0) return 0;
+
+    // Reaplica a última transação do diário; ela pode ter tocado o superbloco
+    cache_adiar_escritas(0);
+    diario_configurar(sb.inicio_diario, sb.blocos_diario);
+    if (diario_recuperar() > 0 && dispositivo_ler(1 * TAMANHO_BLOCO, &sb, sizeof(SuperBloco)) != 0) return 0;
+    cache_adiar_escritas(diario_ativo());
+
+    // Imagens de antes do campo de versão têm zero ali
+    uint32_t versao = sb.versao ? sb.versao : 1;
+    if (versao > VERSAO_REFERENCIAS) return 0;
+    usar_versao_formato(versao);
+    bloco_inicio_somas = versao >= VERSAO_SOMAS ? sb.inicio_somas : 0;
+    bloco_inicio_referencias = versao >= VERSAO_REFERENCIAS ? sb.inicio_referencias : 0;
+    blocos_referencias = versao >= VERSAO_REFERENCIAS ? sb.blocos_referencias : 0;
+
+    total_blocos_disco = sb.total_blocos;
+    bloco_inicio_bitmap = sb.inicio_bitmap;
+    bloco_inicio_raiz = sb.inicio_raiz;
+    bloco_inicio_dados = sb.inicio_dados;
+    
+    if (!carregar_bitmap(1)) return 0;
+
+    nova_montagem();
+    inicializar_diretorio_atual();
+    total_intencoes = 0;
+    intencoes_no_disco = 0;
+    if (sb.montado != 0 && bloco_inicio_somas && reconciliar_somas() != 0) return 0;
+
+    // Depois de uma queda o diário deixa os metadados coerentes entre si, mas
+    // não protege de tudo (imagens sem diário, dados gravados por fora)
+    verificada_na_montagem = sb.montado != 0;
+    if (verificada_na_montagem && verificar_sem_trava(1, 0, &consistencia_montagem) < 0) return 0;
+    marcar_montado(1);
+    return confirmar_pendentes() == 0;
+}
+
+int montar_disco_com_modo(int modo_dispositivo) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = montar_sem_trava(modo_dispositivo);
+    sair_operacao();
+    return estatisticas_registrar(OP_MONTAR, &medicao, res ? 0 : -EIO, 0) == 0;
+}
+
+// --- Operações (chamadas com as travas já adquiridas) ---
+
+// As pastas de um instantâneo levam ATRIBUTO_INSTANTANEO no próprio ".."
+static int diretorio_instantaneo(uint64_t bloco_diretorio) {
+    EntradaDiretorio pai = ler_entrada_fisica(bloco_diretorio, 0);
+    return entrada_pai(&pai) && (pai.atributos & ATRIBUTO_INSTANTANEO);
+}
+
+static int criar_sem_trava(uint64_t bloco_diretorio, const char *nome, uint64_t tamanho_solicitado, uint8_t tipo) {
+    if (nome[0] == '\0') return -EINVAL;
+    if (nome_reservado(nome)) return -EEXIST;
+    if (diretorio_instantaneo(bloco_diretorio)) return -EROFS;
+
+    if (tipo == TIPO_DIRETORIO) {
+        tamanho_solicitado = TAMANHO_BLOCO;
+    }
+    if (tamanho_solicitado > tamanho_maximo_arquivo()) return -EFBIG;
+
+    int embutido = pode_embutir(tipo, tamanho_solicitado);
+
+    if (procurar_entrada(bloco_diretorio, nome, NULL) >= 0) return -EEXIST;
+
+    int indice_diretorio_livre = buscar_slot_livre_diretorio(bloco_diretorio);
+    if (indice_diretorio_livre < 0) return indice_diretorio_livre;
+
+    EntradaDiretorio nova_entrada = {0};
+    strcpy(nova_entrada.nome_arquivo, nome);     // resolver_caminho() já limitou o tamanho
+    nova_entrada.tamanho_bytes = tamanho_solicitado;
+    nova_entrada.status        = STATUS_USADO;
+    nova_entrada.tipo          = tipo;
+    if (embutido) nova_entrada.atributos = ATRIBUTO_EMBUTIDO;
+
+    // Arquivos nascem como um buraco só (bloco_inicial = BURACO): os blocos
+    // vêm com as escritas
+    if (tipo == TIPO_DIRETORIO) {
+        // Diretórios nascem com um bloco e ".." no slot 0; os blocos seguintes
+        // ficam registrados no próprio ".."
+        int64_t bloco_novo = alocar_blocos(1);
+        if (bloco_novo < 0) return -ENOSPC;
+        nova_entrada.bloco_inicial = bloco_novo;
+
+        void *buffer_zeros = calloc(1, TAMANHO_BLOCO);
+        if (buffer_zeros) {
+            cache_escrever(bloco_novo, 0, buffer_zeros, TAMANHO_BLOCO);
+            free(buffer_zeros);
+        }
+
+        EntradaDiretorio pai = {0};
+        strcpy(pai.nome_arquivo, NOME_PAI);
+        pai.tamanho_bytes = TAMANHO_BLOCO;
+        pai.status        = STATUS_USADO;
+        pai.tipo          = TIPO_DIRETORIO;
+        pai.bloco_inicial = bloco_diretorio;
+        salvar_entrada_fisica(bloco_novo, 0, &pai);
+        descartar_indice_diretorio(bloco_novo);
+    }
+
+    salvar_entrada_em(bloco_diretorio, indice_diretorio_livre, &nova_entrada);
+    return 0;
+}
+
+// Diretórios só podem sair com a trava de operações exclusiva; sem ela devolve
+// -EAGAIN para quem chamou repetir assim
+static int remover_sem_trava(uint64_t bloco_diretorio, const char *nome, int exclusiva) {
+    if (nome[0] == '\0' || nome_reservado(nome)) return -EINVAL;
+
+    EntradaDiretorio entrada;
+    int indice_encontrado = procurar_entrada(bloco_diretorio, nome, &entrada);
+    if (indice_encontrado < 0) return indice_encontrado;
+    if ((entrada.atributos & ATRIBUTO_INSTANTANEO) || diretorio_instantaneo(bloco_diretorio)) return -EROFS;
+    if (arquivo_aberto_em(bloco_diretorio, indice_encontrado)) return -EBUSY;
+
+    if (entrada.tipo == TIPO_DIRETORIO) {
+        if (!exclusiva) return -EAGAIN;
+        if (diretorio_em_uso(entrada.bloco_inicial)) return -EBUSY;
+        int vazio = diretorio_vazio(entrada.bloco_inicial);
+        if (vazio <= 0) return vazio < 0 ? vazio : -ENOTEMPTY;
+        descartar_indice_diretorio(entrada.bloco_inicial);
+
+        // Os blocos do diretório estão descritos no ".." dele, não na entrada
+        EntradaDiretorio proprio;
+        descrever_diretorio(entrada.bloco_inicial, &proprio);
+        entrada.tamanho_bytes = proprio.tamanho_bytes;
+        entrada.bloco_extensoes = proprio.bloco_extensoes;
+    }
+
+    ListaExtensoes lista = {0};
+    if (carregar_extensoes(&entrada, &lista) == 0) liberar_extensoes(&lista, 0);
+    free(lista.itens);
+    liberar_cadeia_extensoes(entrada.bloco_extensoes);
+    if (entrada_comprimida(&entrada)) {
+        liberar_cadeia_extensoes(cabecalho_compressao(&entrada)->bloco_mapa);
+        esquecer_pedacos();
+    }
+
+    entrada.status = STATUS_APAGADO;
+    salvar_entrada_em(bloco_diretorio, indice_encontrado, &entrada);
+    return 0;
+}
+
+// Só com trava_operacoes exclusiva: converte o arquivo inteiro e nenhum
+// descritor pode estar com ele
+static int comprimir_sem_trava(uint64_t bloco_diretorio, const char *nome, int ativo) {
+    if (versao_formato_disco < 2) return -ENOTSUP;
+    if (nome[0] == '\0' || nome_reservado(nome)) return -EINVAL;
+
+    EntradaDiretorio entrada;
+    int slot = procurar_entrada(bloco_diretorio, nome, &entrada);
+    if (slot < 0) return slot;
+    if (entrada.tipo == TIPO_DIRETORIO) return -EISDIR;
+    if (entrada.atributos & ATRIBUTO_INSTANTANEO) return -EROFS;
+    if (arquivo_aberto_em(bloco_diretorio, slot)) return -EBUSY;
+    if (((entrada.atributos & ATRIBUTO_COMPRIMIDO) != 0) == (ativo != 0)) return 0;
+
+    esquecer_pedacos();
+    if (entrada_embutida(&entrada)) {
+        entrada.atributos ^= ATRIBUTO_COMPRIMIDO;
+        salvar_entrada_em(bloco_diretorio, slot, &entrada);
+        return 0;
+    }
+
+    // O destino nasce vazio com o tamanho final: um buraco só, ou um fluxo sem pedaços
+    ArquivoAberto origem, destino;
+    memset(&destino, 0, sizeof(ArquivoAberto));
+    int res = carregar_aberto(&origem, bloco_diretorio, slot);
+    if (res == 0) {
+        destino.bloco_diretorio = bloco_diretorio;
+        destino.slot = slot;
+        destino.entrada = origem.entrada;
+        destino.entrada.atributos ^= ATRIBUTO_COMPRIMIDO;
+        destino.entrada.bloco_inicial = BURACO;
+        destino.entrada.bloco_extensoes = 0;
+        memset(destino.entrada.embutido, 0, TAMANHO_EMBUTIDO);
+        res = carregar_extensoes(&destino.entrada, &destino.extensoes);
+    }
+    if (res == 0) res = copiar_conteudo(&origem, &destino);
+
+    // Os blocos antigos esperam a confirmação da entrada nova
+    if (res == 0) {
+        salvar_entrada_em(bloco_diretorio, slot, &destino.entrada);
+        devolver_blocos_arquivo(&origem, 1);
+    } else {
+        devolver_blocos_arquivo(&destino, 0);
+    }
+    liberar_aberto(&origem);
+    liberar_aberto(&destino);
+    return res;
+}
+
+// Uma entrada nova em 'slot' de 'bloco_diretorio' com os mesmos blocos de
+// dados de 'origem' (que ganham mais um dono) e cópias das páginas de
+// extensões e do mapa. Só com trava_operacoes exclusiva e a tabela criada.
+static int clonar_entrada(const EntradaDiretorio *origem, uint64_t bloco_diretorio, int slot, const char *nome,
+                          uint8_t atributos) {
+    EntradaDiretorio nova = *origem;
+    memset(nova.nome_arquivo, 0, TAMANHO_NOME_ARQUIVO);
+    strncpy(nova.nome_arquivo, nome, TAMANHO_NOME_ARQUIVO - 1);
+    nova.atributos = (origem->atributos & ~ATRIBUTO_INSTANTANEO) | atributos;
+
+    if (!entrada_embutida(origem)) {
+        ListaExtensoes lista = {0};
+        int res = carregar_extensoes(origem, &lista);
+        if (res == 0) res = compartilhar_extensoes(&lista);
+        if (res == 0) {
+            // A lista vai para uma cadeia própria (ou só para bloco_inicial)
+            nova.bloco_extensoes = 0;
+            res = salvar_extensoes(&nova, &lista);
+            if (res == 0 && entrada_comprimida(&nova)) {
+                res = copiar_mapa(&nova);
+                if (res != 0) liberar_cadeia_extensoes(nova.bloco_extensoes);
+            }
+            if (res != 0) liberar_extensoes(&lista, 0);
+        }
+        free(lista.itens);
+        if (res != 0) return res;
+    }
+
+    salvar_entrada_em(bloco_diretorio, slot, &nova);
+    if (entrada_comprimida(&nova)) esquecer_pedacos();
+    return 0;
+}
+
+static int clonar_sem_trava(uint64_t diretorio_origem, const char *nome_origem, uint64_t diretorio_destino,
+                            const char *nome_destino) {
+    if (versao_formato_disco < 2) return -ENOTSUP;
+    if (nome_origem[0] == '\0' || nome_reservado(nome_origem) || nome_destino[0] == '\0') return -EINVAL;
+    if (nome_reservado(nome_destino)) return -EEXIST;
+
+    EntradaDiretorio entrada;
+    int slot = procurar_entrada(diretorio_origem, nome_origem, &entrada);
+    if (slot < 0) return slot;
+    if (entrada.tipo == TIPO_DIRETORIO) return -EISDIR;
+    if (diretorio_instantaneo(diretorio_destino)) return -EROFS;
+    if (procurar_entrada(diretorio_destino, nome_destino, NULL) >= 0) return -EEXIST;
+
+    // Um arquivo aberto pode ter pedaço e entrada ainda em memória
+    ArquivoAberto *aberto = arquivo_aberto_em(diretorio_origem, slot);
+    if (aberto) {
+        int res = gravar_aberto(aberto);
+        if (res != 0) return res;
+        entrada = aberto->entrada;
+    }
+
+    int res = criar_referencias();
+    if (res != 0) return res;
+    int slot_destino = buscar_slot_livre_diretorio(diretorio_destino);
+    if (slot_destino < 0) return slot_destino;
+    return clonar_entrada(&entrada, diretorio_destino, slot_destino, nome_destino, 0);
+}
+
+// Copia para 'destino' (vazio) o conteúdo de 'origem', menos os instantâneos,
+// com ATRIBUTO_INSTANTANEO em tudo. O ".." de 'destino' só é marcado no fim,
+// porque até ali criar_sem_trava() precisa aceitar entradas novas nele.
+static int copiar_arvore(uint64_t origem, uint64_t destino) {
+    IndiceDiretorio *indice = obter_indice_diretorio(origem);
+    if (!indice) return -ENOMEM;
+
+    int res = 0;
+    for (uint32_t slot = 0; res == 0 && slot < indice->capacidade; slot++) {
+        if (slot_livre(indice, slot)) continue;
+        EntradaDiretorio entrada = ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO],
+                                                      slot % ENTRADAS_POR_DIRETORIO);
+        if (entrada_pai(&entrada) || (entrada.atributos & ATRIBUTO_INSTANTANEO)) continue;
+
+        if (entrada.tipo != TIPO_DIRETORIO) {
+            int slot_destino = buscar_slot_livre_diretorio(destino);
+            res = slot_destino < 0 ? slot_destino
+                                   : clonar_entrada(&entrada, destino, slot_destino, entrada.nome_arquivo, ATRIBUTO_INSTANTANEO);
+            continue;
+        }
+
+        res = criar_sem_trava(destino, entrada.nome_arquivo, 0, TIPO_DIRETORIO);
+        EntradaDiretorio copia;
+        int slot_copia = res == 0 ? procurar_entrada(destino, entrada.nome_arquivo, &copia) : res;
+        if (slot_copia < 0) {
+            res = slot_copia;
+            break;
+        }
+        res = copiar_arvore(entrada.bloco_inicial, copia.bloco_inicial);
+        copia.atributos |= ATRIBUTO_INSTANTANEO;
+        salvar_entrada_em(destino, slot_copia, &copia);
+    }
+
+    EntradaDiretorio pai = ler_entrada_fisica(destino, 0);
+    pai.atributos |= ATRIBUTO_INSTANTANEO;
+    salvar_entrada_fisica(destino, 0, &pai);
+    return res;
+}
+
+// Remove a entrada em 'slot' de 'bloco_diretorio' e, se for pasta, tudo o que
+// ela contém, tirando antes o ATRIBUTO_INSTANTANEO que impediria a remoção
+static int apagar_arvore(uint64_t bloco_diretorio, int slot) {
+    EntradaDiretorio entrada = ler_entrada_em(bloco_diretorio, slot);
+    entrada.atributos &= ~ATRIBUTO_INSTANTANEO;
+    salvar_entrada_em(bloco_diretorio, slot, &entrada);
+
+    if (entrada.tipo == TIPO_DIRETORIO) {
+        uint64_t filho = entrada.bloco_inicial;
+        EntradaDiretorio pai = ler_entrada_fisica(filho, 0);
+        pai.atributos &= ~ATRIBUTO_INSTANTANEO;
+        salvar_entrada_fisica(filho, 0, &pai);
+
+        IndiceDiretorio *indice = obter_indice_diretorio(filho);
+        if (!indice) return -ENOMEM;
+        for (uint32_t i = 0; i < indice->capacidade; i++) {
+            if (slot_livre(indice, i)) continue;
+            EntradaDiretorio neto = ler_entrada_fisica(indice->blocos[i / ENTRADAS_POR_DIRETORIO], i % ENTRADAS_POR_DIRETORIO);
+            if (entrada_pai(&neto)) continue;
+            int res = apagar_arvore(filho, i);
+            if (res != 0) return res;
+        }
+    }
+    return remover_sem_trava(bloco_diretorio, entrada.nome_arquivo, 1);
+}
+
+// Só com trava_operacoes exclusiva: a árvore inteira fica parada enquanto é copiada
+static int instantaneo_sem_trava(const char *nome) {
+    if (versao_formato_disco < 2) return -ENOTSUP;
+    if (nome[0] == '\0' || strchr(nome, '/')) return -EINVAL;
+    if (strlen(nome) >= TAMANHO_NOME_ARQUIVO) return -ENAMETOOLONG;
+
+    gravar_arquivos_abertos();
+    int res = criar_referencias();
+    if (res == 0) res = criar_sem_trava(bloco_inicio_raiz, nome, 0, TIPO_DIRETORIO);
+    if (res != 0) return res;
+
+    EntradaDiretorio pasta;
+    int slot = procurar_entrada(bloco_inicio_raiz, nome, &pasta);
+    if (slot < 0) return slot;
+    pasta.atributos |= ATRIBUTO_INSTANTANEO;
+    salvar_entrada_em(bloco_inicio_raiz, slot, &pasta);
+
+    res = copiar_arvore(bloco_inicio_raiz, pasta.bloco_inicial);
+    if (res != 0) apagar_arvore(bloco_inicio_raiz, slot);
+    return res;
+}
+
+static int arvore_aberta(uint64_t bloco_diretorio) {
+    if (diretorio_em_uso(bloco_diretorio)) return -EBUSY;
+    IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+    if (!indice) return -ENOMEM;
+    for (uint32_t slot = 0; slot < indice->capacidade; slot++) {
+        if (slot_livre(indice, slot)) continue;
+        EntradaDiretorio entrada = ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO],
+                                                      slot % ENTRADAS_POR_DIRETORIO);
+        if (entrada_pai(&entrada)) continue;
+        if (arquivo_aberto_em(bloco_diretorio, slot)) return -EBUSY;
+        if (entrada.tipo == TIPO_DIRETORIO) {
+            int res = arvore_aberta(entrada.bloco_inicial);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
+}
+
+static int remover_instantaneo_sem_trava(const char *nome) {
+    if (nome[0] == '\0' || nome_reservado(nome) || strchr(nome, '/')) return -EINVAL;
+
+    EntradaDiretorio pasta;
+    int slot = procurar_entrada(bloco_inicio_raiz, nome, &pasta);
+    if (slot < 0) return slot;
+    if (pasta.tipo != TIPO_DIRETORIO || !(pasta.atributos & ATRIBUTO_INSTANTANEO)) return -EINVAL;
+
+    int res = arvore_aberta(pasta.bloco_inicial);
+    return res != 0 ? res : apagar_arvore(bloco_inicio_raiz, slot);
+}
+
+// Chamadas por nome usam o estado do arquivo aberto, se houver; senão
+// carregam entrada e extensões só para esta chamada. A escrita grava a entrada
+// na hora, como antes dos descritores.
+static int acessar_por_nome(uint64_t bloco_diretorio, int slot, uint64_t deslocamento, uint8_t *buffer, uint32_t tamanho, int escrita) {
+    ArquivoAberto temporario;
+    ArquivoAberto *arquivo = arquivo_aberto_em(bloco_diretorio, slot);
+    int res = 0;
+    if (!arquivo) {
+        arquivo = &temporario;
+        res = carregar_aberto(arquivo, bloco_diretorio, slot);
+    }
+
+    if (res == 0) res = transferir_aberto(arquivo, deslocamento, buffer, tamanho, escrita);
+    if (escrita) {
+        int gravado = gravar_aberto(arquivo);
+        if (res == 0) res = gravado;
+    }
+
+    if (arquivo == &temporario) liberar_aberto(&temporario);
+    return res;
+}
+
+// --- Entradas das Operações ---
+// Cada uma resolve o caminho e depois adquire as travas na ordem descrita em
+// "Concorrência"
+
+int criar_arquivo(const char *caminho, uint64_t tamanho_solicitado, uint8_t tipo) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco_diretorio;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, &bloco_diretorio, nome);
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_wrlock(trava);
+        res = criar_sem_trava(bloco_diretorio, nome, tamanho_solicitado, tipo);
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_CRIAR, &medicao, res, 0);
+}
+
+// Importação em lote: todas as entradas vão para o diretório atual sob uma
+// única trava, e o espaço de cada arquivo sai de uma só passada pelo bitmap,
+// com um cursor que coloca os arquivos um depois do outro no disco
+int criar_arquivos_em_lote(const char *const *nomes, const uint64_t *tamanhos, uint32_t quantidade, int *resultados) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco_diretorio = bloco_diretorio_atual;
+    pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+    pthread_rwlock_wrlock(trava);
+
+    uint64_t posicao = bloco_inicio_dados;
+    uint32_t criados = 0;
+    int somente_leitura = diretorio_instantaneo(bloco_diretorio);
+    for (uint32_t i = 0; i < quantidade; i++) {
+        int res = 0;
+        int slot = -1;
+        if (somente_leitura) res = -EROFS;
+        else if (nomes[i][0] == '\0' || strchr(nomes[i], '/')) res = -EINVAL;
+        else if (strlen(nomes[i]) >= TAMANHO_NOME_ARQUIVO) res = -ENAMETOOLONG;
+        else if (tamanhos[i] > tamanho_maximo_arquivo()) res = -EFBIG;
+        else if (nome_reservado(nomes[i]) || procurar_entrada(bloco_diretorio, nomes[i], NULL) >= 0) res = -EEXIST;
+        else slot = buscar_slot_livre_diretorio(bloco_diretorio);
+        if (res == 0 && slot < 0) res = slot;
+
+        EntradaDiretorio nova_entrada = {0};
+        ListaExtensoes lista = {0};
+        if (res == 0) {
+            strncpy(nova_entrada.nome_arquivo, nomes[i], TAMANHO_NOME_ARQUIVO - 1);
+            nova_entrada.tamanho_bytes = tamanhos[i];
+            nova_entrada.status        = STATUS_USADO;
+            nova_entrada.tipo          = TIPO_ARQUIVO;
+            if (pode_embutir(TIPO_ARQUIVO, tamanhos[i])) nova_entrada.atributos = ATRIBUTO_EMBUTIDO;
+
+            uint64_t blocos_necessarios = blocos_do_arquivo(&nova_entrada);
+            travar_mapa();
+            if (blocos_necessarios > total_blocos_livres) res = -ENOSPC;
+            else res = alocar_a_partir(&lista, blocos_necessarios, &posicao);
+            destravar_mapa();
+            if (res == 0) res = salvar_extensoes(&nova_entrada, &lista);
+            if (res != 0) liberar_extensoes(&lista, 0);
+        }
+        free(lista.itens);
+
+        if (res == 0) {
+            salvar_entrada_em(bloco_diretorio, slot, &nova_entrada);
+            criados++;
+        }
+        if (resultados) resultados[i] = res;
+    }
+
+    pthread_rwlock_unlock(trava);
+    sair_operacao();
+
+    if (criados > 0) concluir_operacao();
+    return estatisticas_registrar(OP_CRIAR_LOTE, &medicao, criados, 0);
+}
+
+int remover_arquivo(const char *caminho) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    int res;
+    for (int exclusiva = 0; exclusiva <= 1; exclusiva++) {
+        entrar_operacao(exclusiva);
+        uint64_t bloco_diretorio;
+        char nome[TAMANHO_NOME_ARQUIVO];
+        res = resolver_caminho(caminho, &bloco_diretorio, nome);
+        if (res == 0) {
+            pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+            pthread_rwlock_wrlock(trava);
+            res = remover_sem_trava(bloco_diretorio, nome, exclusiva);
+            pthread_rwlock_unlock(trava);
+        }
+        sair_operacao();
+        if (res != -EAGAIN) break;
+    }
+
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_REMOVER, &medicao, res, 0);
+}
+
+int mudar_diretorio(const char *caminho) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco;
+    int res = resolver_diretorio(caminho, &bloco);
+    if (res == 0) trocar_diretorio_atual(bloco);
+    sair_operacao();
+    return estatisticas_registrar(OP_MUDAR_DIRETORIO, &medicao, res, 0);
+}
+
+uint64_t obter_diretorio_atual() {
+    entrar_operacao(0);
+    uint64_t bloco = bloco_diretorio_atual;
+    sair_operacao();
+    return bloco;
+}
+
+void usar_diretorio(uint64_t bloco_diretorio) {
+    entrar_operacao(0);
+    trocar_diretorio_atual(bloco_diretorio);
+    sair_operacao();
+}
+
+int buscar_entrada_diretorio(const char *caminho, EntradaDiretorio *entrada) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco_diretorio;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, &bloco_diretorio, nome);
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_rdlock(trava);
+        res = procurar_entrada(bloco_diretorio, nome, entrada);
+        if (res >= 0 && entrada) entrada_atualizada(bloco_diretorio, res, entrada);
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+    return estatisticas_registrar(OP_BUSCAR_ENTRADA, &medicao, res, 0);
+}
+
+// Entrega as entradas em uso na ordem dos slots, sem montar a lista toda em
+// memória; os slots livres são pulados pelo mapa do índice
+int listar_diretorio(const char *caminho, int (*visitar)(const EntradaDiretorio *entrada, void *contexto), void *contexto) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco_diretorio;
+    int res = resolver_diretorio(caminho, &bloco_diretorio);
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_rdlock(trava);
+        IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+        if (!indice) res = -ENOMEM;
+
+        for (uint32_t slot = 0; res == 0 && indice && slot < indice->capacidade; slot++) {
+            if (slot % 64 == 0 && indice->slots_livres[slot / 64] == ~0ULL) {
+                slot += 63;
+                continue;
+            }
+            if (slot_livre(indice, slot)) continue;
+
+            EntradaDiretorio entrada = ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO],
+                                                          slot % ENTRADAS_POR_DIRETORIO);
+            if (entrada_pai(&entrada)) continue;
+            entrada_atualizada(bloco_diretorio, slot, &entrada);
+            res = visitar(&entrada, contexto);
+        }
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+    return estatisticas_registrar(OP_LISTAR, &medicao, res, 0);
+}
+
+// Leitura e escrita travam o diretório só para leitura: arquivos diferentes do
+// mesmo diretório andam em paralelo, e o mesmo arquivo tem leitores concorrentes
+static int acessar_arquivo(const char *caminho, uint64_t deslocamento, void *buffer, uint32_t tamanho, int escrita) {
+    entrar_operacao(0);
+    uint64_t bloco_diretorio;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, &bloco_diretorio, nome);
+    if (res == 0 && caminho_de_diretorio(caminho, nome)) res = -EISDIR;
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_rdlock(trava);
+
+        EntradaDiretorio entrada;
+        res = procurar_entrada(bloco_diretorio, nome, &entrada);
+        if (res >= 0 && entrada.tipo == TIPO_DIRETORIO) res = -EISDIR;
+        if (res >= 0) {
+            int slot = res;
+            pthread_rwlock_t *trava_arquivo = trava_do_arquivo(bloco_diretorio, slot);
+            if (escrita) pthread_rwlock_wrlock(trava_arquivo);
+            else pthread_rwlock_rdlock(trava_arquivo);
+            res = acessar_por_nome(bloco_diretorio, slot, deslocamento, buffer, tamanho, escrita);
+            pthread_rwlock_unlock(trava_arquivo);
+        }
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+    return res;
+}
+
+int ler_arquivo(const char *caminho, uint64_t deslocamento_inicial, uint32_t tamanho_leitura, void *buffer_saida) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    int res = acessar_arquivo(caminho, deslocamento_inicial, buffer_saida, tamanho_leitura, 0);
+    return estatisticas_registrar(OP_LER, &medicao, res, res == 0 ? tamanho_leitura : 0);
+}
+
+int escrever_arquivo(const char *caminho, uint64_t deslocamento_inicial, const void *buffer_entrada, uint32_t tamanho_escrita) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    int res = acessar_arquivo(caminho, deslocamento_inicial, (void *)buffer_entrada, tamanho_escrita, 1);
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_ESCREVER, &medicao, res, res == 0 ? tamanho_escrita : 0);
+}
+
+int comprimir_arquivo(const char *caminho, int ativo) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    uint64_t bloco_diretorio;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, &bloco_diretorio, nome);
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_wrlock(trava);
+        res = comprimir_sem_trava(bloco_diretorio, nome, ativo);
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_COMPRIMIR, &medicao, res, 0);
+}
+
+// Com trava_operacoes exclusiva os dois diretórios não precisam de trava própria
+int clonar_arquivo(const char *origem, const char *destino) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    uint64_t diretorio_origem, diretorio_destino;
+    char nome_origem[TAMANHO_NOME_ARQUIVO], nome_destino[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(origem, &diretorio_origem, nome_origem);
+    if (res == 0) res = resolver_caminho(destino, &diretorio_destino, nome_destino);
+    if (res == 0) res = clonar_sem_trava(diretorio_origem, nome_origem, diretorio_destino, nome_destino);
+    sair_operacao();
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_CLONAR, &medicao, res, 0);
+}
+
+int criar_instantaneo(const char *nome) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = instantaneo_sem_trava(nome);
+    sair_operacao();
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_CRIAR_INSTANTANEO, &medicao, res, 0);
+}
+
+int remover_instantaneo(const char *nome) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = remover_instantaneo_sem_trava(nome);
+    sair_operacao();
+    if (res == 0) concluir_operacao();
+    return estatisticas_registrar(OP_REMOVER_INSTANTANEO, &medicao, res, 0);
+}
+
+// --- Descritores ---
+// Threads que usam o mesmo descritor dividem a posição dele (as leituras se
+// revezam na trava do descritor); para posições independentes, cada thread
+// abre o seu, mesmo para o mesmo arquivo.
+
+// Com a trava do arquivo para escrita
+static int registrar_descritor(uint64_t bloco_diretorio, int slot) {
+    pthread_mutex_lock(&trava_descritores);
+    int livre = 0;
+    while (livre < MAXIMO_DESCRITORES && descritores[livre].arquivo) livre++;
+    if (livre == MAXIMO_DESCRITORES) {
+        pthread_mutex_unlock(&trava_descritores);
+        return -EMFILE;
+    }
+
+    ArquivoAberto *arquivo = procurar_aberto(bloco_diretorio, slot);
+    if (!arquivo) {
+        arquivo = malloc(sizeof(ArquivoAberto));
+        int res = arquivo ? carregar_aberto(arquivo, bloco_diretorio, slot) : -ENOMEM;
+        if (res != 0) {
+            if (arquivo) liberar_aberto(arquivo);
+            free(arquivo);
+            pthread_mutex_unlock(&trava_descritores);
+            return res;
+        }
+    }
+
+    arquivo->referencias++;
+    descritores[livre].arquivo = arquivo;
+    descritores[livre].posicao = 0;
+    descritores[livre].fim_ultima_leitura = 0;
+    descritores[livre].leituras_sequenciais = 0;
+    descritores[livre].antecipacao = NULL;
+    pthread_mutex_unlock(&trava_descritores);
+    return livre;
+}
+
+int abrir_arquivo(const char *caminho) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(0);
+    uint64_t bloco_diretorio;
+    char nome[TAMANHO_NOME_ARQUIVO];
+    int res = resolver_caminho(caminho, &bloco_diretorio, nome);
+    if (res == 0 && caminho_de_diretorio(caminho, nome)) res = -EISDIR;
+    if (res == 0) {
+        pthread_rwlock_t *trava = trava_do_diretorio(bloco_diretorio);
+        pthread_rwlock_rdlock(trava);
+
+        EntradaDiretorio entrada;
+        res = procurar_entrada(bloco_diretorio, nome, &entrada);
+        if (res >= 0 && entrada.tipo == TIPO_DIRETORIO) res = -EISDIR;
+        if (res >= 0) {
+            pthread_rwlock_t *trava_arquivo = trava_do_arquivo(bloco_diretorio, res);
+            pthread_rwlock_wrlock(trava_arquivo);
+            res = registrar_descritor(bloco_diretorio, res);
+            pthread_rwlock_unlock(trava_arquivo);
+        }
+        pthread_rwlock_unlock(trava);
+    }
+    sair_operacao();
+    return estatisticas_registrar(OP_ABRIR, &medicao, res, 0);
+}
+
+// Valida o descritor e adquire as travas do seu diretório e do seu arquivo
+static ArquivoAberto *travar_descritor(int descritor, int escrita) {
+    entrar_operacao(0);
+    ArquivoAberto *arquivo = NULL;
+    if (descritor >= 0 && descritor < MAXIMO_DESCRITORES) {
+        pthread_mutex_lock(&trava_descritores);
+        arquivo = descritores[descritor].arquivo;
+        pthread_mutex_unlock(&trava_descritores);
+    }
+    if (!arquivo) {
+        sair_operacao();
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(trava_do_diretorio(arquivo->bloco_diretorio));
+    pthread_rwlock_t *trava_arquivo = trava_do_arquivo(arquivo->bloco_diretorio, arquivo->slot);
+    if (escrita) pthread_rwlock_wrlock(trava_arquivo);
+    else pthread_rwlock_rdlock(trava_arquivo);
+    return arquivo;
+}
+
+static void destravar_descritor(uint64_t bloco_diretorio, int slot) {
+    pthread_rwlock_unlock(trava_do_arquivo(bloco_diretorio, slot));
+    pthread_rwlock_unlock(trava_do_diretorio(bloco_diretorio));
+    sair_operacao();
+}
+
+int fechar_arquivo(int descritor) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    ArquivoAberto *arquivo = travar_descritor(descritor, 1);
+    if (!arquivo) return estatisticas_registrar(OP_FECHAR, &medicao, -EBADF, 0);
+    uint64_t bloco_diretorio = arquivo->bloco_diretorio;
+    int slot = arquivo->slot;
+
+    int res = gravar_aberto(arquivo);
+    pthread_mutex_lock(&trava_descritores);
+    soltar_descritor(descritor);
+    pthread_mutex_unlock(&trava_descritores);
+
+    destravar_descritor(bloco_diretorio, slot);
+    concluir_operacao();
+    return estatisticas_registrar(OP_FECHAR, &medicao, res, 0);
+}
+
+int ler_descritor(int descritor, void *buffer, uint32_t tamanho) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    ArquivoAberto *arquivo = travar_descritor(descritor, 0);
+    if (!arquivo) return estatisticas_registrar(OP_LER_DESCRITOR, &medicao, -EBADF, 0);
+
+    Descritor *proprio = &descritores[descritor];
+    pthread_mutex_lock(&proprio->trava);
+    uint64_t posicao = proprio->posicao;
+    uint64_t disponivel = posicao < arquivo->entrada.tamanho_bytes ? arquivo->entrada.tamanho_bytes - posicao : 0;
+    if (tamanho > disponivel) tamanho = disponivel;
+    if (tamanho > INT32_MAX) tamanho = INT32_MAX;
+
+    int res = tamanho ? ler_antecipando(proprio, arquivo, posicao, buffer, tamanho) : 0;
+    if (res == 0) {
+        proprio->posicao += tamanho;
+        res = tamanho;
+    }
+    pthread_mutex_unlock(&proprio->trava);
+
+    destravar_descritor(arquivo->bloco_diretorio, arquivo->slot);
+    return estatisticas_registrar(OP_LER_DESCRITOR, &medicao, res, res > 0 ? res : 0);
+}
+
+int escrever_descritor(int descritor, const void *buffer, uint32_t tamanho) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    ArquivoAberto *arquivo = travar_descritor(descritor, 1);
+    if (!arquivo) return estatisticas_registrar(OP_ESCREVER_DESCRITOR, &medicao, -EBADF, 0);
+    if (tamanho > INT32_MAX) tamanho = INT32_MAX;
+
+    uint64_t posicao = descritores[descritor].posicao;
+    int res = transferir_aberto(arquivo, posicao, (uint8_t *)buffer, tamanho, 1);
+    if (res == 0) {
+        descritores[descritor].posicao += tamanho;
+        res = tamanho;
+    }
+
+    destravar_descritor(arquivo->bloco_diretorio, arquivo->slot);
+    if (res > 0) concluir_operacao();
+    return estatisticas_registrar(OP_ESCREVER_DESCRITOR, &medicao, res, res > 0 ? res : 0);
+}
+
+// origem: SEEK_SET, SEEK_CUR ou SEEK_END; devolve a nova posição
+int64_t posicionar_descritor(int descritor, int64_t deslocamento, int origem) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    ArquivoAberto *arquivo = travar_descritor(descritor, 0);
+    if (!arquivo) return estatisticas_registrar(OP_POSICIONAR, &medicao, -EBADF, 0);
+
+    pthread_mutex_lock(&descritores[descritor].trava);
+    int64_t base = 0;
+    if (origem == SEEK_CUR) base = descritores[descritor].posicao;
+    else if (origem == SEEK_END) base = arquivo->entrada.tamanho_bytes;
+
+    int64_t res = -EINVAL;
+    if ((origem == SEEK_SET || origem == SEEK_CUR || origem == SEEK_END) && base + deslocamento >= 0) {
+        descritores[descritor].posicao = base + deslocamento;
+        res = base + deslocamento;
+    }
+    pthread_mutex_unlock(&descritores[descritor].trava);
+
+    destravar_descritor(arquivo->bloco_diretorio, arquivo->slot);
+    return estatisticas_registrar(OP_POSICIONAR, &medicao, res, 0);
+}
+
+// Grava a entrada do arquivo e confirma tudo que está pendente, como um fsync
+int sincronizar_descritor(int descritor) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    ArquivoAberto *arquivo = travar_descritor(descritor, 1);
+    if (!arquivo) return estatisticas_registrar(OP_SINCRONIZAR_DESCRITOR, &medicao, -EBADF, 0);
+    int res = gravar_aberto(arquivo);
+    destravar_descritor(arquivo->bloco_diretorio, arquivo->slot);
+
+    if (res == 0) res = sincronizar_disco();
+    return estatisticas_registrar(OP_SINCRONIZAR_DESCRITOR, &medicao, res, 0);
+}
+
+// --- Árvore de Diretórios ---
+
+// Chama visitar() para cada entrada (menos "..") de todos os diretórios, a
+// partir da raiz; um retorno diferente de 0 interrompe o percurso. Só com
+// trava_operacoes exclusiva.
+static int percorrer_arvore(int (*visitar)(uint64_t bloco_diretorio, int slot, EntradaDiretorio *entrada, void *contexto),
+                            void *contexto) {
+    uint32_t capacidade = 16, total = 0;
+    uint64_t *pendentes = malloc(capacidade * sizeof(uint64_t));
+    if (!pendentes) return -ENOMEM;
+    pendentes[total++] = bloco_inicio_raiz;
+
+    int res = 0;
+    while (res == 0 && total > 0) {
+        uint64_t bloco_diretorio = pendentes[--total];
+        IndiceDiretorio *indice = obter_indice_diretorio(bloco_diretorio);
+        if (!indice) res = -ENOMEM;
+
+        for (uint32_t slot = 0; res == 0 && slot < indice->capacidade; slot++) {
+            if (slot_livre(indice, slot)) continue;
+            EntradaDiretorio entrada = ler_entrada_fisica(indice->blocos[slot / ENTRADAS_POR_DIRETORIO],
+                                                          slot % ENTRADAS_POR_DIRETORIO);
+            if (entrada_pai(&entrada)) continue;
+
+            res = visitar(bloco_diretorio, slot, &entrada, contexto);
+            if (res != 0 || entrada.tipo != TIPO_DIRETORIO) continue;
+
+            if (total == capacidade) {
+                uint64_t *maior = realloc(pendentes, capacidade * 2 * sizeof(uint64_t));
+                if (!maior) { res = -ENOMEM; break; }
+                pendentes = maior;
+                capacidade *= 2;
+            }
+            pendentes[total++] = entrada.bloco_inicial;
+        }
+    }
+    free(pendentes);
+    return res;
+}
+
+// --- Desfragmentação ---
+// Cada passada junta numa extensão só os arquivos espalhados e leva os já
+// contíguos para o primeiro vão livre antes deles, em ordem de posição no
+// disco: o espaço livre vai se acumulando no fim. Os dados são copiados em
+// pedaços grandes para blocos livres e só então a entrada passa a apontar
+// para eles. Os blocos antigos só voltam ao bitmap depois da confirmação que
+// grava a entrada nova, então uma queda deixa cada arquivo inteiro num lugar
+// ou no outro.
+//
+// Roda com a trava de operações exclusiva, mas só até gastar o orçamento de
+// blocos copiados ou de tempo; a chamada seguinte continua do estado em que o
+// disco ficou. Pastas e páginas de extensões não se movem.
+
+#define PEDACO_DESFRAGMENTACAO (256 * TAMANHO_BLOCO)
+#define MOVIMENTOS_POR_CONFIRMACAO 64
+
+typedef struct {
+    uint64_t bloco_diretorio;
+    int slot;
+    uint64_t inicio;
+    uint64_t blocos;
+} CandidatoDesfragmentacao;
+
+typedef struct {
+    CandidatoDesfragmentacao *itens;
+    uint32_t total;
+    uint32_t capacidade;
+} ListaCandidatos;
+
+static uint64_t agora_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static int contar_arquivo(uint64_t bloco_diretorio, int slot, EntradaDiretorio *entrada, void *contexto) {
+    (void)bloco_diretorio;
+    (void)slot;
+    Fragmentacao *medida = contexto;
+    if (entrada->tipo == TIPO_ARQUIVO && entrada_embutida(entrada)) medida->arquivos_embutidos++;
+    if (entrada->tipo != TIPO_ARQUIVO || blocos_do_arquivo(entrada) == 0) return 0;
+
+    uint32_t extensoes = entrada->bloco_inicial != BURACO;
+    uint32_t buracos = !extensoes;
+    if (entrada->bloco_extensoes != 0) {
+        ListaExtensoes lista = {0};
+        int res = carregar_extensoes(entrada, &lista);
+        extensoes = buracos = 0;
+        for (uint32_t i = 0; i < lista.total; i++) {
+            if (lista.itens[i].inicio == BURACO) buracos++;
+            else extensoes++;
+        }
+        free(lista.itens);
+        if (res != 0) return res;
+    }
+
+    if (bloco_inicio_referencias) {
+        ListaExtensoes lista = {0};
+        int res = carregar_extensoes(entrada, &lista);
+        if (res == 0 && extensoes_compartilhadas(&lista)) medida->arquivos_compartilhados++;
+        free(lista.itens);
+        if (res != 0) return res;
+    }
+
+    medida->arquivos++;
+    medida->extensoes += extensoes;
+    if (extensoes > 1) medida->arquivos_fragmentados++;
+    if (buracos > 0) medida->arquivos_esparsos++;
+    if (entrada_comprimida(entrada)) medida->arquivos_comprimidos++;
+    return 0;
+}
+
+static int medir_sem_trava(Fragmentacao *medida) {
+    memset(medida, 0, sizeof(Fragmentacao));
+    medida->blocos_livres = total_blocos_livres;
+
+    uint64_t inicio, tamanho;
+    for (uint64_t bloco = bloco_inicio_dados; bloco < total_blocos_disco; bloco = inicio + tamanho) {
+        tamanho = proxima_sequencia_livre(bloco, total_blocos_disco, &inicio);
+        if (tamanho == 0) break;
+        medida->trechos_livres++;
+        if (tamanho > medida->maior_trecho_livre) medida->maior_trecho_livre = tamanho;
+    }
+
+    return percorrer_arvore(contar_arquivo, medida);
+}
+
+int medir_fragmentacao(Fragmentacao *medida) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = medir_sem_trava(medida);
+    sair_operacao();
+    return estatisticas_registrar(OP_MEDIR_FRAGMENTACAO, &medicao, res, 0);
+}
+
+static int coletar_candidato(uint64_t bloco_diretorio, int slot, EntradaDiretorio *entrada, void *contexto) {
+    ListaCandidatos *candidatos = contexto;
+    if (entrada->tipo != TIPO_ARQUIVO || blocos_do_arquivo(entrada) == 0) return 0;
+    if (entrada->bloco_extensoes == 0 && entrada->bloco_inicial == BURACO) return 0;
+
+    if (candidatos->total == candidatos->capacidade) {
+        uint32_t nova_capacidade = candidatos->capacidade ? candidatos->capacidade * 2 : 64;
+        CandidatoDesfragmentacao *novos = realloc(candidatos->itens, nova_capacidade * sizeof(CandidatoDesfragmentacao));
+        if (!novos) return -ENOMEM;
+        candidatos->itens = novos;
+        candidatos->capacidade = nova_capacidade;
+    }
+
+    CandidatoDesfragmentacao *candidato = &candidatos->itens[candidatos->total++];
+    candidato->bloco_diretorio = bloco_diretorio;
+    candidato->slot = slot;
+    candidato->inicio = entrada->bloco_inicial;
+    candidato->blocos = blocos_do_arquivo(entrada);
+    return 0;
+}
+
+static int comparar_candidatos(const void *a, const void *b) {
+    uint64_t inicio_a = ((const CandidatoDesfragmentacao *)a)->inicio;
+    uint64_t inicio_b = ((const CandidatoDesfragmentacao *)b)->inicio;
+    return (inicio_a > inicio_b) - (inicio_a < inicio_b);
+}
+
+// Páginas da cadeia de extensões também esperam a confirmação para sair
+static int adiar_cadeia(ListaExtensoes *liberar, uint64_t bloco) {
+    while (bloco != 0) {
+        int res = adicionar_extensao(liberar, bloco, 1);
+        if (res != 0) return res;
+        if (cache_ler(bloco, offsetof(BlocoExtensoes, proximo_bloco), &bloco, sizeof(uint64_t)) != 0) return -EIO;
+    }
+    return 0;
+}
+
+// Copia o arquivo para uma sequência contígua, se houver uma que o junte numa
+// extensão ou o traga para antes de onde está. Devolve 1 se moveu, 0 se não.
+static int mover_arquivo(ArquivoAberto *arquivo, ListaExtensoes *liberar, uint8_t *buffer, uint64_t *copiados) {
+    EntradaDiretorio *entrada = &arquivo->entrada;
+    ListaExtensoes *antiga = &arquivo->extensoes;
+    uint64_t blocos = blocos_do_arquivo(entrada);
+    if (blocos == 0 || antiga->total == 0) return 0;
+
+    // Arquivos esparsos ficam onde estão: a cópia contígua preencheria os buracos
+    for (uint32_t i = 0; i < antiga->total; i++) {
+        if (antiga->itens[i].inicio == BURACO) return 0;
+    }
+    // E os que dividem blocos com clones também: a cópia desfaria a divisão
+    if (extensoes_compartilhadas(antiga)) return 0;
+
+    travar_mapa();
+    int64_t destino = buscar_sem_trava(blocos);
+    int vale_a_pena = destino >= 0 && (antiga->total > 1 || (uint64_t)destino < antiga->itens[0].inicio);
+    if (vale_a_pena) marcar_blocos(destino, blocos, STATUS_USADO);
+    destravar_mapa();
+    if (!vale_a_pena) return 0;
+
+    ListaExtensoes nova = {0};
+    int res = adicionar_extensao(&nova, destino, blocos);
+    for (uint64_t feito = 0; res == 0 && feito < blocos * TAMANHO_BLOCO; feito += PEDACO_DESFRAGMENTACAO) {
+        uint64_t pedaco = blocos * TAMANHO_BLOCO - feito;
+        if (pedaco > PEDACO_DESFRAGMENTACAO) pedaco = PEDACO_DESFRAGMENTACAO;
+        res = transferir_dados(antiga, feito, buffer, pedaco, 0);
+        if (res == 0) res = transferir_dados(&nova, feito, buffer, pedaco, 1);
+    }
+
+    // Em caso de erro a lista de liberação volta a ser o que era
+    uint32_t total_anterior = liberar->total;
+    uint64_t quantidade_ultima_anterior = liberar->total ? liberar->itens[liberar->total - 1].quantidade : 0;
+    if (res == 0) res = adiar_cadeia(liberar, entrada->bloco_extensoes);
+    for (uint32_t i = 0; res == 0 && i < antiga->total; i++)
+        res = adicionar_extensao(liberar, antiga->itens[i].inicio, antiga->itens[i].quantidade);
+    if (res != 0) {
+        if (total_anterior > 0) liberar->itens[total_anterior - 1].quantidade = quantidade_ultima_anterior;
+        liberar->total = total_anterior;
+        marcar_blocos(destino, blocos, STATUS_LIVRE);
+        free(nova.itens);
+        return res;
+    }
+
+    // Uma extensão só: salvar_extensoes() não tem página nenhuma para alocar
+    entrada->bloco_extensoes = 0;
+    salvar_extensoes(entrada, &nova);
+    free(antiga->itens);
+    *antiga = nova;
+    arquivo->entrada_suja = 1;
+    arquivo->geracao++;
+    gravar_aberto(arquivo);
+
+    *copiados += blocos;
+    estatisticas_evento(EVENTO_ARQUIVO_MOVIDO, 1);
+    return 1;
+}
+
+// Confirma as entradas novas e só então devolve os blocos antigos ao bitmap
+static int liberar_apos_confirmar(ListaExtensoes *liberar) {
+    if (liberar->total == 0) return 0;
+    int res = confirmar_pendentes();
+    if (res == 0) liberar_extensoes(liberar, 0);
+    liberar->total = 0;
+    return res;
+}
+
+int desfragmentar_disco(uint64_t limite_blocos, uint32_t limite_ms, uint64_t *blocos_movidos) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    uint64_t inicio = agora_ms();
+    uint64_t copiados = 0;
+    uint8_t *buffer = malloc(PEDACO_DESFRAGMENTACAO);
+    ListaCandidatos candidatos = {0};
+    ListaExtensoes liberar = {0};
+    int res = buffer ? 0 : -ENOMEM;
+    int esgotado = 0, movidos_na_passada = 1;
+
+    while (res == 0 && !esgotado && movidos_na_passada > 0) {
+        movidos_na_passada = 0;
+        candidatos.total = 0;
+        res = percorrer_arvore(coletar_candidato, &candidatos);
+        if (res == 0) qsort(candidatos.itens, candidatos.total, sizeof(CandidatoDesfragmentacao), comparar_candidatos);
+
+        uint32_t sem_confirmar = 0;
+        for (uint32_t i = 0; res == 0 && i < candidatos.total; i++) {
+            CandidatoDesfragmentacao *candidato = &candidatos.itens[i];
+            if (copiados > 0 && ((limite_blocos && copiados + candidato->blocos > limite_blocos) ||
+                                 (limite_ms && agora_ms() - inicio >= limite_ms))) {
+                esgotado = 1;
+                break;
+            }
+
+            // Arquivos abertos movem junto o estado em memória dos descritores
+            ArquivoAberto temporario;
+            ArquivoAberto *arquivo = arquivo_aberto_em(candidato->bloco_diretorio, candidato->slot);
+            if (arquivo) res = gravar_aberto(arquivo);
+            else {
+                arquivo = &temporario;
+                res = carregar_aberto(arquivo, candidato->bloco_diretorio, candidato->slot);
+            }
+
+            int movido = (res == 0) ? mover_arquivo(arquivo, &liberar, buffer, &copiados) : res;
+            if (arquivo == &temporario) liberar_aberto(&temporario);
+            if (movido < 0) res = movido;
+            movidos_na_passada += (movido > 0);
+            sem_confirmar += (movido > 0);
+
+            if (res == 0 && (sem_confirmar == MOVIMENTOS_POR_CONFIRMACAO || confirmacao_necessaria())) {
+                res = liberar_apos_confirmar(&liberar);
+                sem_confirmar = 0;
+            }
+        }
+        int res_liberar = liberar_apos_confirmar(&liberar);
+        if (res == 0) res = res_liberar;
+    }
+
+    if (res == 0) res = confirmar_pendentes();
+    free(liberar.itens);
+    free(candidatos.itens);
+    free(buffer);
+    sair_operacao();
+
+    if (blocos_movidos) *blocos_movidos = copiados;
+    return estatisticas_registrar(OP_DESFRAGMENTAR, &medicao, res < 0 ? res : esgotado, copiados * TAMANHO_BLOCO);
+}
+
+// --- Varredura ---
+// Confere as somas de todos os blocos em uso, trecho a trecho. Durante um
+// trecho as operações ficam paradas (trava_operacoes exclusiva), então o que
+// está no disco é o que as somas descrevem; as threads dividem o trecho e
+// cada uma lê sequências de blocos em uso numa chamada só.
+
+#define TRECHO_VARREDURA 8192           // Blocos por trecho (32MB)
+#define LEITURA_VARREDURA 64            // Blocos por leitura (256KB)
+#define MAXIMO_THREADS_VARREDURA 64
+
+typedef struct {
+    uint64_t inicio;                    // Faixa desta thread
+    uint64_t fim;
+    uint64_t inicio_trecho;
+    const uint32_t *somas;              // Do trecho inteiro
+    Varredura parcial;
+    uint64_t *ruins;
+    uint64_t total_ruins;
+    uint64_t capacidade_ruins;
+    int erro;
+} TarefaVarredura;
+
+static int bloco_em_uso(uint64_t bloco) {
+    return (mapa_bits[bloco / 64] >> (bloco % 64)) & 1;
+}
+
+static int anotar_ruim(TarefaVarredura *tarefa, uint64_t bloco) {
+    if (tarefa->total_ruins == tarefa->capacidade_ruins) {
+        uint64_t capacidade = tarefa->capacidade_ruins ? tarefa->capacidade_ruins * 2 : 16;
+        uint64_t *novos = realloc(tarefa->ruins, capacidade * sizeof(uint64_t));
+        if (!novos) return -ENOMEM;
+        tarefa->ruins = novos;
+        tarefa->capacidade_ruins = capacidade;
+    }
+    tarefa->ruins[tarefa->total_ruins++] = bloco;
+    return 0;
+}
+
+static void *varrer_faixa(void *parametro) {
+    TarefaVarredura *tarefa = parametro;
+    uint8_t *buffer = malloc(LEITURA_VARREDURA * TAMANHO_BLOCO);
+    if (!buffer) {
+        tarefa->erro = -ENOMEM;
+        return NULL;
+    }
+
+    uint64_t bloco = tarefa->inicio;
+    while (bloco < tarefa->fim && tarefa->erro == 0) {
+        if (!bloco_em_uso(bloco) || !bloco_com_soma(bloco)) {
+            bloco++;
+            continue;
+        }
+        uint64_t quantidade = 1;
+        while (quantidade < LEITURA_VARREDURA && bloco + quantidade < tarefa->fim &&
+               bloco_em_uso(bloco + quantidade) && bloco_com_soma(bloco + quantidade)) quantidade++;
+
+        tarefa->erro = dispositivo_ler(bloco * TAMANHO_BLOCO, buffer, quantidade * TAMANHO_BLOCO);
+        tarefa->parcial.bytes_lidos += quantidade * TAMANHO_BLOCO;
+        for (uint64_t i = 0; i < quantidade && tarefa->erro == 0; i++) {
+            uint32_t soma = tarefa->somas[bloco + i - tarefa->inicio_trecho];
+            if (soma == SEM_SOMA) {
+                tarefa->parcial.blocos_sem_soma++;
+                continue;
+            }
+            tarefa->parcial.blocos_verificados++;
+            if (!soma_confere(buffer + i * TAMANHO_BLOCO, soma)) {
+                tarefa->parcial.blocos_ruins++;
+                tarefa->erro = anotar_ruim(tarefa, bloco + i);
+            }
+        }
+        bloco += quantidade;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Um trecho, com as operações paradas; os blocos ruins ficam nas tarefas
+static int varrer_trecho(uint64_t inicio, uint64_t fim, uint32_t *somas, TarefaVarredura *tarefas, uint32_t threads) {
+    int res = 0;
+    if (cache_total_sujos() + total_blocos_mapa_sujos > 0) res = confirmar_pendentes();
+    if (res == 0) res = ler_somas(inicio, fim - inicio, somas);
+    if (res != 0) return res;
+
+    pthread_t ids[MAXIMO_THREADS_VARREDURA];
+    int criada[MAXIMO_THREADS_VARREDURA];
+    uint64_t por_thread = (fim - inicio + threads - 1) / threads;
+    for (uint32_t t = 0; t < threads; t++) {
+        TarefaVarredura *tarefa = &tarefas[t];
+        tarefa->inicio = inicio + t * por_thread < fim ? inicio + t * por_thread : fim;
+        tarefa->fim = tarefa->inicio + por_thread < fim ? tarefa->inicio + por_thread : fim;
+        tarefa->inicio_trecho = inicio;
+        tarefa->somas = somas;
+        // Sem thread nova, a faixa é conferida aqui mesmo
+        criada[t] = t > 0 && pthread_create(&ids[t], NULL, varrer_faixa, tarefa) == 0;
+        if (t > 0 && !criada[t]) varrer_faixa(tarefa);
+    }
+    varrer_faixa(&tarefas[0]);
+    for (uint32_t t = 1; t < threads; t++) {
+        if (criada[t]) pthread_join(ids[t], NULL);
+    }
+
+    for (uint32_t t = 0; t < threads && res == 0; t++) res = tarefas[t].erro;
+    return res;
+}
+
+int varrer_disco(uint32_t threads, Varredura *varredura, void (*bloco_ruim)(uint64_t bloco, void *contexto), void *contexto) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    memset(varredura, 0, sizeof(Varredura));
+    if (threads == 0) threads = 1;
+    if (threads > MAXIMO_THREADS_VARREDURA) threads = MAXIMO_THREADS_VARREDURA;
+
+    TarefaVarredura *tarefas = calloc(threads, sizeof(TarefaVarredura));
+    uint32_t *somas = malloc(TRECHO_VARREDURA * sizeof(uint32_t));
+    int res = (tarefas && somas) ? 0 : -ENOMEM;
+
+    for (uint64_t inicio = 0; res == 0; inicio += TRECHO_VARREDURA) {
+        entrar_operacao(1);
+        if (!bloco_inicio_somas) res = -ENOTSUP;
+        if (res != 0 || inicio >= total_blocos_disco) {
+            sair_operacao();
+            break;
+        }
+        uint64_t fim = inicio + TRECHO_VARREDURA < total_blocos_disco ? inicio + TRECHO_VARREDURA : total_blocos_disco;
+        res = varrer_trecho(inicio, fim, somas, tarefas, threads);
+        sair_operacao();
+
+        for (uint32_t t = 0; t < threads; t++) {
+            TarefaVarredura *tarefa = &tarefas[t];
+            varredura->blocos_verificados += tarefa->parcial.blocos_verificados;
+            varredura->blocos_sem_soma += tarefa->parcial.blocos_sem_soma;
+            varredura->blocos_ruins += tarefa->parcial.blocos_ruins;
+            varredura->bytes_lidos += tarefa->parcial.bytes_lidos;
+            for (uint64_t i = 0; bloco_ruim && i < tarefa->total_ruins; i++) bloco_ruim(tarefa->ruins[i], contexto);
+            memset(&tarefa->parcial, 0, sizeof(Varredura));
+            tarefa->total_ruins = 0;
+        }
+    }
+
+    for (uint32_t t = 0; tarefas && t < threads; t++) free(tarefas[t].ruins);
+    free(tarefas);
+    free(somas);
+    if (res == 0) res = varredura->blocos_ruins > INT32_MAX ? INT32_MAX : (int)varredura->blocos_ruins;
+    return estatisticas_registrar(OP_VARRER, &medicao, res, varredura->bytes_lidos);
+}
+
+// --- Verificação de Consistência ---
+// Reconstrói o bitmap a partir dos metadados e compara com o atual. A área
+// reservada, os blocos de cada diretório, as páginas das cadeias de extensões
+// e as extensões de cada arquivo são marcados num bitmap "esperado"; um bloco
+// marcado duas vezes tem dois donos. Extensões fora da área de dados, cadeias
+// maiores do que o tamanho justifica (ou em ciclo) e diretórios que não
+// conferem tornam a entrada inválida.
+//
+// São duas etapas, cada uma com várias threads tirando tarefas (um pedaço de
+// um diretório) de uma fila: primeiro só os diretórios, que assim têm
+// prioridade sobre os arquivos pelos blocos disputados, depois os arquivos.
+// O bitmap esperado é marcado com operações atômicas e a comparação com o
+// atual é dividida entre as threads por blocos do bitmap.
+//
+// Com a tabela de referências, os blocos de dados de arquivos podem ter
+// vários donos: cada um é contado em 'donos', e só o primeiro o marca no
+// esperado. No fim cada contador da tabela tem de ser o número de donos menos 1.
+//
+// O reparo junta primeiro o esperado ao bitmap atual, para que nada em uso
+// seja alocado, então corta cada arquivo inválido na última extensão válida,
+// dá a cada arquivo que dividia blocos uma cópia própria e apaga as entradas
+// de diretórios que não conferem. Depois percorre de novo (os reparos também
+// podem cair em blocos disputados), adota o bitmap esperado e regrava os
+// contadores.
+
+#define BLOCOS_POR_TAREFA 128           // Blocos de diretório por tarefa
+#define MAXIMO_THREADS_CONSISTENCIA 64
+#define MAXIMO_PASSADAS_REPARO 3
+
+enum { PROBLEMA_INVALIDA, PROBLEMA_COMPARTILHADA, PROBLEMA_DIRETORIO, PROBLEMA_RAIZ };
+enum { MAPA_COMPARAR, MAPA_JUNTAR, MAPA_ADOTAR };
+
+typedef struct {
+    uint64_t bloco;
+    uint64_t *blocos;                   // Todos, em ordem lógica
+    uint64_t total_blocos;
+} DiretorioVerificado;
+
+typedef struct {
+    DiretorioVerificado *diretorio;
+    uint64_t primeiro_bloco;            // Lógicos
+    uint64_t fim_blocos;
+} TarefaConsistencia;
+
+typedef struct {
+    uint64_t bloco_diretorio;
+    int slot;
+    int tipo;
+} Problema;
+
+typedef struct {
+    int etapa_arquivos;
+    uint64_t *esperado;
+    uint16_t *donos;                    // Só com a tabela de referências (atômicos)
+    pthread_mutex_t trava;              // Fila, diretórios, problemas e erro
+    pthread_cond_t mudou;
+    TarefaConsistencia *fila;
+    uint64_t total_fila;
+    uint64_t capacidade_fila;
+    uint32_t ocupadas;                  // Threads com uma tarefa em andamento
+    DiretorioVerificado **diretorios;
+    uint64_t total_diretorios;
+    uint64_t capacidade_diretorios;
+    Problema *problemas;
+    uint64_t total_problemas;
+    uint64_t capacidade_problemas;
+    uint64_t arquivos;                  // (atômicos)
+    uint64_t blocos_compartilhados;
+    int erro;
+} Percurso;
+
+typedef struct {
+    const uint64_t *esperado;
+    uint64_t primeira_palavra;
+    uint64_t fim_palavras;
+    int modo;
+    uint64_t perdidos;
+    uint64_t nao_marcados;
+    uint64_t em_uso;
+} TarefaMapa;
+
+static uint32_t threads_padrao() {
+    long processadores = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    processadores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (processadores < 1) return 1;
+    return processadores > MAXIMO_THREADS_CONSISTENCIA ? MAXIMO_THREADS_CONSISTENCIA : (uint32_t)processadores;
+}
+
+// Roda trabalho() em 'threads' threads, a primeira na própria chamadora; a
+// thread t recebe argumentos + t * tamanho (tamanho 0: todas o mesmo)
+static void em_paralelo(void *(*trabalho)(void *), void *argumentos, size_t tamanho, uint32_t threads) {
+    pthread_t ids[MAXIMO_THREADS_CONSISTENCIA];
+    int criada[MAXIMO_THREADS_CONSISTENCIA] = {0};
+    for (uint32_t t = 1; t < threads; t++)
+        criada[t] = pthread_create(&ids[t], NULL, trabalho, (uint8_t *)argumentos + t * tamanho) == 0;
+    trabalho(argumentos);
+    for (uint32_t t = 1; t < threads; t++) {
+        // Sem thread nova, a parte dela é feita aqui mesmo
+        if (criada[t]) pthread_join(ids[t], NULL);
+        else trabalho((uint8_t *)argumentos + t * tamanho);
+    }
+}
+
+// O bloco da raiz fica na área reservada, mas é dela
+static int faixa_valida(uint64_t inicio, uint64_t quantidade) {
+    if (quantidade == 0 || inicio >= total_blocos_disco || quantidade > total_blocos_disco - inicio) return 0;
+    if (inicio == bloco_inicio_raiz) {
+        inicio++;
+        quantidade--;
+        if (quantidade == 0) return 1;
+    }
+    return inicio >= bloco_inicio_dados;
+}
+
+// Marca [inicio, inicio + quantidade) no esperado; devolve quantos já estavam
+static uint64_t reivindicar(uint64_t *esperado, uint64_t inicio, uint64_t quantidade) {
+    uint64_t repetidos = 0;
+    while (quantidade > 0) {
+        int bit = inicio % 64;
+        int neste = 64 - bit;
+        if ((uint64_t)neste > quantidade) neste = quantidade;
+
+        uint64_t mascara = mascara_bits(bit, neste);
+        uint64_t antes = __atomic_fetch_or(&esperado[inicio / 64], mascara, __ATOMIC_RELAXED);
+        repetidos += __builtin_popcountll(antes & mascara);
+
+        inicio += neste;
+        quantidade -= neste;
+    }
+    return repetidos;
+}
+
+static uint64_t reivindicar_lista(uint64_t *esperado, const ListaExtensoes *lista, uint32_t primeira) {
+    uint64_t repetidos = 0;
+    for (uint32_t i = primeira; i < lista->total; i++) {
+        if (lista->itens[i].inicio != BURACO)
+            repetidos += reivindicar(esperado, lista->itens[i].inicio, lista->itens[i].quantidade);
+    }
+    return repetidos;
+}
+
+// Extensões de dados de arquivos: com a tabela de referências um bloco pode
+// ter vários donos, e só o primeiro o reivindica
+static uint64_t reivindicar_dados(Percurso *percurso, const ListaExtensoes *lista) {
+    if (!percurso->donos) return reivindicar_lista(percurso->esperado, lista, 0);
+
+    uint64_t repetidos = 0;
+    for (uint32_t i = 0; i < lista->total; i++) {
+        uint64_t inicio = lista->itens[i].inicio;
+        uint64_t fim = inicio + lista->itens[i].quantidade;
+        if (inicio == BURACO) continue;
+
+        uint64_t primeiros_desde = inicio;
+        for (uint64_t bloco = inicio; bloco <= fim; bloco++) {
+            if (bloco < fim && __atomic_fetch_add(&percurso->donos[bloco], 1, __ATOMIC_RELAXED) == 0) continue;
+            if (bloco > primeiros_desde) repetidos += reivindicar(percurso->esperado, primeiros_desde, bloco - primeiros_desde);
+            primeiros_desde = bloco + 1;
+        }
+    }
+    return repetidos;
+}
+
+// Buracos só em arquivos: diretórios têm todos os blocos
+static int extensao_valida(const EntradaDiretorio *entrada, uint64_t inicio, uint64_t quantidade) {
+    if (inicio == BURACO) return entrada->tipo == TIPO_ARQUIVO && quantidade > 0;
+    return faixa_valida(inicio, quantidade);
+}
+
+// O mapa de pedaços de um arquivo comprimido, com os mesmos cuidados: páginas
+// na área de dados, não mais do que o tamanho justifica, e cada pedaço
+// dentro do fluxo. As páginas lidas vão para 'paginas'.
+static int conferir_mapa(const EntradaDiretorio *entrada, ListaExtensoes *paginas) {
+    const CabecalhoCompressao *cabecalho = cabecalho_compressao((EntradaDiretorio *)entrada);
+    if (cabecalho->blocos_mortos > cabecalho->blocos_fluxo) return 1;
+
+    uint64_t pedacos = (entrada->tamanho_bytes + TAMANHO_PEDACO - 1) / TAMANHO_PEDACO;
+    uint64_t maximo_paginas = (pedacos + PEDACOS_POR_BLOCO - 1) / PEDACOS_POR_BLOCO;
+    uint64_t lidas = 0;
+    BlocoPedacos pagina;
+    for (uint64_t bloco = cabecalho->bloco_mapa; bloco != 0; bloco = pagina.proximo_bloco) {
+        if (++lidas > maximo_paginas || !faixa_valida(bloco, 1)) return 1;
+        if (cache_ler(bloco, 0, &pagina, sizeof(BlocoPedacos)) != 0) return -EIO;
+        int res = adicionar_extensao(paginas, bloco, 1);
+        if (res != 0) return res;
+        if (pagina.total_pedacos > PEDACOS_POR_BLOCO) return 1;
+
+        for (uint32_t i = 0; i < pagina.total_pedacos; i++) {
+            Pedaco pedaco = pagina.pedacos[i];
+            uint32_t bytes = bytes_do_pedaco(pedaco);
+            if (pedaco.bytes == 0) continue;
+            if (bytes == 0 || bytes > TAMANHO_PEDACO ||
+                pedaco.bloco + blocos_do_tamanho(bytes) > cabecalho->blocos_fluxo) return 1;
+        }
+    }
+    return 0;
+}
+
+// Como carregar_extensoes(), mas sem confiar na entrada: extensões e páginas
+// têm de estar na área de dados e a cadeia não pode ter mais páginas do que o
+// tamanho justifica (o que também corta ciclos). Devolve 0 se tudo confere, 1
+// se não (a lista fica com as extensões válidas antes do problema e
+// 'paginas' com as páginas lidas) ou -errno.
+static int conferir_cadeia(const EntradaDiretorio *entrada, ListaExtensoes *lista, ListaExtensoes *paginas) {
+    lista->total = 0;
+    paginas->total = 0;
+    uint64_t blocos = blocos_do_arquivo(entrada);
+    if (entrada_embutida(entrada) && (entrada->tamanho_bytes > TAMANHO_EMBUTIDO || entrada->bloco_extensoes)) return 1;
+
+    if (entrada->bloco_extensoes == 0) {
+        if (blocos == 0) return 0;
+        if (!extensao_valida(entrada, entrada->bloco_inicial, blocos)) return 1;
+        return adicionar_extensao(lista, entrada->bloco_inicial, blocos);
+    }
+
+    uint64_t maximo_paginas = (blocos + EXTENSOES_POR_BLOCO - 1) / EXTENSOES_POR_BLOCO + 1;
+    uint64_t lidas = 0;
+    BlocoExtensoes pagina;
+    for (uint64_t bloco = entrada->bloco_extensoes; bloco != 0; bloco = pagina.proximo_bloco) {
+        if (++lidas > maximo_paginas || !faixa_valida(bloco, 1)) return 1;
+        if (cache_ler(bloco, 0, &pagina, sizeof(BlocoExtensoes)) != 0) return -EIO;
+        int res = adicionar_extensao(paginas, bloco, 1);
+        if (res != 0) return res;
+        if (pagina.total_extensoes > EXTENSOES_POR_BLOCO) return 1;
+
+        for (uint32_t i = 0; i < pagina.total_extensoes; i++) {
+            if (!extensao_valida(entrada, pagina.extensoes[i].inicio, pagina.extensoes[i].quantidade)) return 1;
+            res = adicionar_extensao(lista, pagina.extensoes[i].inicio, pagina.extensoes[i].quantidade);
+            if (res != 0) return res;
+        }
+    }
+
+    uint64_t cobertos = 0;
+    for (uint32_t i = 0; i < lista->total; i++) cobertos += lista->itens[i].quantidade;
+    return cobertos < blocos;
+}
+
+static int conferir_extensoes(const EntradaDiretorio *entrada, ListaExtensoes *lista, ListaExtensoes *paginas) {
+    int res = conferir_cadeia(entrada, lista, paginas);
+    if (res == 0 && entrada_comprimida(entrada)) res = conferir_mapa(entrada, paginas);
+    return res;
+}
+
+static int anotar_problema(Percurso *percurso, uint64_t bloco_diretorio, int slot, int tipo) {
+    int res = 0;
+    pthread_mutex_lock(&percurso->trava);
+    if (percurso->total_problemas == percurso->capacidade_problemas) {
+        uint64_t capacidade = percurso->capacidade_problemas ? percurso->capacidade_problemas * 2 : 16;
+        Problema *novos = realloc(percurso->problemas, capacidade * sizeof(Problema));
+        if (novos) {
+            percurso->problemas = novos;
+            percurso->capacidade_problemas = capacidade;
+        } else {
+            res = -ENOMEM;
+        }
+    }
+    if (res == 0) {
+        Problema *problema = &percurso->problemas[percurso->total_problemas++];
+        problema->bloco_diretorio = bloco_diretorio;
+        problema->slot = slot;
+        problema->tipo = tipo;
+    }
+    pthread_mutex_unlock(&percurso->trava);
+    return res;
+}
+
+// Com percurso->trava
+static int enfileirar_diretorio(Percurso *percurso, DiretorioVerificado *diretorio) {
+    for (uint64_t inicio = 0; inicio < diretorio->total_blocos; inicio += BLOCOS_POR_TAREFA) {
+        if (percurso->total_fila == percurso->capacidade_fila) {
+            uint64_t capacidade = percurso->capacidade_fila ? percurso->capacidade_fila * 2 : 64;
+            TarefaConsistencia *maior = realloc(percurso->fila, capacidade * sizeof(TarefaConsistencia));
+            if (!maior) return -ENOMEM;
+            percurso->fila = maior;
+            percurso->capacidade_fila = capacidade;
+        }
+        TarefaConsistencia *tarefa = &percurso->fila[percurso->total_fila++];
+        tarefa->diretorio = diretorio;
+        tarefa->primeiro_bloco = inicio;
+        tarefa->fim_blocos = inicio + BLOCOS_POR_TAREFA < diretorio->total_blocos ? inicio + BLOCOS_POR_TAREFA
+                                                                                   : diretorio->total_blocos;
+    }
+    pthread_cond_broadcast(&percurso->mudou);
+    return 0;
+}
+
+// Guarda o diretório (já conferido e reivindicado) e põe as tarefas dele na fila
+static int acrescentar_diretorio(Percurso *percurso, uint64_t bloco, const ListaExtensoes *extensoes, uint64_t tamanho) {
+    DiretorioVerificado *diretorio = calloc(1, sizeof(DiretorioVerificado));
+    uint64_t total_blocos = blocos_do_tamanho(tamanho);
+    if (diretorio) diretorio->blocos = malloc(total_blocos * sizeof(uint64_t));
+    if (!diretorio || !diretorio->blocos) {
+        free(diretorio);
+        return -ENOMEM;
+    }
+
+    diretorio->bloco = bloco;
+    for (uint32_t e = 0; e < extensoes->total; e++)
+        for (uint64_t b = 0; b < extensoes->itens[e].quantidade && diretorio->total_blocos < total_blocos; b++)
+            diretorio->blocos[diretorio->total_blocos++] = extensoes->itens[e].inicio + b;
+
+    int res = 0;
+    pthread_mutex_lock(&percurso->trava);
+    if (percurso->total_diretorios == percurso->capacidade_diretorios) {
+        uint64_t capacidade = percurso->capacidade_diretorios ? percurso->capacidade_diretorios * 2 : 64;
+        DiretorioVerificado **maior = realloc(percurso->diretorios, capacidade * sizeof(DiretorioVerificado *));
+        if (maior) {
+            percurso->diretorios = maior;
+            percurso->capacidade_diretorios = capacidade;
+        } else {
+            res = -ENOMEM;
+        }
+    }
+    if (res == 0) {
+        percurso->diretorios[percurso->total_diretorios++] = diretorio;
+        res = enfileirar_diretorio(percurso, diretorio);
+    } else {
+        free(diretorio->blocos);
+        free(diretorio);
+    }
+    pthread_mutex_unlock(&percurso->trava);
+    return res;
+}
+
+static int conferir_subdiretorio(Percurso *percurso, uint64_t bloco_pai, int slot, const EntradaDiretorio *entrada,
+                                 ListaExtensoes *lista, ListaExtensoes *paginas) {
+    uint64_t bloco = entrada->bloco_inicial;
+    if (!faixa_valida(bloco, 1)) return anotar_problema(percurso, bloco_pai, slot, PROBLEMA_DIRETORIO);
+
+    EntradaDiretorio proprio;
+    descrever_diretorio(bloco, &proprio);
+    int res = conferir_extensoes(&proprio, lista, paginas);
+    if (res < 0) return res;
+    if (res > 0 || lista->itens[0].inicio != bloco) return anotar_problema(percurso, bloco_pai, slot, PROBLEMA_DIRETORIO);
+
+    // O primeiro bloco decide o dono: de duas entradas apontando para o mesmo
+    // diretório (ou de um ciclo), só uma fica com ele
+    uint64_t repetidos = reivindicar(percurso->esperado, bloco, 1);
+    if (repetidos == 0) {
+        lista->itens[0].inicio++;
+        lista->itens[0].quantidade--;
+        repetidos = reivindicar_lista(percurso->esperado, lista, 0) + reivindicar_lista(percurso->esperado, paginas, 0);
+        lista->itens[0].inicio--;
+        lista->itens[0].quantidade++;
+    }
+    if (repetidos > 0) {
+        __atomic_fetch_add(&percurso->blocos_compartilhados, repetidos, __ATOMIC_RELAXED);
+        return anotar_problema(percurso, bloco_pai, slot, PROBLEMA_DIRETORIO);
+    }
+    return acrescentar_diretorio(percurso, bloco, lista, proprio.tamanho_bytes);
+}
+
+static int conferir_arquivo(Percurso *percurso, uint64_t bloco_diretorio, int slot, const EntradaDiretorio *entrada,
+                            ListaExtensoes *lista, ListaExtensoes *paginas) {
+    int res = conferir_extensoes(entrada, lista, paginas);
+    if (res < 0) return res;
+
+    uint64_t repetidos = reivindicar_dados(percurso, lista) + reivindicar_lista(percurso->esperado, paginas, 0);
+    __atomic_fetch_add(&percurso->arquivos, 1, __ATOMIC_RELAXED);
+    if (repetidos > 0) __atomic_fetch_add(&percurso->blocos_compartilhados, repetidos, __ATOMIC_RELAXED);
+
+    if (res > 0) return anotar_problema(percurso, bloco_diretorio, slot, PROBLEMA_INVALIDA);
+    if (repetidos > 0) return anotar_problema(percurso, bloco_diretorio, slot, PROBLEMA_COMPARTILHADA);
+    return 0;
+}
+
+// Um pedaço de um diretório: na primeira etapa só as subpastas, na segunda só os arquivos
+static int conferir_tarefa(Percurso *percurso, const TarefaConsistencia *tarefa, uint8_t *bloco,
+                           ListaExtensoes *lista, ListaExtensoes *paginas) {
+    DiretorioVerificado *diretorio = tarefa->diretorio;
+    for (uint64_t b = tarefa->primeiro_bloco; b < tarefa->fim_blocos; b++) {
+        int res = cache_ler(diretorio->blocos[b], 0, bloco, TAMANHO_BLOCO);
+        if (res != 0) return res;
+
+        for (int posicao = 0; posicao < ENTRADAS_POR_DIRETORIO && res == 0; posicao++) {
+            EntradaDiretorio entrada = decodificar_entrada(bloco + posicao * tamanho_entrada());
+            if (entrada.status != STATUS_USADO || entrada_pai(&entrada)) continue;
+
+            int slot = b * ENTRADAS_POR_DIRETORIO + posicao;
+            if (entrada.tipo == TIPO_DIRETORIO) {
+                if (!percurso->etapa_arquivos)
+                    res = conferir_subdiretorio(percurso, diretorio->bloco, slot, &entrada, lista, paginas);
+            } else if (percurso->etapa_arquivos) {
+                res = conferir_arquivo(percurso, diretorio->bloco, slot, &entrada, lista, paginas);
+            }
+        }
+        if (res != 0) return res;
+    }
+    return 0;
+}
+
+// Cada thread tira tarefas da fila até ela esvaziar sem ninguém trabalhando
+// (quem trabalha pode enfileirar diretórios novos)
+static void *percorrer_tarefas(void *parametro) {
+    Percurso *percurso = parametro;
+    uint8_t *bloco = malloc(TAMANHO_BLOCO);
+    ListaExtensoes lista = {0}, paginas = {0};
+
+    pthread_mutex_lock(&percurso->trava);
+    if (!bloco) percurso->erro = -ENOMEM;
+    while (1) {
+        while (percurso->total_fila == 0 && percurso->ocupadas > 0 && percurso->erro == 0)
+            pthread_cond_wait(&percurso->mudou, &percurso->trava);
+        if (percurso->total_fila == 0 || percurso->erro != 0) break;
+
+        TarefaConsistencia tarefa = percurso->fila[--percurso->total_fila];
+        percurso->ocupadas++;
+        pthread_mutex_unlock(&percurso->trava);
+
+        int res = conferir_tarefa(percurso, &tarefa, bloco, &lista, &paginas);
+
+        pthread_mutex_lock(&percurso->trava);
+        if (res != 0 && percurso->erro == 0) percurso->erro = res;
+        percurso->ocupadas--;
+    }
+    pthread_cond_broadcast(&percurso->mudou);
+    pthread_mutex_unlock(&percurso->trava);
+
+    free(bloco);
+    free(lista.itens);
+    free(paginas.itens);
+    return NULL;
+}
+
+static void limpar_percurso(Percurso *percurso) {
+    for (uint64_t i = 0; i < percurso->total_diretorios; i++) {
+        free(percurso->diretorios[i]->blocos);
+        free(percurso->diretorios[i]);
+    }
+    percurso->total_diretorios = 0;
+    percurso->total_fila = 0;
+    percurso->total_problemas = 0;
+    percurso->arquivos = 0;
+    percurso->blocos_compartilhados = 0;
+    percurso->erro = 0;
+}
+
+// Percorre a árvore inteira; o bitmap esperado e os problemas ficam no percurso
+static int percorrer_consistencia(Percurso *percurso, uint32_t threads) {
+    limpar_percurso(percurso);
+    memset(percurso->esperado, 0, palavras_mapa * sizeof(uint64_t));
+    reivindicar(percurso->esperado, 0, bloco_inicio_raiz);
+    reivindicar(percurso->esperado, bloco_inicio_raiz + 1, bloco_inicio_dados - bloco_inicio_raiz - 1);
+    if (percurso->donos) {
+        memset(percurso->donos, 0, total_blocos_disco * sizeof(uint16_t));
+        percurso->blocos_compartilhados += reivindicar(percurso->esperado, bloco_inicio_referencias, blocos_referencias);
+    }
+
+    // Uma raiz que não confere fica com o primeiro bloco só
+    ListaExtensoes lista = {0}, paginas = {0};
+    EntradaDiretorio raiz;
+    descrever_diretorio(bloco_inicio_raiz, &raiz);
+    int res = conferir_extensoes(&raiz, &lista, &paginas);
+    if (res > 0 || (res == 0 && lista.itens[0].inicio != bloco_inicio_raiz)) {
+        lista.total = paginas.total = 0;
+        raiz.tamanho_bytes = TAMANHO_BLOCO;
+        res = adicionar_extensao(&lista, bloco_inicio_raiz, 1);
+        if (res == 0) res = anotar_problema(percurso, bloco_inicio_raiz, 0, PROBLEMA_RAIZ);
+    }
+    if (res == 0) {
+        uint64_t repetidos = reivindicar_lista(percurso->esperado, &lista, 0) +
+                             reivindicar_lista(percurso->esperado, &paginas, 0);
+        percurso->blocos_compartilhados += repetidos;
+        res = acrescentar_diretorio(percurso, bloco_inicio_raiz, &lista, raiz.tamanho_bytes);
+    }
+    free(lista.itens);
+    free(paginas.itens);
+    if (res != 0) return res;
+
+    percurso->etapa_arquivos = 0;
+    em_paralelo(percorrer_tarefas, percurso, 0, threads);
+    if (percurso->erro != 0) return percurso->erro;
+
+    percurso->etapa_arquivos = 1;
+    for (uint64_t i = 0; i < percurso->total_diretorios && res == 0; i++)
+        res = enfileirar_diretorio(percurso, percurso->diretorios[i]);
+    if (res != 0) return res;
+    em_paralelo(percorrer_tarefas, percurso, 0, threads);
+    return percurso->erro;
+}
+
+static void *comparar_faixa_mapa(void *parametro) {
+    TarefaMapa *tarefa = parametro;
+    for (uint64_t palavra = tarefa->primeira_palavra; palavra < tarefa->fim_palavras; palavra++) {
+        uint64_t validos = PALAVRA_CHEIA;
+        if ((palavra + 1) * 64 > total_blocos_disco) validos = mascara_bits(0, total_blocos_disco % 64);
+
+        uint64_t esperado = tarefa->esperado[palavra] & validos;
+        uint64_t atual = mapa_bits[palavra] & validos;
+        tarefa->perdidos += __builtin_popcountll(atual & ~esperado);
+        tarefa->nao_marcados += __builtin_popcountll(esperado & ~atual);
+
+        uint64_t novo = atual;
+        if (tarefa->modo == MAPA_JUNTAR) novo = atual | esperado;
+        else if (tarefa->modo == MAPA_ADOTAR) novo = esperado;
+        tarefa->em_uso += __builtin_popcountll(novo);
+        if (novo == atual) continue;
+
+        mapa_bits[palavra] = (mapa_bits[palavra] & ~validos) | novo;
+        if (!mapa_bits_no_mapeamento) blocos_mapa_sujos[palavra / PALAVRAS_POR_BLOCO] = 1;
+
+        // Como em marcar_blocos(): blocos liberados saem do cache
+        uint64_t liberados = atual & ~novo;
+        while (liberados) {
+            int bit = __builtin_ctzll(liberados);
+            uint64_t resto = liberados >> bit;
+            int quantidade = ~resto ? __builtin_ctzll(~resto) : 64;
+            cache_descartar_faixa(palavra * 64 + bit, quantidade);
+            travar_mapa();
+            anotar_liberada(palavra * 64 + bit, quantidade);
+            destravar_mapa();
+            liberados &= ~mascara_bits(bit, quantidade);
+        }
+    }
+    return NULL;
+}
+
+// Compara (e no modo JUNTAR/ADOTAR altera) o bitmap; cada thread fica com
+// blocos do bitmap inteiros, então ninguém disputa blocos_mapa_sujos
+static int comparar_mapa(const uint64_t *esperado, int modo, uint32_t threads, Consistencia *consistencia) {
+    TarefaMapa *tarefas = calloc(threads, sizeof(TarefaMapa));
+    if (!tarefas) return -ENOMEM;
+
+    uint64_t fim_palavras = (total_blocos_disco + 63) / 64;
+    uint64_t blocos_mapa_usados = (fim_palavras + PALAVRAS_POR_BLOCO - 1) / PALAVRAS_POR_BLOCO;
+    uint64_t por_thread = (blocos_mapa_usados + threads - 1) / threads * PALAVRAS_POR_BLOCO;
+    for (uint32_t t = 0; t < threads; t++) {
+        tarefas[t].esperado = esperado;
+        tarefas[t].modo = modo;
+        tarefas[t].primeira_palavra = t * por_thread < fim_palavras ? t * por_thread : fim_palavras;
+        tarefas[t].fim_palavras = tarefas[t].primeira_palavra + por_thread < fim_palavras
+                                      ? tarefas[t].primeira_palavra + por_thread : fim_palavras;
+    }
+    em_paralelo(comparar_faixa_mapa, tarefas, sizeof(TarefaMapa), threads);
+
+    uint64_t em_uso = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        em_uso += tarefas[t].em_uso;
+        if (consistencia) {
+            consistencia->blocos_perdidos += tarefas[t].perdidos;
+            consistencia->blocos_nao_marcados += tarefas[t].nao_marcados;
+        }
+    }
+    if (consistencia) consistencia->blocos_em_uso = em_uso;
+    free(tarefas);
+
+    if (modo != MAPA_COMPARAR) {
+        travar_mapa();
+        total_blocos_mapa_sujos = 0;
+        for (uint64_t i = 0; i < total_blocos_mapa && !mapa_bits_no_mapeamento; i++)
+            total_blocos_mapa_sujos += blocos_mapa_sujos[i];
+        total_blocos_livres = total_blocos_disco - em_uso;
+        dica_palavra_livre = 0;
+        destravar_mapa();
+    }
+    return 0;
+}
+
+// Leitura sem conferir as somas: blocos disputados não conferem para um dos donos
+static int ler_sem_somas(ListaExtensoes *lista, uint64_t deslocamento, uint8_t *buffer, uint64_t tamanho) {
+    CursorExtensoes cursor = {0};
+    while (tamanho > 0) {
+        uint64_t blocos_contiguos;
+        uint64_t bloco_fisico = mapear_bloco(lista, &cursor, deslocamento / TAMANHO_BLOCO, &blocos_contiguos);
+        uint64_t bytes_na_faixa = blocos_contiguos * TAMANHO_BLOCO - deslocamento % TAMANHO_BLOCO;
+        if (bytes_na_faixa > tamanho) bytes_na_faixa = tamanho;
+
+        int res = dispositivo_ler(bloco_fisico * TAMANHO_BLOCO + deslocamento % TAMANHO_BLOCO, buffer, bytes_na_faixa);
+        if (res != 0) return res;
+
+        buffer += bytes_na_faixa;
+        deslocamento += bytes_na_faixa;
+        tamanho -= bytes_na_faixa;
+    }
+    return 0;
+}
+
+// Dá ao arquivo blocos novos com uma cópia do conteúdo (os buracos continuam
+// buracos); os antigos (e a cadeia antiga) ficam para o bitmap esperado da
+// próxima passada decidir
+static int copiar_arquivo(EntradaDiretorio *entrada, ListaExtensoes *antiga) {
+    uint64_t blocos = blocos_do_arquivo(entrada);
+    ListaExtensoes nova = {0};
+    uint8_t *buffer = malloc(PEDACO_DESFRAGMENTACAO);
+    int res = buffer ? 0 : -ENOMEM;
+
+    uint64_t base = 0;
+    for (uint32_t i = 0; res == 0 && i < antiga->total && base < blocos; i++) {
+        uint64_t quantidade = antiga->itens[i].quantidade;
+        if (quantidade > blocos - base) quantidade = blocos - base;
+        if (antiga->itens[i].inicio == BURACO) {
+            res = adicionar_extensao(&nova, BURACO, quantidade);
+            base += quantidade;
+            continue;
+        }
+
+        res = estender_extensoes(&nova, quantidade);
+        uint64_t fim = (base + quantidade) * TAMANHO_BLOCO;
+        for (uint64_t feito = base * TAMANHO_BLOCO; res == 0 && feito < fim; feito += PEDACO_DESFRAGMENTACAO) {
+            uint64_t pedaco = fim - feito;
+            if (pedaco > PEDACO_DESFRAGMENTACAO) pedaco = PEDACO_DESFRAGMENTACAO;
+            res = ler_sem_somas(antiga, feito, buffer, pedaco);
+            if (res == 0) res = transferir_dados(&nova, feito, buffer, pedaco, 1);
+        }
+        base += quantidade;
+    }
+
+    uint64_t bloco_mapa = entrada_comprimida(entrada) ? cabecalho_compressao(entrada)->bloco_mapa : 0;
+    if (res == 0 && bloco_mapa) res = copiar_mapa(entrada);
+    if (res == 0) {
+        entrada->bloco_extensoes = 0;
+        res = salvar_extensoes(entrada, &nova);
+        if (res != 0 && bloco_mapa) {
+            liberar_cadeia_extensoes(cabecalho_compressao(entrada)->bloco_mapa);
+            cabecalho_compressao(entrada)->bloco_mapa = bloco_mapa;
+        }
+    }
+    if (res != 0) liberar_extensoes(&nova, 0);
+    free(nova.itens);
+    free(buffer);
+    return res;
+}
+
+static int reparar_problema(const Problema *problema) {
+    if (problema->tipo == PROBLEMA_RAIZ) {
+        EntradaDiretorio pai = ler_entrada_fisica(bloco_inicio_raiz, 0);
+        pai.tamanho_bytes = TAMANHO_BLOCO;
+        pai.bloco_extensoes = 0;
+        salvar_entrada_fisica(bloco_inicio_raiz, 0, &pai);
+        descartar_indice_diretorio(bloco_inicio_raiz);
+        return 0;
+    }
+
+    EntradaDiretorio entrada = ler_entrada_em(problema->bloco_diretorio, problema->slot);
+    if (entrada.status != STATUS_USADO) return 0;
+
+    if (problema->tipo == PROBLEMA_DIRETORIO) {
+        entrada.status = STATUS_APAGADO;
+        salvar_entrada_em(problema->bloco_diretorio, problema->slot, &entrada);
+        descartar_indice_diretorio(entrada.bloco_inicial);
+        return 0;
+    }
+
+    ListaExtensoes lista = {0}, paginas = {0};
+    int res = conferir_extensoes(&entrada, &lista, &paginas);
+    if (res > 0 && entrada_comprimida(&entrada)) {
+        // Sem um mapa confiável não há o que aproveitar do fluxo
+        entrada.tamanho_bytes = 0;
+        entrada.bloco_inicial = BURACO;
+        entrada.bloco_extensoes = 0;
+        memset(entrada.embutido, 0, TAMANHO_EMBUTIDO);
+        esquecer_pedacos();
+        res = 0;
+    } else if (res > 0) {
+        // Fica o que as extensões válidas cobrem, numa cadeia nova
+        uint64_t cobertos = 0;
+        for (uint32_t i = 0; i < lista.total; i++) cobertos += lista.itens[i].quantidade;
+        if (entrada.tamanho_bytes > cobertos * TAMANHO_BLOCO) entrada.tamanho_bytes = cobertos * TAMANHO_BLOCO;
+        entrada.bloco_extensoes = 0;
+        res = salvar_extensoes(&entrada, &lista);
+    } else if (res == 0) {
+        res = copiar_arquivo(&entrada, &lista);
+    }
+    if (res == 0) salvar_entrada_em(problema->bloco_diretorio, problema->slot, &entrada);
+    free(lista.itens);
+    free(paginas.itens);
+    return res;
+}
+
+// Compara cada contador da tabela com os donos encontrados pelo percurso e,
+// com 'reparar', regrava os que não conferem
+static int conferir_referencias(const Percurso *percurso, int reparar, uint64_t *erradas) {
+    uint16_t contadores[REFERENCIAS_POR_BLOCO];
+    for (uint64_t bloco = 0; bloco < total_blocos_disco; bloco += REFERENCIAS_POR_BLOCO) {
+        uint64_t neste = total_blocos_disco - bloco < REFERENCIAS_POR_BLOCO ? total_blocos_disco - bloco : REFERENCIAS_POR_BLOCO;
+        int res = ler_referencias(bloco, neste, contadores);
+        if (res != 0) return res;
+
+        int alterados = 0;
+        for (uint64_t i = 0; i < neste; i++) {
+            uint16_t donos = percurso->donos[bloco + i];
+            uint16_t esperado = donos ? donos - 1 : 0;
+            if (contadores[i] == esperado) continue;
+            if (erradas) (*erradas)++;
+            contadores[i] = esperado;
+            alterados = 1;
+        }
+        if (reparar && alterados) {
+            res = gravar_referencias(bloco, neste, contadores);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
+}
+
+static int descritores_abertos() {
+    pthread_mutex_lock(&trava_descritores);
+    int abertos = 0;
+    for (int i = 0; i < MAXIMO_DESCRITORES && !abertos; i++) abertos = descritores[i].arquivo != NULL;
+    pthread_mutex_unlock(&trava_descritores);
+    return abertos;
+}
+
+// Só com trava_operacoes exclusiva
+static int verificar_sem_trava(int reparar, uint32_t threads, Consistencia *consistencia) {
+    memset(consistencia, 0, sizeof(Consistencia));
+    if (threads == 0) threads = threads_padrao();
+    if (threads > MAXIMO_THREADS_CONSISTENCIA) threads = MAXIMO_THREADS_CONSISTENCIA;
+    // Reparos mudam entradas e extensões por baixo dos descritores
+    if (reparar && descritores_abertos()) return -EBUSY;
+    gravar_arquivos_abertos();
+    // Fluxos compactados deixam blocos marcados até a próxima confirmação,
+    // que a verificação contaria como perdidos
+    if (total_faixas_adiadas > 0) {
+        int res = confirmar_pendentes();
+        if (res != 0) return res;
+    }
+
+    Percurso percurso = {0};
+    pthread_mutex_init(&percurso.trava, NULL);
+    pthread_cond_init(&percurso.mudou, NULL);
+    percurso.esperado = malloc(palavras_mapa * sizeof(uint64_t));
+    if (bloco_inicio_referencias) percurso.donos = malloc(total_blocos_disco * sizeof(uint16_t));
+    int res = percurso.esperado && (percurso.donos || !bloco_inicio_referencias) ? percorrer_consistencia(&percurso, threads)
+                                                                                : -ENOMEM;
+    if (res == 0) res = comparar_mapa(percurso.esperado, MAPA_COMPARAR, threads, consistencia);
+    if (res == 0 && percurso.donos) res = conferir_referencias(&percurso, 0, &consistencia->referencias_erradas);
+
+    consistencia->diretorios = percurso.total_diretorios;
+    consistencia->arquivos = percurso.arquivos;
+    consistencia->blocos_compartilhados = percurso.blocos_compartilhados;
+    for (uint64_t i = 0; i < percurso.total_problemas; i++)
+        if (percurso.problemas[i].tipo != PROBLEMA_COMPARTILHADA) consistencia->entradas_invalidas++;
+    uint64_t problemas = consistencia->blocos_perdidos + consistencia->blocos_nao_marcados +
+                         consistencia->blocos_compartilhados + consistencia->entradas_invalidas +
+                         consistencia->referencias_erradas;
+
+    for (int passada = 0; res == 0 && reparar && percurso.total_problemas > 0 && passada < MAXIMO_PASSADAS_REPARO; passada++) {
+        res = comparar_mapa(percurso.esperado, MAPA_JUNTAR, threads, NULL);
+        for (uint64_t i = 0; i < percurso.total_problemas && res == 0; i++) {
+            // Um reparo que falha (sem espaço para a cópia, por exemplo) deixa a entrada como está
+            if (reparar_problema(&percurso.problemas[i]) == 0) consistencia->entradas_reparadas++;
+        }
+        if (res == 0) res = percorrer_consistencia(&percurso, threads);
+    }
+    if (res == 0 && reparar && problemas > 0) {
+        res = comparar_mapa(percurso.esperado, MAPA_ADOTAR, threads, NULL);
+        if (res == 0 && percurso.donos) res = conferir_referencias(&percurso, 1, NULL);
+        if (res == 0) res = confirmar_pendentes();
+    }
+
+    limpar_percurso(&percurso);
+    free(percurso.diretorios);
+    free(percurso.fila);
+    free(percurso.problemas);
+    free(percurso.esperado);
+    free(percurso.donos);
+    pthread_mutex_destroy(&percurso.trava);
+    pthread_cond_destroy(&percurso.mudou);
+    if (res != 0) return res;
+    return problemas > INT32_MAX ? INT32_MAX : (int)problemas;
+}
+
+int verificar_consistencia(int reparar, uint32_t threads, Consistencia *consistencia) {
+    Medicao medicao;
+    estatisticas_iniciar(&medicao);
+    entrar_operacao(1);
+    int res = verificar_sem_trava(reparar, threads, consistencia);
+    sair_operacao();
+    return estatisticas_registrar(OP_VERIFICAR_CONSISTENCIA, &medicao, res, 0);
+}
+
+int consistencia_na_montagem(Consistencia *consistencia) {
+    entrar_operacao(0);
+    int verificada = verificada_na_montagem;
+    if (verificada) *consistencia = consistencia_montagem;
+    sair_operacao();
+    return verificada;
+}
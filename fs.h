@@ -11,6 +11,28 @@
 #define STATUS_APAGADO 0xE5     // 1110 0101: Arquivo deletado logicamente
 #define TIPO_ARQUIVO   0        // Identificador para arquivo comum
 #define TIPO_DIRETORIO 1        // Identificador para pasta/diretório
+#define TAMANHO_NOME_ARQUIVO 50
+#define VERSAO_FORMATO 2        // Versão gravada por formatar_disco()
+#define VERSAO_SOMAS 3          // A 2 com somas de verificação por bloco
+#define VERSAO_REFERENCIAS 4    // A 2 ou a 3 com a tabela de referências (clones e instantâneos)
+#define NOME_PAI ".."           // Entrada de cada diretório que aponta para o pai
+#define ATRIBUTO_EMBUTIDO 0x01  // Conteúdo na própria entrada, sem blocos de dados
+#define TAMANHO_EMBUTIDO 46     // Até quanto um arquivo fica embutido (versão 2 em diante)
+#define ATRIBUTO_COMPRIMIDO 0x02 // Conteúdo em pedaços comprimidos (ver comprimir_arquivo())
+#define ATRIBUTO_INSTANTANEO 0x04 // Parte de um instantâneo: só leitura (ver criar_instantaneo())
+
+// Entradas por bloco de diretório: 64 nas imagens da versão 1, 32 nas da 2
+#define MAXIMO_ENTRADAS_POR_DIRETORIO (TAMANHO_BLOCO / (int)sizeof(EntradaDiretorioV1))
+#define ENTRADAS_POR_DIRETORIO entradas_por_diretorio
+
+// Macro para compatibilidade Windows/Linux
+#ifdef _WIN32
+    #define fseek_64 _fseeki64
+    #define ftell_64 _ftelli64
+#else
+    #define fseek_64 fseeko
+    #define ftell_64 ftello
+#endif
 
 // --- Estrutura do Superbloco (Bloco 1) ---
 typedef struct {
@@ -19,18 +41,89 @@ typedef struct {
     uint64_t inicio_bitmap;
     uint64_t inicio_raiz;
     uint64_t inicio_dados;
-    uint8_t  padding[4060];
+    uint64_t inicio_diario;     // 0 = imagem sem diário
+    uint64_t blocos_diario;
+    uint32_t versao;            // 0 nas imagens anteriores ao campo (= versão 1)
+    uint32_t montado;           // Desligado por desmontar_disco()
+    uint64_t inicio_somas;      // 0 = imagem sem somas de verificação
+    uint64_t blocos_somas;
+    uint64_t inicio_referencias; // 0 = nenhum bloco dividido entre arquivos até hoje
+    uint64_t blocos_referencias;
+    uint8_t  padding[4000];
 } SuperBloco;
 
-// --- Estrutura da Entrada de Diretório (64 bytes) ---
+// --- Estrutura da Entrada de Diretório (128 bytes, versão 2) ---
+typedef struct __attribute__((packed)) {
+    uint8_t status;
+    uint8_t tipo;
+    uint8_t atributos;          // ATRIBUTO_* (0 nas entradas anteriores ao campo)
+    uint8_t reservado[5];
+    uint64_t bloco_inicial;
+    uint64_t tamanho_bytes;
+    uint64_t bloco_extensoes;   // 0 = arquivo contíguo a partir de bloco_inicial
+    char nome_arquivo[TAMANHO_NOME_ARQUIVO];
+    uint8_t embutido[TAMANHO_EMBUTIDO];
+} EntradaDiretorio;
+
+// --- Entrada da versão 1 (64 bytes) ---
+// Convertida de e para EntradaDiretorio ao ler e gravar diretórios dessas
+// imagens; nelas arquivos continuam limitados a 4 GB.
 typedef struct __attribute__((packed)) {
     uint8_t status;
     uint8_t tipo;
     uint32_t bloco_inicial;
     uint32_t tamanho_bytes;
-    char nome_arquivo[50];
-    uint8_t reservado[4];
-} EntradaDiretorio;
+    char nome_arquivo[TAMANHO_NOME_ARQUIVO];
+    uint32_t bloco_extensoes;
+} EntradaDiretorioV1;
+
+// --- Lista de Extensões (arquivos com mais de uma faixa de blocos) ---
+typedef struct {
+    uint64_t inicio;            // BURACO = faixa ainda sem blocos
+    uint64_t quantidade;
+} Extensao;
+
+// O bloco 0 é o de boot e nunca pertence a um arquivo: uma extensão (ou um
+// bloco_inicial) com ele é um buraco, que lê zeros e só ganha blocos quando
+// alguém escreve nele
+#define BURACO 0
+
+#define EXTENSOES_POR_BLOCO 255
+
+typedef struct {
+    uint32_t total_extensoes;
+    uint32_t reservado;
+    uint64_t proximo_bloco;     // Continuação da lista (0 = fim)
+    Extensao extensoes[EXTENSOES_POR_BLOCO];
+} BlocoExtensoes;
+
+// --- Arquivos Comprimidos ---
+// As extensões de um arquivo comprimido guardam um fluxo de pedaços
+// comprimidos, um depois do outro, cada um começando num bloco; o mapa diz
+// onde cada pedaço de TAMANHO_PEDACO bytes do conteúdo está no fluxo. Um
+// pedaço reescrito vai para o fim do fluxo e a versão antiga fica morta até
+// o fluxo ser compactado. O cabeçalho ocupa a área de 'embutido' da entrada.
+#define TAMANHO_PEDACO (16 * TAMANHO_BLOCO)
+#define PEDACO_SEM_COMPRESSAO 0x80000000U   // Em Pedaco.bytes: guardado como veio
+#define PEDACOS_POR_BLOCO 510
+
+typedef struct __attribute__((packed)) {
+    uint64_t bloco_mapa;        // Primeira página do mapa (0 = nenhum pedaço gravado)
+    uint64_t blocos_fluxo;      // Blocos cobertos pelas extensões
+    uint64_t blocos_mortos;     // Deles, os de versões antigas de pedaços
+} CabecalhoCompressao;
+
+typedef struct {
+    uint32_t bloco;             // Início no fluxo
+    uint32_t bytes;             // 0 = pedaço só de zeros, sem blocos
+} Pedaco;
+
+typedef struct {
+    uint32_t total_pedacos;
+    uint32_t reservado;
+    uint64_t proximo_bloco;     // Como em BlocoExtensoes
+    Pedaco pedacos[PEDACOS_POR_BLOCO];
+} BlocoPedacos;
 
 // --- Variáveis Globais (Externas) ---
 extern FILE *arquivo_disco;
@@ -38,23 +131,161 @@ extern uint64_t total_blocos_disco;
 extern uint64_t bloco_inicio_dados;
 extern uint64_t bloco_inicio_bitmap;
 extern uint64_t bloco_inicio_raiz;
-extern uint64_t bloco_diretorio_atual;
+extern uint64_t bloco_inicio_somas;     // 0 = sem somas de verificação
+extern uint64_t bloco_inicio_referencias;   // 0 = sem tabela de referências
+extern uint32_t versao_formato_disco;
+extern int entradas_por_diretorio;
+extern _Thread_local uint64_t bloco_diretorio_atual;   // Um por thread
 
 // --- Protótipos das Funções ---
-void formatar_disco(int quantidade_setores);
+// Todas podem ser chamadas de várias threads ao mesmo tempo; cada thread tem
+// o seu diretório atual (começa na raiz). Onde se pede um caminho vale tanto
+// "/a/b/c.txt" quanto um caminho relativo ao diretório atual.
+void formatar_disco(uint64_t quantidade_setores);
+// Com 'somas' cada bloco ganha um CRC32C (ver "Somas de Verificação" abaixo);
+// discos pequenos demais para ter diário ficam sem elas
+void formatar_disco_com_somas(uint64_t quantidade_setores, int somas);
 int montar_disco();
+int montar_disco_com_modo(int modo_dispositivo);  // DISPOSITIVO_* de dispositivo.h
 void inicializar_diretorio_atual();
 
-int criar_arquivo(const char *nome, uint32_t tamanho_solicitado, uint8_t tipo);
-int remover_arquivo(const char *nome);
-int ler_arquivo(const char *nome, uint32_t deslocamento_inicial, uint32_t tamanho_leitura, void *buffer_saida);
-int escrever_arquivo(const char *nome, uint32_t deslocamento_inicial, const void *buffer_entrada, uint32_t tamanho_escrita);
-int mudar_diretorio(const char *nome);
+// Arquivos criados com até TAMANHO_EMBUTIDO bytes guardam o conteúdo na
+// própria entrada e só ganham blocos quando crescem além disso. Os maiores
+// nascem como um buraco do tamanho pedido: nada é alocado até a escrita.
+int criar_arquivo(const char *caminho, uint64_t tamanho_solicitado, uint8_t tipo);
+int remover_arquivo(const char *caminho);      // Pastas só vazias e que não sejam o diretório atual de alguém (-EBUSY)
+// Cria vários arquivos (nomes, não caminhos) no diretório atual já no tamanho
+// final; resultados[i] recebe 0 ou -errno de cada um. Retorna quantos foram criados.
+int criar_arquivos_em_lote(const char *const *nomes, const uint64_t *tamanhos, uint32_t quantidade, int *resultados);
+int ler_arquivo(const char *caminho, uint64_t deslocamento_inicial, uint32_t tamanho_leitura, void *buffer_saida);
+int escrever_arquivo(const char *caminho, uint64_t deslocamento_inicial, const void *buffer_entrada, uint32_t tamanho_escrita);
+// Chama visitar() para cada entrada do diretório (menos ".."), sob a trava de
+// leitura dele: visitar() não pode chamar o sistema de arquivos. Um retorno
+// diferente de 0 interrompe a listagem e é devolvido.
+int listar_diretorio(const char *caminho, int (*visitar)(const EntradaDiretorio *entrada, void *contexto), void *contexto);
+int mudar_diretorio(const char *caminho);
+uint64_t obter_diretorio_atual();                   // Para levar o diretório a outra thread
+void usar_diretorio(uint64_t bloco_diretorio);
+int sincronizar_disco();
+int desmontar_disco();
+void adiar_confirmacoes(int ativo);     // Confirma só em sincronizar_disco() ou com o diário quase cheio
+
+// Arquivos abertos: o nome é resolvido uma vez em abrir_arquivo(); as demais
+// chamadas usam o descritor. ler/escrever devolvem os bytes transferidos (a
+// leitura para no fim do arquivo) ou -errno.
+int abrir_arquivo(const char *caminho);
+int fechar_arquivo(int descritor);
+int ler_descritor(int descritor, void *buffer, uint32_t tamanho);
+int escrever_descritor(int descritor, const void *buffer, uint32_t tamanho);
+int64_t posicionar_descritor(int descritor, int64_t deslocamento, int origem);
+int sincronizar_descritor(int descritor);
+
+// Leitura antecipada: um descritor que lê o arquivo em sequência mantém até
+// 'blocos' blocos à frente já pedidos ao dispositivo (0 = desligada; padrão
+// 256). Leituras e escritas grandes também são divididas em vários pedidos
+// simultâneos. As threads que atendem os pedidos se configuram em assincrono.h.
+int configurar_leitura_antecipada(uint32_t blocos);
+
+// Compressão (imagens da versão 2 em diante): liga ou desliga o atributo
+// ATRIBUTO_COMPRIMIDO e converte o conteúdo que já existe; pedaços só de
+// zeros não ocupam blocos nos dois sentidos. Arquivos embutidos só guardam o
+// atributo, que vale quando crescerem. Falha com -EBUSY se o arquivo estiver
+// aberto. A razão e o tempo gasto pelo compressor aparecem nas estatísticas.
+int comprimir_arquivo(const char *caminho, int ativo);
+
+// Clones (imagens da versão 2 em diante): o destino nasce com os mesmos
+// blocos de dados da origem, sem copiar nada; cada bloco dividido ganha uma
+// referência numa tabela de contadores, e quem escrever nele primeiro recebe
+// um bloco novo com a cópia. Só as páginas de extensões e do mapa de pedaços
+// são duplicadas. Falha com -EISDIR para pastas, -EEXIST se o destino já
+// existe e -EMLINK se algum bloco já tem donos demais.
+int clonar_arquivo(const char *origem, const char *destino);
+
+// Instantâneos: uma pasta na raiz com um clone de toda a árvore (menos os
+// outros instantâneos), no estado da chamada. Tudo dentro dela leva
+// ATRIBUTO_INSTANTANEO e é só leitura: escrever, criar ou remover lá dentro
+// devolve -EROFS. Clonar de um instantâneo para fora dele restaura um arquivo.
+// remover_instantaneo() apaga a pasta inteira (-EBUSY com arquivos abertos nela
+// ou se ela ou uma subpasta for o diretório atual de alguma thread).
+int criar_instantaneo(const char *nome);
+int remover_instantaneo(const char *nome);
+
+// Desfragmentação: junta cada arquivo numa extensão só e empurra os arquivos
+// para o começo da área de dados, enquanto não passar de 'limite_blocos'
+// blocos copiados nem de 'limite_ms' milissegundos (0 = sem limite; pelo menos
+// um arquivo sempre é movido). Devolve 1 se parou pelo orçamento, 0 se não há
+// mais o que mover, ou -errno.
+typedef struct {
+    uint64_t arquivos;                  // Arquivos com pelo menos um bloco
+    uint64_t arquivos_fragmentados;     // Com mais de uma extensão
+    uint64_t arquivos_embutidos;        // Com o conteúdo na entrada (não contam em 'arquivos')
+    uint64_t arquivos_esparsos;         // Com algum buraco
+    uint64_t arquivos_comprimidos;
+    uint64_t arquivos_compartilhados;   // Com algum bloco dividido com clones ou instantâneos
+    uint64_t extensoes;                 // Buracos não contam
+    uint64_t blocos_livres;
+    uint64_t trechos_livres;            // Sequências de blocos livres
+    uint64_t maior_trecho_livre;
+} Fragmentacao;
+
+int medir_fragmentacao(Fragmentacao *medida);
+int desfragmentar_disco(uint64_t limite_blocos, uint32_t limite_ms, uint64_t *blocos_movidos);
+
+// Somas de verificação: cada bloco de metadados recebe o CRC32C do seu
+// conteúdo ao ser confirmado, cada bloco de dados ao ser escrito; uma leitura
+// de dados que não confere devolve -EIO. Blocos sem soma (ainda não escritos
+// desde a formatação) não são verificados. A montagem depois de uma queda
+// refaz as somas das regiões escritas desde a última confirmação, que o
+// diário anota antes de cada escrita (uma vez por região de 16MB).
+//
+// varrer_disco() confere todos os blocos em uso usando 'threads' threads, em
+// trechos durante os quais as demais operações esperam. bloco_ruim() é
+// chamada, fora das travas, para cada bloco que não confere. Devolve o número
+// de blocos ruins, -ENOTSUP numa imagem sem somas ou -errno.
+typedef struct {
+    uint64_t blocos_verificados;
+    uint64_t blocos_sem_soma;
+    uint64_t blocos_ruins;
+    uint64_t bytes_lidos;
+} Varredura;
+
+int varrer_disco(uint32_t threads, Varredura *varredura, void (*bloco_ruim)(uint64_t bloco, void *contexto), void *contexto);
+
+// Verificação de consistência (fsck): percorre todos os diretórios, refaz o
+// bitmap a partir das extensões e o compara com o gravado, usando 'threads'
+// threads (0 = uma por processador). Com a tabela de referências, blocos de
+// dados divididos entre arquivos são esperados e os contadores são conferidos.
+// Com 'reparar' corta arquivos com extensões inválidas, copia os que dividem
+// blocos com pastas ou páginas de metadados (ou com outros arquivos, nas
+// imagens sem a tabela), apaga entradas de diretórios que não conferem,
+// regrava os contadores errados e adota o bitmap refeito; falha com -EBUSY se
+// houver arquivos abertos. Devolve o número de problemas encontrados ou
+// -errno. A montagem de uma imagem que não foi desmontada roda a verificação
+// com reparo.
+typedef struct {
+    uint64_t diretorios;
+    uint64_t arquivos;
+    uint64_t blocos_em_uso;
+    uint64_t blocos_perdidos;           // Marcados no bitmap, sem dono
+    uint64_t blocos_nao_marcados;       // Com dono, livres no bitmap
+    uint64_t blocos_compartilhados;     // Com mais de um dono
+    uint64_t entradas_invalidas;        // Extensões fora da área de dados, cadeias e diretórios corrompidos
+    uint64_t entradas_reparadas;
+    uint64_t referencias_erradas;       // Blocos cujo contador não confere com os donos
+} Consistencia;
+
+int verificar_consistencia(int reparar, uint32_t threads, Consistencia *consistencia);
+// 1 (e o resultado) se a última montagem encontrou a imagem em uso e a verificou
+int consistencia_na_montagem(Consistencia *consistencia);
 
 // Auxiliares
-void definir_status_blocos_bitmap(uint64_t bloco_inicial, int quantidade, int status);
+void definir_status_blocos_bitmap(uint64_t bloco_inicial, uint64_t quantidade, int status);
 int verificar_se_bloco_esta_livre(uint64_t indice_bloco);
+int verificar_faixa_livre(uint64_t bloco_inicial, uint64_t quantidade);
+int64_t buscar_blocos_livres(uint64_t quantidade);
+uint64_t contar_blocos_livres();
 EntradaDiretorio ler_entrada_diretorio(int indice);
+int buscar_entrada_diretorio(const char *caminho, EntradaDiretorio *entrada);
 void salvar_entrada_diretorio(int indice, EntradaDiretorio *entrada);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include <stddef.h>
+#include <string.h>
+#include "lz4.h"
+
+// Cada sequência: um token (4 bits de literais, 4 do casamento menos 4), os
+// comprimentos que passam de 15 em bytes extras (255, 255, ..., resto), os
+// literais, a distância do casamento em 2 bytes e o comprimento extra dele.
+// O bloco termina numa sequência só de literais.
+
+#define MINIMO_CASAMENTO 4
+#define ULTIMOS_LITERAIS 5          // Os últimos bytes do bloco são sempre literais
+#define LIMITE_CASAMENTO 12         // Nenhum casamento começa nos últimos 12 bytes
+#define DISTANCIA_MAXIMA 65535
+#define BITS_HASH 12
+#define PASSO_ACELERACAO 6          // A cada 2^6 tentativas sem casamento o passo cresce
+
+static uint32_t ler32(const uint8_t *p) {
+    uint32_t valor;
+    memcpy(&valor, p, sizeof(valor));
+    return valor;
+}
+
+static uint64_t ler64(const uint8_t *p) {
+    uint64_t valor;
+    memcpy(&valor, p, sizeof(valor));
+    return valor;
+}
+
+static uint32_t hash(uint32_t sequencia) {
+    return (sequencia * 2654435761U) >> (32 - BITS_HASH);
+}
+
+// Bytes iguais a partir de 'a' e 'b', sem 'a' passar de 'limite'
+static uint32_t contar_iguais(const uint8_t *a, const uint8_t *b, const uint8_t *limite) {
+    const uint8_t *inicio = a;
+    while (a + 8 <= limite) {
+        uint64_t diferenca = ler64(a) ^ ler64(b);
+        if (diferenca) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return (uint32_t)(a - inicio) + (__builtin_clzll(diferenca) >> 3);
+#else
+            return (uint32_t)(a - inicio) + (__builtin_ctzll(diferenca) >> 3);
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limite && *a == *b) {
+        a++;
+        b++;
+    }
+    return (uint32_t)(a - inicio);
+}
+
+static uint8_t *gravar_extra(uint8_t *saida, uint32_t resto) {
+    while (resto >= 255) {
+        *saida++ = 255;
+        resto -= 255;
+    }
+    *saida++ = (uint8_t)resto;
+    return saida;
+}
+
+static size_t bytes_extra(uint32_t comprimento) {
+    return comprimento >= 15 ? (comprimento - 15) / 255 + 1 : 0;
+}
+
+// 'casamento' já sem os 4 bytes mínimos; 'distancia' 0 = última sequência.
+// Devolve NULL se não couber até 'fim_saida'.
+static uint8_t *gravar_sequencia(uint8_t *saida, const uint8_t *fim_saida, const uint8_t *literais, const uint8_t *fim,
+                                 uint32_t quantidade, uint32_t distancia, uint32_t casamento) {
+    size_t necessario = 1 + bytes_extra(quantidade) + quantidade;
+    if (distancia) necessario += 2 + bytes_extra(casamento);
+    if ((size_t)(fim_saida - saida) < necessario) return NULL;
+
+    uint8_t *token = saida++;
+    *token = (uint8_t)((quantidade >= 15 ? 15 : quantidade) << 4);
+    if (quantidade >= 15) saida = gravar_extra(saida, quantidade - 15);
+    // Longe dos fins, literais curtos vão numa cópia fixa de 16 bytes
+    if (quantidade < 16 && fim - literais >= 16 && fim_saida - saida >= 16) memcpy(saida, literais, 16);
+    else memcpy(saida, literais, quantidade);
+    saida += quantidade;
+    if (!distancia) return saida;
+
+    *saida++ = (uint8_t)distancia;
+    *saida++ = (uint8_t)(distancia >> 8);
+    *token |= (uint8_t)(casamento >= 15 ? 15 : casamento);
+    if (casamento >= 15) saida = gravar_extra(saida, casamento - 15);
+    return saida;
+}
+
+uint32_t lz4_comprimir(const void *origem, uint32_t tamanho, void *destino, uint32_t capacidade) {
+    const uint8_t *inicio = origem;
+    const uint8_t *p = inicio, *ancora = inicio, *fim = inicio + tamanho;
+    uint8_t *saida = destino;
+    const uint8_t *fim_saida = saida + capacidade;
+
+    if (tamanho > LIMITE_CASAMENTO) {
+        // Última posição vista de cada hash dos 4 bytes seguintes
+        uint32_t tabela[1 << BITS_HASH] = {0};
+        const uint8_t *ultimo_inicio = fim - LIMITE_CASAMENTO;
+        const uint8_t *limite_casamento = fim - ULTIMOS_LITERAIS;
+        uint32_t tentativas = 1 << PASSO_ACELERACAO;
+
+        while (p <= ultimo_inicio) {
+            uint32_t sequencia = ler32(p);
+            uint32_t h = hash(sequencia);
+            const uint8_t *candidato = inicio + tabela[h];
+            tabela[h] = (uint32_t)(p - inicio);
+            if (candidato >= p || p - candidato > DISTANCIA_MAXIMA || ler32(candidato) != sequencia) {
+                // Dados que não casam são atravessados cada vez mais depressa
+                p += tentativas++ >> PASSO_ACELERACAO;
+                continue;
+            }
+            tentativas = 1 << PASSO_ACELERACAO;
+
+            while (p > ancora && candidato > inicio && p[-1] == candidato[-1]) {
+                p--;
+                candidato--;
+            }
+            uint32_t comprimento = MINIMO_CASAMENTO +
+                                   contar_iguais(p + MINIMO_CASAMENTO, candidato + MINIMO_CASAMENTO, limite_casamento);
+
+            saida = gravar_sequencia(saida, fim_saida, ancora, fim, (uint32_t)(p - ancora), (uint32_t)(p - candidato),
+                                     comprimento - MINIMO_CASAMENTO);
+            if (!saida) return 0;
+            p += comprimento;
+            ancora = p;
+
+            // O fim do casamento também entra na tabela: dados repetidos
+            // costumam continuar repetidos logo depois
+            if (p <= ultimo_inicio) tabela[hash(ler32(p - 2))] = (uint32_t)(p - 2 - inicio);
+        }
+    }
+
+    saida = gravar_sequencia(saida, fim_saida, ancora, fim, (uint32_t)(fim - ancora), 0, 0);
+    return saida ? (uint32_t)(saida - (uint8_t *)destino) : 0;
+}
+
+static int ler_extra(const uint8_t **p, const uint8_t *fim, size_t *comprimento) {
+    uint8_t byte;
+    do {
+        if (*p >= fim) return -1;
+        byte = *(*p)++;
+        *comprimento += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int64_t lz4_descomprimir(const void *origem, uint32_t tamanho, void *destino, uint32_t capacidade) {
+    const uint8_t *p = origem, *fim = p + tamanho;
+    uint8_t *saida = destino;
+    uint8_t *fim_saida = saida + capacidade;
+
+    while (p < fim) {
+        uint8_t token = *p++;
+        size_t literais = token >> 4;
+        if (literais == 15 && ler_extra(&p, fim, &literais) != 0) return -1;
+        if (literais > (size_t)(fim - p) || literais > (size_t)(fim_saida - saida)) return -1;
+        // Longe dos fins, literais curtos vão numa cópia fixa de 16 bytes
+        if (literais < 15 && fim - p >= 16 && fim_saida - saida >= 16) memcpy(saida, p, 16);
+        else memcpy(saida, p, literais);
+        saida += literais;
+        p += literais;
+        if (p == fim) return saida - (uint8_t *)destino;
+
+        if (fim - p < 2) return -1;
+        size_t distancia = p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        if (distancia == 0 || distancia > (size_t)(saida - (uint8_t *)destino)) return -1;
+
+        size_t comprimento = token & 15;
+        if (comprimento == 15 && ler_extra(&p, fim, &comprimento) != 0) return -1;
+        comprimento += MINIMO_CASAMENTO;
+        if (comprimento > (size_t)(fim_saida - saida)) return -1;
+
+        // De 8 em 8 bytes quando há folga depois do fim (o excesso é
+        // sobrescrito em seguida); com a distância menor que 8 a cópia lê o que
+        // ela mesma acabou de escrever, então vai byte a byte
+        const uint8_t *copia = saida - distancia;
+        if (distancia >= 8 && (size_t)(fim_saida - saida) >= comprimento + 8) {
+            for (size_t i = 0; i < comprimento; i += 8) memcpy(saida + i, copia + i, 8);
+        } else {
+            for (size_t i = 0; i < comprimento; i++) saida[i] = copia[i];
+        }
+        saida += comprimento;
+    }
+    return -1;      // Um bloco válido termina em literais
+}
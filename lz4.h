@@ -0,0 +1,18 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+// --- LZ4 (formato de bloco) ---
+// Usado nos pedaços dos arquivos comprimidos. Implementa só o formato de bloco
+// (sem o quadro com cabeçalho e somas do lz4 de linha de comando): sequências
+// de literais seguidas de uma cópia de até 64KB para trás. O compressor é o
+// guloso de uma tabela hash, que troca um pouco de razão por velocidade.
+
+// Devolve o tamanho comprimido, ou 0 se não coube em 'capacidade'
+uint32_t lz4_comprimir(const void *origem, uint32_t tamanho, void *destino, uint32_t capacidade);
+// Devolve o tamanho descomprimido, ou -1 se 'origem' não é um bloco válido
+// (nada é lido nem escrito fora dos limites, mesmo com dados corrompidos)
+int64_t  lz4_descomprimir(const void *origem, uint32_t tamanho, void *destino, uint32_t capacidade);
+
+#endif
@@ -2,80 +2,212 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "fs.h"
+#include "dispositivo.h"
+#include "estatisticas.h"
+#include "crc32c.h"
 
 void comando_ajuda() {
     printf("\n--- Comandos Disponiveis ---\n");
     printf("formatar           : Formata o disco (APAGA TUDO!)\n");
     printf("ls                 : Lista arquivos e pastas do diretorio atual\n");
-    printf("cd <nome>          : Entra em uma pasta (use .. para voltar)\n");
+    printf("cd <caminho>       : Entra em uma pasta (use .. para voltar, / para a raiz)\n");
     printf("crpasta <nm>       : Cria uma nova pasta (mkdir)\n");
-    printf("rm <nome>          : Remove arquivo ou pasta (vazia)\n");
+    printf("rm <caminho>       : Remove arquivo ou pasta (vazia)\n");
+    printf("  (nomes aceitam caminhos como /a/b/c.txt ou ../c.txt)\n");
     printf("importar <PC> <FS> : Copia arquivo do PC para o seu sistema\n");
     printf("exportar <FS> <PC> : Copia arquivo do seu sistema para o PC\n");
+    printf("importar_lote <PC> : Importa todos os arquivos de uma pasta (ou lista) do PC\n");
+    printf("defrag <MB>        : Desfragmenta copiando ate MB megabytes (0 = tudo)\n");
+    printf("comprimir <FS> <1|0>: Liga (1) ou desliga (0) a compressao LZ4 de um arquivo\n");
+    printf("clonar <FS> <FS>   : Copia um arquivo dividindo os blocos (copia na escrita)\n");
+    printf("instantaneo <nm>   : Cria /<nm>, uma copia so leitura de toda a arvore\n");
+    printf("rm_instantaneo <nm>: Apaga o instantaneo /<nm>\n");
+    printf("sync               : Grava no disco os blocos pendentes do cache\n");
+    printf("stats              : Chamadas, latencias e E/S de cada operacao\n");
+    printf("scrub <threads>    : Confere as somas de verificacao dos blocos (0 = uma por CPU)\n");
+    printf("fsck <reparar>     : Confere diretorios e bitmap (1 = corrige o que encontrar)\n");
     printf("ajuda              : Mostra esta lista\n");
     printf("sair               : Sai do simulador\n");
 }
 
 void comando_formatar() {
-    int quantidade_setores;
+    unsigned long long quantidade_setores = 0;
     printf("Digite o tamanho do disco em setores de 512 bytes: ");
-    scanf("%d", &quantidade_setores);
+    scanf("%llu", &quantidade_setores);
 
     if (quantidade_setores < 40) {
         printf("Erro: Minimo de 40 setores necessario.\n");
         return;
     }
 
+    char resposta = 'n';
+    printf("Somas de verificacao (CRC32C) por bloco? (s/n): ");
+    scanf(" %c", &resposta);
+
     printf("Formatando...\n");
-    formatar_disco(quantidade_setores);
+    formatar_disco_com_somas(quantidade_setores, resposta == 's' || resposta == 'S');
 
     printf("Total Blocos (4KB): %llu\n", (unsigned long long)total_blocos_disco);
+    printf("Blocos Livres: %llu\n", (unsigned long long)contar_blocos_livres());
+    if (bloco_inicio_somas) printf("Somas de verificacao: sim (%s)\n", crc32c_acelerado() ? "SSE4.2" : "tabelas");
+    else if (resposta == 's' || resposta == 'S') printf("Somas de verificacao: nao (disco pequeno demais para o diario)\n");
     printf("Formatacao concluida.\n");
 }
 
+static int imprimir_entrada(const EntradaDiretorio *entrada, void *contexto) {
+    int *contador_arquivos = contexto;
+    char *tipo_str = (entrada->tipo == TIPO_DIRETORIO) ? "DIR" :
+                     (entrada->atributos & ATRIBUTO_COMPRIMIDO) ? "ARQc" : "ARQ";
+
+    printf("%-20s | %-4s | %10llu | %10llu%s\n",
+           entrada->nome_arquivo, tipo_str,
+           (unsigned long long)entrada->tamanho_bytes, (unsigned long long)entrada->bloco_inicial,
+           (entrada->atributos & ATRIBUTO_INSTANTANEO) ? " (so leitura)" : "");
+    (*contador_arquivos)++;
+    return 0;
+}
+
 void comando_listar() {
     printf("\n%-20s | %-4s | %-10s | %-10s\n", "Nome", "Tipo", "Tamanho", "Bloco Ini");
     printf("---------------------------------------------------------------\n");
     int contador_arquivos = 0;
-    
-    for (int i = 0; i < 64; i++) {
-        EntradaDiretorio entrada = ler_entrada_diretorio(i);
-        if (entrada.status == STATUS_USADO) {
-            char *tipo_str = (entrada.tipo == TIPO_DIRETORIO) ? "DIR" : "ARQ";
-            
-            printf("%-20s | %-4s | %10u | %10u\n", 
-                   entrada.nome_arquivo, tipo_str, 
-                   entrada.tamanho_bytes, entrada.bloco_inicial);
-            contador_arquivos++;
-        }
-    }
+
+    listar_diretorio(".", imprimir_entrada, &contador_arquivos);
     if (contador_arquivos == 0) printf("(diretorio vazio)\n");
 }
 
-void comando_importar(const char *caminho_origem, const char *nome_destino) {
+// Importação e exportação andam em pedaços de 1MB, com dois buffers: enquanto
+// um pedaço vai para o sistema (ou sai dele) o outro é lido do PC (ou gravado
+// nele) por uma thread à parte. Do lado do sistema as leituras em sequência
+// são antecipadas e as escritas grandes vão em vários pedidos simultâneos.
+
+#define PEDACO_TRANSFERENCIA (1024 * 1024)
+
+typedef struct {
+    FILE *arquivo;
+    uint8_t *buffer;
+    size_t tamanho;
+    size_t feitos;
+} PedacoHost;
+
+static void *ler_do_host(void *parametro) {
+    PedacoHost *pedaco = parametro;
+    pedaco->feitos = fread(pedaco->buffer, 1, pedaco->tamanho, pedaco->arquivo);
+    return NULL;
+}
+
+static void *gravar_no_host(void *parametro) {
+    PedacoHost *pedaco = parametro;
+    pedaco->feitos = fwrite(pedaco->buffer, 1, pedaco->tamanho, pedaco->arquivo);
+    return NULL;
+}
+
+// Copia um arquivo do PC para o sistema; devolve 0 ou -errno
+static int importar(const char *caminho_origem, const char *nome_destino, uint64_t *bytes) {
+    *bytes = 0;
     FILE *arquivo_host = fopen(caminho_origem, "rb");
-    if (!arquivo_host) { perror("Erro abrir origem"); return; }
+    if (!arquivo_host) return -errno;
 
-    fseek(arquivo_host, 0, SEEK_END);
-    uint32_t tamanho = ftell(arquivo_host);
+    fseek_64(arquivo_host, 0, SEEK_END);
+    uint64_t tamanho = ftell_64(arquivo_host);
     rewind(arquivo_host);
 
-    if (criar_arquivo(nome_destino, tamanho, TIPO_ARQUIVO) != 0) {
-        printf("Erro: Sem espaco ou nome duplicado.\n");
+    int res = criar_arquivo(nome_destino, tamanho, TIPO_ARQUIVO);
+    int descritor = (res == 0) ? abrir_arquivo(nome_destino) : res;
+    if (descritor < 0) {
         fclose(arquivo_host);
-        return;
+        return descritor;
     }
 
-    uint8_t *buffer = malloc(TAMANHO_BLOCO);
-    uint32_t bytes_lidos, total_escrito = 0;
-    while ((bytes_lidos = fread(buffer, 1, TAMANHO_BLOCO, arquivo_host)) > 0) {
-        escrever_arquivo(nome_destino, total_escrito, buffer, bytes_lidos);
-        total_escrito += bytes_lidos;
+    uint8_t *buffers[2] = {malloc(PEDACO_TRANSFERENCIA), malloc(PEDACO_TRANSFERENCIA)};
+    PedacoHost pedaco = {arquivo_host, buffers[0], PEDACO_TRANSFERENCIA, 0};
+    res = buffers[0] && buffers[1] ? 0 : -ENOMEM;
+    if (res == 0) ler_do_host(&pedaco);
+
+    int atual = 0;
+    while (res >= 0 && pedaco.feitos > 0) {
+        size_t lidos = pedaco.feitos;
+        pedaco.buffer = buffers[!atual];
+        pthread_t leitor;
+        int em_paralelo = pthread_create(&leitor, NULL, ler_do_host, &pedaco) == 0;
+
+        res = escrever_descritor(descritor, buffers[atual], (uint32_t)lidos);
+        if (res > 0) *bytes += res;
+
+        if (em_paralelo) pthread_join(leitor, NULL);
+        else ler_do_host(&pedaco);
+        atual = !atual;
     }
-    free(buffer);
+    free(buffers[0]);
+    free(buffers[1]);
+    fechar_arquivo(descritor);
     fclose(arquivo_host);
-    printf("Arquivo importado.\n");
+
+    // O espaço só é alocado na escrita: sem ele a cópia parcial não fica
+    if (res < 0) remover_arquivo(nome_destino);
+    return res < 0 ? res : 0;
+}
+
+static int exportar(const char *nome_origem_fs, const char *caminho_destino_pc, uint64_t *bytes) {
+    *bytes = 0;
+    int descritor = abrir_arquivo(nome_origem_fs);
+    if (descritor < 0) return descritor;
+
+    FILE *arquivo_host = fopen(caminho_destino_pc, "wb");
+    if (!arquivo_host) {
+        int erro = -errno;
+        fechar_arquivo(descritor);
+        return erro;
+    }
+
+    uint8_t *buffers[2] = {malloc(PEDACO_TRANSFERENCIA), malloc(PEDACO_TRANSFERENCIA)};
+    PedacoHost pedaco = {arquivo_host, NULL, 0, 0};
+    pthread_t gravador;
+    int gravando = 0, atual = 0;
+    int res = buffers[0] && buffers[1] ? 0 : -ENOMEM;
+
+    // O pedaço anterior vai para o PC enquanto este é lido do sistema
+    int bytes_lidos;
+    while (res == 0 && (bytes_lidos = ler_descritor(descritor, buffers[atual], PEDACO_TRANSFERENCIA)) > 0) {
+        if (gravando) pthread_join(gravador, NULL);
+        if (pedaco.feitos != pedaco.tamanho) {
+            res = -EIO;
+            gravando = 0;
+            break;
+        }
+
+        pedaco.buffer = buffers[atual];
+        pedaco.tamanho = bytes_lidos;
+        gravando = pthread_create(&gravador, NULL, gravar_no_host, &pedaco) == 0;
+        if (!gravando) gravar_no_host(&pedaco);
+        *bytes += bytes_lidos;
+        atual = !atual;
+    }
+    if (res == 0 && bytes_lidos < 0) res = bytes_lidos;
+    if (gravando) pthread_join(gravador, NULL);
+    if (res == 0 && pedaco.feitos != pedaco.tamanho) res = -EIO;
+
+    free(buffers[0]);
+    free(buffers[1]);
+    fechar_arquivo(descritor);
+    if (fclose(arquivo_host) != 0 && res == 0) res = -EIO;
+    return res;
+}
+
+void comando_importar(const char *caminho_origem, const char *nome_destino) {
+    uint64_t bytes;
+    int res = importar(caminho_origem, nome_destino, &bytes);
+    if (res == 0) printf("Arquivo importado.\n");
+    else if (res == -ENOSPC || res == -EEXIST) printf("Erro: Sem espaco ou nome duplicado.\n");
+    else printf("Erro ao importar: %s\n", strerror(-res));
 }
 
 void comando_crpasta(const char *nome_pasta) {
@@ -83,8 +215,8 @@ void comando_crpasta(const char *nome_pasta) {
     
     if (res == 0) {
         printf("Pasta '%s' criada com sucesso.\n", nome_pasta);
-    } else if (res == -EPERM) {
-        printf("Erro: Nao permitido criar pasta dentro de pasta.\n");
+    } else if (res == -ENOENT || res == -ENOTDIR) {
+        printf("Erro: Caminho nao encontrado.\n");
     } else {
         printf("Erro ao criar pasta (Disco cheio ou nome duplicado).\n");
     }
@@ -99,54 +231,768 @@ void comando_cd(const char *nome) {
 }
 
 void comando_exportar(const char *nome_origem_fs, const char *caminho_destino_pc) {
-    EntradaDiretorio entrada;
-    int encontrado = 0;
-    for(int i = 0; i < 64; i++) {
-        entrada = ler_entrada_diretorio(i);
-        if(entrada.status == STATUS_USADO && strcmp(entrada.nome_arquivo, nome_origem_fs) == 0) {
-            encontrado = 1; break;
-        }
+    uint64_t bytes;
+    int res = exportar(nome_origem_fs, caminho_destino_pc, &bytes);
+    if (res == 0) printf("Arquivo exportado.\n");
+    else if (res == -ENOENT) printf("Arquivo nao encontrado.\n");
+    else printf("Erro ao exportar: %s\n", strerror(-res));
+}
+
+// --- Desfragmentação ---
+
+#define BLOCOS_POR_MEGA ((1024 * 1024) / TAMANHO_BLOCO)
+
+static void imprimir_fragmentacao(const char *rotulo, const Fragmentacao *medida) {
+    printf("%-6s: %llu arquivo(s), %llu fragmentado(s), %llu extensao(oes), %llu embutido(s), "
+           "%llu esparso(s), %llu comprimido(s), %llu com blocos divididos; %llu blocos livres em %llu trecho(s), "
+           "maior com %llu\n", rotulo,
+           (unsigned long long)medida->arquivos, (unsigned long long)medida->arquivos_fragmentados,
+           (unsigned long long)medida->extensoes, (unsigned long long)medida->arquivos_embutidos,
+           (unsigned long long)medida->arquivos_esparsos, (unsigned long long)medida->arquivos_comprimidos,
+           (unsigned long long)medida->arquivos_compartilhados,
+           (unsigned long long)medida->blocos_livres,
+           (unsigned long long)medida->trechos_livres, (unsigned long long)medida->maior_trecho_livre);
+}
+
+// Limite em MB copiados (0 = até não ter mais o que mover)
+void comando_defrag(const char *limite) {
+    char *fim;
+    unsigned long long megas = strtoull(limite, &fim, 10);
+    if (*fim != '\0') {
+        printf("Erro: Limite invalido.\n");
+        return;
     }
-    if(!encontrado) { printf("Arquivo nao encontrado.\n"); return; }
 
-    FILE *arquivo_host = fopen(caminho_destino_pc, "wb");
-    if (!arquivo_host) { perror("Erro criar destino"); return; }
+    Fragmentacao antes, depois;
+    uint64_t movidos = 0;
+    int res = medir_fragmentacao(&antes);
+    if (res == 0) res = desfragmentar_disco(megas * BLOCOS_POR_MEGA, 0, &movidos);
+    if (res < 0 || medir_fragmentacao(&depois) != 0) {
+        printf("Erro ao desfragmentar: %s\n", strerror(res < 0 ? -res : ENOMEM));
+        return;
+    }
 
-    uint8_t *buffer = malloc(TAMANHO_BLOCO);
-    uint32_t restante = entrada.tamanho_bytes;
-    uint32_t deslocamento = 0;
-    
-    while(restante > 0) {
-        uint32_t tamanho_pedaco = (restante > TAMANHO_BLOCO) ? TAMANHO_BLOCO : restante;
-        ler_arquivo(nome_origem_fs, deslocamento, tamanho_pedaco, buffer);
-        fwrite(buffer, 1, tamanho_pedaco, arquivo_host);
-        deslocamento += tamanho_pedaco;
-        restante -= tamanho_pedaco;
+    imprimir_fragmentacao("Antes", &antes);
+    imprimir_fragmentacao("Depois", &depois);
+    printf("%llu bloco(s) movido(s)%s.\n", (unsigned long long)movidos,
+           res == 1 ? "; limite atingido, rode de novo para continuar" : "");
+}
+
+// --- Compressão ---
+
+void comando_comprimir(const char *caminho, const char *ativo) {
+    if (strcmp(ativo, "0") != 0 && strcmp(ativo, "1") != 0) {
+        printf("Erro: Use 1 para comprimir ou 0 para descomprimir.\n");
+        return;
+    }
+    int res = comprimir_arquivo(caminho, ativo[0] == '1');
+    if (res == 0) printf(ativo[0] == '1' ? "Arquivo comprimido.\n" : "Arquivo descomprimido.\n");
+    else if (res == -ENOENT) printf("Arquivo nao encontrado.\n");
+    else if (res == -EBUSY) printf("Erro: O arquivo esta aberto.\n");
+    else printf("Erro ao comprimir: %s\n", strerror(-res));
+}
+
+// --- Clones e Instantâneos ---
+
+void comando_clonar(const char *origem, const char *destino) {
+    int res = clonar_arquivo(origem, destino);
+    if (res == 0) printf("Arquivo clonado.\n");
+    else if (res == -ENOENT) printf("Arquivo nao encontrado.\n");
+    else if (res == -EEXIST) printf("Erro: O destino ja existe.\n");
+    else if (res == -EROFS) printf("Erro: O destino esta num instantaneo (so leitura).\n");
+    else printf("Erro ao clonar: %s\n", strerror(-res));
+}
+
+void comando_instantaneo(const char *nome) {
+    int res = criar_instantaneo(nome);
+    if (res == 0) printf("Instantaneo /%s criado.\n", nome);
+    else if (res == -EEXIST) printf("Erro: Ja existe /%s.\n", nome);
+    else printf("Erro ao criar o instantaneo: %s\n", strerror(-res));
+}
+
+void comando_remover_instantaneo(const char *nome) {
+    int res = remover_instantaneo(nome);
+    if (res == 0) printf("Instantaneo removido.\n");
+    else if (res == -ENOENT) printf("Instantaneo nao encontrado.\n");
+    else if (res == -EINVAL) printf("Erro: /%s nao e um instantaneo.\n", nome);
+    else if (res == -EBUSY) printf("Erro: Ha arquivos abertos no instantaneo.\n");
+    else printf("Erro ao remover o instantaneo: %s\n", strerror(-res));
+}
+
+// --- Estatísticas ---
+// Latências vêm dos histogramas: cada percentil é o limite superior do balde
+
+void comando_stats() {
+    Estatisticas estatisticas;
+    estatisticas_ler(&estatisticas);
+
+    printf("\n%-29s %9s %6s %10s %8s %8s %6s %9s %9s %9s\n", "Operacao", "Chamadas", "Erros", "MB",
+           "Leituras", "Escritas", "Syncs", "Media us", "p50 us", "p99 us");
+    for (int i = 0; i < TOTAL_OPERACOES; i++) {
+        EstatisticaOperacao *op = &estatisticas.operacoes[i];
+        if (op->chamadas == 0) continue;
+        printf("%-29s %9llu %6llu %10.2f %8llu %8llu %6llu %9.1f %9.1f %9.1f\n", estatisticas_nome_operacao(i),
+               (unsigned long long)op->chamadas, (unsigned long long)op->erros, op->bytes / (1024.0 * 1024.0),
+               (unsigned long long)op->leituras, (unsigned long long)op->escritas,
+               (unsigned long long)op->sincronizacoes, op->nanossegundos / 1e3 / op->chamadas,
+               estatisticas_percentil(op, 0.50) / 1e3, estatisticas_percentil(op, 0.99) / 1e3);
+    }
+
+    printf("\n");
+    for (int i = 0; i < TOTAL_EVENTOS; i++)
+        printf("%-20s: %llu\n", estatisticas_nome_evento(i), (unsigned long long)estatisticas.eventos[i]);
+
+    uint64_t *eventos = estatisticas.eventos;
+    if (eventos[EVENTO_BYTES_COMPRIMIDOS] > 0) {
+        printf("\nCompressao: razao %.2f, %.1f MB/s comprimindo, %.1f MB/s descomprimindo\n",
+               (double)eventos[EVENTO_BYTES_PARA_COMPRIMIR] / eventos[EVENTO_BYTES_COMPRIMIDOS],
+               eventos[EVENTO_NS_COMPRESSAO] ? eventos[EVENTO_BYTES_PARA_COMPRIMIR] * 1e3 / eventos[EVENTO_NS_COMPRESSAO] / 1.048576 : 0.0,
+               eventos[EVENTO_NS_DESCOMPRESSAO] ? eventos[EVENTO_BYTES_DESCOMPRIMIDOS] * 1e3 / eventos[EVENTO_NS_DESCOMPRESSAO] / 1.048576 : 0.0);
+    }
+}
+
+// --- Importação em Lote ---
+// Os arquivos de uma pasta do PC (ou de uma lista com um caminho por linha)
+// são criados todos de uma vez, já no tamanho final, e os dados são copiados
+// por várias threads, cada uma lendo do PC e escrevendo no sistema em pedaços
+// grandes. Como o espaço já está reservado, a cópia não mexe em metadados.
+
+#define PEDACO_IMPORTACAO (1024 * 1024)
+#define MAXIMO_THREADS_IMPORTACAO 8
+
+typedef struct {
+    char caminho[1024];
+    const char *nome;       // Nome no sistema: o final do caminho
+    uint64_t tamanho;
+    int resultado;
+} ItemImportacao;
+
+typedef struct {
+    ItemImportacao *itens;
+    uint32_t quantidade;
+    uint32_t proximo;
+    uint64_t diretorio;
+    uint64_t bytes;
+} Importacao;
+
+static int adicionar_origem(ItemImportacao **itens, uint32_t *quantidade, uint32_t *capacidade, const char *caminho) {
+    // Caminhos que não dá para ler entram como falha; pastas e afins são pulados
+    struct stat info;
+    int erro = (stat(caminho, &info) != 0) ? -errno : 0;
+    if (erro == 0 && !S_ISREG(info.st_mode)) return 0;
+
+    if (*quantidade == *capacidade) {
+        uint32_t nova_capacidade = *capacidade ? *capacidade * 2 : 64;
+        ItemImportacao *novos = realloc(*itens, nova_capacidade * sizeof(ItemImportacao));
+        if (!novos) return -ENOMEM;
+        *itens = novos;
+        *capacidade = nova_capacidade;
+    }
+
+    ItemImportacao *item = &(*itens)[*quantidade];
+    if (strlen(caminho) >= sizeof(item->caminho)) return -ENAMETOOLONG;
+    strcpy(item->caminho, caminho);
+    item->tamanho = erro ? 0 : (uint64_t)info.st_size;
+    item->resultado = erro;
+    (*quantidade)++;
+    return 0;
+}
+
+// Monta a lista de arquivos a partir de uma pasta ou de um arquivo-lista
+static int listar_origens(const char *origem, ItemImportacao **itens, uint32_t *quantidade) {
+    *itens = NULL;
+    *quantidade = 0;
+    struct stat info;
+    if (stat(origem, &info) != 0) return -errno;
+
+    uint32_t capacidade = 0;
+    char caminho[1024];
+    int res = 0;
+
+    if (S_ISDIR(info.st_mode)) {
+        DIR *pasta = opendir(origem);
+        if (!pasta) return -errno;
+        struct dirent *registro;
+        while (res == 0 && (registro = readdir(pasta)) != NULL) {
+            if (registro->d_name[0] == '.') continue;
+            snprintf(caminho, sizeof(caminho), "%s/%s", origem, registro->d_name);
+            res = adicionar_origem(itens, quantidade, &capacidade, caminho);
+        }
+        closedir(pasta);
+    } else {
+        FILE *lista = fopen(origem, "r");
+        if (!lista) return -errno;
+        while (res == 0 && fgets(caminho, sizeof(caminho), lista)) {
+            caminho[strcspn(caminho, "\r\n")] = '\0';
+            if (caminho[0] == '\0' || caminho[0] == '#') continue;
+            res = adicionar_origem(itens, quantidade, &capacidade, caminho);
+        }
+        fclose(lista);
+    }
+
+    // Só agora a lista parou de mudar de lugar na memória
+    for (uint32_t i = 0; i < *quantidade; i++) {
+        const char *barra = strrchr((*itens)[i].caminho, '/');
+        (*itens)[i].nome = barra ? barra + 1 : (*itens)[i].caminho;
     }
+    return res;
+}
+
+static void *alocar_alinhado(size_t tamanho) {
+#ifdef _WIN32
+    return _aligned_malloc(tamanho, TAMANHO_BLOCO);
+#else
+    void *buffer = NULL;
+    return posix_memalign(&buffer, TAMANHO_BLOCO, tamanho) == 0 ? buffer : NULL;
+#endif
+}
+
+static void liberar_alinhado(void *buffer) {
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
     free(buffer);
+#endif
+}
+
+static int copiar_item(ItemImportacao *item, uint8_t *buffer, uint64_t *bytes) {
+    FILE *arquivo_host = fopen(item->caminho, "rb");
+    if (!arquivo_host) return -errno;
+    setvbuf(arquivo_host, NULL, _IONBF, 0);
+
+    int descritor = abrir_arquivo(item->nome);
+    if (descritor < 0) {
+        fclose(arquivo_host);
+        return descritor;
+    }
+
+    int res = 0;
+    uint64_t restantes = item->tamanho;
+    while (res >= 0 && restantes > 0) {
+        uint32_t pedaco = restantes < PEDACO_IMPORTACAO ? restantes : PEDACO_IMPORTACAO;
+        size_t lidos = fread(buffer, 1, pedaco, arquivo_host);
+        if (lidos == 0) break;   // O arquivo encolheu depois de listado: o resto fica zerado
+        res = escrever_descritor(descritor, buffer, (uint32_t)lidos);
+        if (res > 0) {
+            restantes -= res;
+            __atomic_fetch_add(bytes, (uint64_t)res, __ATOMIC_RELAXED);
+        }
+    }
+    fechar_arquivo(descritor);
     fclose(arquivo_host);
-    printf("Arquivo exportado.\n");
+    return res < 0 ? res : 0;
+}
+
+static void *thread_importacao(void *parametro) {
+    Importacao *importacao = parametro;
+    usar_diretorio(importacao->diretorio);
+
+    uint8_t *buffer = alocar_alinhado(PEDACO_IMPORTACAO);
+    while (1) {
+        uint32_t i = __atomic_fetch_add(&importacao->proximo, 1, __ATOMIC_RELAXED);
+        if (i >= importacao->quantidade) break;
+        ItemImportacao *item = &importacao->itens[i];
+        if (item->resultado != 0) continue;
+        item->resultado = buffer ? copiar_item(item, buffer, &importacao->bytes) : -ENOMEM;
+    }
+    liberar_alinhado(buffer);
+    return NULL;
+}
+
+static int numero_processadores() {
+    long processadores = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+    processadores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return processadores < 1 ? 1 : (int)processadores;
+}
+
+static int numero_threads_importacao() {
+    int processadores = numero_processadores();
+    return processadores > MAXIMO_THREADS_IMPORTACAO ? MAXIMO_THREADS_IMPORTACAO : processadores;
+}
+
+// Importa para o diretório atual; devolve 0 ou -errno (erro geral). Os itens
+// ficam em *itens, cada um com o seu resultado, para quem chamou liberar.
+static int importar_lote(const char *origem, ItemImportacao **itens, uint32_t *quantidade, uint64_t *bytes) {
+    *bytes = 0;
+    int res = listar_origens(origem, itens, quantidade);
+    if (res != 0) return res;
+
+    uint32_t total = *quantidade ? *quantidade : 1;
+    const char **nomes = malloc(total * sizeof(char *));
+    uint64_t *tamanhos = malloc(total * sizeof(uint64_t));
+    int *resultados = malloc(total * sizeof(int));
+    if (!nomes || !tamanhos || !resultados) res = -ENOMEM;
+
+    if (res == 0) {
+        // Só os arquivos legíveis entram no lote
+        uint32_t validos = 0;
+        for (uint32_t i = 0; i < *quantidade; i++) {
+            if ((*itens)[i].resultado != 0) continue;
+            nomes[validos] = (*itens)[i].nome;
+            tamanhos[validos++] = (*itens)[i].tamanho;
+        }
+        criar_arquivos_em_lote(nomes, tamanhos, validos, resultados);
+        for (uint32_t i = 0, j = 0; i < *quantidade; i++) {
+            if ((*itens)[i].resultado == 0) (*itens)[i].resultado = resultados[j++];
+        }
+
+        Importacao importacao = { *itens, *quantidade, 0, obter_diretorio_atual(), 0 };
+        int total_threads = numero_threads_importacao();
+        pthread_t threads[MAXIMO_THREADS_IMPORTACAO];
+        int iniciadas = 0;
+        while (iniciadas < total_threads &&
+               pthread_create(&threads[iniciadas], NULL, thread_importacao, &importacao) == 0) iniciadas++;
+        if (iniciadas == 0) thread_importacao(&importacao);
+        for (int i = 0; i < iniciadas; i++) pthread_join(threads[i], NULL);
+        *bytes = importacao.bytes;
+    }
+    free(nomes);
+    free(tamanhos);
+    free(resultados);
+    return res;
+}
+
+void comando_importar_lote(const char *origem) {
+    ItemImportacao *itens;
+    uint32_t quantidade, falhas = 0;
+    uint64_t bytes;
+    int res = importar_lote(origem, &itens, &quantidade, &bytes);
+    if (res != 0) {
+        printf("Erro ao importar: %s\n", strerror(-res));
+    } else {
+        for (uint32_t i = 0; i < quantidade; i++) {
+            if (itens[i].resultado == 0) continue;
+            printf("Erro em %s: %s\n", itens[i].caminho, strerror(-itens[i].resultado));
+            falhas++;
+        }
+        printf("%u arquivo(s) importado(s), %u com erro, %llu bytes.\n",
+               quantidade - falhas, falhas, (unsigned long long)bytes);
+    }
+    free(itens);
+}
+
+// --- Varredura ---
+
+static void imprimir_bloco_ruim(uint64_t bloco, void *contexto) {
+    (void)contexto;
+    printf("Bloco %llu: soma de verificacao nao confere\n", (unsigned long long)bloco);
+}
+
+// 'threads' = 0 usa uma por processador
+void comando_scrub(const char *threads) {
+    char *fim;
+    unsigned long quantidade = strtoul(threads, &fim, 10);
+    if (*fim != '\0') {
+        printf("Erro: Numero de threads invalido.\n");
+        return;
+    }
+    if (quantidade == 0) quantidade = numero_processadores();
+
+    Varredura varredura;
+    struct timespec inicio, fim_varredura;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    int res = varrer_disco(quantidade, &varredura, imprimir_bloco_ruim, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &fim_varredura);
+    if (res < 0) {
+        printf("Erro na varredura: %s\n", res == -ENOTSUP ? "disco formatado sem somas de verificacao" : strerror(-res));
+        return;
+    }
+
+    double segundos = (fim_varredura.tv_sec - inicio.tv_sec) + (fim_varredura.tv_nsec - inicio.tv_nsec) / 1e9;
+    printf("%llu bloco(s) conferido(s), %llu sem soma, %llu ruim(ns); %.1f MB em %.2fs (%.0f MB/s, %lu thread(s))\n",
+           (unsigned long long)varredura.blocos_verificados, (unsigned long long)varredura.blocos_sem_soma,
+           (unsigned long long)varredura.blocos_ruins, varredura.bytes_lidos / (1024.0 * 1024.0), segundos,
+           segundos > 0 ? varredura.bytes_lidos / (1024.0 * 1024.0) / segundos : 0.0, quantidade);
+}
+
+// --- Verificação de Consistência ---
+
+static void imprimir_consistencia(const Consistencia *consistencia) {
+    printf("%llu diretorio(s), %llu arquivo(s), %llu bloco(s) em uso\n",
+           (unsigned long long)consistencia->diretorios, (unsigned long long)consistencia->arquivos,
+           (unsigned long long)consistencia->blocos_em_uso);
+    printf("Blocos marcados sem dono: %llu, em uso e livres no bitmap: %llu, com mais de um dono: %llu\n",
+           (unsigned long long)consistencia->blocos_perdidos, (unsigned long long)consistencia->blocos_nao_marcados,
+           (unsigned long long)consistencia->blocos_compartilhados);
+    printf("Entradas invalidas: %llu, reparadas: %llu; contadores de referencias errados: %llu\n",
+           (unsigned long long)consistencia->entradas_invalidas, (unsigned long long)consistencia->entradas_reparadas,
+           (unsigned long long)consistencia->referencias_erradas);
+}
+
+void comando_fsck(const char *reparar) {
+    if (strcmp(reparar, "0") != 0 && strcmp(reparar, "1") != 0) {
+        printf("Erro: Use 0 (so verificar) ou 1 (reparar).\n");
+        return;
+    }
+
+    Consistencia consistencia;
+    struct timespec inicio, fim;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    int res = verificar_consistencia(reparar[0] == '1', 0, &consistencia);
+    clock_gettime(CLOCK_MONOTONIC, &fim);
+    if (res < 0) {
+        printf("Erro na verificacao: %s\n", res == -EBUSY ? "ha arquivos abertos" : strerror(-res));
+        return;
+    }
+
+    imprimir_consistencia(&consistencia);
+    double segundos = (fim.tv_sec - inicio.tv_sec) + (fim.tv_nsec - inicio.tv_nsec) / 1e9;
+    printf("%d problema(s) em %.2fs\n", res, segundos);
+}
+
+// --- Modo em Lote ---
+// Lê um comando por linha (de um script ou da entrada padrão), sem prompts, e
+// escreve uma linha JSON por comando com o resultado e o tempo gasto. Linhas
+// vazias e comentários (#) são ignorados. Os metadados só são confirmados em
+// "sync", no fim do lote ou quando o diário estiver quase cheio.
+//
+//   {"linha":3,"comando":"rm","args":["a.txt"],"ok":false,"erro":2,"mensagem":"...","us":4.1}
+
+#define MAXIMO_ARGUMENTOS 3
+
+static double agora_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static void imprimir_texto_json(const char *texto) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)texto; *c; c++) {
+        if (*c == '"' || *c == '\\') printf("\\%c", *c);
+        else if (*c < 0x20) printf("\\u%04x", *c);
+        else putchar(*c);
+    }
+    putchar('"');
+}
+
+static int imprimir_entrada_json(const EntradaDiretorio *entrada, void *contexto) {
+    int *primeira = contexto;
+    char nome[TAMANHO_NOME_ARQUIVO + 1] = {0};
+    memcpy(nome, entrada->nome_arquivo, TAMANHO_NOME_ARQUIVO);
+    printf("%s{\"nome\":", *primeira ? "" : ",");
+    imprimir_texto_json(nome);
+    printf(",\"tipo\":\"%s\",\"tamanho\":%llu,\"bloco\":%llu%s%s}",
+           entrada->tipo == TIPO_DIRETORIO ? "DIR" : "ARQ",
+           (unsigned long long)entrada->tamanho_bytes, (unsigned long long)entrada->bloco_inicial,
+           (entrada->atributos & ATRIBUTO_COMPRIMIDO) ? ",\"comprimido\":true" : "",
+           (entrada->atributos & ATRIBUTO_INSTANTANEO) ? ",\"instantaneo\":true" : "");
+    *primeira = 0;
+    return 0;
+}
+
+static void listar_json() {
+    printf(",\"entradas\":[");
+    int primeira = 1;
+    listar_diretorio(".", imprimir_entrada_json, &primeira);
+    putchar(']');
+}
+
+static void imprimir_fragmentacao_json(const char *rotulo, const Fragmentacao *medida) {
+    printf(",\"%s\":{\"arquivos\":%llu,\"fragmentados\":%llu,\"extensoes\":%llu,\"embutidos\":%llu,"
+           "\"esparsos\":%llu,\"comprimidos\":%llu,\"compartilhados\":%llu,\"livres\":%llu,\"trechos_livres\":%llu,"
+           "\"maior_trecho_livre\":%llu}",
+           rotulo, (unsigned long long)medida->arquivos, (unsigned long long)medida->arquivos_fragmentados,
+           (unsigned long long)medida->extensoes, (unsigned long long)medida->arquivos_embutidos,
+           (unsigned long long)medida->arquivos_esparsos, (unsigned long long)medida->arquivos_comprimidos,
+           (unsigned long long)medida->arquivos_compartilhados,
+           (unsigned long long)medida->blocos_livres,
+           (unsigned long long)medida->trechos_livres, (unsigned long long)medida->maior_trecho_livre);
+}
+
+// Histogramas vão até o último balde não vazio
+static void estatisticas_json() {
+    Estatisticas estatisticas;
+    estatisticas_ler(&estatisticas);
+
+    printf(",\"operacoes\":{");
+    int primeira = 1;
+    for (int i = 0; i < TOTAL_OPERACOES; i++) {
+        EstatisticaOperacao *op = &estatisticas.operacoes[i];
+        if (op->chamadas == 0) continue;
+        printf("%s\"%s\":{\"chamadas\":%llu,\"erros\":%llu,\"bytes\":%llu,\"leituras\":%llu,"
+               "\"escritas\":%llu,\"sincronizacoes\":%llu,\"ns\":%llu,\"histograma_ns_log2\":[",
+               primeira ? "" : ",", estatisticas_nome_operacao(i),
+               (unsigned long long)op->chamadas, (unsigned long long)op->erros, (unsigned long long)op->bytes,
+               (unsigned long long)op->leituras, (unsigned long long)op->escritas,
+               (unsigned long long)op->sincronizacoes, (unsigned long long)op->nanossegundos);
+        int ultimo = BALDES_LATENCIA - 1;
+        while (ultimo > 0 && op->histograma[ultimo] == 0) ultimo--;
+        for (int balde = 0; balde <= ultimo; balde++)
+            printf("%s%llu", balde ? "," : "", (unsigned long long)op->histograma[balde]);
+        printf("]}");
+        primeira = 0;
+    }
+
+    printf("},\"eventos\":{");
+    for (int i = 0; i < TOTAL_EVENTOS; i++)
+        printf("%s\"%s\":%llu", i ? "," : "", estatisticas_nome_evento(i), (unsigned long long)estatisticas.eventos[i]);
+    putchar('}');
+}
+
+static void anotar_bloco_ruim_json(uint64_t bloco, void *contexto) {
+    int *primeiro = contexto;
+    printf("%s%llu", *primeiro ? "" : ",", (unsigned long long)bloco);
+    *primeiro = 0;
+}
+
+static int varrer_em_lote(char **args, int total_args) {
+    unsigned long threads = 0;
+    if (total_args > 1) {
+        char *fim;
+        threads = strtoul(args[1], &fim, 10);
+        if (*fim != '\0') return -EINVAL;
+    }
+    if (threads == 0) threads = numero_processadores();
+
+    Varredura varredura;
+    int primeiro = 1;
+    printf(",\"blocos_ruins\":[");
+    int res = varrer_disco(threads, &varredura, anotar_bloco_ruim_json, &primeiro);
+    printf("],\"verificados\":%llu,\"sem_soma\":%llu,\"ruins\":%llu,\"bytes\":%llu,\"threads\":%lu",
+           (unsigned long long)varredura.blocos_verificados, (unsigned long long)varredura.blocos_sem_soma,
+           (unsigned long long)varredura.blocos_ruins, (unsigned long long)varredura.bytes_lidos, threads);
+    return res < 0 ? res : 0;
+}
+
+static int verificar_em_lote(char **args, int total_args) {
+    int reparar = 0;
+    if (total_args > 1) {
+        if (strcmp(args[1], "0") != 0 && strcmp(args[1], "1") != 0) return -EINVAL;
+        reparar = args[1][0] == '1';
+    }
+
+    Consistencia consistencia;
+    int res = verificar_consistencia(reparar, 0, &consistencia);
+    if (res < 0) return res;
+    printf(",\"problemas\":%d,\"diretorios\":%llu,\"arquivos\":%llu,\"em_uso\":%llu,\"perdidos\":%llu,"
+           "\"nao_marcados\":%llu,\"compartilhados\":%llu,\"invalidas\":%llu,\"reparadas\":%llu,"
+           "\"referencias_erradas\":%llu", res,
+           (unsigned long long)consistencia.diretorios, (unsigned long long)consistencia.arquivos,
+           (unsigned long long)consistencia.blocos_em_uso, (unsigned long long)consistencia.blocos_perdidos,
+           (unsigned long long)consistencia.blocos_nao_marcados, (unsigned long long)consistencia.blocos_compartilhados,
+           (unsigned long long)consistencia.entradas_invalidas, (unsigned long long)consistencia.entradas_reparadas,
+           (unsigned long long)consistencia.referencias_erradas);
+    return 0;
+}
+
+static int desfragmentar_em_lote(const char *limite) {
+    char *fim;
+    unsigned long long megas = strtoull(limite, &fim, 10);
+    if (*fim != '\0') return -EINVAL;
+
+    Fragmentacao antes, depois;
+    uint64_t movidos = 0;
+    int res = medir_fragmentacao(&antes);
+    if (res == 0) res = desfragmentar_disco(megas * BLOCOS_POR_MEGA, 0, &movidos);
+    if (res < 0) return res;
+    int pendente = res;
+    res = medir_fragmentacao(&depois);
+    if (res != 0) return res;
+
+    printf(",\"movidos\":%llu,\"pendente\":%s", (unsigned long long)movidos, pendente ? "true" : "false");
+    imprimir_fragmentacao_json("antes", &antes);
+    imprimir_fragmentacao_json("depois", &depois);
+    return 0;
+}
+
+static int comprimir_em_lote(const char *caminho, const char *ativo) {
+    if (strcmp(ativo, "0") != 0 && strcmp(ativo, "1") != 0) return -EINVAL;
+    return comprimir_arquivo(caminho, ativo[0] == '1');
+}
+
+// Executa um comando; devolve 0 ou -errno e completa a linha JSON com os
+// campos próprios do comando
+static int executar_em_lote(char **args, int total_args, int *montado, int *sair) {
+    const char *comando = args[0];
+    int esperados = 0, opcionais = 0;
+    if (strcmp(comando, "formatar") == 0 || strcmp(comando, "scrub") == 0 || strcmp(comando, "fsck") == 0) opcionais = 1;
+    if (strcmp(comando, "formatar") == 0 || strcmp(comando, "rm") == 0 ||
+        strcmp(comando, "crpasta") == 0 || strcmp(comando, "cd") == 0 ||
+        strcmp(comando, "importar_lote") == 0 || strcmp(comando, "defrag") == 0 ||
+        strcmp(comando, "instantaneo") == 0 || strcmp(comando, "rm_instantaneo") == 0) esperados = 1;
+    else if (strcmp(comando, "importar") == 0 || strcmp(comando, "exportar") == 0 ||
+             strcmp(comando, "comprimir") == 0 || strcmp(comando, "clonar") == 0) esperados = 2;
+    else if (strcmp(comando, "ls") != 0 && strcmp(comando, "sync") != 0 && strcmp(comando, "sair") != 0 &&
+             strcmp(comando, "stats") != 0 && strcmp(comando, "scrub") != 0 && strcmp(comando, "fsck") != 0) return -ENOSYS;
+    if (total_args - 1 < esperados || total_args - 1 > esperados + opcionais) return -EINVAL;
+
+    if (strcmp(comando, "sair") == 0) {
+        *sair = 1;
+        return 0;
+    }
+    if (strcmp(comando, "stats") == 0) {
+        estatisticas_json();
+        return 0;
+    }
+    if (strcmp(comando, "formatar") == 0) {
+        char *fim;
+        unsigned long long setores = strtoull(args[1], &fim, 10);
+        if (*fim != '\0' || setores < 40) return -EINVAL;
+        // "formatar <setores> somas" liga as somas de verificação
+        int somas = total_args > 2;
+        if (somas && strcmp(args[2], "somas") != 0) return -EINVAL;
+        formatar_disco_com_somas(setores, somas);
+        *montado = 1;
+        printf(",\"blocos\":%llu,\"livres\":%llu,\"somas\":%s",
+               (unsigned long long)total_blocos_disco, (unsigned long long)contar_blocos_livres(),
+               bloco_inicio_somas ? "true" : "false");
+        return 0;
+    }
+    if (!*montado) return -ENODEV;
+
+    if (strcmp(comando, "ls") == 0) {
+        listar_json();
+        return 0;
+    }
+    if (strcmp(comando, "rm") == 0) return remover_arquivo(args[1]);
+    if (strcmp(comando, "crpasta") == 0) return criar_arquivo(args[1], 0, TIPO_DIRETORIO);
+    if (strcmp(comando, "cd") == 0) return mudar_diretorio(args[1]);
+    if (strcmp(comando, "sync") == 0) return sincronizar_disco();
+    if (strcmp(comando, "defrag") == 0) return desfragmentar_em_lote(args[1]);
+    if (strcmp(comando, "comprimir") == 0) return comprimir_em_lote(args[1], args[2]);
+    if (strcmp(comando, "clonar") == 0) return clonar_arquivo(args[1], args[2]);
+    if (strcmp(comando, "instantaneo") == 0) return criar_instantaneo(args[1]);
+    if (strcmp(comando, "rm_instantaneo") == 0) return remover_instantaneo(args[1]);
+    if (strcmp(comando, "scrub") == 0) return varrer_em_lote(args, total_args);
+    if (strcmp(comando, "fsck") == 0) return verificar_em_lote(args, total_args);
+
+    uint64_t bytes = 0;
+    if (strcmp(comando, "importar_lote") == 0) {
+        // Falhas de arquivos isolados aparecem na linha; o erro devolvido é o primeiro
+        ItemImportacao *itens;
+        uint32_t quantidade, falhas = 0;
+        int res = importar_lote(args[1], &itens, &quantidade, &bytes);
+        if (res == 0) {
+            for (uint32_t i = 0; i < quantidade; i++) {
+                if (itens[i].resultado == 0) continue;
+                if (res == 0) res = itens[i].resultado;
+                falhas++;
+            }
+            printf(",\"arquivos\":%u,\"falhas\":%u,\"bytes\":%llu",
+                   quantidade - falhas, falhas, (unsigned long long)bytes);
+        }
+        free(itens);
+        return res;
+    }
+
+    int res = (strcmp(comando, "importar") == 0) ? importar(args[1], args[2], &bytes)
+                                                 : exportar(args[1], args[2], &bytes);
+    printf(",\"bytes\":%llu", (unsigned long long)bytes);
+    return res;
+}
+
+// Devolve quantos comandos falharam
+static int executar_lote(FILE *script, int montado) {
+    adiar_confirmacoes(1);
+
+    char linha[1024];
+    uint64_t numero_linha = 0, comandos = 0, falhas = 0;
+    double inicio_lote = agora_us();
+    int sair = 0;
+
+    while (!sair && fgets(linha, sizeof(linha), script)) {
+        numero_linha++;
+        char *args[MAXIMO_ARGUMENTOS + 1];
+        int total_args = 0;
+        for (char *token = strtok(linha, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+            if (total_args == 0 && token[0] == '#') break;
+            if (total_args <= MAXIMO_ARGUMENTOS) args[total_args] = token;
+            total_args++;
+        }
+        if (total_args == 0) continue;
+
+        printf("{\"linha\":%llu,\"comando\":", (unsigned long long)numero_linha);
+        imprimir_texto_json(args[0]);
+        printf(",\"args\":[");
+        for (int i = 1; i < total_args && i <= MAXIMO_ARGUMENTOS; i++) {
+            if (i > 1) putchar(',');
+            imprimir_texto_json(args[i]);
+        }
+        putchar(']');
+
+        double inicio = agora_us();
+        int res = total_args > MAXIMO_ARGUMENTOS ? -E2BIG : executar_em_lote(args, total_args, &montado, &sair);
+        double gasto = agora_us() - inicio;
+
+        comandos++;
+        if (res == 0) {
+            printf(",\"ok\":true");
+        } else {
+            falhas++;
+            printf(",\"ok\":false,\"erro\":%d,\"mensagem\":", -res);
+            imprimir_texto_json(res == -ENOSYS ? "comando invalido" :
+                                res == -ENODEV ? "disco nao formatado" : strerror(-res));
+        }
+        printf(",\"us\":%.1f}\n", gasto);
+    }
+
+    double inicio_sincronizacao = agora_us();
+    int res = montado ? sincronizar_disco() : 0;
+    if (res != 0) falhas++;
+    printf("{\"resumo\":true,\"comandos\":%llu,\"falhas\":%llu,\"us_sync\":%.1f,\"us\":%.1f}\n",
+           (unsigned long long)comandos, (unsigned long long)falhas,
+           agora_us() - inicio_sincronizacao, agora_us() - inicio_lote);
+    return falhas > 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Uso: sudo %s <dispositivo_ou_imagem>\n", argv[0]);
+    int modo_dispositivo = DISPOSITIVO_POSICIONAL;
+    const char *caminho_disco = NULL;
+    const char *caminho_script = NULL;
+    int em_lote = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) modo_dispositivo = DISPOSITIVO_MAPEADO;
+        else if (strcmp(argv[i], "--lote") == 0) em_lote = 1;
+        else if (strncmp(argv[i], "--lote=", 7) == 0) { em_lote = 1; caminho_script = argv[i] + 7; }
+        else if (strncmp(argv[i], "--antecipar=", 12) == 0) {
+            if (configurar_leitura_antecipada((uint32_t)strtoul(argv[i] + 12, NULL, 10)) < 0) {
+                printf("Janela de leitura antecipada invalida: %s\n", argv[i] + 12);
+                return 1;
+            }
+        }
+        else caminho_disco = argv[i];
+    }
+
+    if (!caminho_disco) {
+        printf("Uso: sudo %s [--mmap] [--antecipar=blocos] [--lote[=script]] <dispositivo_ou_imagem>\n", argv[0]);
         return 1;
     }
 
-    arquivo_disco = fopen(argv[1], "r+b");
+    arquivo_disco = fopen(caminho_disco, "r+b");
     if (!arquivo_disco) {
-        printf("Arquivo nao existe. Criando novo...\n");
-        arquivo_disco = fopen(argv[1], "w+b");
+        if (!em_lote) printf("Arquivo nao existe. Criando novo...\n");
+        arquivo_disco = fopen(caminho_disco, "w+b");
         if(!arquivo_disco) { perror("Erro fatal"); return 1; }
     }
 
-    if (montar_disco()) {
-        printf("Disco: %s (Montado)\n", argv[1]);
+    if (em_lote) {
+        FILE *script = caminho_script ? fopen(caminho_script, "r") : stdin;
+        if (!script) { perror("Erro ao abrir script"); return 1; }
+
+        int falhas = executar_lote(script, montar_disco_com_modo(modo_dispositivo));
+        if (script != stdin) fclose(script);
+        desmontar_disco();
+        fclose(arquivo_disco);
+        return falhas ? 2 : 0;
+    }
+
+    if (montar_disco_com_modo(modo_dispositivo)) {
+        printf("Disco: %s (Montado%s)\n", caminho_disco,
+               dispositivo_modo() == DISPOSITIVO_MAPEADO ? ", mmap" : "");
         printf("Tamanho: %llu blocos\n", (unsigned long long)total_blocos_disco);
+        printf("Livres: %llu blocos\n", (unsigned long long)contar_blocos_livres());
+        Consistencia consistencia;
+        if (consistencia_na_montagem(&consistencia)) {
+            printf("O disco nao foi desmontado da ultima vez; verificado:\n");
+            imprimir_consistencia(&consistencia);
+        }
         printf("Digite 'ajuda' para ver os comandos.\n");
     } else {
-        printf("Disco: %s (NAO FORMATADO)\n", argv[1]);
+        printf("Disco: %s (NAO FORMATADO)\n", caminho_disco);
         printf("Digite 'formatar' para iniciar.\n");
     }
 
@@ -161,13 +1007,19 @@ int main(int argc, char *argv[]) {
         else if (strcmp(comando, "ls") == 0) comando_listar();
         else if (strcmp(comando, "rm") == 0) {
             scanf("%s", arg1);
-            if(remover_arquivo(arg1) == 0) printf("Removido.\n");
+            int res = remover_arquivo(arg1);
+            if (res == 0) printf("Removido.\n");
+            else if (res == -ENOTEMPTY) printf("Erro: A pasta nao esta vazia.\n");
             else printf("Erro.\n");
         }
         else if (strcmp(comando, "importar") == 0) {
             scanf("%s %s", arg1, arg2);
             comando_importar(arg1, arg2);
         }
+        else if (strcmp(comando, "importar_lote") == 0) {
+            scanf("%s", arg1);
+            comando_importar_lote(arg1);
+        }
         else if (strcmp(comando, "exportar") == 0) {
             scanf("%s %s", arg1, arg2);
             comando_exportar(arg1, arg2);
@@ -180,8 +1032,42 @@ int main(int argc, char *argv[]) {
             scanf("%s", arg1);
             comando_cd(arg1);
         }
+        else if (strcmp(comando, "stats") == 0) comando_stats();
+        else if (strcmp(comando, "scrub") == 0) {
+            scanf("%s", arg1);
+            comando_scrub(arg1);
+        }
+        else if (strcmp(comando, "fsck") == 0) {
+            scanf("%s", arg1);
+            comando_fsck(arg1);
+        }
+        else if (strcmp(comando, "defrag") == 0) {
+            scanf("%s", arg1);
+            comando_defrag(arg1);
+        }
+        else if (strcmp(comando, "comprimir") == 0) {
+            scanf("%s %s", arg1, arg2);
+            comando_comprimir(arg1, arg2);
+        }
+        else if (strcmp(comando, "clonar") == 0) {
+            scanf("%s %s", arg1, arg2);
+            comando_clonar(arg1, arg2);
+        }
+        else if (strcmp(comando, "instantaneo") == 0) {
+            scanf("%s", arg1);
+            comando_instantaneo(arg1);
+        }
+        else if (strcmp(comando, "rm_instantaneo") == 0) {
+            scanf("%s", arg1);
+            comando_remover_instantaneo(arg1);
+        }
+        else if (strcmp(comando, "sync") == 0) {
+            if (sincronizar_disco() == 0) printf("Cache sincronizado.\n");
+            else printf("Erro ao sincronizar.\n");
+        }
         else printf("Comando invalido. Digite 'ajuda'.\n");
     }
+    desmontar_disco();
     fclose(arquivo_disco);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fs.h"
+#include "dispositivo.h"
+
+// --- Teste: Caminhos Aninhados ---
+// Monta uma árvore de pastas numa imagem nova e confere que, depois da primeira
+// passada, buscas por caminho (absolutos e relativos, achando ou não) saem
+// todas dos índices de diretório em memória: nenhuma leitura no dispositivo.
+// Depois confere que a pasta que é o diretório atual de alguma thread não
+// pode ser removida, nem sozinha nem dentro de um instantâneo.
+
+#define PROFUNDIDADE 6
+#define ARQUIVOS_POR_PASTA 20
+
+static int falhas = 0;
+
+#define CONFERIR(condicao) do { \
+    if (!(condicao)) { printf("FALHOU %s:%d: %s\n", __FILE__, __LINE__, #condicao); falhas++; } \
+} while (0)
+
+// Busca cada arquivo de cada nível e alguns nomes que não existem
+static void buscar_tudo() {
+    char caminho[256];
+    EntradaDiretorio entrada;
+    size_t fim = 0;
+    for (int nivel = 0; nivel < PROFUNDIDADE; nivel++) {
+        fim += snprintf(caminho + fim, sizeof(caminho) - fim, "/p%d", nivel);
+        for (int i = 0; i < ARQUIVOS_POR_PASTA; i++) {
+            snprintf(caminho + fim, sizeof(caminho) - fim, "/a%d", i);
+            CONFERIR(buscar_entrada_diretorio(caminho, &entrada) >= 0);
+            CONFERIR(entrada.tipo == TIPO_ARQUIVO);
+        }
+        snprintf(caminho + fim, sizeof(caminho) - fim, "/nao_existe");
+        CONFERIR(buscar_entrada_diretorio(caminho, &entrada) == -ENOENT);
+        snprintf(caminho + fim, sizeof(caminho) - fim, "/nao_existe/a0");
+        CONFERIR(buscar_entrada_diretorio(caminho, &entrada) < 0);
+        caminho[fim] = '\0';
+    }
+
+    CONFERIR(mudar_diretorio("/p0/p1/p2") == 0);
+    CONFERIR(buscar_entrada_diretorio("p3/p4/a7", &entrada) >= 0);
+    CONFERIR(buscar_entrada_diretorio("../p2/p3/a1", &entrada) >= 0);
+    CONFERIR(buscar_entrada_diretorio("p3/nada", &entrada) == -ENOENT);
+    CONFERIR(mudar_diretorio("/") == 0);
+}
+
+// Thread que fica num diretório até ser liberada (e então termina)
+static pthread_mutex_t trava_parada = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sinal_parada = PTHREAD_COND_INITIALIZER;
+static int etapa_parada = 0;
+
+static void *ficar_no_diretorio(void *caminho) {
+    int res = mudar_diretorio(caminho);
+    pthread_mutex_lock(&trava_parada);
+    etapa_parada = res == 0 ? 1 : -1;
+    pthread_cond_broadcast(&sinal_parada);
+    while (etapa_parada != 2) pthread_cond_wait(&sinal_parada, &trava_parada);
+    pthread_mutex_unlock(&trava_parada);
+    return NULL;
+}
+
+static void conferir_diretorio_atual() {
+    // Um bloco cada: /vitima fica com o primeiro bloco livre, o que era de /x
+    static unsigned char dados[TAMANHO_BLOCO], lidos[TAMANHO_BLOCO];
+    for (size_t i = 0; i < sizeof(dados); i++) dados[i] = (unsigned char)(i * 7 + 1);
+
+    // Remover o próprio diretório atual liberaria o bloco dele para a próxima
+    // alocação, e criar "f" ali gravaria uma entrada por cima de /vitima
+    CONFERIR(criar_arquivo("/x", 0, TIPO_DIRETORIO) == 0);
+    CONFERIR(criar_arquivo("/enchimento", 0, TIPO_ARQUIVO) == 0);
+    CONFERIR(escrever_arquivo("/enchimento", 0, dados, sizeof(dados)) == 0);
+    CONFERIR(mudar_diretorio("x") == 0);
+    CONFERIR(remover_arquivo("/x") == -EBUSY);
+    CONFERIR(sincronizar_disco() == 0);
+    CONFERIR(criar_arquivo("/vitima", 0, TIPO_ARQUIVO) == 0);
+    CONFERIR(escrever_arquivo("/vitima", 0, dados, sizeof(dados)) == 0);
+    CONFERIR(criar_arquivo("f", 0, TIPO_ARQUIVO) == 0);
+    CONFERIR(sincronizar_disco() == 0);
+    CONFERIR(ler_arquivo("/vitima", 0, sizeof(lidos), lidos) == 0);
+    CONFERIR(memcmp(lidos, dados, sizeof(dados)) == 0);
+    CONFERIR(buscar_entrada_diretorio("/x/f", NULL) >= 0);
+
+    CONFERIR(mudar_diretorio("/") == 0);
+    CONFERIR(remover_arquivo("/x/f") == 0);
+    CONFERIR(remover_arquivo("/x") == 0);
+
+    // O diretório atual de outra thread também segura a pasta, até ela terminar
+    CONFERIR(criar_arquivo("/y", 0, TIPO_DIRETORIO) == 0);
+    pthread_t thread;
+    CONFERIR(pthread_create(&thread, NULL, ficar_no_diretorio, "/y") == 0);
+    pthread_mutex_lock(&trava_parada);
+    while (etapa_parada == 0) pthread_cond_wait(&sinal_parada, &trava_parada);
+    pthread_mutex_unlock(&trava_parada);
+    CONFERIR(etapa_parada == 1);
+    CONFERIR(remover_arquivo("/y") == -EBUSY);
+    pthread_mutex_lock(&trava_parada);
+    etapa_parada = 2;
+    pthread_cond_broadcast(&sinal_parada);
+    pthread_mutex_unlock(&trava_parada);
+    pthread_join(thread, NULL);
+    CONFERIR(remover_arquivo("/y") == 0);
+
+    // Um instantâneo com o diretório atual numa subpasta não é apagado
+    CONFERIR(criar_instantaneo("s") == 0);
+    CONFERIR(mudar_diretorio("/s/p0/p1") == 0);
+    CONFERIR(remover_instantaneo("s") == -EBUSY);
+    CONFERIR(buscar_entrada_diretorio("a0", NULL) >= 0);
+    CONFERIR(mudar_diretorio("/") == 0);
+    CONFERIR(remover_instantaneo("s") == 0);
+
+    Consistencia consistencia;
+    CONFERIR(verificar_consistencia(0, 1, &consistencia) == 0);
+}
+
+int main() {
+    const char *imagem = "teste_caminhos.img";
+    remove(imagem);
+    arquivo_disco = fopen(imagem, "w+b");
+    if (!arquivo_disco) {
+        perror("Erro ao criar a imagem");
+        return 1;
+    }
+    formatar_disco(100000);
+
+    char caminho[256];
+    size_t fim = 0;
+    for (int nivel = 0; nivel < PROFUNDIDADE; nivel++) {
+        fim += snprintf(caminho + fim, sizeof(caminho) - fim, "/p%d", nivel);
+        CONFERIR(criar_arquivo(caminho, 0, TIPO_DIRETORIO) == 0);
+        for (int i = 0; i < ARQUIVOS_POR_PASTA; i++) {
+            snprintf(caminho + fim, sizeof(caminho) - fim, "/a%d", i);
+            CONFERIR(criar_arquivo(caminho, 100, TIPO_ARQUIVO) == 0);
+        }
+        caminho[fim] = '\0';
+    }
+    CONFERIR(sincronizar_disco() == 0);
+
+    // Remontada, a imagem começa com os índices vazios: a primeira passada lê
+    desmontar_disco();
+    CONFERIR(montar_disco());
+    buscar_tudo();
+
+    ContadoresDispositivo contadores;
+    dispositivo_zerar_contadores();
+    buscar_tudo();
+    buscar_tudo();
+    dispositivo_contadores(&contadores);
+    if (contadores.leituras != 0) printf("%llu leituras nas buscas repetidas\n", (unsigned long long)contadores.leituras);
+    CONFERIR(contadores.leituras == 0);
+
+    conferir_diretorio_atual();
+
+    desmontar_disco();
+    fclose(arquivo_disco);
+    remove(imagem);
+
+    if (falhas) {
+        printf("%d falha(s)\n", falhas);
+        return 1;
+    }
+    printf("caminhos ok\n");
+    return 0;
+}
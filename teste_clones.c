@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "fs.h"
+
+// --- Teste: Clones e Desmontagem ---
+// Clona arquivos, escreve nos clones (cópia na escrita), apaga origens e
+// desmonta sem sincronizar antes: os contadores da tabela de referências que
+// a desmontagem sujar precisam chegar ao disco. Na montagem seguinte a
+// verificação não pode achar contadores errados nem blocos perdidos.
+
+#define ARQUIVOS 8
+#define TAMANHO (64 * 1024)
+
+static int falhas = 0;
+
+#define CONFERIR(condicao) do { \
+    if (!(condicao)) { printf("FALHOU %s:%d: %s\n", __FILE__, __LINE__, #condicao); falhas++; } \
+} while (0)
+
+static unsigned char conteudo[TAMANHO];
+static unsigned char lido[TAMANHO];
+
+static void preencher(int semente) {
+    for (int i = 0; i < TAMANHO; i++) conteudo[i] = (unsigned char)(i * 31 + semente);
+}
+
+static void remontar_e_verificar(const char *etapa) {
+    CONFERIR(desmontar_disco() == 0);
+    CONFERIR(montar_disco());
+
+    Consistencia consistencia;
+    int problemas = verificar_consistencia(0, 1, &consistencia);
+    if (problemas != 0) {
+        printf("%s: %d problema(s), %llu referência(s) errada(s), %llu bloco(s) perdido(s), %llu não marcado(s)\n",
+               etapa, problemas, (unsigned long long)consistencia.referencias_erradas,
+               (unsigned long long)consistencia.blocos_perdidos, (unsigned long long)consistencia.blocos_nao_marcados);
+    }
+    CONFERIR(problemas == 0);
+}
+
+int main() {
+    const char *imagem = "teste_clones.img";
+    remove(imagem);
+    arquivo_disco = fopen(imagem, "w+b");
+    if (!arquivo_disco) {
+        perror("Erro ao criar a imagem");
+        return 1;
+    }
+    formatar_disco(100000);
+
+    char origem[32], clone[32];
+    for (int i = 0; i < ARQUIVOS; i++) {
+        snprintf(origem, sizeof(origem), "/o%d", i);
+        preencher(i);
+        CONFERIR(criar_arquivo(origem, 0, TIPO_ARQUIVO) == 0);
+        CONFERIR(escrever_arquivo(origem, 0, conteudo, TAMANHO) == 0);
+    }
+    CONFERIR(sincronizar_disco() == 0);
+
+    // Clone e cópia na escrita de metade de cada arquivo, sem sincronizar
+    for (int i = 0; i < ARQUIVOS; i++) {
+        snprintf(origem, sizeof(origem), "/o%d", i);
+        snprintf(clone, sizeof(clone), "/c%d", i);
+        CONFERIR(clonar_arquivo(origem, clone) == 0);
+        preencher(100 + i);
+        CONFERIR(escrever_arquivo(clone, 0, conteudo, TAMANHO / 2) == 0);
+    }
+    remontar_e_verificar("clones");
+
+    // Apagar as origens devolve os blocos ainda divididos só depois da confirmação
+    for (int i = 0; i < ARQUIVOS; i++) {
+        snprintf(origem, sizeof(origem), "/o%d", i);
+        CONFERIR(remover_arquivo(origem) == 0);
+    }
+    remontar_e_verificar("origens apagadas");
+
+    for (int i = 0; i < ARQUIVOS; i++) {
+        snprintf(clone, sizeof(clone), "/c%d", i);
+        CONFERIR(ler_arquivo(clone, 0, TAMANHO, lido) == 0);
+        preencher(100 + i);
+        CONFERIR(memcmp(lido, conteudo, TAMANHO / 2) == 0);
+        preencher(i);
+        CONFERIR(memcmp(lido + TAMANHO / 2, conteudo + TAMANHO / 2, TAMANHO / 2) == 0);
+    }
+
+    // Um instantâneo divide tudo de novo; escrever e apagar depois dele também
+    CONFERIR(criar_instantaneo("s") == 0);
+    for (int i = 0; i < ARQUIVOS; i++) {
+        snprintf(clone, sizeof(clone), "/c%d", i);
+        preencher(200 + i);
+        CONFERIR(escrever_arquivo(clone, TAMANHO / 4, conteudo, TAMANHO / 2) == 0);
+        if (i % 2) CONFERIR(remover_arquivo(clone) == 0);
+    }
+    remontar_e_verificar("instantâneo");
+
+    CONFERIR(remover_instantaneo("s") == 0);
+    remontar_e_verificar("instantâneo apagado");
+
+    desmontar_disco();
+    fclose(arquivo_disco);
+    remove(imagem);
+
+    if (falhas) {
+        printf("%d falha(s)\n", falhas);
+        return 1;
+    }
+    printf("clones ok\n");
+    return 0;
+}